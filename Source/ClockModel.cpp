@@ -0,0 +1,172 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ClockModel.h"
+
+#include <algorithm>
+#include <cmath>
+
+ClockModel::ClockModel()
+{
+    reset();
+}
+
+void ClockModel::reset()
+{
+    numSamples = 0;
+    nextSample = 0;
+
+    sequence.store (0);
+    fitReferenceUs.store (0.0);
+    fitOffset.store (0.0);
+    fitSkew.store (0.0);
+
+    valid.store (false);
+    lastRoundTrip.store (0.0);
+    minRoundTrip.store (0.0);
+}
+
+void ClockModel::addSample (double hostSendUs, double hostReceiveUs, double serverUs)
+{
+    const double roundTrip = hostReceiveUs - hostSendUs;
+
+    if (roundTrip < 0.0)
+        return;
+
+    Sample& sample = samples[nextSample];
+    sample.hostUs = hostSendUs + roundTrip * 0.5;
+    sample.offsetUs = serverUs - sample.hostUs;
+    sample.roundTripUs = roundTrip;
+
+    nextSample = (nextSample + 1) % windowSize;
+    numSamples = std::min (numSamples + 1, windowSize);
+
+    lastRoundTrip.store (roundTrip, std::memory_order_relaxed);
+
+    refit();
+}
+
+void ClockModel::refit()
+{
+    double bestRoundTrip = samples[0].roundTripUs;
+    for (int i = 1; i < numSamples; ++i)
+        bestRoundTrip = std::min (bestRoundTrip, samples[i].roundTripUs);
+
+    minRoundTrip.store (bestRoundTrip, std::memory_order_relaxed);
+
+    // Trust only exchanges that saw (almost) no queuing
+    const double threshold = bestRoundTrip * 1.5 + 20.0;
+
+    double referenceUs = 0.0;
+    int count = 0;
+    double sumX = 0.0, sumY = 0.0;
+
+    for (int i = 0; i < numSamples; ++i)
+    {
+        if (samples[i].roundTripUs <= threshold)
+        {
+            referenceUs = std::max (referenceUs, samples[i].hostUs);
+            sumY += samples[i].offsetUs;
+            sumX += samples[i].hostUs;
+            ++count;
+        }
+    }
+
+    const double meanX = sumX / count;
+    const double meanY = sumY / count;
+
+    // Least-squares slope of offset against host time is the skew
+    double covariance = 0.0, variance = 0.0;
+
+    for (int i = 0; i < numSamples; ++i)
+    {
+        if (samples[i].roundTripUs <= threshold)
+        {
+            const double dx = samples[i].hostUs - meanX;
+            covariance += dx * (samples[i].offsetUs - meanY);
+            variance += dx * dx;
+        }
+    }
+
+    // Need samples spread over a second or so before the slope means anything
+    double skew = 0.0;
+    if (count >= 3 && variance / count > 0.25e12)
+        skew = std::max (-maxSkew, std::min (maxSkew, covariance / variance));
+
+    const double offset = meanY + skew * (referenceUs - meanX);
+
+    // Publish: odd sequence while the fields are inconsistent
+    const uint32_t s = sequence.load (std::memory_order_relaxed);
+    sequence.store (s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+
+    fitReferenceUs.store (referenceUs, std::memory_order_relaxed);
+    fitOffset.store (offset, std::memory_order_relaxed);
+    fitSkew.store (skew, std::memory_order_relaxed);
+
+    sequence.store (s + 2, std::memory_order_release);
+    valid.store (true, std::memory_order_release);
+}
+
+double ClockModel::hostToServer (double hostUs) const
+{
+    double referenceUs, offset, skew;
+    uint32_t before, after;
+
+    do
+    {
+        before = sequence.load (std::memory_order_acquire);
+
+        referenceUs = fitReferenceUs.load (std::memory_order_relaxed);
+        offset = fitOffset.load (std::memory_order_relaxed);
+        skew = fitSkew.load (std::memory_order_relaxed);
+
+        std::atomic_thread_fence (std::memory_order_acquire);
+        after = sequence.load (std::memory_order_relaxed);
+    }
+    while ((before & 1) != 0 || before != after);
+
+    return hostUs + offset + skew * (hostUs - referenceUs);
+}
+
+double ClockModel::serverToHost (double serverUs) const
+{
+    double referenceUs, offset, skew;
+    uint32_t before, after;
+
+    do
+    {
+        before = sequence.load (std::memory_order_acquire);
+
+        referenceUs = fitReferenceUs.load (std::memory_order_relaxed);
+        offset = fitOffset.load (std::memory_order_relaxed);
+        skew = fitSkew.load (std::memory_order_relaxed);
+
+        std::atomic_thread_fence (std::memory_order_acquire);
+        after = sequence.load (std::memory_order_relaxed);
+    }
+    while ((before & 1) != 0 || before != after);
+
+    // Solves serverUs = hostUs + offset + skew * (hostUs - referenceUs) for hostUs
+    return (serverUs - offset + skew * referenceUs) / (1.0 + skew);
+}
@@ -0,0 +1,112 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Maps host time to the Raspberry Pi's clock.
+ *
+ * Fed with NTP-style ping exchanges (host send time, host receive time,
+ * server time). Only exchanges whose round trip is close to the smallest one
+ * seen recently are trusted, since queuing delay is what makes the midpoint
+ * assumption wrong; a least-squares fit over those gives the offset and the
+ * relative drift (skew) between the two oscillators.
+ *
+ * addSample() is called from one thread (the client's reader). The fitted
+ * model is published through a seqlock, so hostToServer() is lock-free and
+ * wait-free in practice, and safe to call from the audio thread.
+ */
+class ClockModel
+{
+public:
+    ClockModel();
+
+    /** Forgets all samples (e.g. on reconnect) */
+    void reset();
+
+    /** Adds one ping exchange (single writer)
+     *
+     * @param hostSendUs Host time the request was written, in microseconds
+     * @param hostReceiveUs Host time the reply was read, in microseconds
+     * @param serverUs Server clock reading carried in the reply, in microseconds
+     */
+    void addSample (double hostSendUs, double hostReceiveUs, double serverUs);
+
+    /** True once at least one exchange has been accepted */
+    bool isValid() const { return valid.load (std::memory_order_acquire); }
+
+    /** Converts host microseconds to server microseconds using the current fit */
+    double hostToServer (double hostUs) const;
+
+    /** Converts server microseconds to host microseconds (the inverse of hostToServer) */
+    double serverToHost (double serverUs) const;
+
+    /** Current offset (server - host) in microseconds at the latest reference point */
+    double getOffsetUs() const { return fitOffset.load (std::memory_order_relaxed); }
+
+    /** Current drift of the server clock relative to the host, in parts per million */
+    double getSkewPpm() const { return fitSkew.load (std::memory_order_relaxed) * 1.0e6; }
+
+    /** Round trip of the most recent exchange, in microseconds */
+    double getLastRoundTripUs() const { return lastRoundTrip.load (std::memory_order_relaxed); }
+
+    /** Smallest round trip in the current window, in microseconds */
+    double getMinRoundTripUs() const { return minRoundTrip.load (std::memory_order_relaxed); }
+
+    /** Estimated uncertainty of the offset (half the best round trip), in microseconds */
+    double getUncertaintyUs() const { return getMinRoundTripUs() * 0.5; }
+
+private:
+    /** Refits the model from the sample window and publishes it */
+    void refit();
+
+    struct Sample
+    {
+        double hostUs;      // midpoint of the exchange
+        double offsetUs;    // server - host at the midpoint
+        double roundTripUs;
+    };
+
+    static constexpr int windowSize = 64;
+
+    /** Largest skew accepted from the fit; crystals are far better than this */
+    static constexpr double maxSkew = 500.0e-6;
+
+    // Writer-side state (addSample only)
+    Sample samples[windowSize];
+    int numSamples;
+    int nextSample;
+
+    // Published fit, guarded by the seqlock counter (odd while being written)
+    std::atomic<uint32_t> sequence;
+    std::atomic<double> fitReferenceUs;
+    std::atomic<double> fitOffset;
+    std::atomic<double> fitSkew;
+
+    std::atomic<bool> valid;
+    std::atomic<double> lastRoundTrip;
+    std::atomic<double> minRoundTrip;
+};
@@ -0,0 +1,182 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Fixed-size, log-linear latency histogram.
+ *
+ * Values (in nanoseconds) are binned into 16 linear sub-buckets per power of
+ * two, which keeps the relative error of any reported percentile under ~6%
+ * from 1 ns up to ~68 s. Recording is a handful of relaxed atomic operations
+ * with no locks or allocation, so it can be called from the audio, sender and
+ * reader threads while the editor reads percentiles on the message thread.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr int subBucketBits = 4;
+    static constexpr int subBuckets = 1 << subBucketBits;
+    static constexpr int maxExponent = 36;
+    static constexpr int numBuckets = (maxExponent - subBucketBits + 1) * subBuckets;
+
+    LatencyHistogram() { reset(); }
+
+    /** Records one value in nanoseconds */
+    void record (uint64_t nanoseconds)
+    {
+        counts[bucketIndex (nanoseconds)].fetch_add (1, std::memory_order_relaxed);
+        total.fetch_add (1, std::memory_order_relaxed);
+
+        uint64_t previous = maximum.load (std::memory_order_relaxed);
+        while (nanoseconds > previous
+               && !maximum.compare_exchange_weak (previous, nanoseconds, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /** Clears all buckets (not atomic with respect to concurrent record() calls) */
+    void reset()
+    {
+        for (auto& count : counts)
+            count.store (0, std::memory_order_relaxed);
+
+        total.store (0, std::memory_order_relaxed);
+        maximum.store (0, std::memory_order_relaxed);
+    }
+
+    /** Replaces the contents with bucket counts recorded elsewhere in this layout (e.g. by gpio_server)
+     *
+     * The maximum becomes the top of the highest non-empty bucket. Like reset(),
+     * not atomic with respect to concurrent record() calls.
+     *
+     * @param firstBucket Bucket that bucketCounts[0] belongs to; the rest follow it
+     */
+    void assign (int firstBucket, const uint32_t* bucketCounts, int numCounts)
+    {
+        uint64_t sum = 0;
+        uint64_t top = 0;
+
+        for (int i = 0; i < numBuckets; ++i)
+        {
+            const int offset = i - firstBucket;
+            const uint32_t count = (offset >= 0 && offset < numCounts) ? bucketCounts[offset] : 0;
+            counts[i].store (count, std::memory_order_relaxed);
+            sum += count;
+
+            if (count > 0)
+                top = bucketLowerBound (i + 1) - 1;
+        }
+
+        total.store (sum, std::memory_order_relaxed);
+        maximum.store (top, std::memory_order_relaxed);
+    }
+
+    /** Number of values recorded */
+    uint64_t getCount() const { return total.load (std::memory_order_relaxed); }
+
+    /** Largest value recorded, in nanoseconds */
+    uint64_t getMax() const { return maximum.load (std::memory_order_relaxed); }
+
+    /** Returns the value below which the given fraction of samples fall
+     *
+     * @param fraction e.g. 0.5 for the median, 0.999 for p99.9
+     * @return value in nanoseconds (bucket midpoint), or 0 if empty
+     */
+    uint64_t getPercentile (double fraction) const
+    {
+        const uint64_t n = getCount();
+
+        if (n == 0)
+            return 0;
+
+        uint64_t target = (uint64_t) (fraction * (double) n + 0.5);
+        if (target < 1)
+            target = 1;
+
+        uint64_t seen = 0;
+
+        for (int i = 0; i < numBuckets; ++i)
+        {
+            seen += counts[i].load (std::memory_order_relaxed);
+
+            if (seen >= target)
+            {
+                const uint64_t low = bucketLowerBound (i);
+                const uint64_t mid = low + (bucketLowerBound (i + 1) - low) / 2;
+                return mid < getMax() ? mid : getMax();
+            }
+        }
+
+        return getMax();
+    }
+
+    /** Returns the number of values recorded in a bucket */
+    uint64_t getBucketCount (int index) const { return counts[index].load (std::memory_order_relaxed); }
+
+    /** Lower bound (inclusive, nanoseconds) of a bucket */
+    static uint64_t bucketLowerBound (int index)
+    {
+        if (index < subBuckets)
+            return (uint64_t) index;
+
+        const int exponent = index / subBuckets + subBucketBits - 1;
+        const uint64_t sub = (uint64_t) (index % subBuckets);
+        return ((uint64_t) subBuckets + sub) << (exponent - subBucketBits);
+    }
+
+    /** Bucket a value falls into */
+    static int bucketIndex (uint64_t value)
+    {
+        if (value < (uint64_t) subBuckets)
+            return (int) value;
+
+        int exponent = 63 - countLeadingZeros (value);
+
+        if (exponent >= maxExponent)
+            return numBuckets - 1;
+
+        const int shift = exponent - subBucketBits;
+        const int sub = (int) ((value >> shift) & (subBuckets - 1));
+        return (exponent - subBucketBits + 1) * subBuckets + sub;
+    }
+
+private:
+    static int countLeadingZeros (uint64_t value)
+    {
+       #if defined (_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64 (&index, value);
+        return 63 - (int) index;
+       #else
+        return __builtin_clzll (value);
+       #endif
+    }
+
+    std::atomic<uint64_t> counts[numBuckets];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> maximum;
+};
@@ -22,6 +22,7 @@
 */
 
 #include "PigpiodOutput.h"
+#include "PigpiodInput.h"
 #include <PluginInfo.h>
 #include <string>
 #ifdef _WIN32
@@ -32,7 +33,7 @@
 #endif
 
 using namespace Plugin;
-#define NUM_PLUGINS 1
+#define NUM_PLUGINS 2
 
 extern "C" EXPORT void getLibInfo (Plugin::LibraryInfo* info)
 {
@@ -52,6 +53,12 @@ extern "C" EXPORT int getPluginInfo (int index, Plugin::PluginInfo* info)
             info->processor.type = Plugin::Processor::SINK;
             info->processor.creator = &(Plugin::createProcessor<PigpiodOutput>);
             break;
+        case 1:
+            info->type = Plugin::PROCESSOR;
+            info->processor.name = "Pigpiod Input";
+            info->processor.type = Plugin::Processor::FILTER;
+            info->processor.creator = &(Plugin::createProcessor<PigpiodInput>);
+            break;
         default:
             return -1;
             break;
@@ -0,0 +1,167 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "PigpiodBenchmark.h"
+
+static juce::uint64 ticksToNanoseconds (juce::int64 ticks)
+{
+    return ticks > 0 ? (juce::uint64) (juce::Time::highResolutionTicksToSeconds (ticks) * 1.0e9) : 0;
+}
+
+PigpiodBenchmark::PigpiodBenchmark (PigpiodClient& client_)
+    : juce::Thread ("Pigpiod Benchmark")
+    , client (client_)
+    , progress (0)
+{
+}
+
+PigpiodBenchmark::~PigpiodBenchmark()
+{
+    stopThread (2000);
+}
+
+bool PigpiodBenchmark::start (const Settings& settings_)
+{
+    if (isThreadRunning())
+        return false;
+
+    settings = settings_;
+    progress.store (0);
+    startThread();
+    return true;
+}
+
+juce::uint64 PigpiodBenchmark::waitForEdge (int edgeNumber)
+{
+    // The pulse thread logs the edge within microseconds; the first read usually finds it
+    for (int attempt = 0; attempt < 20 && !threadShouldExit(); ++attempt)
+    {
+        juce::uint64 edgeUs = 0;
+
+        if (client.readEdge (settings.loopbackGpio, edgeNumber, edgeUs) >= edgeNumber && edgeUs != 0)
+            return edgeUs;
+
+        wait (1);
+    }
+
+    return 0;
+}
+
+void PigpiodBenchmark::run()
+{
+    samples.assign ((size_t) juce::jmax (0, settings.numPulses), Sample());
+    sendLatency.reset();
+    roundTripLatency.reset();
+    edgeLatency.reset();
+    edgeNote = juce::String();
+
+    // Plain UDP TRIGs and compact frames get no reply, so there is no round trip to measure
+    const bool measureRoundTrip = client.getTransport() != PigpiodClient::Transport::udp && !client.isUsingCompactFrames();
+
+    // The output idles low, so the pulse's first edge at the loopback input is a rising one
+    client.write (settings.outputGpio, PI_LOW);
+
+    bool measureEdges = settings.loopbackGpio >= 0;
+    juce::uint64 unused;
+
+    if (!measureEdges)
+        edgeNote = "no loopback pin";
+    else if (client.setMode (settings.loopbackGpio, PI_INPUT) < 0
+             || client.readEdge (settings.loopbackGpio, 0, unused) < 0)
+        edgeNote = "the server can't timestamp edges (needs gpio_server)";
+    else if (!client.getClockModel().isValid())
+        edgeNote = "no clock sync with the server";
+
+    measureEdges = edgeNote.isEmpty();
+
+    const PigpiodFrame frame = PigpiodFrame::trig ((uint32_t) settings.outputGpio, (uint32_t) settings.pulseUs, PI_HIGH);
+    const double periodTicks = (double) juce::Time::getHighResolutionTicksPerSecond() / juce::jmax (1.0, settings.rateHz);
+    const juce::int64 startTicks = juce::Time::getHighResolutionTicks();
+
+    for (int i = 0; i < settings.numPulses && !threadShouldExit() && client.isConnected(); ++i)
+    {
+        // Pulses keep to the configured rate however long each measurement takes
+        const juce::int64 dueTicks = startTicks + (juce::int64) ((double) i * periodTicks);
+        const double waitMs = juce::Time::highResolutionTicksToSeconds (dueTicks - juce::Time::getHighResolutionTicks()) * 1000.0;
+
+        if (waitMs >= 1.0)
+            wait ((int) waitMs);
+
+        const int edgesBefore = measureEdges ? client.readEdge (settings.loopbackGpio, 0, unused) : 0;
+
+        const juce::int64 t0 = juce::Time::getHighResolutionTicks();
+        const int result = client.sendFrame (frame);
+        const juce::int64 t1 = juce::Time::getHighResolutionTicks();
+
+        if (result < 0)
+        {
+            progress.store (i + 1, std::memory_order_relaxed);
+            continue;
+        }
+
+        Sample& sample = samples[(size_t) i];
+        sample.sendUs = juce::Time::highResolutionTicksToSeconds (t1 - t0) * 1.0e6;
+        sendLatency.record (ticksToNanoseconds (t1 - t0));
+
+        // Either way this is a blocking round trip, so the TRIG's reply is in when it returns
+        const juce::uint64 edgeUs = measureEdges ? waitForEdge (edgesBefore + 1) : 0;
+
+        if (!measureEdges)
+            client.getVersion();
+
+        const double roundTripMs = measureRoundTrip ? client.getLastRoundTripMs (PI_CMD_TRIG) : -1.0;
+
+        if (roundTripMs >= 0.0)
+        {
+            sample.roundTripUs = roundTripMs * 1000.0;
+            roundTripLatency.record ((juce::uint64) (roundTripMs * 1.0e6));
+        }
+
+        if (edgeUs != 0)
+        {
+            // Clock model error can put the edge a little before the write; count that as 0
+            const double latencyUs = (double) (juce::int64) (edgeUs - client.hostTicksToServerMicros (t0));
+            sample.edgeUs = juce::jmax (0.0, latencyUs);
+            edgeLatency.record ((juce::uint64) (sample.edgeUs * 1000.0));
+        }
+
+        progress.store (i + 1, std::memory_order_relaxed);
+    }
+
+    // A stopped run keeps the pulses it fired
+    samples.resize ((size_t) progress.load());
+}
+
+bool PigpiodBenchmark::writeCsv (const juce::File& file) const
+{
+    auto field = [] (double us) { return us < 0.0 ? juce::String() : juce::String (us, 1); };
+
+    juce::String csv = "pulse,send_us,rtt_us,edge_us\n";
+
+    for (size_t i = 0; i < samples.size(); ++i)
+        csv += juce::String ((int) i + 1) + "," + field (samples[i].sendUs) + ","
+               + field (samples[i].roundTripUs) + "," + field (samples[i].edgeUs) + "\n";
+
+    return file.replaceWithText (csv);
+}
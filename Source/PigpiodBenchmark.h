@@ -0,0 +1,122 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#pragma once
+
+#include "PigpiodClient.h"
+#include "LatencyHistogram.h"
+
+#include <vector>
+
+/**
+ * Measures pulse latency end to end by firing a series of test pulses.
+ *
+ * Each pulse is a TRIG on the output pin, sent exactly as the sender thread
+ * sends one. For every pulse the benchmark records how long the socket write
+ * took, the command's round trip, and, if the output pin is wired to a
+ * loopback input and the server is gpio_server, when the edge actually
+ * appeared, from the server's EDGE timestamp mapped through the clock model.
+ * Runs on its own thread with blocking commands, so only start it while
+ * acquisition is stopped.
+ */
+class PigpiodBenchmark : public juce::Thread
+{
+public:
+    /** What to measure */
+    struct Settings
+    {
+        /** Pin to pulse (BCM numbering) */
+        int outputGpio = 17;
+
+        /** Input wired to outputGpio, or -1 to skip edge times */
+        int loopbackGpio = -1;
+
+        int pulseUs = 50;
+        int numPulses = 1000;
+        double rateHz = 100.0;
+    };
+
+    /** Measurements for one pulse, in microseconds (negative if not measured) */
+    struct Sample
+    {
+        double sendUs = -1.0;
+        double roundTripUs = -1.0;
+
+        /** From the start of the write to the edge at the loopback input */
+        double edgeUs = -1.0;
+    };
+
+    /** Constructor */
+    explicit PigpiodBenchmark (PigpiodClient& client);
+
+    /** Destructor */
+    ~PigpiodBenchmark() override;
+
+    /** Starts a run in the background (message thread); false if one is running */
+    bool start (const Settings& settings);
+
+    /** Pulses fired so far in the current (or last) run */
+    int getProgress() const { return progress.load (std::memory_order_relaxed); }
+
+    /** Pulses in the current (or last) run */
+    int getNumPulses() const { return settings.numPulses; }
+
+    /** Per-pulse results of the last run (only while the thread isn't running) */
+    const std::vector<Sample>& getSamples() const { return samples; }
+
+    /** Distributions of the last run (nanoseconds) */
+    const LatencyHistogram& getSendLatency() const { return sendLatency; }
+    const LatencyHistogram& getRoundTripLatency() const { return roundTripLatency; }
+    const LatencyHistogram& getEdgeLatency() const { return edgeLatency; }
+
+    /** Why edge times are missing from the last run, if they are */
+    juce::String getEdgeNote() const { return edgeNote; }
+
+    /** Writes the last run as CSV, one row per pulse (message thread) */
+    bool writeCsv (const juce::File& file) const;
+
+    /** Thread body */
+    void run() override;
+
+private:
+    /** Waits for the pulse's rising edge at the loopback input (thread only)
+     *
+     * @return the edge's server time in microseconds, or 0 if it never came
+     */
+    juce::uint64 waitForEdge (int edgeNumber);
+
+    PigpiodClient& client;
+
+    Settings settings;
+    std::vector<Sample> samples;
+    std::atomic<int> progress;
+
+    LatencyHistogram sendLatency;
+    LatencyHistogram roundTripLatency;
+    LatencyHistogram edgeLatency;
+
+    juce::String edgeNote;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodBenchmark);
+};
@@ -26,9 +26,111 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+PigpiodClient::ResponseReader::ResponseReader (PigpiodClient& owner_)
+    : juce::Thread ("Pigpiod Reader")
+    , owner (owner_)
+{
+}
+
+void PigpiodClient::ResponseReader::run()
+{
+    owner.readResponses (*this);
+}
+
+PigpiodClient::ClockPinger::ClockPinger (PigpiodClient& owner_)
+    : juce::Thread ("Pigpiod Clock")
+    , owner (owner_)
+{
+}
+
+void PigpiodClient::ClockPinger::run()
+{
+    while (!threadShouldExit())
+    {
+        owner.sendClockPing();
+        wait (clockPingIntervalMs);
+    }
+}
+
+PigpiodClient::EdgePoller::EdgePoller (PigpiodClient& owner_, int intervalMs_)
+    : juce::Thread ("Pigpiod Edges")
+    , owner (owner_)
+    , intervalMs (intervalMs_)
+{
+}
+
+void PigpiodClient::EdgePoller::run()
+{
+    while (!threadShouldExit())
+    {
+        owner.pollEdges();
+
+        // The reader signals early when a full reply says the server has more waiting
+        owner.edgeWake.wait (intervalMs);
+    }
+}
+
+static_assert (GS_EDGE_READ_MAX * GS_EDGE_RECORD_SIZE <= GS_MAX_REPLY_EXT, "reader buffers hold GS_MAX_REPLY_EXT");
+
+/** Bytes of extension that follow a reply: only EDGEREAD and STATS return data */
+static int getReplyExtensionSize (const uint32_t* response)
+{
+    int32_t status;
+    memcpy (&status, response + 3, 4);
+
+    if (response[0] == GS_CMD_EDGEREAD && status > 0 && status <= GS_EDGE_READ_MAX * GS_EDGE_RECORD_SIZE)
+        return (int) status;
+
+    if (response[0] == GS_CMD_STATS && status >= 4 && status <= GS_MAX_REPLY_EXT)
+        return (int) status;
+
+    return 0;
+}
+
 PigpiodClient::PigpiodClient()
-    : port (8888)
+    : transport (Transport::tcp)
+    , sentSequence (0)
+    , receivedSequence (0)
+    , syncSequence (0)
+    , syncResult (0)
+    , syncDone (false)
+    , connectionLost (false)
+    , lastReplyTicks (0)
+    , replyCount (0)
+    , errorReplyCount (0)
+    , mismatchedReplyCount (0)
+    , lateReplyCount (0)
+    , lostReplyCount (0)
+    , staleReplyCount (0)
+    , pendingAcks (0)
+    , batchSize (0)
+    , batchSupported (false)
+    , sharedMemoryActive (false)
+    , sharedMemoryWanted (true)
+    , busyPoll (false)
+    , compactWanted (false)
+    , compactActive (false)
+    , protocolVersion (0)
+    , serverCapabilities (0)
+    , edgeMask (0)
+    , nextEdgeSequence (0)
+    , edgeReadPending (false)
+    , edgeReadTicks (0)
+    , edgeBacklog (false)
+    , lostEdgeCount (0)
+    , clockCommand (0)
+    , lastServerTick (0)
+    , serverTickEpoch (0)
+    , microsPerTick (1.0e6 / (double) juce::Time::getHighResolutionTicksPerSecond())
+    , port (8888)
 {
+    for (auto& rtt : lastRoundTripTicks)
+        rtt.store (-1);
+
+    for (auto& counter : serverStatsCounters)
+        counter.store (0);
+
+    forgetPinStates();
 }
 
 PigpiodClient::~PigpiodClient()
@@ -38,21 +140,63 @@ PigpiodClient::~PigpiodClient()
 
 bool PigpiodClient::isConnected() const
 {
-    return socket != nullptr && socket->isConnected();
+    const juce::ScopedLock lock (socketLock);
+
+    if (transport != Transport::tcp)
+        return datagramSocket != nullptr && !connectionLost.load();
+
+    return socket != nullptr && socket->isConnected() && !connectionLost.load();
 }
 
-bool PigpiodClient::connect (const juce::String& hostname, int port)
+bool PigpiodClient::connect (const juce::String& hostname, int port, Transport transport)
 {
     disconnect(); // Close any existing connection
 
-    this->hostname = hostname;
-    this->port = port;
+    {
+        const juce::ScopedLock lock (socketLock);
+        this->hostname = hostname;
+        this->port = port;
+    }
+
+    this->transport.store (transport, std::memory_order_release);
+
+    if (transport != Transport::tcp)
+    {
+        // Connectionless: the version query below is what proves the server is there
+        auto newSocket = std::make_unique<juce::DatagramSocket> (false);
+
+        if (!newSocket->bindToPort (0))
+        {
+            setLastError ("Failed to open a UDP socket");
+            return false;
+        }
+
+        setLastError ("");
 
-    socket = std::make_unique<juce::StreamingSocket>();
+        {
+            const juce::ScopedLock lock (socketLock);
+            datagramSocket = std::move (newSocket);
+        }
 
-    if (socket->connect (hostname, port, 3000)) // 3 second timeout
+        if (datagramSocket->getRawSocketHandle() >= 0)
+            tuneSocket (datagramSocket->getRawSocketHandle());
+    }
+    else
     {
-        lastError = "";
+        auto newSocket = std::make_unique<juce::StreamingSocket>();
+
+        if (!newSocket->connect (hostname, port, 3000)) // 3 second timeout
+        {
+            setLastError ("Failed to connect to " + hostname + ":" + juce::String (port));
+            return false;
+        }
+
+        setLastError ("");
+
+        {
+            const juce::ScopedLock lock (socketLock);
+            socket = std::move (newSocket);
+        }
 
         // Disable Nagle's algorithm for minimal latency
         int socketHandle = socket->getRawSocketHandle();
@@ -67,258 +211,1520 @@ bool PigpiodClient::connect (const juce::String& hostname, int port)
             {
                 DBG ("TCP_NODELAY enabled for minimal latency");
             }
+
+            tuneSocket (socketHandle);
         }
+    }
 
-        // Verify connection by getting version
-        int version = getVersion();
-        if (version > 0)
+    // Replies are consumed by the reader from the very first command
+    startReader();
+
+    // gpio_server answers HELLO with what it supports; pigpiod (or an older
+    // gpio_server) rejects it, and the version query proves it is there
+    const int protocol = negotiateProtocol();
+    int version = protocol > 0 ? protocol : getVersion();
+    if (version > 0)
+    {
+        const uint32_t capabilities = getCapabilities();
+
+        if (protocol > 0)
         {
-            return true;
+            batchSupported.store ((capabilities & GS_CAP_BATCH) != 0, std::memory_order_release);
         }
         else
         {
-            lastError = "Failed to get pigpiod version. Is pigpiod running?";
-            disconnect();
-            return false;
+            // An empty batch is a no-op on gpio_server and an unknown command to pigpiod
+            uint8_t probe[16] = { 0 };
+            const uint32_t batchCommand = GS_CMD_BATCH;
+            memcpy (probe, &batchCommand, 4);
+            batchSupported.store (sendAndWait (probe, nullptr, 0) >= 0, std::memory_order_release);
+        }
+
+        if (sharedMemoryWanted.load (std::memory_order_relaxed) && isLocalHost (hostname) && (protocol <= 0 || (capabilities & GS_CAP_SHM) != 0) && attachSharedMemory())
+        {
+            DBG ("Using gpio_server's shared-memory ring");
         }
+
+        // Without a clock, pulses are simply sent immediately
+        syncServerClock();
+        return true;
     }
     else
     {
-        lastError = "Failed to connect to " + hostname + ":" + juce::String (port);
-        socket = nullptr;
+        disconnect();
+
+        if (transport != Transport::tcp)
+            setLastError ("No UDP reply from " + hostname + ":" + juce::String (port) + ". Is gpio_server running?");
+        else
+            setLastError ("Failed to get pigpiod version. Is pigpiod running?");
+
         return false;
     }
 }
 
-void PigpiodClient::disconnect()
+juce::uint64 PigpiodClient::getErrorReplyCount() const
 {
-    if (socket != nullptr)
-    {
-        socket->close();
-        socket = nullptr;
-    }
-    lastError = "";
+    // disconnect() unmaps the shared-memory counters under socketLock
+    const juce::ScopedLock lock (socketLock);
+    return errorReplyCount.load (std::memory_order_relaxed) + sharedMemory.getRejectedCount();
 }
 
-int PigpiodClient::getVersion()
+juce::uint64 PigpiodClient::getLateReplyCount() const
 {
-    return sendCommand (PI_CMD_PIGPV);
+    const juce::ScopedLock lock (socketLock);
+    return lateReplyCount.load (std::memory_order_relaxed) + sharedMemory.getLateCount();
 }
 
-int PigpiodClient::setMode (int gpio, int mode)
+bool PigpiodClient::reconnect()
 {
-    if (gpio < 0 || gpio > 53)
+    juce::String lastHostname;
+    int lastPort;
+
     {
-        lastError = "Invalid GPIO number: " + juce::String (gpio);
-        return PI_BAD_GPIO;
+        const juce::ScopedLock lock (socketLock);
+        lastHostname = hostname;
+        lastPort = port;
     }
 
-    DBG ("PigpiodClient::setMode - Setting GPIO " + juce::String(gpio) + " to mode " + juce::String(mode));
-    return sendCommand (PI_CMD_MODES, gpio, mode);
+    return connect (lastHostname, lastPort, getTransport());
 }
 
-int PigpiodClient::write (int gpio, int level)
+juce::String PigpiodClient::getHostname() const
 {
-    if (gpio < 0 || gpio > 53)
-    {
-        lastError = "Invalid GPIO number: " + juce::String (gpio);
-        return PI_BAD_GPIO;
-    }
+    const juce::ScopedLock lock (socketLock);
+    return hostname;
+}
 
-    return sendCommand (PI_CMD_WRITE, gpio, level);
+juce::String PigpiodClient::getLastError() const
+{
+    const juce::ScopedLock lock (errorLock);
+    return lastError;
 }
 
-int PigpiodClient::trig (int gpio, int pulseLength)
+void PigpiodClient::setLastError (const juce::String& message)
 {
-    if (gpio < 0 || gpio > 53)
-    {
-        lastError = "Invalid GPIO number: " + juce::String (gpio);
-        return PI_BAD_GPIO;
-    }
+    const juce::ScopedLock lock (errorLock);
+    lastError = message;
+}
 
-    if (pulseLength < 1 || pulseLength > 100)
-    {
-        lastError = "Invalid pulse length: " + juce::String (pulseLength) + " (must be 1-100 microseconds)";
-        return PI_BAD_GPIO;
-    }
+int PigpiodClient::negotiateProtocol()
+{
+    // Compact frames rely on TCP's ordering; datagrams keep the pigpiod format
+    const uint32_t wanted = compactWanted.load (std::memory_order_relaxed) && transport == Transport::tcp
+                                ? GS_PROTOCOL_COMPACT
+                                : GS_PROTOCOL_PIGPIOD;
 
-    // TRIG uses extension data for the level parameter
-    // p1=gpio, p2=pulseLength, p3=4 (size of extension), ext=level
-    uint32_t level = 1; // HIGH pulse
+    uint8_t cmdBuf[16] = { 0 };
+    const uint32_t header[4] = { GS_CMD_HELLO, wanted, 0, 0 };
+    memcpy (cmdBuf, header, sizeof (header));
 
-    // Use non-waiting version for minimal latency (fire-and-forget)
-    int result = sendCommandExtNoWait (PI_CMD_TRIG, gpio, pulseLength, sizeof(uint32_t), &level);
+    uint32_t response[4];
+    const int result = sendAndWait (cmdBuf, nullptr, 0, response);
+
+    if (result <= 0 || response[0] != GS_CMD_HELLO)
+        return result < 0 ? result : PI_SOCKET_ERROR;
 
+    serverCapabilities.store (response[1], std::memory_order_release);
+    protocolVersion.store (result, std::memory_order_release);
+
+    // The server switched straight after its reply, and nothing else has been sent since
+    compactActive.store (result == GS_PROTOCOL_COMPACT && transport == Transport::tcp, std::memory_order_release);
     return result;
 }
 
-int PigpiodClient::sendCommand (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t p3)
+void PigpiodClient::disconnect()
 {
-    if (!isConnected())
+    // The server forgets the stream along with the connection
+    stopEdgePoller();
+    edgeMask.store (0, std::memory_order_release);
+
+    if (pinger != nullptr)
     {
-        lastError = "Not connected to pigpiod";
-        return PI_NOT_CONNECTED;
+        pinger->stopThread (1000);
+        pinger = nullptr;
     }
 
-    // Prepare command (16 bytes: 4x uint32_t in little-endian)
-    uint8_t cmdBuf[16];
-    memcpy (cmdBuf + 0, &cmd, 4);
-    memcpy (cmdBuf + 4, &p1, 4);
-    memcpy (cmdBuf + 8, &p2, 4);
-    memcpy (cmdBuf + 12, &p3, 4);
+    // The reader uses the socket without holding the lock, so it must stop first
+    stopReader();
+
+    const juce::ScopedLock lock (socketLock);
+
+    sharedMemoryActive.store (false, std::memory_order_release);
+    sharedMemory.close();
 
-    // Send command
-    int sent = socket->write (cmdBuf, 16);
-    if (sent != 16)
+    if (socket != nullptr)
     {
-        lastError = "Failed to send command";
-        return PI_SOCKET_ERROR;
+        socket->close();
+        socket = nullptr;
     }
 
-    // Receive response (16 bytes: status + data)
-    uint8_t resBuf[16];
-    int totalReceived = 0;
-    int attempts = 0;
-    const int maxAttempts = 100; // Prevent infinite loop
+    if (datagramSocket != nullptr)
+    {
+        datagramSocket->shutdown();
+        datagramSocket = nullptr;
+    }
+    setLastError ("");
+}
 
-    // Keep reading until we get all 16 bytes
-    while (totalReceived < 16 && attempts < maxAttempts)
+void PigpiodClient::tuneSocket (int socketHandle)
+{
+#if defined(__linux__)
+    // Ahead of bulk traffic in the host's own queues; 6 is the highest allowed without CAP_NET_ADMIN
+    int priority = 6;
+    if (setsockopt (socketHandle, SOL_SOCKET, SO_PRIORITY, &priority, sizeof (priority)) < 0)
     {
-        int received = socket->read (resBuf + totalReceived, 16 - totalReceived, true); // blocking read
+        DBG ("Warning: Failed to set SO_PRIORITY");
+    }
 
-        if (received > 0)
-        {
-            totalReceived += received;
-        }
-        else if (received < 0)
+   #ifdef SO_BUSY_POLL
+    if (busyPoll.load (std::memory_order_relaxed))
+    {
+        int busyPollUs = 50;
+        if (setsockopt (socketHandle, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof (busyPollUs)) < 0)
         {
-            lastError = "Socket read error";
-            return PI_SOCKET_ERROR;
+            DBG ("Warning: Failed to set SO_BUSY_POLL (raising it above net.core.busy_read needs CAP_NET_ADMIN)");
         }
-
-        attempts++;
     }
+   #endif
+#else
+    juce::ignoreUnused (socketHandle);
+#endif
+}
 
-    if (totalReceived != 16)
-    {
-        lastError = "Incomplete response from pigpiod";
-        return PI_SOCKET_ERROR;
-    }
+void PigpiodClient::startReader()
+{
+    sentSequence.store (0);
+    receivedSequence.store (0);
+    syncSequence.store (0);
+    connectionLost.store (false);
+    lastReplyTicks.store (juce::Time::getHighResolutionTicks());
+    replyCount.store (0);
+    errorReplyCount.store (0);
+    mismatchedReplyCount.store (0);
+    lateReplyCount.store (0);
+    lostReplyCount.store (0);
+    staleReplyCount.store (0);
+    pendingAcks.store (0);
+    batchSupported.store (false);
+    compactActive.store (false);
+    protocolVersion.store (0);
+    serverCapabilities.store (0);
+    clockCommand.store (0);
+    clock.reset();
+    lastServerTick = 0;
+    serverTickEpoch = 0;
 
-    // Extract status (first 4 bytes)
-    int32_t status;
-    memcpy (&status, resBuf, 4);
+    for (auto& rtt : lastRoundTripTicks)
+        rtt.store (-1);
 
-    return status;
-}
+    for (auto& entry : inFlight)
+        entry.awaitingSequence.store (0);
 
-int PigpiodClient::sendCommandExt (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t extSize, const void* extData)
-{
-    if (!isConnected())
+    roundTripLatency.reset();
+
+    // A reconnect may reach a different or rebooted server, whose pins are wherever they are
+    forgetPinStates();
+
+    // Nor does its old telemetry apply
+    for (int i = 0; i < GS_STATS_COUNT; ++i)
     {
-        lastError = "Not connected to pigpiod";
-        return PI_NOT_CONNECTED;
+        serverStats[i].reset();
+        serverStatsCounters[i].store (0);
     }
 
-    // Prepare command header (16 bytes: 4x uint32_t)
-    // p3 = size of extension data
-    uint8_t cmdBuf[16];
-    memcpy (cmdBuf + 0, &cmd, 4);
-    memcpy (cmdBuf + 4, &p1, 4);
-    memcpy (cmdBuf + 8, &p2, 4);
-    memcpy (cmdBuf + 12, &extSize, 4);
+    reader = std::make_unique<ResponseReader> (*this);
+    reader->startThread();
+}
 
-    // Send command header
-    int sent = socket->write (cmdBuf, 16);
-    if (sent != 16)
+void PigpiodClient::stopReader()
+{
+    if (reader != nullptr)
     {
-        lastError = "Failed to send command header";
-        return PI_SOCKET_ERROR;
+        reader->stopThread (1000);
+        reader = nullptr;
     }
+}
 
-    // Send extension data if present
-    if (extSize > 0 && extData != nullptr)
+int PigpiodClient::findFirstResponder (const juce::StringArray& hosts, int port, int timeoutMs)
+{
+    // Shared with the probe threads, which may outlive this call
+    struct Race
     {
-        int extSent = socket->write (extData, extSize);
-        if (extSent != (int)extSize)
-        {
-            lastError = "Failed to send extension data";
-            return PI_SOCKET_ERROR;
-        }
-    }
+        std::atomic<int> winner { -1 };
+        std::atomic<int> remaining { 0 };
+        juce::WaitableEvent done;
+    };
 
-    // Receive response (16 bytes: status + data)
-    uint8_t resBuf[16];
-    int totalReceived = 0;
-    int attempts = 0;
-    const int maxAttempts = 100; // Prevent infinite loop
+    auto race = std::make_shared<Race>();
+    race->remaining.store (hosts.size());
 
-    // Keep reading until we get all 16 bytes
-    while (totalReceived < 16 && attempts < maxAttempts)
+    for (int i = 0; i < hosts.size(); ++i)
     {
-        int received = socket->read (resBuf + totalReceived, 16 - totalReceived, true); // blocking read
+        const juce::String host = hosts[i];
 
-        if (received > 0)
-        {
-            totalReceived += received;
-        }
-        else if (received < 0)
+        const bool launched = juce::Thread::launch ([race, host, port, timeoutMs, i]
         {
-            lastError = "Socket read error";
-            return PI_SOCKET_ERROR;
-        }
+            juce::StreamingSocket probe;
+            int none = -1;
+
+            if (probe.connect (host, port, timeoutMs))
+                race->winner.compare_exchange_strong (none, i);
+
+            probe.close();
 
-        attempts++;
+            if (race->winner.load() >= 0 || race->remaining.fetch_sub (1) == 1)
+                race->done.signal();
+        });
+
+        if (!launched && race->remaining.fetch_sub (1) == 1)
+            race->done.signal();
     }
 
-    if (totalReceived != 16)
+    race->done.wait (timeoutMs + 500);
+    return race->winner.load();
+}
+
+bool PigpiodClient::isLocalHost (const juce::String& hostname)
+{
+    if (hostname.equalsIgnoreCase ("localhost") || hostname.startsWith ("127.") || hostname == "::1")
+        return true;
+
+    for (auto& address : juce::IPAddress::getAllAddresses())
+        if (address.toString() == hostname)
+            return true;
+
+    return false;
+}
+
+bool PigpiodClient::attachSharedMemory()
+{
+    // The server hands the ring to one client at a time
+    if (sendCommand (GS_CMD_SHMATTACH) < 0)
+        return false;
+
+    const juce::ScopedLock lock (socketLock);
+
+    if (!sharedMemory.open (port))
+        return false;
+
+    sharedMemoryActive.store (true, std::memory_order_release);
+    return true;
+}
+
+int PigpiodClient::getVersion()
+{
+    return sendCommand (PI_CMD_PIGPV);
+}
+
+double PigpiodClient::getMillisecondsSinceLastReply() const
+{
+    return juce::Time::highResolutionTicksToSeconds (juce::Time::getHighResolutionTicks() - lastReplyTicks.load()) * 1000.0;
+}
+
+int PigpiodClient::warmUp (int roundTrips)
+{
+    int succeeded = 0;
+
+    for (int i = 0; i < roundTrips; ++i)
+        if (getVersion() > 0)
+            ++succeeded;
+
+    return succeeded;
+}
+
+int PigpiodClient::setMode (int gpio, int mode)
+{
+    if (gpio < 0 || gpio > 53)
     {
-        lastError = "Incomplete response from pigpiod";
-        return PI_SOCKET_ERROR;
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
     }
 
-    // Extract status (first 4 bytes)
-    int32_t status;
-    memcpy (&status, resBuf, 4);
+    DBG ("PigpiodClient::setMode - Setting GPIO " + juce::String(gpio) + " to mode " + juce::String(mode));
+    // A pin that changes mode may come up at any level (an input's sensed level isn't its output latch)
+    const bool modeChanges = getKnownMode (gpio) != mode;
+    const int result = sendCommand (PI_CMD_MODES, gpio, mode);
+    updatePinState (gpio, result, mode, -1);
+
+    if (modeChanges)
+        knownLevels[gpio].store (-1, std::memory_order_relaxed);
 
-    return status;
+    return result;
 }
 
-int PigpiodClient::sendCommandExtNoWait (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t extSize, const void* extData)
+int PigpiodClient::write (int gpio, int level)
 {
-    if (!isConnected())
+    if (gpio < 0 || gpio > 53)
     {
-        lastError = "Not connected to pigpiod";
-        return PI_NOT_CONNECTED;
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
     }
 
-    // Prepare command header (16 bytes: 4x uint32_t)
-    // p3 = size of extension data
-    uint8_t cmdBuf[16];
-    memcpy (cmdBuf + 0, &cmd, 4);
-    memcpy (cmdBuf + 4, &p1, 4);
-    memcpy (cmdBuf + 8, &p2, 4);
-    memcpy (cmdBuf + 12, &extSize, 4);
+    // WRITE makes the pin an output too
+    const int result = sendCommand (PI_CMD_WRITE, gpio, level);
+    updatePinState (gpio, result, PI_OUTPUT, level != 0 ? PI_HIGH : PI_LOW);
+    return result;
+}
 
-    // Send command header
-    int sent = socket->write (cmdBuf, 16);
-    if (sent != 16)
+int PigpiodClient::read (int gpio)
+{
+    if (gpio < 0 || gpio > 53)
     {
-        lastError = "Failed to send command header";
-        return PI_SOCKET_ERROR;
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
     }
 
-    // Send extension data if present
-    if (extSize > 0 && extData != nullptr)
+    const int result = sendCommand (PI_CMD_READ, gpio);
+
+    // Only an output reads back the level it was driven to
+    if (result >= 0 && getKnownMode (gpio) == PI_OUTPUT)
+        knownLevels[gpio].store ((int8_t) (result != 0 ? PI_HIGH : PI_LOW), std::memory_order_relaxed);
+
+    return result;
+}
+
+int PigpiodClient::getKnownMode (int gpio) const
+{
+    return gpio >= 0 && gpio < numGpios ? knownModes[gpio].load (std::memory_order_relaxed) : -1;
+}
+
+int PigpiodClient::getKnownLevel (int gpio) const
+{
+    return gpio >= 0 && gpio < numGpios ? knownLevels[gpio].load (std::memory_order_relaxed) : -1;
+}
+
+void PigpiodClient::forgetPinStates()
+{
+    for (int gpio = 0; gpio < numGpios; ++gpio)
     {
-        int extSent = socket->write (extData, extSize);
-        if (extSent != (int)extSize)
-        {
-            lastError = "Failed to send extension data";
-            return PI_SOCKET_ERROR;
-        }
+        knownModes[gpio].store (-1, std::memory_order_relaxed);
+        knownLevels[gpio].store (-1, std::memory_order_relaxed);
+    }
+}
+
+void PigpiodClient::updatePinState (int gpio, int result, int mode, int level)
+{
+    // A failed command may or may not have reached the pin
+    if (result < 0)
+    {
+        knownModes[gpio].store (-1, std::memory_order_relaxed);
+        knownLevels[gpio].store (-1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (mode >= 0)
+        knownModes[gpio].store ((int8_t) mode, std::memory_order_relaxed);
+
+    if (level >= 0)
+        knownLevels[gpio].store ((int8_t) level, std::memory_order_relaxed);
+}
+
+int PigpiodClient::readEdge (int gpio, int edgeNumber, juce::uint64& edgeUs)
+{
+    edgeUs = 0;
+
+    if (gpio < 0 || gpio > 53)
+    {
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
+    }
+
+    uint8_t cmdBuf[16] = { 0 };
+    const uint32_t header[4] = { GS_CMD_EDGE, (uint32_t) gpio, (uint32_t) edgeNumber, 0 };
+    memcpy (cmdBuf, header, sizeof (header));
+
+    uint32_t response[4];
+    const int result = sendAndWait (cmdBuf, nullptr, 0, response);
+
+    if (result < 0 || response[0] != GS_CMD_EDGE)
+        return result < 0 ? result : PI_SOCKET_ERROR;
+
+    // The reply's p1/p2 carry the timestamp instead of echoing the command
+    edgeUs = (juce::uint64) response[1] | ((juce::uint64) response[2] << 32);
+    return result;
+}
+
+int PigpiodClient::setBank (uint32_t mask)
+{
+    const int result = sendCommand (PI_CMD_BS1, mask);
+
+    for (int gpio = 0; gpio < 32; ++gpio)
+        if ((mask >> gpio) & 1)
+            updatePinState (gpio, result, -1, PI_HIGH);
+
+    return result;
+}
+
+int PigpiodClient::clearBank (uint32_t mask)
+{
+    const int result = sendCommand (PI_CMD_BC1, mask);
+
+    for (int gpio = 0; gpio < 32; ++gpio)
+        if ((mask >> gpio) & 1)
+            updatePinState (gpio, result, -1, PI_LOW);
+
+    return result;
+}
+
+int PigpiodClient::setPwmDutyCycle (int gpio, int dutyCycle)
+{
+    if (gpio < 0 || gpio > 53)
+    {
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
+    }
+
+    // The pin keeps toggling (or is left low when stopped), so its level is no longer known,
+    // and a bank write wouldn't stop the PWM: only a WRITE does
+    knownModes[gpio].store (-1, std::memory_order_relaxed);
+    knownLevels[gpio].store (-1, std::memory_order_relaxed);
+    return sendCommand (PI_CMD_PWM, gpio, dutyCycle);
+}
+
+int PigpiodClient::setPwmRange (int gpio, int range)
+{
+    if (gpio < 0 || gpio > 53)
+    {
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
+    }
+
+    return sendCommand (PI_CMD_PRS, gpio, range);
+}
+
+int PigpiodClient::setPwmFrequency (int gpio, int frequencyHz)
+{
+    if (gpio < 0 || gpio > 53)
+    {
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
+    }
+
+    return sendCommand (PI_CMD_PFS, gpio, frequencyHz);
+}
+
+int PigpiodClient::setHardwarePwm (int gpio, int frequencyHz, int dutyCycle)
+{
+    if (gpio < 0 || gpio > 53)
+    {
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
+    }
+
+    uint32_t duty = (uint32_t) dutyCycle;
+    // As with software PWM, the pin's level is no longer known; HP also moves it to an ALT function
+    knownModes[gpio].store (-1, std::memory_order_relaxed);
+    knownLevels[gpio].store (-1, std::memory_order_relaxed);
+    return sendCommandExt (PI_CMD_HP, gpio, frequencyHz, sizeof (duty), &duty);
+}
+
+int PigpiodClient::trig (int gpio, int pulseLength)
+{
+    if (gpio < 0 || gpio > 53)
+    {
+        setLastError ("Invalid GPIO number: " + juce::String (gpio));
+        return PI_BAD_GPIO;
+    }
+
+    if (pulseLength < 1 || pulseLength > 100)
+    {
+        setLastError ("Invalid pulse length: " + juce::String (pulseLength) + " (must be 1-100 microseconds)");
+        return PI_BAD_GPIO;
+    }
+
+    // TRIG uses extension data for the level parameter
+    // p1=gpio, p2=pulseLength, p3=4 (size of extension), ext=level
+    uint32_t level = 1; // HIGH pulse
+
+    // Use non-waiting version for minimal latency (fire-and-forget)
+    int result = sendCommandExtNoWait (PI_CMD_TRIG, gpio, pulseLength, sizeof(uint32_t), &level);
+
+    return result;
+}
+
+bool PigpiodClient::syncServerClock()
+{
+    // Prefer gpio_server's full timestamp, fall back to pigpiod's tick
+    for (uint32_t cmd : { (uint32_t) GS_CMD_TIME, (uint32_t) PI_CMD_TICK })
+    {
+        // The reader can only interpret the reply once it knows the command is a clock
+        clockCommand.store (cmd, std::memory_order_release);
+
+        // A tick above 2^31 reads as a negative status, so judge by the model instead
+        sendCommand (cmd);
+
+        if (clock.isValid())
+        {
+            DBG ("Server clock offset " + juce::String (clock.getOffsetUs(), 1) + " us, RTT "
+                 + juce::String (clock.getLastRoundTripUs(), 1) + " us");
+
+            pinger = std::make_unique<ClockPinger> (*this);
+            pinger->startThread();
+            return true;
+        }
+    }
+
+    clockCommand.store (0, std::memory_order_release);
+    return false;
+}
+
+int PigpiodClient::sendClockPing()
+{
+    uint8_t cmdBuf[16] = { 0 };
+    const uint32_t cmd = clockCommand.load (std::memory_order_acquire);
+    memcpy (cmdBuf, &cmd, 4);
+
+    uint32_t sequence;
+    return writeCommand (cmdBuf, nullptr, 0, sequence, true);
+}
+
+void PigpiodClient::handleClockReply (const InFlightCommand& entry, const uint32_t* response, juce::int64 receiveTicks)
+{
+    double serverUs;
+
+    if (entry.command == GS_CMD_TIME)
+    {
+        serverUs = (double) ((juce::uint64) response[1] | ((juce::uint64) response[2] << 32));
+    }
+    else
+    {
+        // pigpiod's tick wraps every ~72 minutes; pings are far more frequent than that
+        const uint32_t tick = response[3];
+
+        if (clock.isValid() && tick < lastServerTick)
+            serverTickEpoch += (juce::uint64) 1 << 32;
+
+        lastServerTick = tick;
+        serverUs = (double) (serverTickEpoch + tick);
+    }
+
+    clock.addSample ((double) entry.sendTicks * microsPerTick, (double) receiveTicks * microsPerTick, serverUs);
+}
+
+juce::uint64 PigpiodClient::hostTicksToServerMicros (juce::int64 ticks) const
+{
+    return (juce::uint64) clock.hostToServer ((double) ticks * microsPerTick);
+}
+
+juce::int64 PigpiodClient::serverMicrosToHostTicks (juce::uint64 serverUs) const
+{
+    return (juce::int64) (clock.serverToHost ((double) serverUs) / microsPerTick);
+}
+
+int PigpiodClient::startEdgeStream (uint32_t mask, int pollIntervalMs)
+{
+    stopEdgeStream();
+
+    if (mask == 0)
+        return 0;
+
+    // p2 = 1 starts the pins; the reply's p1 is where this client's reads begin
+    const uint32_t header[4] = { GS_CMD_EDGESTREAM, mask, 1, 0 };
+    uint32_t response[4];
+    const int result = sendAndWait (header, nullptr, 0, response);
+
+    if (result < 0 || response[0] != GS_CMD_EDGESTREAM)
+    {
+        if (isConnected())
+            setLastError ("Edge stream rejected (" + juce::String (result) + "); it needs gpio_server");
+
+        return result < 0 ? result : PI_SOCKET_ERROR;
+    }
+
+    nextEdgeSequence.store (response[1], std::memory_order_release);
+    edgeReadPending.store (false, std::memory_order_release);
+    edgeBacklog.store (false, std::memory_order_release);
+    edgeMask.store (mask, std::memory_order_release);
+
+    edgeWake.reset();
+
+    const juce::ScopedLock lock (edgePollerLock);
+    edgePoller = std::make_unique<EdgePoller> (*this, juce::jlimit (1, 1000, pollIntervalMs));
+    edgePoller->startThread();
+    return 0;
+}
+
+void PigpiodClient::stopEdgeStream()
+{
+    stopEdgePoller();
+
+    const uint32_t mask = edgeMask.exchange (0, std::memory_order_acq_rel);
+
+    if (mask != 0 && isConnected())
+        sendCommand (GS_CMD_EDGESTREAM, mask, 0);
+}
+
+void PigpiodClient::stopEdgePoller()
+{
+    // Taken out under the lock but stopped outside it, so neither caller waits on the other's thread
+    std::unique_ptr<EdgePoller> poller;
+
+    {
+        const juce::ScopedLock lock (edgePollerLock);
+        poller = std::move (edgePoller);
+    }
+
+    if (poller != nullptr)
+    {
+        poller->signalThreadShouldExit();
+        edgeWake.signal();
+        poller->stopThread (1000);
+    }
+}
+
+void PigpiodClient::pollEdges()
+{
+    // One read in flight at a time; a reply that never comes (UDP) is asked for again
+    const juce::int64 now = juce::Time::getHighResolutionTicks();
+    const juce::int64 timeoutTicks = juce::Time::getHighResolutionTicksPerSecond() / 10;
+
+    if (edgeReadPending.load (std::memory_order_acquire) && now - edgeReadTicks.load() < timeoutTicks)
+        return;
+
+    uint8_t cmdBuf[16] = { 0 };
+    const uint32_t header[2] = { GS_CMD_EDGEREAD, nextEdgeSequence.load (std::memory_order_acquire) };
+    memcpy (cmdBuf, header, sizeof (header));
+
+    edgeReadTicks.store (now);
+    edgeReadPending.store (true, std::memory_order_release);
+
+    uint32_t sequence;
+    if (writeCommand (cmdBuf, nullptr, 0, sequence, true) < 0)
+        edgeReadPending.store (false, std::memory_order_release);
+}
+
+void PigpiodClient::handleEdgeReply (const uint32_t* response, const uint8_t* ext, int extSize)
+{
+    // The reply holds records [next - count, next); p2 = records lost before them
+    const uint32_t count = (uint32_t) extSize / GS_EDGE_RECORD_SIZE;
+    const uint32_t next = response[1];
+    const uint32_t expected = nextEdgeSequence.load (std::memory_order_relaxed);
+
+    // A retried read can be answered twice, so only take records not seen yet
+    if ((int32_t) (next - expected) <= 0)
+        return;
+
+    const uint32_t first = next - count;
+    uint32_t skip = 0;
+
+    if ((int32_t) (expected - first) > 0)
+        skip = expected - first;
+    else
+        lostEdgeCount.fetch_add (response[2], std::memory_order_relaxed);
+
+    // The server has one ring for all its clients, so it may hold other clients' pins too
+    const uint32_t mask = edgeMask.load (std::memory_order_acquire);
+
+    for (uint32_t i = skip; i < count; ++i)
+    {
+        uint32_t words[3];
+        memcpy (words, ext + i * GS_EDGE_RECORD_SIZE, sizeof (words));
+
+        EdgeRecord record;
+        record.serverTimeUs = (juce::uint64) words[0] | ((juce::uint64) words[1] << 32);
+        record.gpio = (int) (words[2] & 0xff);
+        record.level = (int) ((words[2] >> 8) & 1);
+
+        if (record.gpio >= 32 || ((mask >> record.gpio) & 1) == 0)
+            continue;
+
+        if (!edgeQueue.push (record))
+            lostEdgeCount.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    nextEdgeSequence.store (next, std::memory_order_release);
+    edgeBacklog.store (count == GS_EDGE_READ_MAX, std::memory_order_release);
+}
+
+bool PigpiodClient::requestServerStats (bool reset)
+{
+    if ((getCapabilities() & GS_CAP_STATS) == 0)
+        return false;
+
+    for (uint32_t id = 0; id < GS_STATS_COUNT; ++id)
+    {
+        uint8_t cmdBuf[16] = { 0 };
+        const uint32_t header[3] = { GS_CMD_STATS, id, reset ? (uint32_t) GS_STATS_RESET : 0u };
+        memcpy (cmdBuf, header, sizeof (header));
+
+        uint32_t sequence;
+        if (writeCommand (cmdBuf, nullptr, 0, sequence, true) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+void PigpiodClient::handleStatsReply (const uint32_t* response, const uint8_t* ext, int extSize)
+{
+    // p1 = histogram, p2 = bucket of the first count; the extension starts with the counter
+    static_assert (GS_STATS_BUCKETS == LatencyHistogram::numBuckets, "gpio_server bins like LatencyHistogram");
+
+    const uint32_t id = response[1];
+    const uint32_t firstBucket = response[2];
+    const int numCounts = (extSize - 4) / 4;
+
+    if (id >= GS_STATS_COUNT || firstBucket + (uint32_t) numCounts > GS_STATS_BUCKETS)
+        return;
+
+    uint32_t counter;
+    memcpy (&counter, ext, 4);
+
+    uint32_t counts[GS_STATS_BUCKETS];
+    memcpy (counts, ext + 4, (size_t) numCounts * 4);
+
+    serverStats[id].assign ((int) firstBucket, counts, numCounts);
+    serverStatsCounters[id].store (counter, std::memory_order_relaxed);
+}
+
+bool PigpiodClient::getServerUdpStats (juce::uint64& received, juce::uint64& lost, juce::uint64& late)
+{
+    uint8_t cmdBuf[16] = { 0 };
+    const uint32_t cmd = GS_CMD_UDPSTATS;
+    memcpy (cmdBuf, &cmd, 4);
+
+    uint32_t response[4];
+    const int result = sendAndWait (cmdBuf, nullptr, 0, response);
+
+    if (result < 0 || response[0] != GS_CMD_UDPSTATS)
+        return false;
+
+    received = (juce::uint64) result;
+    lost = response[1];
+    late = response[2];
+    return true;
+}
+
+int PigpiodClient::getPendingCount() const
+{
+    if (transport != Transport::tcp)
+        return pendingAcks.load (std::memory_order_relaxed);
+
+    return (int) (sentSequence.load (std::memory_order_acquire) - receivedSequence.load (std::memory_order_acquire));
+}
+
+double PigpiodClient::getLastRoundTripMs (uint32_t cmd) const
+{
+    if (cmd >= maxTrackedCommand)
+        return -1.0;
+
+    const juce::int64 ticks = lastRoundTripTicks[cmd].load (std::memory_order_relaxed);
+
+    if (ticks < 0)
+        return -1.0;
+
+    return juce::Time::highResolutionTicksToSeconds (ticks) * 1000.0;
+}
+
+int PigpiodClient::writeCommand (const void* header, const void* extData, uint32_t extSize, uint32_t& sequence,
+                                 bool wantsReply)
+{
+    const juce::ScopedLock lock (socketLock);
+
+    if (!isConnected())
+        return PI_NOT_CONNECTED;
+
+    const uint32_t last = sentSequence.load (std::memory_order_relaxed);
+
+    if (transport != Transport::tcp)
+    {
+        sequence = last + 1;
+        sentSequence.store (sequence, std::memory_order_release);
+        return writeDatagram (header, extData, extSize, sequence, wantsReply);
+    }
+
+    if (last - receivedSequence.load (std::memory_order_acquire) >= maxInFlight)
+        return PI_TOO_MANY_PENDING;
+
+    // Publish the entry before writing, so the reader always finds it when the reply lands
+    sequence = last + 1;
+    InFlightCommand& entry = inFlight[sequence & (maxInFlight - 1)];
+    memcpy (&entry.command, header, 4);
+    entry.sendTicks = juce::Time::getHighResolutionTicks();
+    sentSequence.store (sequence, std::memory_order_release);
+
+    if (compactActive.load (std::memory_order_relaxed))
+    {
+        // Wrapped whole in a GS_OP_CMD op, which the server replies to as before
+        PigpiodCompactFrame frame;
+        uint8_t command[16 + GS_MAX_EXT];
+        const uint32_t commandSize = 16 + (extData != nullptr ? extSize : 0);
+
+        if (commandSize > sizeof (command))
+        {
+            sentSequence.store (last, std::memory_order_release);
+            return PI_BAD_PARAM;
+        }
+
+        memcpy (command, header, 16);
+        if (commandSize > 16)
+            memcpy (command + 16, extData, extSize);
+
+        frame.appendCommand (command, commandSize);
+
+        uint32_t size;
+        const uint8_t* bytes = frame.finish (false, size);
+
+        if (socket->write (bytes, (int) size) != (int) size)
+        {
+            sentSequence.store (last, std::memory_order_release);
+            return PI_SOCKET_ERROR;
+        }
+
+        return 0;
+    }
+
+    if (extSize > 0 && extData != nullptr && extSize <= GS_MAX_EXT)
+    {
+        // Header and extension (e.g. TRIG level, a whole BATCH) go out in one write
+        uint8_t buf[16 + GS_MAX_EXT];
+        memcpy (buf, header, 16);
+        memcpy (buf + 16, extData, extSize);
+
+        if (socket->write (buf, 16 + (int) extSize) != 16 + (int) extSize)
+        {
+            sentSequence.store (last, std::memory_order_release);
+            return PI_SOCKET_ERROR;
+        }
+
+        return 0;
+    }
+
+    if (socket->write (header, 16) != 16)
+    {
+        sentSequence.store (last, std::memory_order_release);
+        return PI_SOCKET_ERROR;
+    }
+
+    if (extSize > 0 && extData != nullptr)
+    {
+        if (socket->write (extData, (int) extSize) != (int) extSize)
+        {
+            // The header is already out, so the stream is no longer in a known state
+            connectionLost.store (true);
+            return PI_SOCKET_ERROR;
+        }
+    }
+
+    return 0;
+}
+
+int PigpiodClient::writeDatagram (const void* header, const void* extData, uint32_t extSize, uint32_t sequence,
+                                  bool wantsReply)
+{
+    if (GS_UDP_HEADER_SIZE + 16 + (int) extSize > maxDatagramSize)
+        return PI_BAD_PARAM;
+
+    uint32_t command;
+    memcpy (&command, header, 4);
+    registerDatagram (sequence, command, juce::Time::getHighResolutionTicks(), wantsReply);
+
+    // Number every datagram, acked or not, so the server can count the gaps
+    const uint32_t flags = wantsReply ? GS_UDP_ACK : 0;
+    uint8_t buf[maxDatagramSize];
+    memcpy (buf, &sequence, 4);
+    memcpy (buf + 4, &flags, 4);
+    memcpy (buf + GS_UDP_HEADER_SIZE, header, 16);
+
+    if (extSize > 0 && extData != nullptr)
+        memcpy (buf + GS_UDP_HEADER_SIZE + 16, extData, extSize);
+
+    const int bytes = GS_UDP_HEADER_SIZE + 16 + (int) extSize;
+
+    if (datagramSocket->write (hostname, port, buf, bytes) != bytes)
+    {
+        // Nothing went out, so nothing will answer
+        if (inFlight[sequence & (maxInFlight - 1)].awaitingSequence.exchange (0) == sequence)
+            pendingAcks.fetch_sub (1, std::memory_order_relaxed);
+
+        return PI_SOCKET_ERROR;
+    }
+
+    return 0;
+}
+
+void PigpiodClient::registerDatagram (uint32_t sequence, uint32_t command, juce::int64 sendTicks, bool wantsReply)
+{
+    InFlightCommand& entry = inFlight[sequence & (maxInFlight - 1)];
+
+    // Unlike TCP there is no bound on what's outstanding: a reply that hasn't
+    // come back after maxInFlight more commands is written off as lost
+    if (entry.awaitingSequence.exchange (0, std::memory_order_acq_rel) != 0)
+    {
+        lostReplyCount.fetch_add (1, std::memory_order_relaxed);
+        pendingAcks.fetch_sub (1, std::memory_order_relaxed);
+    }
+
+    entry.command = command;
+    entry.sendTicks = sendTicks;
+
+    if (wantsReply)
+    {
+        pendingAcks.fetch_add (1, std::memory_order_relaxed);
+        entry.awaitingSequence.store (sequence, std::memory_order_release);
+    }
+}
+
+int PigpiodClient::sendAndWait (const void* header, const void* extData, uint32_t extSize, uint32_t* response)
+{
+    const juce::ScopedLock lock (callLock);
+
+    uint32_t sequence = 0;
+
+    // Claim the sequence number under the socket lock so the reader can't
+    // match the reply before we've registered interest in it
+    {
+        const juce::ScopedLock socketScope (socketLock);
+
+        syncSequence.store (sentSequence.load() + 1, std::memory_order_release);
+        syncDone.store (false, std::memory_order_release);
+        replyEvent.reset();
+
+        int result = writeCommand (header, extData, extSize, sequence);
+
+        if (result < 0)
+        {
+            syncSequence.store (0);
+
+            if (result == PI_NOT_CONNECTED)
+                setLastError ("Not connected to pigpiod");
+            else if (result == PI_TOO_MANY_PENDING)
+                setLastError ("Too many commands awaiting a reply");
+            else
+                setLastError ("Failed to send command");
+
+            return result;
+        }
+    }
+
+    // A lost datagram is never retransmitted, so don't wait as long for it
+    const int timeoutMs = transport != Transport::tcp ? 1000 : 3000;
+    const juce::uint32 deadline = juce::Time::getMillisecondCounter() + (juce::uint32) timeoutMs;
+
+    while (!syncDone.load (std::memory_order_acquire))
+    {
+        if (connectionLost.load())
+        {
+            syncSequence.store (0);
+            setLastError ("Connection closed by pigpiod");
+            return PI_SOCKET_ERROR;
+        }
+
+        const int remaining = (int) (deadline - juce::Time::getMillisecondCounter());
+
+        if (remaining <= 0)
+        {
+            syncSequence.store (0);
+            setLastError ("Timed out waiting for response from pigpiod");
+            return PI_SOCKET_ERROR;
+        }
+
+        replyEvent.wait (remaining);
+    }
+
+    syncSequence.store (0);
+    const int32_t result = syncResult.load (std::memory_order_acquire);
+
+    if (response != nullptr)
+        memcpy (response, syncResponse, sizeof (syncResponse));
+
+    return result;
+}
+
+void PigpiodClient::readResponses (juce::Thread& thread)
+{
+    if (transport != Transport::tcp)
+    {
+        readDatagrams (thread);
+        return;
+    }
+
+    uint32_t response[4];
+    uint8_t ext[GS_MAX_REPLY_EXT];
+    int totalReceived = 0;
+    int extSize = 0; // extension bytes after the reply being read
+
+    while (!thread.threadShouldExit())
+    {
+        // Short timeout so a disconnect never waits long for this thread
+        int ready = socket->waitUntilReady (true, 50);
+
+        if (ready == 0)
+            continue;
+
+        uint8_t* destination = totalReceived < 16 ? (uint8_t*) response + totalReceived : ext + (totalReceived - 16);
+        const int wanted = (totalReceived < 16 ? 16 : 16 + extSize) - totalReceived;
+        int received = ready > 0 ? socket->read (destination, wanted, false) : -1;
+
+        if (received <= 0)
+        {
+            // Readable but nothing to read means the server closed the connection
+            connectionLost.store (true);
+            replyEvent.signal();
+            return;
+        }
+
+        totalReceived += received;
+
+        if (totalReceived == 16)
+            extSize = getReplyExtensionSize (response);
+
+        if (totalReceived == 16 + extSize)
+        {
+            handleResponse (response, ext, extSize);
+            totalReceived = 0;
+            extSize = 0;
+        }
+    }
+}
+
+void PigpiodClient::readDatagrams (juce::Thread& thread)
+{
+    uint8_t buf[GS_UDP_HEADER_SIZE + 16 + GS_MAX_REPLY_EXT];
+
+    while (!thread.threadShouldExit())
+    {
+        // Short timeout so a disconnect never waits long for this thread
+        if (datagramSocket->waitUntilReady (true, 50) <= 0)
+            continue;
+
+        juce::String senderAddress;
+        int senderPort = 0;
+
+        const int bytes = datagramSocket->read (buf, (int) sizeof (buf), false, senderAddress, senderPort);
+
+        if (bytes < GS_UDP_HEADER_SIZE + 16)
+            continue; // Not one of ours, or truncated
+
+        uint32_t sequence;
+        uint32_t response[4];
+        memcpy (&sequence, buf, 4);
+        memcpy (response, buf + GS_UDP_HEADER_SIZE, 16);
+
+        const int extSize = bytes - GS_UDP_HEADER_SIZE - 16;
+
+        if (extSize != getReplyExtensionSize (response))
+            continue;
+
+        handleDatagram (sequence, response, buf + GS_UDP_HEADER_SIZE + 16, extSize);
+    }
+}
+
+void PigpiodClient::handleResponse (const uint32_t* response, const uint8_t* ext, int extSize)
+{
+    const juce::int64 now = juce::Time::getHighResolutionTicks();
+
+    const uint32_t received = receivedSequence.load (std::memory_order_relaxed);
+
+    if (received == sentSequence.load (std::memory_order_acquire))
+    {
+        // A reply with nothing in flight: the stream is out of step
+        mismatchedReplyCount.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+
+    const uint32_t sequence = received + 1;
+    const InFlightCommand& entry = inFlight[sequence & (maxInFlight - 1)];
+
+    if (response[0] != entry.command)
+        mismatchedReplyCount.fetch_add (1, std::memory_order_relaxed);
+
+    completeCommand (entry, sequence, response, now, ext, extSize);
+}
+
+void PigpiodClient::handleDatagram (uint32_t sequence, const uint32_t* response, const uint8_t* ext, int extSize)
+{
+    const juce::int64 now = juce::Time::getHighResolutionTicks();
+
+    InFlightCommand& entry = inFlight[sequence & (maxInFlight - 1)];
+    uint32_t expected = sequence;
+
+    // Claim the entry, so a reply and the writer writing it off as lost can't both count it
+    if (sequence == 0 || !entry.awaitingSequence.compare_exchange_strong (expected, 0, std::memory_order_acq_rel))
+    {
+        staleReplyCount.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+
+    pendingAcks.fetch_sub (1, std::memory_order_relaxed);
+
+    if (response[0] != entry.command)
+        mismatchedReplyCount.fetch_add (1, std::memory_order_relaxed);
+
+    completeCommand (entry, sequence, response, now, ext, extSize);
+}
+
+void PigpiodClient::completeCommand (const InFlightCommand& entry, uint32_t sequence, const uint32_t* response,
+                                     juce::int64 receiveTicks, const uint8_t* ext, int extSize)
+{
+    // pigpiod echoes cmd, p1, p2 and returns the result in the last word
+    const uint32_t command = response[0];
+    int32_t status;
+    memcpy (&status, response + 3, 4);
+
+    lastReplyTicks.store (receiveTicks, std::memory_order_relaxed);
+
+    // The tick is unsigned, so a "negative" status is just a large count
+    const bool isClockReply = (command == entry.command && entry.command == clockCommand.load (std::memory_order_acquire));
+
+    if (isClockReply && (entry.command == PI_CMD_TICK || status >= 0))
+    {
+        handleClockReply (entry, response, receiveTicks);
+    }
+    else if ((entry.command == GS_CMD_BATCH || entry.command == GS_CMD_FRAME) && status >= 0)
+    {
+        // One reply for the whole batch or frame: p1 = commands that failed, p2 = pulses that started late
+        errorReplyCount.fetch_add (response[1], std::memory_order_relaxed);
+        lateReplyCount.fetch_add (response[2], std::memory_order_relaxed);
+    }
+    else if (entry.command == GS_CMD_EDGEREAD && command == GS_CMD_EDGEREAD && status >= 0)
+        handleEdgeReply (response, ext, extSize); // status = extension size
+    else if (entry.command == GS_CMD_STATS && command == GS_CMD_STATS && status >= 4)
+        handleStatsReply (response, ext, extSize);
+    else if (status < 0)
+        errorReplyCount.fetch_add (1, std::memory_order_relaxed);
+    else if ((entry.command == GS_CMD_TRIGAT || entry.command == GS_CMD_PATPLAY) && status > 0)
+        lateReplyCount.fetch_add (1, std::memory_order_relaxed); // started this many us late
+
+    if (entry.command == GS_CMD_EDGEREAD)
+    {
+        edgeReadPending.store (false, std::memory_order_release);
+
+        // Only now can the poller's next read go out, so this is when to wake it
+        if (edgeBacklog.exchange (false, std::memory_order_acq_rel))
+            edgeWake.signal();
+    }
+
+    const juce::int64 roundTrip = receiveTicks - entry.sendTicks;
+
+    if (entry.command < maxTrackedCommand)
+        lastRoundTripTicks[entry.command].store (roundTrip, std::memory_order_relaxed);
+
+    roundTripLatency.record ((juce::uint64) (juce::Time::highResolutionTicksToSeconds (roundTrip) * 1.0e9));
+
+    replyCount.fetch_add (1, std::memory_order_relaxed);
+
+    const bool isSync = (sequence == syncSequence.load (std::memory_order_acquire));
+
+    if (isSync)
+    {
+        memcpy (syncResponse, response, sizeof (syncResponse));
+        syncResult.store (status, std::memory_order_release);
+    }
+
+    if (transport == Transport::tcp)
+        receivedSequence.store (sequence, std::memory_order_release);
+
+    if (isSync)
+    {
+        syncDone.store (true, std::memory_order_release);
+        replyEvent.signal();
+    }
+}
+
+int PigpiodClient::sendCommand (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t p3)
+{
+    // Prepare command (16 bytes: 4x uint32_t in little-endian)
+    uint8_t cmdBuf[16];
+    memcpy (cmdBuf + 0, &cmd, 4);
+    memcpy (cmdBuf + 4, &p1, 4);
+    memcpy (cmdBuf + 8, &p2, 4);
+    memcpy (cmdBuf + 12, &p3, 4);
+
+    return sendAndWait (cmdBuf, nullptr, 0);
+}
+
+int PigpiodClient::sendCommandExt (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t extSize, const void* extData)
+{
+    // Prepare command header (16 bytes: 4x uint32_t)
+    // p3 = size of extension data
+    uint8_t cmdBuf[16];
+    memcpy (cmdBuf + 0, &cmd, 4);
+    memcpy (cmdBuf + 4, &p1, 4);
+    memcpy (cmdBuf + 8, &p2, 4);
+    memcpy (cmdBuf + 12, &extSize, 4);
+
+    return sendAndWait (cmdBuf, extData, extSize);
+}
+
+int PigpiodClient::sendCommandExtNoWait (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t extSize, const void* extData)
+{
+    // Prepare command header (16 bytes: 4x uint32_t)
+    // p3 = size of extension data
+    uint8_t cmdBuf[16];
+    memcpy (cmdBuf + 0, &cmd, 4);
+    memcpy (cmdBuf + 4, &p1, 4);
+    memcpy (cmdBuf + 8, &p2, 4);
+    memcpy (cmdBuf + 12, &extSize, 4);
+
+    // Don't wait for response - the reader thread matches and discards it
+    uint32_t sequence;
+    int result = writeCommand (cmdBuf, extData, extSize, sequence, transport == Transport::udpAcked);
+
+    if (result == PI_NOT_CONNECTED)
+        setLastError ("Not connected to pigpiod");
+    else if (result == PI_TOO_MANY_PENDING)
+        setLastError ("Too many commands awaiting a reply");
+    else if (result < 0)
+        setLastError ("Failed to send command");
+
+    return result;
+}
+
+int PigpiodClient::clearWaves()
+{
+    return sendCommand (PI_CMD_WVCLR);
+}
+
+int PigpiodClient::addWavePulses (const PigpiodWavePulse* pulses, int numPulses)
+{
+    if (numPulses <= 0)
+        return PI_BAD_PARAM;
+
+    // p3 = extension size; the extension is the gpioPulse_t array
+    return sendCommandExt (PI_CMD_WVAG, 0, 0, (uint32_t) numPulses * sizeof (PigpiodWavePulse), pulses);
+}
+
+int PigpiodClient::createWave()
+{
+    return sendCommand (PI_CMD_WVCRE);
+}
+
+int PigpiodClient::deleteWave (int waveId)
+{
+    return sendCommand (PI_CMD_WVDEL, (uint32_t) waveId);
+}
+
+int PigpiodClient::sendWave (int waveId)
+{
+    return sendCommand (PI_CMD_WVTX, (uint32_t) waveId);
+}
+
+int PigpiodClient::definePattern (int patternId, const PigpiodPatternStep* steps, int numSteps)
+{
+    if (numSteps > GS_PATTERN_STEPS)
+        return PI_BAD_PARAM;
+
+    if (numSteps <= 0)
+        return sendCommand (GS_CMD_PATDEF, (uint32_t) patternId);
+
+    // p2 = index of the chunk's first step, so the server appends to what it has
+    constexpr int stepsPerCommand = GS_MAX_EXT / (int) sizeof (PigpiodPatternStep);
+    int result = 0;
+
+    for (int first = 0; first < numSteps && result >= 0; first += stepsPerCommand)
+    {
+        const int count = jmin (stepsPerCommand, numSteps - first);
+        result = sendCommandExt (GS_CMD_PATDEF, (uint32_t) patternId, (uint32_t) first,
+                                 (uint32_t) count * sizeof (PigpiodPatternStep), steps + first);
+    }
+
+    return result;
+}
+
+int PigpiodClient::haltWave()
+{
+    return sendCommand (PI_CMD_WVHLT);
+}
+
+void PigpiodClient::beginBatch()
+{
+    batchSize = 0;
+}
+
+int PigpiodClient::appendToBatch (const PigpiodFrame& frame)
+{
+    int result = 0;
+
+    if (batchSize == maxFramesPerWrite)
+        result = flushBatch();
+
+    batch[batchSize++] = frame;
+    return result;
+}
+
+int PigpiodClient::flushBatch()
+{
+    const int numFrames = batchSize;
+    batchSize = 0;
+
+    if (numFrames == 0)
+        return 0;
+
+    // The ring already costs nothing per frame, so only the network path
+    // batches; compact frames hold several ops anyway
+    if (numFrames > 1 && supportsBatch() && !isUsingSharedMemory() && !isUsingCompactFrames())
+        return sendBatchCommand (batch, numFrames);
+
+    return sendFrames (batch, numFrames);
+}
+
+int PigpiodClient::sendBatchCommand (const PigpiodFrame* frames, int numFrames)
+{
+    // Every frame is at most 32 bytes, so a full batch always fits
+    uint8_t ext[GS_MAX_EXT];
+    uint32_t extSize = 0;
+
+    for (int i = 0; i < numFrames; ++i)
+    {
+        memcpy (ext + extSize, frames[i].getData(), frames[i].size);
+        extSize += frames[i].size;
+    }
+
+    // p1 = number of commands, p3 = extension size
+    const uint32_t header[4] = { GS_CMD_BATCH, (uint32_t) numFrames, 0, extSize };
+
+    uint32_t sequence;
+    return writeCommand (header, ext, extSize, sequence, transport != Transport::udp);
+}
+
+int PigpiodClient::sendCompactFrames (const PigpiodFrame* frames, int numFrames)
+{
+    PigpiodCompactFrame frame;
+    uint32_t commands[maxFramesPerWrite]; // codes of the GS_OP_CMD ops, in reply order
+    int next = 0;
+
+    // Normally one frame (and one write) holds everything
+    while (next < numFrames)
+    {
+        frame.clear();
+        int numCommands = 0;
+
+        while (next < numFrames && frame.append (frames[next]))
+        {
+            if (frame.commandOps > numCommands)
+                commands[numCommands++] = frames[next].getCommand();
+
+            ++next;
+        }
+
+        if (frame.isEmpty())
+            return PI_BAD_PARAM; // A single command too big for a frame
+
+        // Only scheduled ops have something to report (how late they started);
+        // an immediate pulse goes unanswered
+        const bool wantsReply = frame.scheduled;
+        const uint32_t replies = (uint32_t) numCommands + (wantsReply ? 1 : 0);
+        const uint32_t last = sentSequence.load (std::memory_order_relaxed);
+
+        if (last + replies - receivedSequence.load (std::memory_order_acquire) > maxInFlight)
+            return PI_TOO_MANY_PENDING;
+
+        // Wrapped commands reply as they run, then the frame itself
+        const juce::int64 now = juce::Time::getHighResolutionTicks();
+
+        for (uint32_t i = 0; i < replies; ++i)
+        {
+            InFlightCommand& entry = inFlight[(last + 1 + i) & (maxInFlight - 1)];
+            entry.command = i < (uint32_t) numCommands ? commands[i] : GS_CMD_FRAME;
+            entry.sendTicks = now;
+        }
+
+        sentSequence.store (last + replies, std::memory_order_release);
+
+        uint32_t size;
+        const uint8_t* bytes = frame.finish (wantsReply, size);
+
+        if (socket->write (bytes, (int) size) != (int) size)
+        {
+            sentSequence.store (last, std::memory_order_release);
+            return PI_SOCKET_ERROR;
+        }
+    }
+
+    return 0;
+}
+
+int PigpiodClient::sendFrame (const PigpiodFrame& frame)
+{
+    return sendFrames (&frame, 1);
+}
+
+int PigpiodClient::sendFrames (const PigpiodFrame* frames, int numFrames)
+{
+    // lastError is left untouched here: this runs on the sender thread,
+    // while getLastError() is read from the message thread
+    if (numFrames <= 0 || numFrames > maxFramesPerWrite)
+        return PI_BAD_PARAM;
+
+    const juce::ScopedLock lock (socketLock);
+
+    if (!isConnected())
+        return PI_NOT_CONNECTED;
+
+    // Frames the ring can't carry (PWM) still go over the socket
+    PigpiodFrame socketFrames[maxFramesPerWrite];
+
+    if (sharedMemoryActive.load (std::memory_order_acquire))
+    {
+        int numSocketFrames = 0;
+
+        // No reply and no syscall: the server's pulse thread picks these up directly
+        for (int i = 0; i < numFrames; ++i)
+        {
+            if (!SharedMemoryRing::carries (frames[i].getCommand()))
+                socketFrames[numSocketFrames++] = frames[i];
+            else if (!sharedMemory.push (frames[i]))
+                return PI_TOO_MANY_PENDING;
+        }
+
+        if (numSocketFrames == 0)
+            return 0;
+
+        frames = socketFrames;
+        numFrames = numSocketFrames;
+    }
+
+    const uint32_t last = sentSequence.load (std::memory_order_relaxed);
+
+    if (transport != Transport::tcp)
+    {
+        // One datagram per command: a lost packet costs only its own pulse
+        const bool wantsReply = (transport == Transport::udpAcked);
+
+        for (int i = 0; i < numFrames; ++i)
+        {
+            const uint32_t sequence = last + 1 + (uint32_t) i;
+            const uint32_t extSize = frames[i].size - 16;
+            sentSequence.store (sequence, std::memory_order_release);
+
+            if (writeDatagram (frames[i].getData(), (const uint8_t*) frames[i].getData() + 16,
+                               extSize, sequence, wantsReply) < 0)
+                return PI_SOCKET_ERROR;
+        }
+
+        return 0;
+    }
+
+    if (compactActive.load (std::memory_order_relaxed))
+        return sendCompactFrames (frames, numFrames);
+
+    if (last + (uint32_t) numFrames - receivedSequence.load (std::memory_order_acquire) > maxInFlight)
+        return PI_TOO_MANY_PENDING;
+
+    // Gather every frame into one buffer: one syscall and, usually, one segment
+    uint8_t buf[maxFramesPerWrite * sizeof (PigpiodFrame::words)];
+    int bytes = 0;
+
+    const juce::int64 now = juce::Time::getHighResolutionTicks();
+
+    for (int i = 0; i < numFrames; ++i)
+    {
+        InFlightCommand& entry = inFlight[(last + 1 + (uint32_t) i) & (maxInFlight - 1)];
+        entry.command = frames[i].getCommand();
+        entry.sendTicks = now;
+
+        memcpy (buf + bytes, frames[i].getData(), frames[i].size);
+        bytes += (int) frames[i].size;
+    }
+
+    sentSequence.store (last + (uint32_t) numFrames, std::memory_order_release);
+
+    if (socket->write (buf, bytes) != bytes)
+    {
+        sentSequence.store (last, std::memory_order_release);
+        return PI_SOCKET_ERROR;
     }
 
-    // Don't wait for response - fire and forget for minimal latency
     return 0;
 }
@@ -25,29 +25,22 @@
 
 #include <CommonLibHeader.h>
 
-// pigpiod socket interface command codes
-#define PI_CMD_MODES 5   // Set GPIO mode
-#define PI_CMD_PIGPV 26  // Get pigpio version
-#define PI_CMD_WRITE 4   // Write GPIO level
-#define PI_CMD_TRIG 37   // Trigger pulse
-
-// GPIO modes
-#define PI_INPUT 0
-#define PI_OUTPUT 1
-
-// GPIO levels
-#define PI_LOW 0
-#define PI_HIGH 1
-
-// Error codes
-#define PI_NOT_CONNECTED -1
-#define PI_SOCKET_ERROR -2
-#define PI_BAD_GPIO -3
+#include "PigpiodProtocol.h"
+#include "LatencyHistogram.h"
+#include "ClockModel.h"
+#include "SharedMemoryRing.h"
+#include "SpscQueue.h"
 
 /**
  * Client for communicating with pigpiod daemon over TCP socket.
  *
  * Implements the pigpiod binary socket protocol for remote GPIO control.
+ *
+ * Every command gets a 16-byte reply from the server, including the
+ * fire-and-forget ones. A background reader thread consumes all replies and
+ * matches them, in order, against a sequence-numbered table of commands in
+ * flight, so pipelined TRIGs never leave stale replies in the socket for a
+ * later blocking call to pick up.
  */
 class PigpiodClient
 {
@@ -55,13 +48,86 @@ public:
     PigpiodClient();
     ~PigpiodClient();
 
+    /** How commands travel to the server */
+    enum class Transport
+    {
+        /** pigpiod framing over TCP; every command is acknowledged, in order */
+        tcp,
+
+        /** One datagram per command (gpio_server only); only blocking calls and clock pings are acknowledged */
+        udp,
+
+        /** As udp, but every command is acknowledged so loss and round trips can be measured */
+        udpAcked
+    };
+
     /** Connect to pigpiod daemon
      *
      * @param hostname IP address or hostname
      * @param port Port number (default 8888)
+     * @param transport TCP (pigpiod or gpio_server) or UDP (gpio_server only)
      * @return true if connection successful
      */
-    bool connect (const juce::String& hostname, int port = 8888);
+    bool connect (const juce::String& hostname, int port = 8888, Transport transport = Transport::tcp);
+
+    /** Transport used by the current (or last) connection */
+    Transport getTransport() const { return transport.load (std::memory_order_acquire); }
+
+    /** True if pulses bypass the network through gpio_server's shared-memory ring
+     *
+     * Chosen automatically on connect when the server runs on this machine.
+     * The socket stays open for blocking calls and clock pings.
+     */
+    bool isUsingSharedMemory() const { return sharedMemoryActive.load (std::memory_order_acquire); }
+
+    /** True if hostname refers to this machine */
+    static bool isLocalHost (const juce::String& hostname);
+
+    /** Asks the kernel to busy-poll the socket on reads (SO_BUSY_POLL, Linux only; applies on the next connect)
+     *
+     * The reader thread then spins on the NIC for a short while before
+     * sleeping, which shortens reply wake-ups at the cost of CPU time.
+     */
+    void setBusyPoll (bool enabled) { busyPoll.store (enabled, std::memory_order_relaxed); }
+
+    /** Asks gpio_server for compact frames on the next TCP connect (GS_PROTOCOL_COMPACT)
+     *
+     * Pulses then cost a few bytes each and get no reply unless their frame
+     * asks for one; other commands are wrapped whole and replied to as
+     * usual. pigpiod, and UDP, keep the pigpiod format.
+     */
+    void setCompactProtocol (bool enabled) { compactWanted.store (enabled, std::memory_order_relaxed); }
+
+    /** Whether a localhost connect attaches gpio_server's shared-memory ring (default on; applies on the next connect)
+     *
+     * The server gives the ring to one client at a time, so clients that
+     * send no pulses should turn this off and leave it to one that does.
+     */
+    void setUseSharedMemory (bool enabled) { sharedMemoryWanted.store (enabled, std::memory_order_relaxed); }
+
+    /** Protocol version negotiated by HELLO: GS_PROTOCOL_COMPACT, GS_PROTOCOL_PIGPIOD, or 0 for a server without HELLO (pigpiod) */
+    int getProtocolVersion() const { return protocolVersion.load (std::memory_order_acquire); }
+
+    /** GS_CAP_* bits the server reported in its HELLO reply (0 for a server without HELLO) */
+    uint32_t getCapabilities() const { return serverCapabilities.load (std::memory_order_acquire); }
+
+    /** True once the connection carries compact frames */
+    bool isUsingCompactFrames() const { return compactActive.load (std::memory_order_acquire); }
+
+    /** Connect again with the hostname, port and transport of the last connect() */
+    bool reconnect();
+
+    /** Host of the current (or last) connection (any thread) */
+    juce::String getHostname() const;
+
+    /** Tries a TCP connection to every host at once and returns the first to accept
+     *
+     * Each attempt runs on its own short-lived thread, so one unreachable host
+     * never holds up the others. pigpiod and gpio_server both listen for TCP.
+     *
+     * @return index into hosts of the first to answer, or -1 if none did within timeoutMs
+     */
+    static int findFirstResponder (const juce::StringArray& hosts, int port, int timeoutMs);
 
     /** Disconnect from pigpiod daemon */
     void disconnect();
@@ -69,6 +135,21 @@ public:
     /** Check if connected to pigpiod */
     bool isConnected() const;
 
+    /** Milliseconds since the last reply of any kind was matched (or since connecting) */
+    double getMillisecondsSinceLastReply() const;
+
+    /** True if clock pings are running, so silence means the link is down */
+    bool isPingingClock() const { return clockCommand.load (std::memory_order_acquire) != 0; }
+
+    /** Make a few blocking round trips to warm up the path to the server
+     *
+     * Primes ARP, the TCP congestion window and both ends' caches, so the
+     * first real pulse after a connect doesn't pay for them.
+     *
+     * @return number of round trips that succeeded
+     */
+    int warmUp (int roundTrips);
+
     /** Get pigpiod version
      *
      * @return version number, or negative error code
@@ -91,6 +172,142 @@ public:
      */
     int write (int gpio, int level);
 
+    /** Read GPIO pin level
+     *
+     * @param gpio GPIO number (BCM numbering)
+     * @return 0 or 1, or negative error code on failure
+     */
+    int read (int gpio);
+
+    /** Mode of a pin as this client last had it acknowledged (PI_INPUT, PI_OUTPUT), or -1 if unknown
+     *
+     * The mirror starts empty on every connect and is updated from the replies to
+     * setMode(), write(), read(), setBank() and clearBank(); a failed command or
+     * setPwmDutyCycle() / setHardwarePwm() on the pin makes its mode and level
+     * unknown again (PWM queued on a dispatcher isn't seen). Pulses (TRIG, trains, patterns) are
+     * taken to leave their pins where they found them, as the plugin's always do.
+     * Another client driving the same pins is not seen.
+     */
+    int getKnownMode (int gpio) const;
+
+    /** Level of a pin as this client last had it acknowledged (PI_LOW, PI_HIGH), or -1 if unknown */
+    int getKnownLevel (int gpio) const;
+
+    /** True if the pin is known to be an output at the given level, so writing it again would change nothing */
+    bool isKnownAt (int gpio, int level) const { return getKnownMode (gpio) == PI_OUTPUT && getKnownLevel (gpio) == level; }
+
+    /** Forgets the mirrored mode and level of every pin (e.g. after something else reconfigured them) */
+    void forgetPinStates();
+
+    /** Read an edge timestamp from a watched pin (gpio_server EDGE)
+     *
+     * The first call for a pin starts watching it; the server numbers its
+     * edges from then on. Ask for edge 0 to learn the count before an edge,
+     * then for count + 1 once it should have happened.
+     *
+     * @param edgeNumber 1-based edge to read, or 0 for none
+     * @param edgeUs Receives the edge's server clock time in microseconds (0 if not recorded)
+     * @return edges seen on the pin so far, or negative error code (pigpiod has no EDGE)
+     */
+    int readEdge (int gpio, int edgeNumber, juce::uint64& edgeUs);
+
+    /** An input edge streamed by gpio_server (see startEdgeStream()) */
+    struct EdgeRecord
+    {
+        /** Server clock time of the edge, in microseconds */
+        juce::uint64 serverTimeUs = 0;
+
+        /** GPIO number (BCM numbering) */
+        int gpio = -1;
+
+        /** Level the pin changed to (PI_LOW or PI_HIGH) */
+        int level = PI_LOW;
+    };
+
+    /** Number of slots in the queue streamed edges wait in for popEdge() */
+    static constexpr size_t edgeQueueSize = 4096;
+
+    /** Starts streaming the edges of some pins from gpio_server (EDGESTREAM/EDGEREAD)
+     *
+     * Replaces any stream already running. A background thread polls the
+     * server every pollIntervalMs and queues the edges for popEdge(); the
+     * pins should already be inputs.
+     *
+     * @param mask Bit n set for each GPIO n (0-31) to stream
+     * @return 0 on success, negative error code (pigpiod has no edge stream)
+     */
+    int startEdgeStream (uint32_t mask, int pollIntervalMs);
+
+    /** Stops the edge stream, leaving queued edges for popEdge() */
+    void stopEdgeStream();
+
+    /** Pins whose edges are being streamed (0 if none) */
+    uint32_t getEdgeStreamMask() const { return edgeMask.load (std::memory_order_acquire); }
+
+    /** Takes the oldest streamed edge (one consumer thread only, e.g. the audio thread; never blocks)
+     *
+     * @return false if no edge is waiting
+     */
+    bool popEdge (EdgeRecord& record) { return edgeQueue.pop (record); }
+
+    /** Edges lost because the server's ring or the local queue overflowed */
+    juce::uint64 getLostEdgeCount() const { return lostEdgeCount.load (std::memory_order_relaxed); }
+
+    /** Set several GPIO pins high in one command (pigpiod BS1)
+     *
+     * All pins change on the same register write, so there is no skew between them.
+     * Pins must already be outputs (e.g. initialised with write()).
+     *
+     * @param mask Bit n set for each GPIO n (0-31) to drive HIGH
+     * @return 0 on success, negative error code on failure
+     */
+    int setBank (uint32_t mask);
+
+    /** Set several GPIO pins low in one command (pigpiod BC1)
+     *
+     * @param mask Bit n set for each GPIO n (0-31) to drive LOW
+     * @return 0 on success, negative error code on failure
+     */
+    int clearBank (uint32_t mask);
+
+    /** Start, change or stop PWM on a pin (pigpiod PWM)
+     *
+     * The pin becomes an output. pigpiod times PWM with DMA; gpio_server
+     * times it on its pulse thread, so keep frequencies in the low kHz.
+     *
+     * @param gpio GPIO number (BCM numbering)
+     * @param dutyCycle 0 (off, pin low) up to the pin's range (always on)
+     * @return 0 on success, negative error code on failure
+     */
+    int setPwmDutyCycle (int gpio, int dutyCycle);
+
+    /** Set the duty cycle that means always on for a pin's PWM (pigpiod PRS)
+     *
+     * @param range 25-40000 (default 255); a running duty cycle keeps its proportion
+     * @return the range set, or negative error code on failure
+     */
+    int setPwmRange (int gpio, int range);
+
+    /** Set a pin's PWM frequency (pigpiod PFS)
+     *
+     * @param frequencyHz Requested frequency (default 800 Hz)
+     * @return the frequency the server chose, or negative error code on failure
+     */
+    int setPwmFrequency (int gpio, int frequencyHz);
+
+    /** Start, change or stop hardware PWM (pigpiod HP)
+     *
+     * Only pins wired to a PWM channel (12, 13, 18, 19, 40, 41, 45, 52, 53)
+     * can do this, and pins on the same channel share it. The edges are
+     * clocked by the PWM peripheral, with no software jitter. gpio_server
+     * supports it on BCM2835/BCM2711 boards when run as root.
+     *
+     * @param frequencyHz PWM frequency, or 0 to stop (leaving the pin low)
+     * @param dutyCycle 0 to PI_HW_PWM_RANGE (millionths)
+     * @return 0 on success, negative error code on failure
+     */
+    int setHardwarePwm (int gpio, int frequencyHz, int dutyCycle);
+
     /** Trigger pulse on GPIO pin
      *
      * @param gpio GPIO number (BCM numbering)
@@ -99,10 +316,357 @@ public:
      */
     int trig (int gpio, int pulseLength);
 
-    /** Get last error message */
-    juce::String getLastError() const { return lastError; }
+    /** Clear all waveforms on the server (pigpiod WVCLR)
+     *
+     * Waveforms are global to pigpiod, so this also removes other clients' waves.
+     *
+     * @return 0 on success, negative error code (e.g. from gpio_server, which has no waves)
+     */
+    int clearWaves();
+
+    /** Add pulses to the waveform being built (pigpiod WVAG)
+     *
+     * @return total number of pulses in the waveform so far, PI_BAD_PARAM if numPulses is not
+     *         positive, or another negative error code
+     */
+    int addWavePulses (const PigpiodWavePulse* pulses, int numPulses);
+
+    /** Create a waveform from the pulses added since the last one (pigpiod WVCRE)
+     *
+     * @return waveform ID, or negative error code
+     */
+    int createWave();
+
+    /** Delete a waveform (pigpiod WVDEL) */
+    int deleteWave (int waveId);
+
+    /** Play a waveform once (pigpiod WVTX), waiting for the reply
+     *
+     * On the event path, queue PigpiodFrame::waveTx() instead.
+     *
+     * @return number of DMA control blocks, or negative error code
+     */
+    int sendWave (int waveId);
+
+    /** Stop the waveform being transmitted (pigpiod WVHLT) */
+    int haltWave();
+
+    /** Store a pattern in gpio_server's pattern library (PATDEF)
+     *
+     * Long patterns are uploaded in several commands. The pattern belongs to
+     * this connection and is freed when it closes; an empty pattern frees it now.
+     *
+     * @param patternId 0 to GS_MAX_PATTERNS - 1
+     * @return number of steps stored, PI_BAD_PARAM if numSteps exceeds GS_PATTERN_STEPS,
+     *         or another negative error code (pigpiod has no patterns)
+     */
+    int definePattern (int patternId, const PigpiodPatternStep* steps, int numSteps);
+
+    /** Send a pre-encoded frame without waiting for a response
+     *
+     * Safe to call from a sender thread while other commands are issued
+     * from the message thread; the frame is written in a single call.
+     *
+     * @param frame Encoded command (header plus optional extension)
+     * @return 0 on successful send, negative error code on failure
+     */
+    int sendFrame (const PigpiodFrame& frame);
+
+    /** Send several pre-encoded frames in a single socket write
+     *
+     * The frames are registered in the in-flight table together, so their
+     * replies are matched in order like any other fire-and-forget command.
+     *
+     * @param frames Encoded commands
+     * @param numFrames Number of frames (at most maxFramesPerWrite)
+     * @return 0 on successful send, PI_BAD_PARAM for a bad numFrames, another negative error code on failure
+     */
+    int sendFrames (const PigpiodFrame* frames, int numFrames);
+
+    /** Largest number of frames sendFrames() will coalesce into one write */
+    static constexpr int maxFramesPerWrite = 64;
+
+    /** Start collecting frames to send together
+     *
+     * The batch belongs to the calling thread (normally the sender thread);
+     * only one thread may use the batch API.
+     */
+    void beginBatch();
+
+    /** Add a frame to the current batch, sending the batch first if it is full
+     *
+     * @return 0 on success, negative error code if an early flush failed
+     */
+    int appendToBatch (const PigpiodFrame& frame);
+
+    /** Send every frame appended since beginBatch()
+     *
+     * gpio_server gets them as one GS_CMD_BATCH command, which it runs in a
+     * single pass with a single reply; pigpiod gets the same frames back to
+     * back in one write.
+     *
+     * @return 0 on successful send, negative error code on failure
+     */
+    int flushBatch();
+
+    /** True if the server runs GS_CMD_BATCH (gpio_server) */
+    bool supportsBatch() const { return batchSupported.load (std::memory_order_acquire); }
+
+    /** Get last error message (any thread; connect() may be running on another) */
+    juce::String getLastError() const;
+
+    /** Number of commands sent whose reply has not yet arrived */
+    int getPendingCount() const;
+
+    /** Number of replies received and matched since connecting */
+    juce::uint64 getReplyCount() const { return replyCount.load (std::memory_order_relaxed); }
+
+    /** Number of replies reporting an error status (e.g. a rejected TRIG) */
+    juce::uint64 getErrorReplyCount() const;
+
+    /** Number of replies that did not match the oldest command in flight */
+    juce::uint64 getMismatchedReplyCount() const { return mismatchedReplyCount.load (std::memory_order_relaxed); }
+
+    /** Round-trip time of the most recent reply to a given command
+     *
+     * @param cmd Command code (e.g. PI_CMD_TRIG)
+     * @return round-trip time in milliseconds, or a negative value if none was seen
+     */
+    double getLastRoundTripMs (uint32_t cmd) const;
+
+    /** Find out how to read the server clock and seed the clock model
+     *
+     * Called on connect. gpio_server answers GS_CMD_TIME with a 64-bit
+     * timestamp; pigpiod only has PI_CMD_TICK (a 32-bit microsecond counter),
+     * which is enough to measure the offset but not to schedule pulses.
+     * Once a clock command is found, a background thread keeps pinging with
+     * it so the model tracks drift for as long as the connection is open.
+     *
+     * @return true if the server clock could be read
+     */
+    bool syncServerClock();
+
+    /** True if the server accepts scheduled pulses (GS_CMD_TRIGAT) */
+    bool supportsScheduledPulses() const
+    {
+        return clockCommand.load (std::memory_order_acquire) == GS_CMD_TIME && clock.isValid();
+    }
+
+    /** Converts a host high resolution tick count to server clock microseconds
+     *
+     * Uses the drift-compensated clock model. Lock-free; safe to call from
+     * the audio thread.
+     */
+    juce::uint64 hostTicksToServerMicros (juce::int64 ticks) const;
+
+    /** Converts server clock microseconds to a host high resolution tick count
+     *
+     * The inverse of hostTicksToServerMicros(); lock-free.
+     */
+    juce::int64 serverMicrosToHostTicks (juce::uint64 serverUs) const;
+
+    /** Offset, skew and round-trip estimates for the server clock */
+    const ClockModel& getClockModel() const { return clock; }
+
+    /** Interval between clock pings while connected, in milliseconds */
+    static constexpr int clockPingIntervalMs = 200;
+
+    /** UDP: acknowledged commands whose reply never arrived */
+    juce::uint64 getLostReplyCount() const { return lostReplyCount.load (std::memory_order_relaxed); }
+
+    /** UDP: replies that arrived after their command had stopped waiting */
+    juce::uint64 getStaleReplyCount() const { return staleReplyCount.load (std::memory_order_relaxed); }
+
+    /** Read the server's UDP counters (GS_CMD_UDPSTATS)
+     *
+     * @param received Receives the number of datagrams the server received
+     * @param lost Receives the number of datagrams that never reached the server
+     * @param late Receives the number of datagrams the server discarded for arriving out of order
+     * @return true if the server answered
+     */
+    bool getServerUdpStats (juce::uint64& received, juce::uint64& lost, juce::uint64& late);
+
+    /** Asks gpio_server for its telemetry histograms without waiting (GS_CMD_STATS)
+     *
+     * The replies replace getServerReceiptLatency(), getServerOverrun() and
+     * getServerWidthError() as the reader receives them.
+     *
+     * @param reset Have the server start its histograms and their counters over after reading them
+     * @return false if the server doesn't keep them or a request couldn't be written
+     */
+    bool requestServerStats (bool reset = false);
+
+    /** gpio_server's time from receiving a TRIG, WRITE, BS1 or BC1 to writing the pins */
+    const LatencyHistogram& getServerReceiptLatency() const { return serverStats[GS_STATS_RECEIPT]; }
+
+    /** How late gpio_server's pulse thread fired each timed edge */
+    const LatencyHistogram& getServerOverrun() const { return serverStats[GS_STATS_OVERRUN]; }
+
+    /** How far each gpio_server pulse's width was off */
+    const LatencyHistogram& getServerWidthError() const { return serverStats[GS_STATS_WIDTH]; }
+
+    /** Edges gpio_server fired early because its pulse heap was full, since its last stats reset */
+    juce::uint64 getServerHeapFullCount() const { return serverStatsCounters[GS_STATS_OVERRUN].load (std::memory_order_relaxed); }
+
+    /** TRIGs gpio_server timed inline because its pulse ring was full, since its last stats reset */
+    juce::uint64 getServerInlinePulseCount() const { return serverStatsCounters[GS_STATS_WIDTH].load (std::memory_order_relaxed); }
+
+    /** Number of scheduled pulses the server reported as starting late */
+    juce::uint64 getLateReplyCount() const;
+
+    /** Round-trip times of all replies, from write to reply matched */
+    const LatencyHistogram& getRoundTripLatency() const { return roundTripLatency; }
+
+    /** Clears the round-trip histogram (e.g. at the start of acquisition) */
+    void resetRoundTripLatency() { roundTripLatency.reset(); }
 
 private:
+    /** Reads and matches replies for as long as the connection is open */
+    class ResponseReader : public juce::Thread
+    {
+    public:
+        ResponseReader (PigpiodClient& owner);
+        void run() override;
+
+    private:
+        PigpiodClient& owner;
+    };
+
+    /** Sends a clock ping every clockPingIntervalMs; the reader timestamps the replies */
+    class ClockPinger : public juce::Thread
+    {
+    public:
+        ClockPinger (PigpiodClient& owner);
+        void run() override;
+
+    private:
+        PigpiodClient& owner;
+    };
+
+    /** Asks the server for streamed edges every few milliseconds */
+    class EdgePoller : public juce::Thread
+    {
+    public:
+        EdgePoller (PigpiodClient& owner, int intervalMs);
+        void run() override;
+
+    private:
+        PigpiodClient& owner;
+        const int intervalMs;
+    };
+
+    /** A command that has been written to the socket and awaits its reply */
+    struct InFlightCommand
+    {
+        uint32_t command;
+        juce::int64 sendTicks;
+
+        /** UDP: sequence number still waiting for its ack (0 once answered or not acked) */
+        std::atomic<uint32_t> awaitingSequence { 0 };
+    };
+
+    /** Largest datagram sent over UDP (header, command and extension) */
+    static constexpr int maxDatagramSize = GS_UDP_HEADER_SIZE + 16 + GS_MAX_EXT;
+
+    /** Size of the in-flight table (power of two) */
+    static constexpr uint32_t maxInFlight = 256;
+
+    /** Command codes tracked for round-trip times */
+    static constexpr uint32_t maxTrackedCommand = 256;
+
+    /** Writes a command, registering it in the in-flight table
+     *
+     * @param header 16-byte command header
+     * @param extData Extension data written after the header (may be nullptr)
+     * @param extSize Size of extension data in bytes
+     * @param sequence Receives the sequence number assigned to the command
+     * @param wantsReply UDP only: ask the server to acknowledge (TCP always replies)
+     * @return 0 on successful send, negative error code on failure
+     */
+    int writeCommand (const void* header, const void* extData, uint32_t extSize, uint32_t& sequence,
+                      bool wantsReply = true);
+
+    /** Sends one command as a sequence-numbered datagram (under socketLock)
+     *
+     * @return 0 on successful send, PI_BAD_PARAM if the command doesn't fit in a datagram,
+     *         another negative error code on failure
+     */
+    int writeDatagram (const void* header, const void* extData, uint32_t extSize, uint32_t sequence, bool wantsReply);
+
+    /** Registers a UDP command in the in-flight table, counting any ack it displaces as lost */
+    void registerDatagram (uint32_t sequence, uint32_t command, juce::int64 sendTicks, bool wantsReply);
+
+    /** Sends a command and blocks until its reply has been matched by the reader
+     *
+     * @param response If not null, receives the 4 reply words (cmd, p1, p2, result)
+     * @return Response value, or negative error code
+     */
+    int sendAndWait (const void* header, const void* extData, uint32_t extSize, uint32_t* response = nullptr);
+
+    /** Reader thread body */
+    void readResponses (juce::Thread& thread);
+
+    /** Reader thread body for UDP */
+    void readDatagrams (juce::Thread& thread);
+
+    /** Matches one 16-byte reply (and any extension after it) against the oldest command in flight */
+    void handleResponse (const uint32_t* response, const uint8_t* ext = nullptr, int extSize = 0);
+
+    /** Matches one UDP reply against the command with the same sequence number */
+    void handleDatagram (uint32_t sequence, const uint32_t* response, const uint8_t* ext = nullptr, int extSize = 0);
+
+    /** Records a matched reply and wakes a blocking caller waiting on it */
+    void completeCommand (const InFlightCommand& entry, uint32_t sequence, const uint32_t* response,
+                          juce::int64 receiveTicks, const uint8_t* ext = nullptr, int extSize = 0);
+
+    /** Stops and deletes the edge poller, if there is one (any thread but the poller and reader) */
+    void stopEdgePoller();
+
+    /** Writes one EDGEREAD, unless one is still waiting for its reply (poller only) */
+    void pollEdges();
+
+    /** Queues the records of an EDGEREAD reply (reader only) */
+    void handleEdgeReply (const uint32_t* response, const uint8_t* ext, int extSize);
+
+    /** Copies a STATS reply into serverStats (reader only) */
+    void handleStatsReply (const uint32_t* response, const uint8_t* ext, int extSize);
+
+    /** Records the outcome of a command that set a pin's mode and/or level (-1 leaves that part alone) */
+    void updatePinState (int gpio, int result, int mode, int level);
+
+    /** Sets SO_PRIORITY, and SO_BUSY_POLL if asked for, on a freshly opened socket (Linux only) */
+    void tuneSocket (int socketHandle);
+
+    /** Starts the reader thread for a freshly opened socket */
+    void startReader();
+
+    /** Stops the reader thread */
+    void stopReader();
+
+    /** Sends frames as one GS_CMD_BATCH command without waiting for the reply */
+    int sendBatchCommand (const PigpiodFrame* frames, int numFrames);
+
+    /** Sends frames as compact frames, asking for a reply only where one reports lateness (under socketLock) */
+    int sendCompactFrames (const PigpiodFrame* frames, int numFrames);
+
+    /** Sends HELLO, recording the protocol version and capabilities it returns
+     *
+     * @return the protocol version, or a negative error code if the server has no HELLO
+     */
+    int negotiateProtocol();
+
+    /** Attaches to gpio_server's shared-memory ring, if it offers one
+     *
+     * Fails while another client has the ring, which leaves this one on its socket.
+     */
+    bool attachSharedMemory();
+
+    /** Writes one clock ping without waiting for the reply */
+    int sendClockPing();
+
+    /** Feeds a clock reply to the model (reader only) */
+    void handleClockReply (const InFlightCommand& entry, const uint32_t* response, juce::int64 receiveTicks);
+
     /** Send command to pigpiod and receive response
      *
      * @param cmd Command code
@@ -135,8 +699,127 @@ private:
      */
     int sendCommandExtNoWait (uint32_t cmd, uint32_t p1, uint32_t p2, uint32_t extSize, const void* extData);
 
+    /** Records an error for getLastError() (any thread but the sender's) */
+    void setLastError (const juce::String& message);
+
+    std::atomic<Transport> transport;
     std::unique_ptr<juce::StreamingSocket> socket;
+    std::unique_ptr<juce::DatagramSocket> datagramSocket;
+
+    /** Serialises socket access between the message thread and the sender thread */
+    juce::CriticalSection socketLock;
+
+    /** Serialises blocking commands, so only one caller waits for a reply at a time */
+    juce::CriticalSection callLock;
+
+    std::unique_ptr<ResponseReader> reader;
+    std::unique_ptr<ClockPinger> pinger;
+    std::unique_ptr<EdgePoller> edgePoller;
+
+    /** Guards edgePoller, which startEdgeStream() sets and disconnect() may clear from the reconnector */
+    juce::CriticalSection edgePollerLock;
+
+    /** Wakes the edge poller before its interval is up (see edgeBacklog) */
+    juce::WaitableEvent edgeWake;
+
+    /** Commands in flight, indexed by sequence number */
+    InFlightCommand inFlight[maxInFlight];
+
+    /** Sequence number of the last command written (under socketLock); also the UDP datagram number */
+    std::atomic<uint32_t> sentSequence;
+
+    /** Sequence number of the last command whose reply was matched (TCP reader only) */
+    std::atomic<uint32_t> receivedSequence;
+
+    /** Sequence number a blocking caller is waiting on (0 if none) */
+    std::atomic<uint32_t> syncSequence;
+    std::atomic<int32_t> syncResult;
+    std::atomic<bool> syncDone;
+    uint32_t syncResponse[4];
+    juce::WaitableEvent replyEvent;
+
+    /** Set by the reader when the server closes the connection */
+    std::atomic<bool> connectionLost;
+
+    /** High resolution tick count of the last matched reply */
+    std::atomic<juce::int64> lastReplyTicks;
+
+    std::atomic<juce::uint64> replyCount;
+    std::atomic<juce::uint64> errorReplyCount;
+    std::atomic<juce::uint64> mismatchedReplyCount;
+    std::atomic<juce::uint64> lateReplyCount;
+    std::atomic<juce::uint64> lostReplyCount;
+    std::atomic<juce::uint64> staleReplyCount;
+
+    /** UDP: acknowledged commands still waiting for their reply */
+    std::atomic<int> pendingAcks;
+
+    /** Frames collected by appendToBatch() (batch thread only) */
+    PigpiodFrame batch[maxFramesPerWrite];
+    int batchSize;
+    std::atomic<bool> batchSupported;
+
+    /** Same-host fast path; pushed under socketLock so disconnect can't unmap it mid-write */
+    SharedMemoryRing sharedMemory;
+    std::atomic<bool> sharedMemoryActive;
+
+    /** Attach the ring on the next localhost connect */
+    std::atomic<bool> sharedMemoryWanted;
+
+    /** Set SO_BUSY_POLL on the next connect */
+    std::atomic<bool> busyPoll;
+
+    /** Ask for compact frames on the next connect, and whether the current connection uses them */
+    std::atomic<bool> compactWanted;
+    std::atomic<bool> compactActive;
+
+    /** What HELLO returned (0 if the server has no HELLO) */
+    std::atomic<int> protocolVersion;
+    std::atomic<uint32_t> serverCapabilities;
+
+    /** Pins being streamed, and the sequence number of the next record to read */
+    std::atomic<uint32_t> edgeMask;
+
+    std::atomic<uint32_t> nextEdgeSequence;
+
+    /** True while an EDGEREAD awaits its reply, written at edgeReadTicks */
+    std::atomic<bool> edgeReadPending;
+    std::atomic<juce::int64> edgeReadTicks;
+
+    /** Set by the reader when a full reply says more records are waiting; edgeWake follows once the read completes */
+    std::atomic<bool> edgeBacklog;
+
+    /** Filled by the reader, drained by popEdge() */
+    SpscQueue<EdgeRecord, edgeQueueSize> edgeQueue;
+    std::atomic<juce::uint64> lostEdgeCount;
+
+    /** Acknowledged pin modes and levels, -1 where unknown (see getKnownMode()) */
+    static constexpr int numGpios = 54;
+    std::atomic<int8_t> knownModes[numGpios];
+    std::atomic<int8_t> knownLevels[numGpios];
+
+    /** Command used to read the server clock (GS_CMD_TIME, PI_CMD_TICK, or 0 if none) */
+    std::atomic<uint32_t> clockCommand;
+    ClockModel clock;
+
+    /** Extends the 32-bit pigpiod tick to 64 bits across wraps (reader only) */
+    uint32_t lastServerTick;
+    juce::uint64 serverTickEpoch;
+
+    /** Microseconds per high resolution tick */
+    const double microsPerTick;
+    std::atomic<juce::int64> lastRoundTripTicks[maxTrackedCommand];
+    LatencyHistogram roundTripLatency;
+
+    /** Last STATS replies, indexed by GS_STATS_* */
+    LatencyHistogram serverStats[GS_STATS_COUNT];
+    std::atomic<juce::uint64> serverStatsCounters[GS_STATS_COUNT];
+
+    /** connect() can run on a reconnector thread while the message thread reads these */
+    juce::CriticalSection errorLock;
     juce::String lastError;
+
+    /** Under socketLock, which the datagram path already holds when it reads them */
     juce::String hostname;
     int port;
 
@@ -0,0 +1,296 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "PigpiodDispatcher.h"
+
+#include <ProcessorHeaders.h>
+
+#include <limits>
+
+#if defined(__linux__)
+ #include <pthread.h>
+ #include <sched.h>
+#elif defined(__APPLE__)
+ #include <pthread.h>
+ #include <mach/mach.h>
+ #include <mach/mach_time.h>
+ #include <mach/thread_policy.h>
+#elif defined(_WIN32)
+ #include <windows.h>
+ #include <avrt.h>
+ #pragma comment(lib, "avrt.lib")
+#endif
+
+/** SCHED_FIFO priority of a real-time sender: above audio and ordinary RT threads, below gpio_server's 99 */
+static constexpr int realtimePriority = 80;
+
+static juce::uint64 ticksToNanoseconds (juce::int64 ticks)
+{
+    return ticks > 0 ? (juce::uint64) (juce::Time::highResolutionTicksToSeconds (ticks) * 1.0e9) : 0;
+}
+
+PigpiodDispatcher::PigpiodDispatcher (PigpiodClient& client_)
+    : juce::Thread ("Pigpiod Sender")
+    , client (client_)
+    , droppedCount (0)
+    , sendErrorCount (0)
+    , highWaterMark (0)
+{
+}
+
+PigpiodDispatcher::~PigpiodDispatcher()
+{
+    stopThread (1000);
+}
+
+bool PigpiodDispatcher::enqueueTrig (int gpio, int pulseLength, int level, juce::int64 releaseTicks)
+{
+    PigpiodFrame frame = PigpiodFrame::trig ((uint32_t) gpio, (uint32_t) pulseLength, (uint32_t) level);
+    frame.releaseTicks = releaseTicks;
+    return enqueue (frame);
+}
+
+bool PigpiodDispatcher::enqueueTrigAt (int gpio, int pulseLength, int level, juce::uint64 serverTimeUs)
+{
+    PigpiodFrame frame = PigpiodFrame::trigAt ((uint32_t) gpio, (uint32_t) pulseLength, (uint32_t) level, serverTimeUs);
+    return enqueue (frame);
+}
+
+bool PigpiodDispatcher::enqueueWaveTx (int waveId, juce::int64 releaseTicks)
+{
+    PigpiodFrame frame = PigpiodFrame::waveTx ((uint32_t) waveId);
+    frame.releaseTicks = releaseTicks;
+    return enqueue (frame);
+}
+
+bool PigpiodDispatcher::enqueuePatternPlay (int patternId, juce::uint64 serverTimeUs)
+{
+    PigpiodFrame frame = serverTimeUs != 0 ? PigpiodFrame::patternPlayAt ((uint32_t) patternId, serverTimeUs)
+                                           : PigpiodFrame::patternPlay ((uint32_t) patternId);
+    return enqueue (frame);
+}
+
+bool PigpiodDispatcher::enqueuePwm (int gpio, int dutyCycle, juce::int64 releaseTicks)
+{
+    PigpiodFrame frame = PigpiodFrame::pwm ((uint32_t) gpio, (uint32_t) dutyCycle);
+    frame.releaseTicks = releaseTicks;
+    return enqueue (frame);
+}
+
+bool PigpiodDispatcher::enqueueHardwarePwm (int gpio, int frequencyHz, int dutyCycle, juce::int64 releaseTicks)
+{
+    PigpiodFrame frame = PigpiodFrame::hardwarePwm ((uint32_t) gpio, (uint32_t) frequencyHz, (uint32_t) dutyCycle);
+    frame.releaseTicks = releaseTicks;
+    return enqueue (frame);
+}
+
+bool PigpiodDispatcher::enqueue (PigpiodFrame& frame)
+{
+    frame.enqueueTicks = juce::Time::getHighResolutionTicks();
+
+    if (!queue.push (frame))
+    {
+        droppedCount.fetch_add (1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Only the producer writes the high-water mark, so a plain compare is enough
+    const int depth = (int) queue.size();
+    if (depth > highWaterMark.load (std::memory_order_relaxed))
+        highWaterMark.store (depth, std::memory_order_relaxed);
+
+    return true;
+}
+
+void PigpiodDispatcher::flush()
+{
+    notify();
+}
+
+void PigpiodDispatcher::resetStatistics()
+{
+    droppedCount.store (0, std::memory_order_relaxed);
+    sendErrorCount.store (0, std::memory_order_relaxed);
+    highWaterMark.store (0, std::memory_order_relaxed);
+    sendLatency.reset();
+    queueDelay.reset();
+}
+
+void* PigpiodDispatcher::applyThreadSettings()
+{
+    void* task = nullptr;
+
+    spin = threadSettings.busyPoll;
+
+    if (threadSettings.cpu >= 0 && threadSettings.cpu < 32)
+        juce::Thread::setCurrentThreadAffinityMask ((juce::uint32) 1 << threadSettings.cpu);
+
+    if (!threadSettings.realtime)
+        return task;
+
+    bool realtime = false;
+
+#if defined(__linux__)
+    sched_param param {};
+    param.sched_priority = realtimePriority;
+    realtime = pthread_setschedparam (pthread_self(), SCHED_FIFO, &param) == 0;
+#elif defined(__APPLE__)
+    // Aperiodic (woken by flush()): ask for 0.2 ms of CPU within 1 ms of waking
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info (&timebase);
+    const double machTicksPerMs = 1.0e6 * (double) timebase.denom / (double) timebase.numer;
+
+    thread_time_constraint_policy_data_t policy;
+    policy.period = 0;
+    policy.computation = (uint32_t) (0.2 * machTicksPerMs);
+    policy.constraint = (uint32_t) (1.0 * machTicksPerMs);
+    policy.preemptible = 1;
+    realtime = thread_policy_set (pthread_mach_thread_np (pthread_self()), THREAD_TIME_CONSTRAINT_POLICY,
+                                  (thread_policy_t) &policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT) == KERN_SUCCESS;
+#elif defined(_WIN32)
+    DWORD taskIndex = 0;
+    task = AvSetMmThreadCharacteristicsW (L"Pro Audio", &taskIndex);
+    realtime = task != nullptr && AvSetMmThreadPriority (task, AVRT_PRIORITY_CRITICAL);
+#endif
+
+    if (!realtime)
+        LOGC ("Couldn't give the sender thread real-time priority (on Linux this needs an rtprio limit or CAP_SYS_NICE)");
+
+    // yield() only gives way to threads of the same priority, so a real-time thread that
+    // spins keeps its core from everything else (including the GUI when it isn't pinned)
+    if (realtime && spin)
+    {
+        LOGC ("Sender busy poll is off while it has real-time priority; it sleeps until flush() instead");
+        spin = false;
+    }
+
+    return task;
+}
+
+void PigpiodDispatcher::waitUntil (juce::int64 releaseTicks)
+{
+    // wait() can overshoot by a scheduler tick, so it only covers all but the last half
+    // millisecond; a busy-polling sender never sleeps at all
+    const juce::int64 yieldTicks = spin ? std::numeric_limits<juce::int64>::max()
+                                                           : juce::Time::getHighResolutionTicksPerSecond() / 2000;
+
+    while (!threadShouldExit())
+    {
+        const juce::int64 remaining = releaseTicks - juce::Time::getHighResolutionTicks();
+
+        if (remaining <= 0)
+            return;
+
+        if (remaining > yieldTicks)
+            wait (juce::jmax (1.0, juce::Time::highResolutionTicksToSeconds (remaining - yieldTicks) * 1000.0));
+        else
+            juce::Thread::yield();
+    }
+}
+
+void PigpiodDispatcher::run()
+{
+    PigpiodFrame frames[PigpiodClient::maxFramesPerWrite];
+    PigpiodFrame held;
+    bool holding = false;
+
+    void* task = applyThreadSettings();
+
+    while (!threadShouldExit())
+    {
+        int numFrames = 0;
+
+        if (holding)
+        {
+            waitUntil (held.releaseTicks);
+
+            if (threadShouldExit())
+                break;
+
+            frames[numFrames++] = held;
+            holding = false;
+        }
+
+        // Everything queued in a block arrives before flush(), so draining the
+        // queue here coalesces that block's pulses into a single write. A frame
+        // that is not due yet ends the batch and heads the next one once due;
+        // frames behind it were queued for later events, so they can wait too.
+        while (numFrames < PigpiodClient::maxFramesPerWrite && queue.pop (frames[numFrames]))
+        {
+            if (frames[numFrames].releaseTicks > juce::Time::getHighResolutionTicks())
+            {
+                held = frames[numFrames];
+                holding = true;
+                break;
+            }
+
+            ++numFrames;
+        }
+
+        if (numFrames == 0 && holding)
+            continue;
+
+        if (numFrames == 0)
+        {
+            // Woken by flush(); the timeout only bounds how long a missed wake-up can delay a frame.
+            // Busy polling skips the wake-up latency by never sleeping.
+            if (spin)
+                juce::Thread::yield();
+            else
+                wait (10);
+
+            continue;
+        }
+
+        auto t1 = juce::Time::getHighResolutionTicks();
+
+        client.beginBatch();
+
+        int result = 0;
+        for (int i = 0; i < numFrames && result >= 0; ++i)
+            result = client.appendToBatch (frames[i]);
+
+        if (result >= 0)
+            result = client.flushBatch();
+
+        auto t2 = juce::Time::getHighResolutionTicks();
+
+        for (int i = 0; i < numFrames; ++i)
+            queueDelay.record (ticksToNanoseconds (t1 - juce::jmax (frames[i].enqueueTicks, frames[i].releaseTicks)));
+
+        sendLatency.record (ticksToNanoseconds (t2 - t1));
+
+        if (result < 0)
+        {
+            sendErrorCount.fetch_add ((juce::uint64) numFrames, std::memory_order_relaxed);
+            LOGC ("Failed to send ", numFrames, " GPIO pulse(s): ", result);
+        }
+    }
+
+#if defined(_WIN32)
+    if (task != nullptr)
+        AvRevertMmThreadCharacteristics (task);
+#else
+    juce::ignoreUnused (task);
+#endif
+}
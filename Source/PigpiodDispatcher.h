@@ -0,0 +1,181 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "PigpiodClient.h"
+#include "SpscQueue.h"
+#include "LatencyHistogram.h"
+
+/**
+ * Sends pigpiod frames from a dedicated thread.
+ *
+ * The audio thread encodes each TRIG into a PigpiodFrame and pushes it onto a
+ * lock-free SPSC queue; the sender thread pops frames and writes them to the
+ * PigpiodClient socket, coalescing whatever is queued into a single write. A
+ * network stall therefore delays only this thread, never the processing block
+ * that produced the event.
+ *
+ * A frame with a release time is held until that time, which lets servers
+ * without TRIGAT still fire pulses a fixed delay after their events.
+ */
+class PigpiodDispatcher : public juce::Thread
+{
+public:
+    /** Number of slots in the dispatch queue */
+    static constexpr size_t queueSize = 1024;
+
+    /** How the sender thread is scheduled (applied each time it starts) */
+    struct ThreadSettings
+    {
+        /** CPU to pin the thread to (0-31), or -1 to let the OS choose */
+        int cpu = -1;
+
+        /** Real-time priority: SCHED_FIFO on Linux, a time-constraint policy on macOS, MMCSS "Pro Audio" on Windows */
+        bool realtime = false;
+
+        /** Spin waiting for frames instead of sleeping until flush(); costs a whole CPU, and is ignored under real-time priority */
+        bool busyPoll = false;
+    };
+
+    /** Constructor */
+    PigpiodDispatcher (PigpiodClient& client);
+
+    /** Destructor */
+    ~PigpiodDispatcher() override;
+
+    /** Queues a TRIG frame (audio thread only; never blocks or allocates)
+     *
+     * @param gpio GPIO number (BCM numbering)
+     * @param pulseLength Pulse length in microseconds
+     * @param level Pulse level (PI_HIGH or PI_LOW)
+     * @param releaseTicks High resolution tick count to hold the frame until, or 0 to send at once
+     * @return false if the queue was full and the pulse was dropped
+     */
+    bool enqueueTrig (int gpio, int pulseLength, int level = PI_HIGH, juce::int64 releaseTicks = 0);
+
+    /** Queues a TRIGAT frame that fires at a server clock time (audio thread only)
+     *
+     * @param gpio GPIO number (BCM numbering)
+     * @param pulseLength Pulse length in microseconds
+     * @param level Pulse level (PI_HIGH or PI_LOW)
+     * @param serverTimeUs Start time on the server clock (see PigpiodClient::hostTicksToServerMicros)
+     * @return false if the queue was full and the pulse was dropped
+     */
+    bool enqueueTrigAt (int gpio, int pulseLength, int level, juce::uint64 serverTimeUs);
+
+    /** Queues a WVTX frame that plays a cached pigpiod waveform (audio thread only)
+     *
+     * @param waveId ID returned by PigpiodClient::createWave()
+     * @param releaseTicks High resolution tick count to hold the frame until, or 0 to send at once
+     * @return false if the queue was full and the train was dropped
+     */
+    bool enqueueWaveTx (int waveId, juce::int64 releaseTicks = 0);
+
+    /** Queues a PATPLAY frame that plays a stored gpio_server pattern (audio thread only)
+     *
+     * @param patternId ID passed to PigpiodClient::definePattern()
+     * @param serverTimeUs Start time on the server clock, or 0 to play on arrival
+     * @return false if the queue was full and the pattern was dropped
+     */
+    bool enqueuePatternPlay (int patternId, juce::uint64 serverTimeUs = 0);
+
+    /** Queues a PWM frame that starts, changes or stops software PWM on a pin (audio thread only)
+     *
+     * @param dutyCycle 0 (stop, pin low) up to the pin's range
+     * @param releaseTicks High resolution tick count to hold the frame until, or 0 to send at once
+     * @return false if the queue was full and the frame was dropped
+     */
+    bool enqueuePwm (int gpio, int dutyCycle, juce::int64 releaseTicks = 0);
+
+    /** Queues an HP frame that starts, changes or stops hardware PWM on a pin (audio thread only)
+     *
+     * @param frequencyHz PWM frequency, or 0 to stop (pin low)
+     * @param dutyCycle 0 to PI_HW_PWM_RANGE (millionths)
+     * @param releaseTicks High resolution tick count to hold the frame until, or 0 to send at once
+     * @return false if the queue was full and the frame was dropped
+     */
+    bool enqueueHardwarePwm (int gpio, int frequencyHz, int dutyCycle, juce::int64 releaseTicks = 0);
+
+    /** Sets how the sender thread is scheduled from its next start (message thread, while stopped) */
+    void setThreadSettings (const ThreadSettings& settings) { threadSettings = settings; }
+
+    /** Wakes the sender thread; call once per block after enqueuing */
+    void flush();
+
+    /** Number of frames dropped because the queue was full */
+    juce::uint64 getDroppedCount() const { return droppedCount.load (std::memory_order_relaxed); }
+
+    /** Number of frames the sender failed to write to the socket */
+    juce::uint64 getSendErrorCount() const { return sendErrorCount.load (std::memory_order_relaxed); }
+
+    /** Frames queued but not yet taken by the sender thread */
+    int getQueueDepth() const { return (int) queue.size(); }
+
+    /** Largest queue depth seen since the last reset */
+    int getHighWaterMark() const { return highWaterMark.load (std::memory_order_relaxed); }
+
+    /** Time spent in each socket write (one write may carry several frames) */
+    const LatencyHistogram& getSendLatency() const { return sendLatency; }
+
+    /** Time from handleTTLEvent queuing a frame (or from its release time, if held) to the sender starting to write it */
+    const LatencyHistogram& getQueueDelay() const { return queueDelay; }
+
+    /** Clears the counters, histograms and the high-water mark */
+    void resetStatistics();
+
+    /** Sender thread loop */
+    void run() override;
+
+private:
+    /** Stamps and queues one frame (audio thread only) */
+    bool enqueue (PigpiodFrame& frame);
+
+    /** Sleeps, then yields, until the high resolution clock reaches releaseTicks (sender thread only) */
+    void waitUntil (juce::int64 releaseTicks);
+
+    /** Applies threadSettings to the calling thread, logging what couldn't be set (sender thread only)
+     *
+     * @return the MMCSS task handle on Windows, to be reverted when the thread ends; otherwise nullptr
+     */
+    void* applyThreadSettings();
+
+    PigpiodClient& client;
+
+    /** Written only while the thread is stopped */
+    ThreadSettings threadSettings;
+
+    /** Whether the sender spins rather than sleeps: busyPoll, unless it got real-time priority (sender thread only) */
+    bool spin = false;
+
+    SpscQueue<PigpiodFrame, queueSize> queue;
+
+    std::atomic<juce::uint64> droppedCount;
+    std::atomic<juce::uint64> sendErrorCount;
+    std::atomic<int> highWaterMark;
+
+    LatencyHistogram sendLatency;
+    LatencyHistogram queueDelay;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodDispatcher);
+};
@@ -0,0 +1,470 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "PigpiodInput.h"
+#include "PigpiodInputEditor.h"
+
+PigpiodInput::PigpiodInput()
+    : GenericProcessor ("Pigpiod Input")
+    , numLines (0)
+    , pollIntervalMs (2)
+    , acquisitionStartTicks (0)
+    , edgeCount (0)
+    , lateEdgeCount (0)
+    , lostEdgesAtStart (0)
+    , connected (false)
+    , connectPending (false)
+    , linkUp (false)
+    , connectionStatus ("Disconnected")
+    , hostname ("localhost")
+    , pigpiodPort (8888)
+    , reconnector (pigpiod, *this)
+{
+    for (auto& line : lineForGpio)
+        line.store (-1);
+
+    // Edges come back over the socket; the shared-memory ring is for a sink on the same Pi
+    pigpiod.setUseSharedMemory (false);
+}
+
+PigpiodInput::~PigpiodInput()
+{
+    disconnectFromPigpiod();
+    cancelPendingUpdate();
+}
+
+void PigpiodInput::registerParameters()
+{
+    addStringParameter (Parameter::PROCESSOR_SCOPE, "hostname", "Hostname/IP",
+                       "The hostname or IP address of the Raspberry Pi running gpio_server",
+                       "localhost", true);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "port", "Port",
+                    "The port number for gpio_server", 8888, 1, 65535);
+
+    addStringParameter (Parameter::PROCESSOR_SCOPE, "input_pins", "Input pins",
+                       "Comma-separated GPIO inputs (BCM numbering); the first drives TTL line 1, the next line 2, and so on",
+                       "", true);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "poll_interval", "Poll interval (ms)",
+                    "How often the Pi is asked for new edges; shorter gets edges into earlier blocks",
+                    2, 1, 100);
+}
+
+AudioProcessorEditor* PigpiodInput::createEditor()
+{
+    editor = std::make_unique<PigpiodInputEditor> (this);
+    return editor.get();
+}
+
+String PigpiodInput::parseInputPins (const String& text, int* lineForGpio, int& numLines)
+{
+    String error;
+    numLines = 0;
+    std::fill (lineForGpio, lineForGpio + numGpios, -1);
+
+    for (auto& entry : StringArray::fromTokens (text, ", ;", ""))
+    {
+        if (entry.trim().isEmpty())
+            continue;
+
+        const int gpio = entry.getIntValue();
+
+        if (!entry.trim().containsOnly ("0123456789") || gpio < 2 || gpio > 27)
+        {
+            error = error.isEmpty() ? "\"" + entry.trim() + "\" is not a GPIO from 2 to 27" : error;
+            continue;
+        }
+
+        if (lineForGpio[gpio] >= 0)
+        {
+            error = error.isEmpty() ? "GPIO " + String (gpio) + " is listed twice" : error;
+            continue;
+        }
+
+        if (numLines == maxInputLines)
+        {
+            error = error.isEmpty() ? "more than " + String (maxInputLines) + " pins" : error;
+            continue;
+        }
+
+        lineForGpio[gpio] = numLines++;
+    }
+
+    return error;
+}
+
+uint32_t PigpiodInput::getInputMask() const
+{
+    uint32_t mask = 0;
+
+    for (int gpio = 0; gpio < numGpios; ++gpio)
+        if (lineForGpio[gpio].load (std::memory_order_relaxed) >= 0)
+            mask |= (uint32_t) 1 << gpio;
+
+    return mask;
+}
+
+void PigpiodInput::connectToPigpiod()
+{
+    if (connected || connectPending)
+        disconnectFromPigpiod();
+
+    // Several comma-separated hosts are raced; the first to answer is used
+    StringArray hosts = StringArray::fromTokens (getParameter ("hostname")->getValue().toString(), ", ;", "");
+    hosts.removeEmptyStrings();
+
+    if (hosts.isEmpty())
+    {
+        connectionStatus = "Error: No hostname";
+        return;
+    }
+
+    hostname = hosts[0];
+    pigpiodPort = (int) getParameter ("port")->getValue();
+
+    LOGC ("Connecting to gpio_server at ", hosts.joinIntoString (" or "), ":", pigpiodPort, " for input edges");
+
+    linkUp.store (false, std::memory_order_release);
+    connectPending = true;
+    connectionStatus = "Connecting...";
+    reconnector.connectAsync (hosts, pigpiodPort, PigpiodClient::Transport::tcp);
+}
+
+void PigpiodInput::disconnectFromPigpiod()
+{
+    if (connected)
+    {
+        reconnector.stop();
+        linkUp.store (false, std::memory_order_release);
+
+        if (pigpiod.isConnected())
+            pigpiod.stopEdgeStream();
+
+        pigpiod.disconnect();
+        connected = false;
+        connectionStatus = "Disconnected";
+        LOGC ("Disconnected from gpio_server");
+        CoreServices::sendStatusMessage ("Disconnected from gpio_server");
+        CoreServices::updateSignalChain (this);
+    }
+    else if (connectPending)
+    {
+        connectPending = false;
+        connectionStatus = "Disconnected";
+        LOGC ("Connection attempt cancelled");
+
+        // Don't wait out a connect timeout here; the attempt drops its connection itself
+        if (reconnector.getState() == PigpiodReconnector::State::connecting)
+        {
+            reconnector.cancel();
+        }
+        else
+        {
+            reconnector.stop();
+            pigpiod.disconnect();
+        }
+    }
+}
+
+bool PigpiodInput::isConnectedToPigpiod() const
+{
+    return connected && pigpiod.isConnected();
+}
+
+bool PigpiodInput::isConnecting() const
+{
+    return connectPending;
+}
+
+bool PigpiodInput::isReconnecting() const
+{
+    return connected && !linkUp.load (std::memory_order_acquire);
+}
+
+String PigpiodInput::getConnectionStatus() const
+{
+    if (isReconnecting())
+        return "Reconnecting (" + String (reconnector.getAttemptCount()) + ")";
+
+    return connectionStatus;
+}
+
+juce::uint64 PigpiodInput::getLostEdgeCount() const
+{
+    return pigpiod.getLostEdgeCount() - lostEdgesAtStart;
+}
+
+bool PigpiodInput::startStream()
+{
+    const uint32_t mask = getInputMask();
+
+    if (mask == 0)
+    {
+        pigpiod.stopEdgeStream();
+        connectionStatus = "Connected (no input pins)";
+        return true;
+    }
+
+    // Edge times are only useful on the host clock, which needs gpio_server's TIME
+    if (!pigpiod.supportsScheduledPulses())
+    {
+        pigpiod.stopEdgeStream();
+        connectionStatus = "Error: needs gpio_server";
+        LOGC ("The server can't timestamp edges; input streaming needs gpio_server");
+        return false;
+    }
+
+    for (int gpio = 0; gpio < numGpios; ++gpio)
+        if ((mask >> gpio) & 1)
+            pigpiod.setMode (gpio, PI_INPUT);
+
+    if (pigpiod.startEdgeStream (mask, pollIntervalMs) < 0)
+    {
+        connectionStatus = "Error: " + pigpiod.getLastError();
+        LOGC ("Couldn't stream input edges: ", pigpiod.getLastError());
+        return false;
+    }
+
+    connectionStatus = "Streaming " + String (numLines) + " pin(s)";
+    LOGC ("Streaming edges of ", numLines, " GPIO input(s), polled every ", pollIntervalMs, " ms");
+    return true;
+}
+
+void PigpiodInput::connectionLost()
+{
+    // Reconnector thread: report on the message thread
+    linkUp.store (false, std::memory_order_release);
+    triggerAsyncUpdate();
+}
+
+void PigpiodInput::connectionRestored()
+{
+    triggerAsyncUpdate();
+}
+
+void PigpiodInput::connectionFailed()
+{
+    triggerAsyncUpdate();
+}
+
+void PigpiodInput::handleAsyncUpdate()
+{
+    const PigpiodReconnector::State state = reconnector.getState();
+
+    if (!connected)
+    {
+        if (state == PigpiodReconnector::State::restoring)
+        {
+            if (connectPending)
+            {
+                connectPending = false;
+                connected = true;
+                hostname = pigpiod.getHostname();
+                LOGC ("Connected to gpio_server at ", hostname, ", version ", pigpiod.getVersion());
+
+                startStream();
+
+                linkUp.store (true, std::memory_order_release);
+                reconnector.restoreComplete();
+
+                CoreServices::sendStatusMessage ("Connected to gpio_server at " + hostname + ":" + String (pigpiodPort));
+                CoreServices::updateSignalChain (this);
+            }
+            else
+            {
+                // Cancelled, but the attempt got through before it noticed
+                reconnector.stop();
+                pigpiod.disconnect();
+            }
+        }
+        else if (state == PigpiodReconnector::State::failed && connectPending)
+        {
+            connectPending = false;
+            connectionStatus = "Error: " + reconnector.getLastError();
+
+            LOGC ("Failed to connect: ", reconnector.getLastError());
+            CoreServices::sendStatusMessage ("Failed to connect to gpio_server: " + reconnector.getLastError());
+            CoreServices::updateSignalChain (this);
+        }
+
+        return;
+    }
+
+    if (state == PigpiodReconnector::State::down)
+    {
+        LOGC ("Lost connection to ", hostname, ":", pigpiodPort, "; reconnecting");
+        CoreServices::sendStatusMessage ("Lost connection to gpio_server, reconnecting");
+    }
+    else if (state == PigpiodReconnector::State::restoring)
+    {
+        // The Pi may have rebooted, and the stream went with the old connection either way
+        startStream();
+
+        linkUp.store (true, std::memory_order_release);
+        reconnector.restoreComplete();
+
+        LOGC ("Reconnected after ", String (reconnector.getOutageMs(), 0), " ms; edges during the outage are lost");
+        CoreServices::sendStatusMessage ("Reconnected to gpio_server at " + hostname + ":" + String (pigpiodPort));
+    }
+}
+
+void PigpiodInput::updateSettings()
+{
+    isEnabled = connected;
+
+    int maxStreamId = -1;
+    for (auto stream : getDataStreams())
+        maxStreamId = jmax (maxStreamId, (int) stream->getStreamId());
+
+    streamSettings.assign ((size_t) (maxStreamId + 1), StreamSettings());
+    streamIds.clear();
+
+    // One TTL channel per stream, so every stream sees the edges on its own sample clock
+    for (auto stream : getDataStreams())
+    {
+        EventChannel::Settings settings {
+            EventChannel::Type::TTL,
+            "Pigpiod Input",
+            "Edges on Raspberry Pi GPIO inputs, one TTL line per pin",
+            "pigpiod.input",
+            getDataStream (stream->getStreamId()),
+            maxInputLines
+        };
+
+        eventChannels.add (new EventChannel (settings));
+        eventChannels.getLast()->addProcessor (this);
+
+        StreamSettings& cached = streamSettings[stream->getStreamId()];
+        cached.channel = eventChannels.getLast();
+        cached.ticksPerSample = stream->getSampleRate() > 0
+                                    ? (double) Time::getHighResolutionTicksPerSecond() / stream->getSampleRate()
+                                    : 0.0;
+
+        streamIds.push_back (stream->getStreamId());
+    }
+}
+
+bool PigpiodInput::startAcquisition()
+{
+    // Edges from before the start have no sample to land on
+    acquisitionStartTicks = Time::getHighResolutionTicks();
+    edgeCount.store (0);
+    lateEdgeCount.store (0);
+    lostEdgesAtStart = pigpiod.getLostEdgeCount();
+
+    return true;
+}
+
+bool PigpiodInput::stopAcquisition()
+{
+    if (connected)
+        LOGC ("Input edges: ", (int64) getEdgeCount(), " as TTL events, ", (int64) getLateEdgeCount(),
+              " placed late, ", (int64) getLostEdgeCount(), " lost");
+
+    return true;
+}
+
+void PigpiodInput::parameterValueChanged (Parameter* param)
+{
+    if (param->getName().equalsIgnoreCase ("input_pins"))
+    {
+        int lines[numGpios];
+        const String error = parseInputPins (param->getValue().toString(), lines, numLines);
+
+        if (error.isNotEmpty())
+            LOGC ("Ignoring input pin ", error);
+
+        for (int gpio = 0; gpio < numGpios; ++gpio)
+            lineForGpio[gpio].store (lines[gpio], std::memory_order_relaxed);
+
+        if (connected && linkUp.load())
+            startStream();
+    }
+    else if (param->getName().equalsIgnoreCase ("poll_interval"))
+    {
+        pollIntervalMs = (int) param->getValue();
+
+        if (connected && linkUp.load() && pigpiod.getEdgeStreamMask() != 0)
+            startStream();
+    }
+}
+
+void PigpiodInput::process (AudioBuffer<float>& buffer)
+{
+    // Reference point for sample times: the block's last sample has only just been acquired
+    const int64 now = Time::getHighResolutionTicks();
+
+    int numEdges = 0;
+    PigpiodClient::EdgeRecord record;
+
+    while (numEdges < maxEdgesPerBlock && pigpiod.popEdge (record))
+    {
+        const int64 ticks = pigpiod.serverMicrosToHostTicks (record.serverTimeUs);
+
+        if (ticks < acquisitionStartTicks || lineForGpio[record.gpio].load (std::memory_order_relaxed) < 0)
+            continue;
+
+        blockEdges[numEdges] = record;
+        blockEdgeTicks[numEdges] = ticks;
+        ++numEdges;
+    }
+
+    if (numEdges == 0)
+        return;
+
+    bool firstStream = true;
+
+    for (auto streamId : streamIds)
+    {
+        const StreamSettings& settings = streamSettings[streamId];
+        const int numSamples = (int) getNumSamplesInBlock (streamId);
+
+        if (settings.channel == nullptr || settings.ticksPerSample <= 0.0 || numSamples <= 0)
+            continue;
+
+        const int64 firstSample = getFirstSampleNumberForBlock (streamId);
+
+        for (int i = 0; i < numEdges; ++i)
+        {
+            // Samples back from the last one; an edge that seems newer (clock error) lands on it,
+            // one that missed its own block lands on this block's first sample
+            const int64 age = (int64) ((double) (now - blockEdgeTicks[i]) / settings.ticksPerSample);
+            const int offset = numSamples - 1 - (int) jlimit ((int64) 0, (int64) numSamples - 1, age);
+
+            if (firstStream && age > numSamples - 1)
+                lateEdgeCount.fetch_add (1, std::memory_order_relaxed);
+
+            const int line = lineForGpio[blockEdges[i].gpio].load (std::memory_order_relaxed);
+
+            TTLEventPtr event = TTLEvent::createTTLEvent (settings.channel, firstSample + offset, (uint8) line,
+                                                          blockEdges[i].level == PI_HIGH);
+            addEvent (event, offset);
+        }
+
+        firstStream = false;
+    }
+
+    edgeCount.fetch_add ((juce::uint64) numEdges, std::memory_order_relaxed);
+}
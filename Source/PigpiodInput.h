@@ -0,0 +1,203 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __PIGPIODINPUT_H_3C91E6B2__
+#define __PIGPIODINPUT_H_3C91E6B2__
+
+#include <ProcessorHeaders.h>
+#include "PigpiodClient.h"
+#include "PigpiodReconnector.h"
+
+/**
+
+    Brings Raspberry Pi GPIO inputs back into the signal chain as TTL events.
+
+    gpio_server timestamps every edge on the chosen pins with its pulse
+    thread and streams the records to this processor, which maps each
+    server time onto the host clock (through the client's clock model) and
+    from there onto the sample it coincides with. Every data stream gets a
+    TTL channel with one line per input pin.
+
+    @see GenericProcessor
+ */
+class PigpiodInput : public GenericProcessor,
+                     private PigpiodReconnector::Listener,
+                     private AsyncUpdater
+{
+public:
+    /** Constructor */
+    PigpiodInput();
+
+    /** Destructor */
+    ~PigpiodInput();
+
+    /** Registers the parameters for a given processor */
+    void registerParameters() override;
+
+    /** Called whenever a parameter's value is changed */
+    void parameterValueChanged (Parameter* param) override;
+
+    /** Adds the edges that arrived since the last block as TTL events */
+    void process (AudioBuffer<float>& buffer) override;
+
+    /** Creates a TTL channel for each data stream */
+    void updateSettings() override;
+
+    /** Called immediately before the start of data acquisition. */
+    bool startAcquisition() override;
+
+    /** Called immediately after the end of data acquisition. */
+    bool stopAcquisition() override;
+
+    /** Creates the PigpiodInputEditor. */
+    AudioProcessorEditor* createEditor() override;
+
+    /** Starts connecting to gpio_server in the background (see PigpiodOutput::connectToPigpiod) */
+    void connectToPigpiod();
+
+    /** Stops the edge stream and disconnects */
+    void disconnectFromPigpiod();
+
+    /** Get connection status */
+    bool isConnectedToPigpiod() const;
+
+    /** True while a connection started by connectToPigpiod() is being made */
+    bool isConnecting() const;
+
+    /** True while a lost connection is being re-established in the background */
+    bool isReconnecting() const;
+
+    /** Get connection status message */
+    String getConnectionStatus() const;
+
+    /** Edges turned into TTL events since acquisition started */
+    juce::uint64 getEdgeCount() const { return edgeCount.load (std::memory_order_relaxed); }
+
+    /** Edges that reached a block after the one they belong in, and were placed at its first sample */
+    juce::uint64 getLateEdgeCount() const { return lateEdgeCount.load (std::memory_order_relaxed); }
+
+    /** Edges lost on the way (server ring or local queue overflowed) since acquisition started */
+    juce::uint64 getLostEdgeCount() const;
+
+    /** Parses an "input_pins" parameter: comma-separated BCM GPIOs, the first on TTL line 1
+     *
+     * @param lineForGpio Receives the 0-based TTL line of each of numGpios GPIOs, -1 if not an input
+     * @return an empty string, or a description of the first invalid entry
+     */
+    static String parseInputPins (const String& text, int* lineForGpio, int& numLines);
+
+private:
+    /** GPIOs that can be inputs (bank 0, which EDGESTREAM takes as a mask) */
+    static constexpr int numGpios = 32;
+
+    /** Most input pins, and so TTL lines per channel */
+    static constexpr int maxInputLines = 16;
+
+    /** Most edges taken from the queue in one block */
+    static constexpr int maxEdgesPerBlock = 1024;
+
+    /** Where one stream's events go and how its samples are timed */
+    struct StreamSettings
+    {
+        /** TTL channel created for the stream in updateSettings() */
+        EventChannel* channel = nullptr;
+
+        /** High resolution ticks per sample (from the stream's sample rate) */
+        double ticksPerSample = 0.0;
+    };
+
+    /** Pin mask of the "input_pins" parameter */
+    uint32_t getInputMask() const;
+
+    /** Makes the input pins inputs and starts streaming their edges (message thread)
+     *
+     * @return false if the server can't stream edges; connectionStatus says why
+     */
+    bool startStream();
+
+    /** PigpiodReconnector::Listener */
+    void connectionLost() override;
+    void connectionRestored() override;
+    void connectionFailed() override;
+
+    /** Finishes a connection attempt, or sets the stream up again after an outage (message thread) */
+    void handleAsyncUpdate() override;
+
+    /** TTL line (0-based) of each GPIO, -1 if it isn't an input; read on the audio thread */
+    std::atomic<int> lineForGpio[numGpios];
+
+    /** Number of input pins, and so of TTL lines */
+    int numLines;
+
+    /** Cached "poll_interval" parameter (milliseconds) */
+    int pollIntervalMs;
+
+    /** Channels by stream ID (rebuilt in updateSettings) */
+    std::vector<StreamSettings> streamSettings;
+
+    /** IDs of the streams in streamSettings, so process() needn't copy getDataStreams() */
+    std::vector<uint16> streamIds;
+
+    /** Edges taken from the client during the current block (audio thread only) */
+    PigpiodClient::EdgeRecord blockEdges[maxEdgesPerBlock];
+
+    /** Host tick count of each edge in blockEdges */
+    int64 blockEdgeTicks[maxEdgesPerBlock];
+
+    /** Edges from before this tick count (the start of acquisition) are discarded */
+    int64 acquisitionStartTicks;
+
+    std::atomic<juce::uint64> edgeCount;
+    std::atomic<juce::uint64> lateEdgeCount;
+
+    /** Client's lost edge count when acquisition started */
+    juce::uint64 lostEdgesAtStart;
+
+    /** pigpiod client */
+    PigpiodClient pigpiod;
+
+    /** Connection state: true from a successful connect until the user disconnects */
+    bool connected;
+
+    /** True from connectToPigpiod() until the attempt succeeds, fails or is cancelled */
+    bool connectPending;
+
+    /** False while the link is down or being set up again */
+    std::atomic<bool> linkUp;
+
+    String connectionStatus;
+
+    /** Hostname/IP for gpio_server */
+    String hostname;
+
+    /** Port for gpio_server */
+    int pigpiodPort;
+
+    /** Re-establishes a dropped connection (declared after pigpiod, which it uses) */
+    PigpiodReconnector reconnector;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodInput);
+};
+
+#endif // __PIGPIODINPUT_H_3C91E6B2__
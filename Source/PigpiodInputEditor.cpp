@@ -0,0 +1,119 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "PigpiodInputEditor.h"
+
+PigpiodInputEditor::PigpiodInputEditor (GenericProcessor* parentNode)
+    : GenericEditor (parentNode)
+{
+    desiredWidth = 420;
+
+    // Column 1: Connection settings
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "hostname", 10, 29);
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "port", 10, 54);
+
+    // Connect button
+    connectButton = std::make_unique<UtilityButton> ("CONNECT");
+    connectButton->setBounds (10, 79, 80, 20);
+    connectButton->addListener (this);
+    addAndMakeVisible (connectButton.get());
+
+    // Connection status label
+    statusLabel = std::make_unique<Label> ("Status", "");
+    statusLabel->setBounds (10, 104, 160, 20);
+    statusLabel->setColour (Label::textColourId, Colours::grey);
+    addAndMakeVisible (statusLabel.get());
+
+    // Column 2: Input pins (GPIO, ... in TTL line order) and how often they're read
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "input_pins", 175, 29);
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "poll_interval", 175, 54);
+
+    // Edge counts since acquisition started
+    countLabel = std::make_unique<Label> ("Edges", "");
+    countLabel->setBounds (175, 79, 240, 45);
+    countLabel->setFont (Font (FontOptions (12.0f)));
+    countLabel->setJustificationType (Justification::topLeft);
+    countLabel->setColour (Label::textColourId, Colours::grey);
+    addAndMakeVisible (countLabel.get());
+
+    // Start timer to update connection status
+    startTimer (500);
+
+    updateConnectionStatus();
+}
+
+void PigpiodInputEditor::buttonClicked (Button* button)
+{
+    PigpiodInput* processor = (PigpiodInput*) getProcessor();
+
+    if (button == connectButton.get())
+    {
+        if (processor->isConnectedToPigpiod() || processor->isConnecting() || processor->isReconnecting())
+            processor->disconnectFromPigpiod();
+        else
+            processor->connectToPigpiod();
+
+        updateConnectionStatus();
+    }
+}
+
+void PigpiodInputEditor::timerCallback()
+{
+    updateConnectionStatus();
+
+    PigpiodInput* processor = (PigpiodInput*) getProcessor();
+
+    countLabel->setText ("Edges " + String ((int64) processor->getEdgeCount())
+                         + "  Late " + String ((int64) processor->getLateEdgeCount())
+                         + "  Lost " + String ((int64) processor->getLostEdgeCount()),
+                         dontSendNotification);
+}
+
+void PigpiodInputEditor::updateConnectionStatus()
+{
+    PigpiodInput* processor = (PigpiodInput*) getProcessor();
+
+    if (processor->isConnecting())
+    {
+        connectButton->setLabel ("CONNECTING");
+        statusLabel->setColour (Label::textColourId, Colours::grey);
+    }
+    else if (processor->isReconnecting())
+    {
+        connectButton->setLabel ("RETRYING");
+        statusLabel->setColour (Label::textColourId, Colours::orange);
+    }
+    else if (processor->isConnectedToPigpiod())
+    {
+        connectButton->setLabel ("CONNECTED");
+        statusLabel->setColour (Label::textColourId, Colours::grey);
+    }
+    else
+    {
+        connectButton->setLabel ("CONNECT");
+        statusLabel->setColour (Label::textColourId, Colours::grey);
+    }
+
+    statusLabel->setText (processor->getConnectionStatus(), dontSendNotification);
+}
@@ -0,0 +1,66 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __PIGPIODINPUTEDITOR_H_7A2D40F1__
+#define __PIGPIODINPUTEDITOR_H_7A2D40F1__
+
+#include "PigpiodInput.h"
+#include <EditorHeaders.h>
+
+/**
+
+  User interface for the PigpiodInput processor.
+
+  @see PigpiodInput
+
+*/
+
+class PigpiodInputEditor : public GenericEditor, public Timer, public Button::Listener
+{
+public:
+    /** Constructor*/
+    PigpiodInputEditor (GenericProcessor* parentNode);
+
+    /** Destructor*/
+    ~PigpiodInputEditor() {}
+
+    /** Called when the connect button is clicked */
+    void buttonClicked (Button* button) override;
+
+private:
+
+    /** Timer callback to update connection status and edge counts */
+    void timerCallback() override;
+
+    /** Update the connection status label */
+    void updateConnectionStatus();
+
+    std::unique_ptr<UtilityButton> connectButton;
+    std::unique_ptr<Label> statusLabel;
+    std::unique_ptr<Label> countLabel;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodInputEditor);
+};
+
+#endif // __PIGPIODINPUTEDITOR_H_7A2D40F1__
@@ -28,17 +28,36 @@
 
 PigpiodOutput::PigpiodOutput()
     : GenericProcessor ("Pigpiod Sink")
+    , gpioPin (17)
+    , pulseDurationUs (50)
+    , nextPatternId (0)
+    , blockStartTicks (0)
+    , timestampEvents (false)
+    , dispatcher (pigpiod)
+    , router (pigpiod, dispatcher, pulseSettings)
+    , benchmark (pigpiod)
     , connected (false)
+    , connectPending (false)
+    , linkUp (false)
+    , outageBufferMs (0)
+    , numOutageEvents (0)
+    , outageEventCount (0)
+    , replayedEventCount (0)
+    , discardedEventCount (0)
     , gateIsOpen (true)
     , hostname ("localhost")
     , pigpiodPort (8888)
     , connectionStatus ("Disconnected")
+    , reconnector (pigpiod, *this)
 {
 }
 
 PigpiodOutput::~PigpiodOutput()
 {
+    dispatcher.stopThread (1000);
+    benchmark.stopThread (2000);
     disconnectFromPigpiod();
+    cancelPendingUpdate();
 }
 
 void PigpiodOutput::registerParameters()
@@ -50,6 +69,14 @@ void PigpiodOutput::registerParameters()
     addIntParameter (Parameter::PROCESSOR_SCOPE, "port", "Port",
                     "The port number for pigpiod", 8888, 1, 65535);
 
+    addCategoricalParameter (Parameter::PROCESSOR_SCOPE, "transport", "Transport",
+                            "TCP works with pigpiod and gpio_server; UDP (gpio_server only) never stalls on a lost packet",
+                            { "TCP", "UDP", "UDP+ack" }, 0);
+
+    addCategoricalParameter (Parameter::PROCESSOR_SCOPE, "protocol", "Protocol",
+                            "Compact (gpio_server over TCP only) packs each pulse into a few bytes and only acknowledges scheduled ones; applies on the next connect",
+                            { "pigpiod", "Compact" }, 0);
+
     addIntParameter (Parameter::PROCESSOR_SCOPE, "gpio_pin", "GPIO Pin",
                     "The Raspberry Pi GPIO pin to use (BCM numbering)", 17, 2, 27);
 
@@ -61,6 +88,55 @@ void PigpiodOutput::registerParameters()
 
     addIntParameter (Parameter::STREAM_SCOPE, "gate_line", "Gate line",
                     "The TTL line for gating the output", 0, 0, 16);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "schedule_delay", "Fixed delay (us)",
+                    "Fire each pulse this long after its event's sample was acquired: on the Pi's clock with gpio_server, held on this computer with pigpiod; 0 sends as soon as possible",
+                    0, 0, 100000);
+
+    addStringParameter (Parameter::STREAM_SCOPE, "routes", "Routes",
+                       "Additional TTL line to GPIO routes, as comma-separated line:gpio[@host][:us[:high|low]], or line:gpio:pwm|hp:hz[:duty%] for PWM while the line is high",
+                       "", true);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "train_pulses", "Train pulses",
+                    "Pulses sent for each event; above 1, pigpiod plays the train from a cached waveform",
+                    1, 1, maxTrainPulses);
+
+    addFloatParameter (Parameter::PROCESSOR_SCOPE, "train_rate", "Train rate",
+                      "Pulse rate within a train", "Hz", 40.0f, 1.0f, 1000.0f, 1.0f);
+
+    addCategoricalParameter (Parameter::PROCESSOR_SCOPE, "coalesce", "Coalesce",
+                            "Triggers inside a pin's refractory window: Drop discards them, Merge keeps the latest, Extend stretches the pulse (applied at acquisition start)",
+                            { "Off", "Drop", "Merge", "Extend" }, 0);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "refractory", "Refractory (us)",
+                    "Window after each pulse starts in which further triggers on its pin are coalesced; 0 uses the pulse (or train) length",
+                    0, 0, 1000000);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "outage_buffer", "Outage buffer (ms)",
+                    "Events during a lost connection are replayed on reconnect if no older than this; 0 only counts them",
+                    0, 0, 5000);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "sender_cpu", "Sender CPU",
+                    "CPU the sender threads are pinned to; -1 lets the OS choose (applied at acquisition start)",
+                    -1, -1, 31);
+
+    addCategoricalParameter (Parameter::PROCESSOR_SCOPE, "sender_priority", "Sender priority",
+                            "Realtime uses SCHED_FIFO on Linux (needs an rtprio limit), a time-constraint policy on macOS and MMCSS on Windows",
+                            { "Normal", "Realtime" }, 0);
+
+    addCategoricalParameter (Parameter::PROCESSOR_SCOPE, "sender_wait", "Sender wait",
+                            "Busy poll spins on the send queue (and on the socket, on Linux) instead of sleeping, using a whole CPU",
+                            { "Block", "Busy poll" }, 0);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "bench_pulses", "Bench pulses",
+                    "Test pulses fired on the GPIO pin by BENCH", 1000, 10, 100000);
+
+    addFloatParameter (Parameter::PROCESSOR_SCOPE, "bench_rate", "Bench rate",
+                      "Rate of the BENCH test pulses", "Hz", 100.0f, 1.0f, 1000.0f, 1.0f);
+
+    addIntParameter (Parameter::PROCESSOR_SCOPE, "loopback_pin", "Loopback pin",
+                    "Input wired to the GPIO pin, whose edges gpio_server timestamps during BENCH; 0 for none",
+                    0, 0, 27);
 }
 
 AudioProcessorEditor* PigpiodOutput::createEditor()
@@ -69,55 +145,114 @@ AudioProcessorEditor* PigpiodOutput::createEditor()
     return editor.get();
 }
 
-bool PigpiodOutput::connectToPigpiod()
+void PigpiodOutput::connectToPigpiod()
 {
-    hostname = getParameter ("hostname")->getValue().toString();
-    pigpiodPort = (int) getParameter ("port")->getValue();
+    if (connected || connectPending)
+        disconnectFromPigpiod();
 
-    LOGC ("Connecting to pigpiod at ", hostname, ":", pigpiodPort);
+    // Several comma-separated hosts are raced; the first to answer is used
+    StringArray hosts = getHostnameCandidates();
 
-    if (pigpiod.connect (hostname, pigpiodPort))
+    if (hosts.isEmpty())
     {
-        int version = pigpiod.getVersion();
-        connected = true;
-        connectionStatus = "Connected (version " + String (version) + ")";
-        LOGC ("Connected to pigpiod version ", version);
+        connectionStatus = "Error: No hostname";
+        return;
+    }
 
-        // Initialize GPIO pin to LOW (required for TRIG command to work)
-        // WRITE command implicitly sets the pin to OUTPUT mode
-        int gpio = (int) getParameter ("gpio_pin")->getValue();
-        int writeResult = pigpiod.write (gpio, PI_LOW);
-        if (writeResult < 0)
-        {
-            LOGC ("Warning: Failed to initialize GPIO ", gpio, " to LOW: ", writeResult);
-        }
-        else
-        {
-            LOGC ("Initialized GPIO ", gpio, " to LOW");
-        }
+    hostname = hosts[0];
+    pigpiodPort = (int) getParameter ("port")->getValue();
 
-        CoreServices::sendStatusMessage ("Connected to pigpiod at " + hostname + ":" + String (pigpiodPort));
-        CoreServices::updateSignalChain (this);
-        return true;
-    }
-    else
-    {
-        connected = false;
-        connectionStatus = "Error: " + pigpiod.getLastError();
-        LOGC ("Failed to connect: ", pigpiod.getLastError());
-        CoreServices::sendStatusMessage ("Failed to connect to pigpiod: " + pigpiod.getLastError());
-        CoreServices::updateSignalChain (this);
-        return false;
-    }
+    const PigpiodClient::Transport transport = getTransportSetting();
+
+    // Taken up by HELLO on connect; pigpiod and UDP ignore it
+    const bool compact = (int) getParameter ("protocol")->getValue() == 1;
+    pigpiod.setCompactProtocol (compact);
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        targets[i]->setCompactProtocol (compact);
+
+    LOGC ("Connecting to pigpiod at ", hosts.joinIntoString (" or "), ":", pigpiodPort,
+          transport == PigpiodClient::Transport::tcp ? "" : " (UDP)");
+
+    // The connect and its first round trips run on the reconnector thread;
+    // handleAsyncUpdate() finishes the job on the message thread
+    linkUp.store (false, std::memory_order_release);
+    connectPending = true;
+    connectionStatus = "Connecting...";
+    reconnector.connectAsync (hosts, pigpiodPort, transport);
+
+    // Other Pis connect alongside, each on its own thread
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        targets[i]->connect (pigpiodPort, transport);
+}
+
+StringArray PigpiodOutput::getHostnameCandidates() const
+{
+    StringArray hosts = StringArray::fromTokens (getParameter ("hostname")->getValue().toString(), ", ;", "");
+    hosts.removeEmptyStrings();
+    return hosts;
+}
+
+PigpiodClient::Transport PigpiodOutput::getTransportSetting() const
+{
+    const int transportIndex = (int) getParameter ("transport")->getValue();
+    return transportIndex == 2 ? PigpiodClient::Transport::udpAcked
+         : transportIndex == 1 ? PigpiodClient::Transport::udp
+                               : PigpiodClient::Transport::tcp;
+}
+
+void PigpiodOutput::finishConnecting()
+{
+    connectPending = false;
+    hostname = pigpiod.getHostname();
+
+    // Stored trains don't survive a new connection (and the server may differ)
+    trainCache.clear();
+    pulseSettings.trainEngine = TrainEngine::unknown;
+    nextPatternId = 0;
+
+    int version = pigpiod.getVersion();
+    connected = true;
+    connectionStatus = "Connected (version " + String (version) + ")";
+
+    if (pigpiod.isUsingSharedMemory())
+        LOGC ("gpio_server is on this machine; pulses go through shared memory");
+    if (pigpiod.getProtocolVersion() > 0)
+        LOGC ("gpio_server protocol ", pigpiod.getProtocolVersion(), pigpiod.isUsingCompactFrames() ? " (compact frames)" : "",
+              ", capabilities 0x", String::toHexString ((int) pigpiod.getCapabilities()));
+    LOGC ("Connected to pigpiod at ", hostname, ", version ", version);
+
+    // Initialize routed GPIO pins to their idle level (required for TRIG command to work)
+    // WRITE command implicitly sets the pin to OUTPUT mode
+    resetRoutedPins();
+
+    // Acquisition started while connecting, so nothing is sending its events yet
+    if (CoreServices::getAcquisitionStatus())
+        startSending();
+
+    // From here on a dropped link is re-established in the background
+    linkUp.store (true, std::memory_order_release);
+    reconnector.restoreComplete();
+
+    CoreServices::sendStatusMessage ("Connected to pigpiod at " + hostname + ":" + String (pigpiodPort));
+    CoreServices::updateSignalChain (this);
 }
 
 void PigpiodOutput::disconnectFromPigpiod()
 {
+    benchmark.stopThread (2000);
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        targets[i]->disconnect();
+
     if (connected)
     {
-        // Set GPIO low before disconnecting
-        int gpio = (int) getParameter ("gpio_pin")->getValue();
-        pigpiod.write (gpio, PI_LOW);
+        reconnector.stop();
+        linkUp.store (false, std::memory_order_release);
+
+        // Return GPIO pins to idle before disconnecting
+        if (pigpiod.isConnected())
+            resetRoutedPins (true);
 
         pigpiod.disconnect();
         connected = false;
@@ -126,6 +261,50 @@ void PigpiodOutput::disconnectFromPigpiod()
         CoreServices::sendStatusMessage ("Disconnected from pigpiod");
         CoreServices::updateSignalChain (this);
     }
+    else if (connectPending)
+    {
+        connectPending = false;
+        connectionStatus = "Disconnected";
+        LOGC ("Connection attempt cancelled");
+
+        // Don't wait out a connect timeout here; the attempt drops its connection itself
+        if (reconnector.getState() == PigpiodReconnector::State::connecting)
+        {
+            reconnector.cancel();
+        }
+        else
+        {
+            reconnector.stop();
+            pigpiod.disconnect();
+        }
+    }
+}
+
+bool PigpiodOutput::startBenchmark()
+{
+    if (!isConnectedToPigpiod() || isReconnecting() || CoreServices::getAcquisitionStatus())
+        return false;
+
+    PigpiodBenchmark::Settings settings;
+    settings.outputGpio = gpioPin;
+    settings.pulseUs = pulseDurationUs;
+    settings.numPulses = (int) getParameter ("bench_pulses")->getValue();
+    settings.rateHz = (double) getParameter ("bench_rate")->getValue();
+
+    const int loopbackPin = (int) getParameter ("loopback_pin")->getValue();
+    settings.loopbackGpio = loopbackPin > 0 && loopbackPin != gpioPin ? loopbackPin : -1;
+
+    if (!benchmark.start (settings))
+        return false;
+
+    LOGC ("Benchmark: ", settings.numPulses, " pulses on GPIO ", gpioPin, " at ", settings.rateHz, " Hz",
+          settings.loopbackGpio >= 0 ? ", loopback on GPIO " + String (settings.loopbackGpio) : String());
+    return true;
+}
+
+void PigpiodOutput::stopBenchmark()
+{
+    benchmark.stopThread (2000);
 }
 
 bool PigpiodOutput::isConnectedToPigpiod() const
@@ -133,61 +312,677 @@ bool PigpiodOutput::isConnectedToPigpiod() const
     return connected && pigpiod.isConnected();
 }
 
+bool PigpiodOutput::isConnecting() const
+{
+    return connectPending;
+}
+
+bool PigpiodOutput::isReconnecting() const
+{
+    return connected && !linkUp.load (std::memory_order_acquire);
+}
+
 String PigpiodOutput::getConnectionStatus() const
 {
+    if (isReconnecting())
+        return "Reconnecting (" + String (reconnector.getAttemptCount()) + ")";
+
     return connectionStatus;
 }
 
+void PigpiodOutput::connectionLost()
+{
+    // Reconnector thread: close the hot path now, report on the message thread
+    linkUp.store (false, std::memory_order_release);
+    triggerAsyncUpdate();
+}
+
+void PigpiodOutput::connectionRestored()
+{
+    triggerAsyncUpdate();
+}
+
+void PigpiodOutput::connectionFailed()
+{
+    triggerAsyncUpdate();
+}
+
+void PigpiodOutput::handleAsyncUpdate()
+{
+    const PigpiodReconnector::State state = reconnector.getState();
+
+    if (!connected)
+    {
+        if (state == PigpiodReconnector::State::restoring)
+        {
+            if (connectPending)
+            {
+                finishConnecting();
+            }
+            else
+            {
+                // Cancelled, but the attempt got through before it noticed
+                reconnector.stop();
+                pigpiod.disconnect();
+            }
+        }
+        else if (state == PigpiodReconnector::State::failed && connectPending)
+        {
+            connectPending = false;
+            connectionStatus = "Error: " + reconnector.getLastError();
+
+            // The other Pis are only used together with the main one
+            for (int i = 0; i < router.getNumTargets(); ++i)
+                targets[i]->disconnect();
+
+            LOGC ("Failed to connect: ", reconnector.getLastError());
+            CoreServices::sendStatusMessage ("Failed to connect to pigpiod: " + reconnector.getLastError());
+            CoreServices::updateSignalChain (this);
+        }
+
+        return;
+    }
+
+    if (state == PigpiodReconnector::State::down)
+    {
+        LOGC ("Lost connection to ", hostname, ":", pigpiodPort, "; reconnecting");
+        CoreServices::sendStatusMessage ("Lost connection to pigpiod, reconnecting");
+    }
+    else if (state == PigpiodReconnector::State::restoring)
+    {
+        // The Pi may have rebooted: pins are inputs again and stored trains are gone
+        clearTrains();
+        pulseSettings.trainEngine = TrainEngine::unknown;
+
+        resetRoutedPins();
+        prepareTrains();
+
+        if (CoreServices::getAcquisitionStatus())
+            preparePwmRoutes();
+
+        // The clock model starts over; fall back to immediate pulses if it can't schedule yet
+        pulseSettings.schedulePulses = pulseSettings.schedulePulses && pigpiod.supportsScheduledPulses();
+
+        // Should still be running from acquisition start, but events must not queue up unsent
+        if (CoreServices::getAcquisitionStatus() && !dispatcher.isThreadRunning())
+            dispatcher.startThread();
+
+        linkUp.store (true, std::memory_order_release);
+        reconnector.restoreComplete();
+
+        LOGC ("Reconnected after ", String (reconnector.getOutageMs(), 0), " ms (", reconnector.getAttemptCount(),
+              " attempt(s)); ", (int64) getOutageEventCount(), " event(s) missed so far");
+        CoreServices::sendStatusMessage ("Reconnected to pigpiod at " + hostname + ":" + String (pigpiodPort));
+    }
+}
+
 void PigpiodOutput::updateSettings()
 {
     isEnabled = connected;
+
+    cacheProcessorSettings();
+
+    // Size the table for the largest stream ID so lookups are a bounds check and an index
+    int maxStreamId = -1;
+    for (auto stream : getDataStreams())
+        maxStreamId = jmax (maxStreamId, (int) stream->getStreamId());
+
+    streamSettings.assign ((size_t) (maxStreamId + 1), StreamSettings());
+    streamIds.clear();
+
+    for (auto stream : getDataStreams())
+    {
+        streamIds.push_back (stream->getStreamId());
+        cacheStreamSettings (stream);
+    }
 }
 
-bool PigpiodOutput::stopAcquisition()
+void PigpiodOutput::cacheProcessorSettings()
+{
+    gpioPin = (int) getParameter ("gpio_pin")->getValue();
+    pulseDurationUs = (int) getParameter ("pulse_duration")->getValue();
+    pulseSettings.scheduleDelayUs = (int) getParameter ("schedule_delay")->getValue();
+    outageBufferMs = (int) getParameter ("outage_buffer")->getValue();
+    pulseSettings.refractoryUs = (int) getParameter ("refractory")->getValue();
+
+    senderSettings.cpu = (int) getParameter ("sender_cpu")->getValue();
+    senderSettings.realtime = (int) getParameter ("sender_priority")->getValue() == 1;
+    senderSettings.busyPoll = (int) getParameter ("sender_wait")->getValue() == 1;
+
+    // Socket options are set on connect, so this takes effect on the next (re)connect
+    pigpiod.setBusyPoll (senderSettings.busyPoll);
+    pulseSettings.trainPulses = (int) getParameter ("train_pulses")->getValue();
+    pulseSettings.trainPeriodUs = roundToInt (1.0e6 / jmax (1.0, (double) getParameter ("train_rate")->getValue()));
+}
+
+void PigpiodOutput::prepareTrains()
+{
+    if (!connected || pulseSettings.trainPulses <= 1 || !pigpiod.isConnected())
+        return;
+
+    // Start pigpiod from a clean slate; gpio_server has no waveforms and rejects
+    // WVCLR, but frees an empty pattern, which pigpiod rejects in turn
+    if (pulseSettings.trainEngine == TrainEngine::unknown)
+    {
+        if (pigpiod.clearWaves() >= 0)
+            pulseSettings.trainEngine = TrainEngine::waveforms;
+        else if (pigpiod.definePattern (0, nullptr, 0) >= 0)
+            pulseSettings.trainEngine = TrainEngine::patterns;
+        else
+            pulseSettings.trainEngine = TrainEngine::none;
+    }
+
+    if (pulseSettings.trainEngine == TrainEngine::none)
+        return;
+
+    for (auto& settings : streamSettings)
+    {
+        for (auto& route : settings.routes)
+        {
+            // Other Pis play trains as scheduled pulses
+            if (route.gpio >= 0 && route.target < 0 && route.pwm == PwmMode::none && route.trainId < 0)
+            {
+                route.trainId = findCachedTrain (route);
+
+                if (route.trainId < 0)
+                    route.trainId = pulseSettings.trainEngine == TrainEngine::waveforms ? createTrainWave (route)
+                                                                          : createTrainPattern (route);
+            }
+        }
+    }
+}
+
+int PigpiodOutput::findCachedTrain (const Route& route) const
+{
+    auto it = trainCache.find (std::make_tuple (route.gpio, route.pulseUs, route.level));
+    return it != trainCache.end() ? it->second : -1;
+}
+
+int PigpiodOutput::createTrainWave (const Route& route)
+{
+    // Each pulse is two steps: to the pulse level for pulseUs, back to idle for the rest of the period
+    const uint32_t mask = 1u << route.gpio;
+    const uint32_t onMask = route.level == PI_HIGH ? mask : 0;
+    const uint32_t offMask = route.level == PI_HIGH ? 0 : mask;
+
+    PigpiodWavePulse pulses[2 * maxTrainPulses];
+
+    for (int i = 0; i < pulseSettings.trainPulses; ++i)
+    {
+        pulses[2 * i] = { onMask, offMask, (uint32_t) route.pulseUs };
+        pulses[2 * i + 1] = { offMask, onMask, (uint32_t) jmax (1, pulseSettings.trainPeriodUs - route.pulseUs) };
+    }
+
+    int waveId = pigpiod.addWavePulses (pulses, 2 * pulseSettings.trainPulses);
+
+    if (waveId >= 0)
+        waveId = pigpiod.createWave();
+
+    if (waveId < 0)
+    {
+        LOGC ("Failed to create a ", pulseSettings.trainPulses, "-pulse train on GPIO ", route.gpio, ": ", waveId);
+        return -1;
+    }
+
+    trainCache[std::make_tuple (route.gpio, route.pulseUs, route.level)] = waveId;
+    return waveId;
+}
+
+int PigpiodOutput::createTrainPattern (const Route& route)
+{
+    if (route.gpio >= 32 || nextPatternId >= GS_MAX_PATTERNS)
+    {
+        LOGC ("No gpio_server pattern for the train on GPIO ", route.gpio, "; sending its pulses individually");
+        return -1;
+    }
+
+    // Each pulse is two steps: to the pulse level, then back to idle pulseUs later
+    const uint32_t mask = 1u << route.gpio;
+    const uint32_t onMask = route.level == PI_HIGH ? mask : 0;
+    const uint32_t offMask = route.level == PI_HIGH ? 0 : mask;
+
+    PigpiodPatternStep steps[2 * maxTrainPulses];
+
+    for (int i = 0; i < pulseSettings.trainPulses; ++i)
+    {
+        steps[2 * i] = { (uint32_t) (i == 0 ? 0 : jmax (1, pulseSettings.trainPeriodUs - route.pulseUs)), onMask, offMask };
+        steps[2 * i + 1] = { (uint32_t) route.pulseUs, offMask, onMask };
+    }
+
+    // A pattern still playing can't be redefined; the route then falls back to single pulses
+    const int patternId = nextPatternId;
+    const int result = pigpiod.definePattern (patternId, steps, 2 * pulseSettings.trainPulses);
+
+    if (result < 0)
+    {
+        LOGC ("Failed to store a ", pulseSettings.trainPulses, "-pulse train on GPIO ", route.gpio, ": ", result);
+        return -1;
+    }
+
+    ++nextPatternId;
+    trainCache[std::make_tuple (route.gpio, route.pulseUs, route.level)] = patternId;
+    return patternId;
+}
+
+void PigpiodOutput::clearTrains()
+{
+    // Patterns are simply redefined, starting again from ID 0
+    if (connected && pulseSettings.trainEngine == TrainEngine::waveforms && !trainCache.empty())
+        pigpiod.clearWaves();
+
+    trainCache.clear();
+    nextPatternId = 0;
+
+    for (auto& settings : streamSettings)
+        for (auto& route : settings.routes)
+            route.trainId = -1;
+}
+
+void PigpiodOutput::cacheStreamSettings (DataStream* stream)
 {
-    // Set GPIO low
+    const uint16 streamId = stream->getStreamId();
+
+    if (streamId >= streamSettings.size())
+        return;
+
+    // Built aside and copied in whole, so a route never names a target before it exists
+    StreamSettings settings;
+    settings.gateLine = (int) (*stream)["gate_line"];
+
+    if (stream->getSampleRate() > 0)
+        settings.ticksPerSample = (double) Time::getHighResolutionTicksPerSecond() / stream->getSampleRate();
+
+    // "input_line" drives the processor-wide GPIO pin; explicit routes take precedence
+    const int inputLine = (int) (*stream)["input_line"];
+    if (inputLine >= 1 && inputLine <= maxRoutedLines)
+    {
+        Route& route = settings.routes[(inputLine - 1) * maxRoutesPerLine];
+        route.gpio = gpioPin;
+        route.pulseUs = pulseDurationUs;
+        route.level = PI_HIGH;
+    }
+
+    String error = PigpiodRouter::parseRoutes ((*stream)["routes"].toString(), settings.routes, pulseDurationUs,
+                                getHostnameCandidates(), targetHosts);
+    if (error.isNotEmpty())
+        LOGC ("Ignoring route on stream ", stream->getName(), ": ", error);
+
+    // Trains already uploaded keep their waveform; prepareTrains() creates the rest
+    if (pulseSettings.trainPulses > 1)
+        for (auto& route : settings.routes)
+            if (route.gpio >= 0 && route.target < 0)
+                route.trainId = findCachedTrain (route);
+
+    streamSettings[streamId] = settings;
+
+    updateTargets();
+}
+
+void PigpiodOutput::computeIdleLevels (int target, int* idleLevel) const
+{
+    // Each pin is driven once, to the level opposite its pulse polarity
+    std::fill (idleLevel, idleLevel + PigpiodTarget::numPins, -1);
+
+    if (target < 0)
+        idleLevel[gpioPin] = PI_LOW;
+
+    for (auto& settings : streamSettings)
+        for (auto& route : settings.routes)
+            if (route.gpio >= 0 && route.target == target)
+                idleLevel[route.gpio] = route.level == PI_HIGH ? PI_LOW : PI_HIGH;
+}
+
+void PigpiodOutput::updateTargets()
+{
+    while (router.getNumTargets() < targetHosts.size())
+    {
+        const int index = router.getNumTargets();
+        targets[index] = std::make_unique<PigpiodTarget> (targetHosts[index]);
+        targets[index]->setSenderSettings (senderSettings);
+        targets[index]->setCompactProtocol ((int) getParameter ("protocol")->getValue() == 1);
+
+        if (connected || connectPending)
+            targets[index]->connect (pigpiodPort, getTransportSetting());
+
+        if (CoreServices::getAcquisitionStatus())
+            targets[index]->startAcquisition (pulseSettings.scheduleDelayUs > 0);
+
+        router.addTarget (targets[index].get());
+    }
+
+    int idleLevel[PigpiodTarget::numPins];
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+    {
+        computeIdleLevels (i, idleLevel);
+        targets[i]->setIdleLevels (idleLevel);
+    }
+}
+
+void PigpiodOutput::resetRoutedPins (bool pinsAreOutputs)
+{
+    // A bank write doesn't stop PWM, so stop it first; this also leaves the pin low
+    for (auto& settings : streamSettings)
+    {
+        for (auto& route : settings.routes)
+        {
+            if (route.gpio < 0 || route.pwm == PwmMode::none)
+                continue;
+
+            const int result = route.pwm == PwmMode::hardware ? pigpiod.setHardwarePwm (route.gpio, 0, 0)
+                                                              : pigpiod.setPwmDutyCycle (route.gpio, 0);
+            if (result < 0)
+                LOGC ("Warning: Failed to stop PWM on GPIO ", route.gpio, ": ", result);
+        }
+    }
+
+    int idleLevel[PigpiodTarget::numPins];
+    computeIdleLevels (-1, idleLevel);
+    PigpiodTarget::driveIdleLevels (pigpiod, idleLevel, pinsAreOutputs);
+}
+
+void PigpiodOutput::preparePwmRoutes()
+{
+    if (!connected || !pigpiod.isConnected())
+        return;
+
+    for (auto& settings : streamSettings)
+    {
+        for (auto& route : settings.routes)
+        {
+            if (route.gpio < 0 || route.pwm != PwmMode::software)
+                continue;
+
+            int result = pigpiod.setPwmFrequency (route.gpio, route.pwmFrequencyHz);
+
+            if (result >= 0 && result != route.pwmFrequencyHz)
+                LOGC ("PWM on GPIO ", route.gpio, " runs at ", result, " Hz, the nearest the server supports to ", route.pwmFrequencyHz);
+
+            if (result >= 0)
+                result = pigpiod.setPwmRange (route.gpio, PigpiodRouter::pwmRange);
+
+            if (result < 0)
+                LOGC ("Warning: Failed to set up PWM on GPIO ", route.gpio, ": ", result);
+        }
+    }
+}
+
+String PigpiodOutput::formatLatency (const String& name, const LatencyHistogram& histogram)
+{
+    if (histogram.getCount() == 0)
+        return name + " --";
+
+    auto us = [] (juce::uint64 ns) { return String ((double) ns / 1000.0, 0); };
+
+    return name + " " + us (histogram.getPercentile (0.5))
+           + "/" + us (histogram.getPercentile (0.99))
+           + "/" + us (histogram.getPercentile (0.999))
+           + "/" + us (histogram.getMax());
+}
+
+StringArray PigpiodOutput::getLatencyReport() const
+{
+    StringArray report;
+
+    // Only recorded when a fixed delay or coalescing needs event times
+    if (eventAge.getCount() > 0)
+        report.add (formatLatency ("Age", eventAge));
+
+    report.add (formatLatency ("Queue", dispatcher.getQueueDelay()));
+    report.add (formatLatency ("Send", dispatcher.getSendLatency()));
+    report.add (formatLatency ("RTT", pigpiod.getRoundTripLatency()));
+    return report;
+}
+
+StringArray PigpiodOutput::getServerStatsReport() const
+{
+    StringArray report;
+
+    if ((pigpiod.getCapabilities() & GS_CAP_STATS) == 0)
+        return report;
+
+    report.add ("gpio_server (p50/p99/p99.9/max us):");
+    report.add (formatLatency ("Rx to pin", pigpiod.getServerReceiptLatency()));
+    report.add (formatLatency ("Overrun", pigpiod.getServerOverrun())
+                + ", " + String ((int64) pigpiod.getServerHeapFullCount()) + " fired early (heap full)");
+    report.add (formatLatency ("Width error", pigpiod.getServerWidthError())
+                + ", " + String ((int64) pigpiod.getServerInlinePulseCount()) + " timed inline (ring full)");
+    return report;
+}
+
+void PigpiodOutput::pollServerStats()
+{
+    // Extra traffic would skew what the benchmark measures
+    if (connected && linkUp.load() && !benchmark.isThreadRunning())
+        pigpiod.requestServerStats();
+}
+
+StringArray PigpiodOutput::getTargetReport() const
+{
+    StringArray report;
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+    {
+        const PigpiodTarget& target = *targets[i];
+        report.add (target.getHost() + " (" + target.getStatus() + "): "
+                    + formatLatency ("Send", target.getDispatcher().getSendLatency()) + ", "
+                    + formatLatency ("RTT", target.getClient().getRoundTripLatency()) + ", "
+                    + String ((int64) target.getDispatcher().getDroppedCount()) + " dropped, "
+                    + String ((int64) target.getMissedCount()) + " missed");
+    }
+
+    return report;
+}
+
+int PigpiodOutput::getNumTargetsUp() const
+{
+    int numUp = 0;
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        if (targets[i]->isLinkUp())
+            ++numUp;
+
+    return numUp;
+}
+
+bool PigpiodOutput::startAcquisition()
+{
+    // The benchmark's blocking commands would compete with the sender thread
+    if (benchmark.isThreadRunning())
+    {
+        LOGC ("Stopping the benchmark for acquisition");
+        benchmark.stopThread (2000);
+    }
+
+    dispatcher.resetStatistics();
+    pigpiod.resetRoundTripLatency();
+
+    if (connected && linkUp.load())
+        pigpiod.requestServerStats (true);
+
+    numOutageEvents = 0;
+    outageEventCount.store (0);
+    replayedEventCount.store (0);
+    discardedEventCount.store (0);
+
+    eventAge.reset();
+
+    // Coalescing starts afresh: no pin is inside a window, and the counters restart
+    pulseSettings.coalescePolicy = (CoalescePolicy) (int) getParameter ("coalesce")->getValue();
+    router.reset();
+
+    // The sender threads are stopped, so their scheduling can change
+    dispatcher.setThreadSettings (senderSettings);
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        targets[i]->setSenderSettings (senderSettings);
+
+    // A connect still in progress calls this once it is through
+    pulseSettings.schedulePulses = false;
+    timestampEvents = false;
+
     if (connected)
+        startSending();
+
+    return true;
+}
+
+void PigpiodOutput::startSending()
+{
+    pulseSettings.schedulePulses = pulseSettings.scheduleDelayUs > 0 && pigpiod.supportsScheduledPulses();
+    timestampEvents = router.needsEventTimes();
+
+    // Coalescing alone timestamps events too, but its pulses still go out at once
+    if (pulseSettings.scheduleDelayUs > 0 && !pulseSettings.schedulePulses)
+        LOGC ("Server can't schedule pulses; holding each one on this computer until its fixed delay is up");
+
+    prepareTrains();
+    preparePwmRoutes();
+
+    if (pulseSettings.trainPulses > 1 && pulseSettings.trainEngine == TrainEngine::none && !pulseSettings.schedulePulses)
+        LOGC ("Trains need pigpiod waveforms or gpio_server patterns; sending single pulses");
+
+    if (!dispatcher.isThreadRunning())
+        dispatcher.startThread();
+
+    // Each Pi has its own sender thread, so one slow Pi doesn't hold up the others
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        if (!targets[i]->isSending())
+            targets[i]->startAcquisition (pulseSettings.scheduleDelayUs > 0);
+}
+
+bool PigpiodOutput::stopAcquisition()
+{
+    // Stop sending before the pin is forced low, so a queued pulse can't follow it
+    dispatcher.stopThread (1000);
+
+    for (int i = 0; i < router.getNumTargets(); ++i)
+        targets[i]->stopAcquisition();
+
+    LOGC ("TRIG dispatch: ", (int64) dispatcher.getDroppedCount(), " dropped (queue full), ",
+          (int64) dispatcher.getSendErrorCount(), " send errors, queue high-water mark ",
+          dispatcher.getHighWaterMark(), "/", (int) PigpiodDispatcher::queueSize - 1);
+
+    if (const juce::uint64 coalesced = getCoalescedCount())
+    {
+        LOGC ("Coalesced ", (int64) coalesced, " trigger(s):");
+        for (auto& line : getCoalesceReport())
+            LOGC ("  ", line);
+    }
+
+    LOGC ("TRIG latency (us, p50/p99/p99.9/max) over ", (int64) dispatcher.getSendLatency().getCount(), " pulses:");
+    for (auto& line : getLatencyReport())
+        LOGC ("  ", line);
+
+    for (auto& line : getServerStatsReport())
+        LOGC ("  ", line);
+
+    for (auto& line : getTargetReport())
+        LOGC ("  ", line);
+
+    juce::uint64 received, lost, late;
+    if (connected && linkUp.load() && pigpiod.getTransport() != PigpiodClient::Transport::tcp
+        && pigpiod.getServerUdpStats (received, lost, late))
     {
-        int gpio = (int) getParameter ("gpio_pin")->getValue();
-        pigpiod.write (gpio, PI_LOW);
+        LOGC ("UDP: server received ", (int64) received, ", lost ", (int64) lost, ", discarded ", (int64) late,
+              " out of order; client lost ", (int64) pigpiod.getLostReplyCount(), " replies, ",
+              (int64) pigpiod.getStaleReplyCount(), " stale");
     }
 
+    if (getOutageEventCount() > 0)
+        LOGC ("Outages: ", (int64) reconnector.getOutageCount(), " connection loss(es), ",
+              (int64) getOutageEventCount(), " event(s) while down, ", (int64) replayedEventCount.load(),
+              " replayed, ", (int64) discardedEventCount.load(), " discarded");
+
+    // Return GPIO pins to idle
+    if (connected && linkUp.load())
+        resetRoutedPins (true);
+
     return true;
 }
 
 void PigpiodOutput::parameterValueChanged (Parameter* param)
 {
-    if (param->getName().equalsIgnoreCase ("gate_line"))
+    if (param->getName().equalsIgnoreCase ("input_line"))
     {
+        if (DataStream* stream = getDataStream (param->getStreamId()))
+            cacheStreamSettings (stream);
+    }
+    else if (param->getName().equalsIgnoreCase ("gate_line"))
+    {
+        if (DataStream* stream = getDataStream (param->getStreamId()))
+            cacheStreamSettings (stream);
+
         if (int (param->getValue()) == 0)
             gateIsOpen = true;
         else
             gateIsOpen = false;
     }
-    else if (param->getName().equalsIgnoreCase ("gpio_pin"))
+    else if (param->getName().equalsIgnoreCase ("routes"))
     {
-        // Initialize new GPIO pin if connected (required for TRIG to work)
+        if (DataStream* stream = getDataStream (param->getStreamId()))
+            cacheStreamSettings (stream);
+
+        // Initialize newly routed pins if connected (required for TRIG to work)
         if (connected)
-        {
-            int gpio = (int) param->getValue();
+            resetRoutedPins();
 
-            // Initialize GPIO to LOW (WRITE implicitly sets OUTPUT mode)
-            int writeResult = pigpiod.write (gpio, PI_LOW);
-            if (writeResult < 0)
-            {
-                LOGC ("Warning: Failed to initialize GPIO ", gpio, " to LOW: ", writeResult);
-            }
-            else
-            {
-                LOGC ("Changed GPIO pin to ", gpio, " and initialized to LOW");
-            }
+        prepareTrains();
+    }
+    else if (param->getName().equalsIgnoreCase ("schedule_delay")
+             || param->getName().equalsIgnoreCase ("outage_buffer")
+             || param->getName().equalsIgnoreCase ("refractory")
+             || param->getName().startsWithIgnoreCase ("sender_"))
+    {
+        cacheProcessorSettings();
+    }
+    else if (param->getName().equalsIgnoreCase ("train_pulses")
+             || param->getName().equalsIgnoreCase ("train_rate"))
+    {
+        // Every waveform encodes the old train, so start over
+        clearTrains();
+        cacheProcessorSettings();
+        prepareTrains();
+    }
+    else if (param->getName().equalsIgnoreCase ("pulse_duration")
+             || param->getName().equalsIgnoreCase ("gpio_pin"))
+    {
+        cacheProcessorSettings();
+
+        for (auto stream : getDataStreams())
+            cacheStreamSettings (stream);
+
+        // Initialize new GPIO pin if connected (required for TRIG to work)
+        if (connected && param->getName().equalsIgnoreCase ("gpio_pin"))
+        {
+            LOGC ("Changed GPIO pin to ", gpioPin);
+            resetRoutedPins();
         }
+
+        prepareTrains();
     }
 }
 
 void PigpiodOutput::process (AudioBuffer<float>& buffer)
 {
+    // Reference point for event times: the block's last sample has only just been acquired
+    blockStartTicks = Time::getHighResolutionTicks();
+
+    if (timestampEvents)
+    {
+        for (auto streamId : streamIds)
+            streamSettings[streamId].blockEndSample = getFirstSampleNumberForBlock (streamId)
+                                                      + getNumSamplesInBlock (streamId);
+    }
+
+    // Events kept during an outage go out first, once the link is back
+    if (numOutageEvents > 0 && linkUp.load (std::memory_order_acquire))
+        replayOutageEvents();
+
     checkForEvents();
+
+    // Merged and extended pulses go out once the whole block has been seen, then one wake-up per sender
+    router.flush (linkUp.load (std::memory_order_acquire));
 }
 
 void PigpiodOutput::handleTTLEvent (TTLEventPtr event)
@@ -195,11 +990,16 @@ void PigpiodOutput::handleTTLEvent (TTLEventPtr event)
     if (!connected)
         return;
 
+    const uint16 streamId = event->getStreamId();
+
+    if (streamId >= streamSettings.size())
+        return;
+
+    const StreamSettings& settings = streamSettings[streamId];
     const int eventBit = event->getLine() + 1;
-    DataStream* stream = getDataStream (event->getStreamId());
 
     // Handle gate line
-    if (eventBit == int ((*stream)["gate_line"]))
+    if (eventBit == settings.gateLine)
     {
         if (event->getState())
             gateIsOpen = true;
@@ -207,31 +1007,103 @@ void PigpiodOutput::handleTTLEvent (TTLEventPtr event)
             gateIsOpen = false;
     }
 
-    // Handle input line (trigger)
-    if (gateIsOpen)
+    const int line = event->getLine();
+
+    if (line >= maxRoutedLines)
+        return;
+
+    // An event's age is how many samples of the block came after it; the
+    // earliest event in a block is a whole block older than the latest
+    const int64 eventTicks = timestampEvents
+        ? blockStartTicks - (int64) ((double) (settings.blockEndSample - event->getSampleNumber()) * settings.ticksPerSample)
+        : 0;
+
+    // Falling edges stop PWM routes, even with the gate closed
+    if (!event->getState())
     {
-        if (eventBit == int ((*stream)["input_line"]))
-        {
-            if (event->getState()) // Rising edge
-            {
-                auto t1 = juce::Time::getHighResolutionTicks();
+        router.releaseEvent (settings.routes + line * maxRoutesPerLine, eventTicks,
+                             linkUp.load (std::memory_order_acquire));
+        return;
+    }
+
+    // Handle routed lines (trigger)
+    if (gateIsOpen) // Rising edge
+    {
+        if (timestampEvents)
+            eventAge.record ((juce::uint64) ((double) jmax ((int64) 0, blockStartTicks - eventTicks)
+                                             * 1.0e9 / (double) Time::getHighResolutionTicksPerSecond()));
+
+        const bool missed = router.routeEvent (settings.routes + line * maxRoutesPerLine, eventTicks,
+                                               linkUp.load (std::memory_order_acquire));
 
-                int gpio = (int) getParameter ("gpio_pin")->getValue();
-                int pulseDurationUs = (int) getParameter ("pulse_duration")->getValue();
+        // During an outage nothing reaches the socket; keep the event for replay if asked to
+        if (missed)
+            bufferOutageEvent (streamId, line);
+    }
+}
+
+StringArray PigpiodOutput::getCoalesceReport() const
+{
+    StringArray report;
 
-                // Trigger pulse using pigpiod TRIG command
-                int result = pigpiod.trig (gpio, pulseDurationUs);
+    for (int i = 0; i < PigpiodRouter::numPinStates; ++i)
+    {
+        const juce::uint64 count = router.getCoalescedCount (i);
 
-                auto t2 = juce::Time::getHighResolutionTicks();
-                double latencyMs = juce::Time::highResolutionTicksToSeconds(t2 - t1) * 1000.0;
+        if (count == 0)
+            continue;
 
-                LOGC ("TRIG latency: ", String(latencyMs, 3), " ms");
+        const int target = i / PigpiodRouter::numPinsPerPi - 1;
+        const String host = target >= 0 && target < router.getNumTargets()
+            ? "@" + targets[target]->getHost()
+            : String();
 
-                if (result < 0)
-                {
-                    LOGC ("Failed to trigger GPIO pulse: ", result);
-                }
-            }
+        report.add ("GPIO " + String (i % PigpiodRouter::numPinsPerPi) + host + ": " + String ((int64) count) + " coalesced");
+    }
+
+    return report;
+}
+
+void PigpiodOutput::bufferOutageEvent (uint16 streamId, int line)
+{
+    outageEventCount.fetch_add (1, std::memory_order_relaxed);
+
+    if (outageBufferMs <= 0)
+        return;
+
+    if (numOutageEvents == maxOutageEvents)
+    {
+        discardedEventCount.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+
+    outageEvents[numOutageEvents++] = { streamId, line, blockStartTicks };
+}
+
+void PigpiodOutput::replayOutageEvents()
+{
+    // Replayed pulses fire on arrival: their scheduled time has long passed
+    const int64 maxAgeTicks = (int64) ((double) outageBufferMs * 1.0e-3 * (double) Time::getHighResolutionTicksPerSecond());
+
+    for (int i = 0; i < numOutageEvents; ++i)
+    {
+        const OutageEvent& event = outageEvents[i];
+
+        if (blockStartTicks - event.ticks > maxAgeTicks || event.streamId >= streamSettings.size())
+        {
+            discardedEventCount.fetch_add (1, std::memory_order_relaxed);
+            continue;
         }
+
+        // Other Pis weren't affected by the outage and already had their pulses
+        const Route* routes = streamSettings[event.streamId].routes + event.line * maxRoutesPerLine;
+
+        for (int r = 0; r < maxRoutesPerLine && routes[r].gpio >= 0; ++r)
+            if (routes[r].target < 0 && routes[r].pwm == PwmMode::none)
+                router.triggerRoute (routes[r], 0);
+
+        replayedEventCount.fetch_add (1, std::memory_order_relaxed);
     }
+
+    numOutageEvents = 0;
 }
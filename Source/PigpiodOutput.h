@@ -26,16 +26,27 @@
 
 #include <ProcessorHeaders.h>
 #include "PigpiodClient.h"
+#include "PigpiodBenchmark.h"
+#include "PigpiodDispatcher.h"
+#include "PigpiodReconnector.h"
+#include "PigpiodRouter.h"
+#include "PigpiodTarget.h"
+
+#include <map>
+#include <tuple>
 
 /**
 
     Provides a network interface to a Raspberry Pi running pigpiod.
 
-    Sends GPIO trigger pulses via the pigpiod daemon.
+    Sends GPIO trigger pulses via the pigpiod daemon. Routes can also name
+    pins on other Pis, each reached through its own PigpiodTarget.
 
     @see GenericProcessor
  */
-class PigpiodOutput : public GenericProcessor
+class PigpiodOutput : public GenericProcessor,
+                      private PigpiodReconnector::Listener,
+                      private AsyncUpdater
 {
 public:
     /** Constructor */
@@ -59,14 +70,23 @@ public:
     /** Called when settings need to be updated. */
     void updateSettings() override;
 
+    /** Called immediately before the start of data acquisition. */
+    bool startAcquisition() override;
+
     /** Called immediately after the end of data acquisition. */
     bool stopAcquisition() override;
 
     /** Creates the PigpiodOutputEditor. */
     AudioProcessorEditor* createEditor() override;
 
-    /** Connect to pigpiod daemon */
-    bool connectToPigpiod();
+    /** Starts connecting to pigpiod in the background
+     *
+     * Returns at once; isConnecting() is true until the attempt succeeds or
+     * fails, and getConnectionStatus() then says which. The "hostname"
+     * parameter may list several hosts separated by commas, in which case the
+     * first to answer is used.
+     */
+    void connectToPigpiod();
 
     /** Disconnect from pigpiod daemon */
     void disconnectFromPigpiod();
@@ -74,18 +94,259 @@ public:
     /** Get connection status */
     bool isConnectedToPigpiod() const;
 
+    /** True while a connection started by connectToPigpiod() is being made */
+    bool isConnecting() const;
+
+    /** True while a lost connection is being re-established in the background */
+    bool isReconnecting() const;
+
     /** Get connection status message */
     String getConnectionStatus() const;
 
+    /** Reconnect state and outage statistics */
+    const PigpiodReconnector& getReconnector() const { return reconnector; }
+
+    /** Triggers that arrived while the connection was down, since acquisition started */
+    juce::uint64 getOutageEventCount() const
+    {
+        return outageEventCount.load (std::memory_order_relaxed) + router.getMissedCount();
+    }
+
+    /** Fires the "bench_pulses" test pulses on the GPIO pin in the background
+     *
+     * Needs a connection and acquisition to be stopped; the "loopback_pin"
+     * parameter adds edge times on gpio_server.
+     *
+     * @return false if a run couldn't start
+     */
+    bool startBenchmark();
+
+    /** Stops a benchmark run, keeping the pulses measured so far */
+    void stopBenchmark();
+
+    /** True while a benchmark run is in progress */
+    bool isBenchmarkRunning() const { return benchmark.isThreadRunning(); }
+
+    /** Results of the current (or last) benchmark run */
+    const PigpiodBenchmark& getBenchmark() const { return benchmark; }
+
     /** Get reference to pigpiod client (for test button) */
     PigpiodClient& getPigpiodClient() { return pigpiod; }
 
+    /** Get reference to the TRIG dispatcher (for queue statistics) */
+    const PigpiodDispatcher& getDispatcher() const { return dispatcher; }
+
+    /** Formats one histogram as "name p50/p99/p99.9/max" in microseconds */
+    static String formatLatency (const String& name, const LatencyHistogram& histogram);
+
+    /** Send, round-trip and event-to-send latency summary, one histogram per line */
+    StringArray getLatencyReport() const;
+
+    /** gpio_server's own receipt-to-pin, overrun and pulse-width error histograms, as of the last poll */
+    StringArray getServerStatsReport() const;
+
+    /** Asks the main gpio_server for its telemetry without waiting (message thread; editor timer) */
+    void pollServerStats();
+
+    /** One line per additional Pi: host, state, send and round-trip latency, misses */
+    StringArray getTargetReport() const;
+
+    /** Number of additional Pis named by routes */
+    int getNumTargets() const { return router.getNumTargets(); }
+
+    /** Number of additional Pis whose link is up */
+    int getNumTargetsUp() const;
+
+    /** Triggers dropped or folded into another pulse by coalescing, over all pins */
+    juce::uint64 getCoalescedCount() const { return router.getCoalescedCount(); }
+
+    /** One line per pin that coalesced triggers: "GPIO n[@host]: count" */
+    StringArray getCoalesceReport() const;
+
 private:
+    using Route = PigpiodRouter::Route;
+    using CoalescePolicy = PigpiodRouter::CoalescePolicy;
+    using TrainEngine = PigpiodRouter::TrainEngine;
+    using PwmMode = PigpiodRouter::PwmMode;
+
+    static constexpr int maxRoutedLines = PigpiodRouter::maxRoutedLines;
+    static constexpr int maxRoutesPerLine = PigpiodRouter::maxRoutesPerLine;
+
+    /** Largest number of pulses in one train */
+    static constexpr int maxTrainPulses = 100;
+
+    /** Per-stream trigger settings, snapshotted from the stream parameters */
+    struct StreamSettings
+    {
+        /** TTL line (1-based) that gates the output; 0 for no gate */
+        int gateLine = 0;
+
+        /** Routes for each TTL line (0-based), maxRoutesPerLine slots per line; the first unused slot has gpio -1 */
+        Route routes[maxRoutedLines * maxRoutesPerLine];
+
+        /** High resolution ticks per sample (from the stream's sample rate) */
+        double ticksPerSample = 0.0;
+
+        /** Sample number just past the last sample in the current block (set in process) */
+        int64 blockEndSample = 0;
+    };
+
+    /** Candidate hosts from the "hostname" parameter */
+    StringArray getHostnameCandidates() const;
+
+    /** Transport selected by the "transport" parameter */
+    PigpiodClient::Transport getTransportSetting() const;
+
+    /** Fills a PigpiodTarget::numPins table with the idle level of every pin routed to one Pi
+     *
+     * @param target Target index, or -1 for the main connection
+     */
+    void computeIdleLevels (int target, int* idleLevel) const;
+
+    /** Adds Pis that routes newly name to the pool and sends every target its pins (message thread) */
+    void updateTargets();
+
+    /** Stops PWM routes' PWM and drives every routed GPIO pin to its idle level (blocking)
+     *
+     * @param pinsAreOutputs true if the pins were already initialised and may be
+     *        mid-pulse, in which case they are all reset
+     */
+    void resetRoutedPins (bool pinsAreOutputs = false);
+
+    /** Sets the frequency and range of every software PWM route's pin (blocking)
+     *
+     * The server keeps them, so a rising edge then costs a single PWM command.
+     */
+    void preparePwmRoutes();
+
+    /** Re-reads the stream parameters of one stream into streamSettings */
+    void cacheStreamSettings (DataStream* stream);
+
+    /** Re-reads the processor parameters used on the event path */
+    void cacheProcessorSettings();
+
+    /** Stores every routed train that isn't on the server yet (blocking)
+     *
+     * With pigpiod each train is uploaded once (WVAG/WVCRE) and then costs a
+     * single WVTX per trigger, with pulse timing from the Pi's DMA engine.
+     * gpio_server keeps it in its pattern library instead (PATDEF), played
+     * by one PATPLAY from the server's pulse thread.
+     */
+    void prepareTrains();
+
+    /** Looks up the stored train for a route (-1 if there is none) */
+    int findCachedTrain (const Route& route) const;
+
+    /** Uploads a route's train as a pigpiod waveform (blocking; -1 on failure) */
+    int createTrainWave (const Route& route);
+
+    /** Uploads a route's train as a gpio_server pattern (blocking; -1 on failure) */
+    int createTrainPattern (const Route& route);
+
+    /** Forgets stored trains, clearing pigpiod's waveforms if any were created */
+    void clearTrains();
+
+    /** Counts a trigger that arrived during an outage and keeps it if buffering is on (audio thread) */
+    void bufferOutageEvent (uint16 streamId, int line);
+
+    /** Sends the triggers kept during an outage that haven't expired (audio thread) */
+    void replayOutageEvents();
+
+    /** PigpiodReconnector::Listener */
+    void connectionLost() override;
+    void connectionRestored() override;
+    void connectionFailed() override;
+
+    /** Sets up the server once the first connection is made (message thread) */
+    void finishConnecting();
+
+    /** Decides how pulses are timed and starts the sender threads that aren't running yet
+     *
+     * Called at acquisition start, and when a connection comes up while acquiring.
+     */
+    void startSending();
+
+    /** Reports an outage, or sets the server up again after one (message thread) */
+    void handleAsyncUpdate() override;
+
+    /** Most triggers kept for replay during one outage */
+    static constexpr int maxOutageEvents = 256;
+
+    /** A trigger that arrived while the connection was down */
+    struct OutageEvent
+    {
+        uint16 streamId;
+        int line;
+        int64 ticks;
+    };
+
+    /** Hot-path settings, indexed by stream ID (rebuilt in updateSettings) */
+    std::vector<StreamSettings> streamSettings;
+
+    /** IDs of the streams in streamSettings, so process() needn't copy getDataStreams() */
+    std::vector<uint16> streamIds;
+
+    /** Tick count at the start of the current process() call */
+    int64 blockStartTicks;
+
+    /** True if handleTTLEvent needs event times (a fixed delay or coalescing is set) */
+    bool timestampEvents;
+
+    /** Time from each event's sample being acquired to handleTTLEvent seeing it (audio thread writes) */
+    LatencyHistogram eventAge;
+
+    /** Cached "gpio_pin" parameter (routed from each stream's "input_line") */
+    int gpioPin;
+
+    /** Cached "pulse_duration" parameter (microseconds) */
+    int pulseDurationUs;
+
+    /** Stored train IDs by (gpio, pulse length, level), for the current train settings */
+    std::map<std::tuple<int, int, int>, int> trainCache;
+
+    /** Next free gpio_server pattern ID */
+    int nextPatternId;
+
     /** pigpiod client */
     PigpiodClient pigpiod;
 
-    /** Connection state */
+    /** Sends TRIG frames queued by handleTTLEvent on its own thread */
+    PigpiodDispatcher dispatcher;
+
+    /** Cached timing, coalescing and train parameters, plus what acquisition start decided from them */
+    PigpiodRouter::Settings pulseSettings;
+
+    /** Turns each routed rising edge into queued pulses (declared after dispatcher and pulseSettings) */
+    PigpiodRouter router;
+
+    /** "sender_cpu", "sender_priority" and "sender_wait"; given to every sender thread at acquisition start */
+    PigpiodDispatcher::ThreadSettings senderSettings;
+
+    /** Loopback latency measurement, started from the editor */
+    PigpiodBenchmark benchmark;
+
+    /** Connection state: true from a successful connect until the user disconnects */
     bool connected;
+
+    /** True from connectToPigpiod() until the attempt succeeds, fails or is cancelled */
+    bool connectPending;
+
+    /** False while the link is down or being set up again; gates the hot path */
+    std::atomic<bool> linkUp;
+
+    /** Cached "outage_buffer" parameter (milliseconds); 0 only counts events during outages */
+    int outageBufferMs;
+
+    /** Triggers kept during the current outage (audio thread only) */
+    OutageEvent outageEvents[maxOutageEvents];
+    int numOutageEvents;
+
+    std::atomic<juce::uint64> outageEventCount;
+    std::atomic<juce::uint64> replayedEventCount;
+
+    /** Kept triggers that expired, or didn't fit in outageEvents */
+    std::atomic<juce::uint64> discardedEventCount;
+
     String connectionStatus;
 
     /** Gate state */
@@ -97,6 +358,15 @@ private:
     /** Port for pigpiod */
     int pigpiodPort;
 
+    /** Re-establishes a dropped connection (declared after pigpiod, which it uses) */
+    PigpiodReconnector reconnector;
+
+    /** Additional Pis; the pool only grows, so the audio thread can index it without a lock */
+    std::unique_ptr<PigpiodTarget> targets[PigpiodRouter::maxTargets];
+
+    /** Hosts of targets[] and of Pis named since, by target index (message thread) */
+    StringArray targetHosts;
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodOutput);
 };
 
@@ -27,7 +27,7 @@
 PigpiodOutputEditor::PigpiodOutputEditor (GenericProcessor* parentNode)
     : GenericEditor (parentNode)
 {
-    desiredWidth = 340;
+    desiredWidth = 1140;
 
     // Column 1: Connection settings
     // Hostname/IP input (text)
@@ -67,6 +67,53 @@ PigpiodOutputEditor::PigpiodOutputEditor (GenericProcessor* parentNode)
     // Gate line
     addComboBoxParameterEditor (Parameter::STREAM_SCOPE, "gate_line", 175, 104);
 
+    // Column 3: Additional routes (line:gpio[@host][:us[:high|low]], ...)
+    addTextBoxParameterEditor (Parameter::STREAM_SCOPE, "routes", 335, 29);
+
+    // Fixed event-to-pulse delay (scheduled pulses)
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "schedule_delay", 335, 54);
+
+    // TCP, or UDP to gpio_server (applies on the next connect)
+    addComboBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "transport", 335, 79);
+
+    // Column 4: Pulse trains (pigpiod waveforms, or scheduled pulses on gpio_server)
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "train_pulses", 495, 29);
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "train_rate", 495, 54);
+
+    // Replay window for events that arrive while reconnecting
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "outage_buffer", 495, 79);
+
+    // Chattering inputs
+    addComboBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "coalesce", 335, 104);
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "refractory", 495, 104);
+
+    // Column 5: Loopback benchmark
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "bench_pulses", 655, 29);
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "bench_rate", 655, 54);
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "loopback_pin", 655, 79);
+
+    // Column 6: Sender thread scheduling (applies at acquisition start)
+    addTextBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "sender_cpu", 815, 29);
+    addComboBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "sender_priority", 815, 54);
+    addComboBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "sender_wait", 815, 79);
+
+    // pigpiod commands or gpio_server's compact frames (applies on the next connect)
+    addComboBoxParameterEditor (Parameter::PROCESSOR_SCOPE, "protocol", 815, 104);
+
+    // Bench button (hidden until connected)
+    benchButton = std::make_unique<UtilityButton> ("BENCH");
+    benchButton->setBounds (655, 104, 80, 20);
+    benchButton->addListener (this);
+    addChildComponent (benchButton.get());
+
+    // Column 7: Latency statistics (p50/p99/p99.9/max, microseconds)
+    latencyLabel = std::make_unique<Label> ("Latency", "");
+    latencyLabel->setBounds (975, 29, 160, 95);
+    latencyLabel->setFont (Font (FontOptions (12.0f)));
+    latencyLabel->setJustificationType (Justification::topLeft);
+    latencyLabel->setColour (Label::textColourId, Colours::grey);
+    addAndMakeVisible (latencyLabel.get());
+
     // Start timer to update connection status
     startTimer (500); // Update every 500ms
 
@@ -80,9 +127,9 @@ void PigpiodOutputEditor::buttonClicked (Button* button)
 
     if (button == connectButton.get())
     {
-        if (processor->isConnectedToPigpiod())
+        if (processor->isConnectedToPigpiod() || processor->isConnecting() || processor->isReconnecting())
         {
-            // Disconnect
+            // Disconnect (or give up connecting)
             processor->disconnectFromPigpiod();
         }
         else
@@ -93,6 +140,23 @@ void PigpiodOutputEditor::buttonClicked (Button* button)
 
         updateConnectionStatus();
     }
+    else if (button == benchButton.get())
+    {
+        if (processor->isBenchmarkRunning())
+        {
+            processor->stopBenchmark();
+        }
+        else if (processor->startBenchmark())
+        {
+            benchmarkPending = true;
+        }
+        else
+        {
+            CoreServices::sendStatusMessage ("Benchmark needs a connection, with acquisition stopped");
+        }
+
+        updateConnectionStatus();
+    }
     else if (button == testButton.get())
     {
         // Trigger a test pulse
@@ -128,17 +192,108 @@ void PigpiodOutputEditor::buttonClicked (Button* button)
 void PigpiodOutputEditor::timerCallback()
 {
     updateConnectionStatus();
+    updateLatencyStats();
+
+    PigpiodOutput* processor = (PigpiodOutput*) getProcessor();
+
+    // Show the histograms once a run has finished
+    if (benchmarkPending && !processor->isBenchmarkRunning())
+    {
+        benchmarkPending = false;
+        const PigpiodBenchmark& benchmark = processor->getBenchmark();
+
+        LOGC ("Benchmark done: ", (int) benchmark.getSamples().size(), " pulses; ",
+              PigpiodOutput::formatLatency ("send", benchmark.getSendLatency()), ", ",
+              PigpiodOutput::formatLatency ("RTT", benchmark.getRoundTripLatency()), ", ",
+              PigpiodOutput::formatLatency ("edge", benchmark.getEdgeLatency()), " (us, p50/p99/p99.9/max)");
+
+        if (!benchmark.getSamples().empty())
+        {
+            auto view = std::make_unique<PigpiodBenchmarkView> (benchmark);
+            CallOutBox::launchAsynchronously (std::move (view), benchButton->getBounds(), this);
+        }
+    }
+}
+
+void PigpiodOutputEditor::updateLatencyStats()
+{
+    PigpiodOutput* processor = (PigpiodOutput*) getProcessor();
+
+    // The replies arrive on the reader thread in time for the next update
+    processor->pollServerStats();
+
+    StringArray lines;
+    lines.add ("p50/p99/p99.9/max us");
+    lines.add (processor->getLatencyReport().joinIntoString ("\n"));
+
+    const PigpiodDispatcher& dispatcher = processor->getDispatcher();
+    lines.add ("Drops " + String ((int64) dispatcher.getDroppedCount())
+               + "  Peak " + String (dispatcher.getHighWaterMark())
+               + "  Late " + String ((int64) processor->getPigpiodClient().getLateReplyCount())
+               + (processor->getPigpiodClient().getTransport() != PigpiodClient::Transport::tcp
+                      ? "  Lost " + String ((int64) processor->getPigpiodClient().getLostReplyCount())
+                      : String()));
+
+    if (processor->getReconnector().getOutageCount() > 0)
+        lines.add ("Outages " + String ((int64) processor->getReconnector().getOutageCount())
+                   + "  Missed " + String ((int64) processor->getOutageEventCount()));
+
+    const ClockModel& clock = processor->getPigpiodClient().getClockModel();
+    if (clock.isValid())
+        lines.add ("Clock RTT " + String (clock.getLastRoundTripUs(), 0)
+                   + "  +/-" + String (clock.getUncertaintyUs(), 0)
+                   + "  " + String (clock.getSkewPpm(), 1) + " ppm");
+
+    // Other Pis get one summary line; their per-Pi latency is in the tooltip
+    if (processor->getNumTargets() > 0)
+        lines.add ("Other Pis " + String (processor->getNumTargetsUp()) + "/" + String (processor->getNumTargets()) + " up");
+
+    if (const juce::uint64 coalesced = processor->getCoalescedCount())
+        lines.add ("Coalesced " + String ((int64) coalesced));
+
+    latencyLabel->setText (lines.joinIntoString ("\n"), dontSendNotification);
+
+    // Server-side, per-Pi and per-pin detail doesn't fit in the label
+    StringArray details = processor->getServerStatsReport();
+    details.addArray (processor->getTargetReport());
+    details.addArray (processor->getCoalesceReport());
+    latencyLabel->setTooltip (details.joinIntoString ("\n"));
 }
 
 void PigpiodOutputEditor::updateConnectionStatus()
 {
     PigpiodOutput* processor = (PigpiodOutput*) getProcessor();
 
-    if (processor->isConnectedToPigpiod())
+    if (processor->isConnecting())
+    {
+        connectButton->setLabel ("CONNECTING");
+        testButton->setVisible (false);
+        statusLabel->setText (processor->getConnectionStatus(), dontSendNotification);
+        statusLabel->setColour (Label::textColourId, Colours::grey);
+    }
+    else if (processor->isReconnecting())
+    {
+        connectButton->setLabel ("RETRYING");
+        testButton->setVisible (false);
+        statusLabel->setText (processor->getConnectionStatus(), dontSendNotification);
+        statusLabel->setColour (Label::textColourId, Colours::orange);
+    }
+    else if (processor->isConnectedToPigpiod())
     {
         connectButton->setLabel ("CONNECTED");
         testButton->setVisible (true);
-        statusLabel->setText ("", dontSendNotification);
+
+        if (processor->isBenchmarkRunning())
+        {
+            const PigpiodBenchmark& benchmark = processor->getBenchmark();
+            statusLabel->setText (String (benchmark.getProgress()) + "/" + String (benchmark.getNumPulses()),
+                                  dontSendNotification);
+            statusLabel->setColour (Label::textColourId, Colours::grey);
+        }
+        else
+        {
+            statusLabel->setText ("", dontSendNotification);
+        }
     }
     else
     {
@@ -147,4 +302,118 @@ void PigpiodOutputEditor::updateConnectionStatus()
         statusLabel->setText (processor->getConnectionStatus(), dontSendNotification);
         statusLabel->setColour (Label::textColourId, Colours::grey);
     }
+
+    benchButton->setVisible (processor->isConnectedToPigpiod() && !processor->isReconnecting());
+    benchButton->setLabel (processor->isBenchmarkRunning() ? "STOP" : "BENCH");
+}
+
+PigpiodBenchmarkView::PigpiodBenchmarkView (const PigpiodBenchmark& benchmark_)
+    : benchmark (benchmark_)
+{
+    saveButton = std::make_unique<UtilityButton> ("SAVE CSV");
+    saveButton->setBounds (330, 296, 80, 20);
+    saveButton->addListener (this);
+    addAndMakeVisible (saveButton.get());
+
+    setSize (420, 324);
+}
+
+void PigpiodBenchmarkView::paint (Graphics& g)
+{
+    g.fillAll (Colours::darkgrey);
+
+    g.setColour (Colours::white);
+    g.setFont (Font (FontOptions (14.0f)));
+    g.drawText (String ((int) benchmark.getSamples().size()) + " pulses (us: p50/p99/p99.9/max)",
+                10, 4, 400, 18, Justification::centredLeft);
+
+    paintHistogram (g, "Send", benchmark.getSendLatency(), Rectangle<int> (10, 26, 400, 86));
+    paintHistogram (g, "RTT", benchmark.getRoundTripLatency(), Rectangle<int> (10, 116, 400, 86));
+
+    if (benchmark.getEdgeLatency().getCount() > 0)
+    {
+        paintHistogram (g, "Edge", benchmark.getEdgeLatency(), Rectangle<int> (10, 206, 400, 86));
+    }
+    else
+    {
+        g.setColour (Colours::lightgrey);
+        g.setFont (Font (FontOptions (12.0f)));
+        g.drawText ("No edge times: " + benchmark.getEdgeNote(), 10, 206, 400, 20, Justification::centredLeft);
+    }
+}
+
+void PigpiodBenchmarkView::paintHistogram (Graphics& g, const String& name, const LatencyHistogram& histogram,
+                                           Rectangle<int> area)
+{
+    g.setColour (Colours::lightgrey);
+    g.setFont (Font (FontOptions (12.0f)));
+    g.drawText (PigpiodOutput::formatLatency (name, histogram), area.getX(), area.getY(), area.getWidth(), 16,
+                Justification::centredLeft);
+
+    if (histogram.getCount() == 0)
+        return;
+
+    // Only the occupied range of buckets is drawn, one bar per bucket
+    int first = LatencyHistogram::numBuckets, last = 0;
+    juce::uint64 tallest = 1;
+
+    for (int i = 0; i < LatencyHistogram::numBuckets; ++i)
+    {
+        const juce::uint64 count = histogram.getBucketCount (i);
+
+        if (count > 0)
+        {
+            first = jmin (first, i);
+            last = i;
+            tallest = jmax (tallest, count);
+        }
+    }
+
+    const int plotY = area.getY() + 18;
+    const int plotHeight = area.getHeight() - 32;
+    const float barWidth = (float) area.getWidth() / (float) (last - first + 1);
+
+    g.setColour (Colours::orange);
+
+    for (int i = first; i <= last; ++i)
+    {
+        const float height = (float) plotHeight * (float) histogram.getBucketCount (i) / (float) tallest;
+        g.fillRect ((float) area.getX() + (float) (i - first) * barWidth, (float) (plotY + plotHeight) - height,
+                    jmax (1.0f, barWidth - 1.0f), height);
+    }
+
+    // Bucket bounds under the ends of the axis
+    auto us = [] (juce::uint64 ns) { return String ((double) ns / 1000.0, 1); };
+
+    g.setColour (Colours::lightgrey);
+    g.drawText (us (LatencyHistogram::bucketLowerBound (first)), area.getX(), plotY + plotHeight, 100, 14,
+                Justification::centredLeft);
+    g.drawText (us (LatencyHistogram::bucketLowerBound (last + 1)), area.getRight() - 100, plotY + plotHeight, 100, 14,
+                Justification::centredRight);
+}
+
+void PigpiodBenchmarkView::buttonClicked (Button* button)
+{
+    if (button != saveButton.get())
+        return;
+
+    chooser = std::make_unique<FileChooser> ("Save benchmark results",
+                                             CoreServices::getDefaultUserSaveDirectory().getChildFile ("pigpiod_benchmark.csv"),
+                                             "*.csv");
+
+    // Async, so the message thread keeps running while the dialog is open
+    chooser->launchAsync (FileBrowserComponent::saveMode | FileBrowserComponent::canSelectFiles
+                              | FileBrowserComponent::warnAboutOverwriting,
+                          [this] (const FileChooser& fc)
+                          {
+                              const File file = fc.getResult();
+
+                              if (file == File())
+                                  return;
+
+                              if (benchmark.writeCsv (file))
+                                  CoreServices::sendStatusMessage ("Saved benchmark results to " + file.getFullPathName());
+                              else
+                                  CoreServices::sendStatusMessage ("Failed to write " + file.getFullPathName());
+                          });
 }
@@ -27,6 +27,41 @@
 #include "PigpiodOutput.h"
 #include <EditorHeaders.h>
 
+/**
+
+  Histograms of a benchmark run, shown in a call-out box when it finishes.
+
+  One row each for send time, round trip and loopback edge latency, with a
+  button to save the per-pulse results as CSV.
+
+*/
+
+class PigpiodBenchmarkView : public Component, public Button::Listener
+{
+public:
+    /** Constructor */
+    PigpiodBenchmarkView (const PigpiodBenchmark& benchmark);
+
+    /** Draws the histograms */
+    void paint (Graphics& g) override;
+
+    /** Called when the save button is clicked */
+    void buttonClicked (Button* button) override;
+
+private:
+    /** Draws one histogram with its percentiles into a row */
+    static void paintHistogram (Graphics& g, const String& name, const LatencyHistogram& histogram,
+                                Rectangle<int> area);
+
+    const PigpiodBenchmark& benchmark;
+    std::unique_ptr<UtilityButton> saveButton;
+
+    /** Open while the save dialog is up; deleting it closes the dialog */
+    std::unique_ptr<FileChooser> chooser;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodBenchmarkView);
+};
+
 /**
 
   User interface for the PigpiodOutput processor.
@@ -55,9 +90,17 @@ private:
     /** Update the connection status label */
     void updateConnectionStatus();
 
+    /** Update the latency statistics label */
+    void updateLatencyStats();
+
     std::unique_ptr<UtilityButton> connectButton;
     std::unique_ptr<UtilityButton> testButton;
+    std::unique_ptr<UtilityButton> benchButton;
     std::unique_ptr<Label> statusLabel;
+    std::unique_ptr<Label> latencyLabel;
+
+    /** True from starting a benchmark until its results are shown */
+    bool benchmarkPending = false;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodOutputEditor);
 };
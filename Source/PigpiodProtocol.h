@@ -0,0 +1,432 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// pigpiod socket interface command codes
+#define PI_CMD_MODES 0   // Set GPIO mode
+#define PI_CMD_PIGPV 26  // Get pigpio version
+#define PI_CMD_READ 3    // Read GPIO level
+#define PI_CMD_WRITE 4   // Write GPIO level
+#define PI_CMD_PWM 5     // Set a pin's PWM duty cycle (0 = off)
+#define PI_CMD_PRS 6     // Set a pin's PWM range (the full-on duty cycle)
+#define PI_CMD_PFS 7     // Set a pin's PWM frequency
+#define PI_CMD_BC1 12    // Clear GPIO 0-31 in one register write
+#define PI_CMD_BS1 14    // Set GPIO 0-31 in one register write
+#define PI_CMD_TICK 16   // Read the 32-bit microsecond tick
+#define PI_CMD_TRIG 37   // Trigger pulse
+#define PI_CMD_HP 86     // Hardware PWM on the PWM peripheral's pins (duty cycle in the extension)
+
+// pigpiod waveforms: pulses are uploaded once, then played by the Pi's DMA engine
+#define PI_CMD_WVCLR 27  // Clear all waveforms
+#define PI_CMD_WVAG 28   // Add generic pulses to the waveform being built
+#define PI_CMD_WVHLT 33  // Stop the current waveform
+#define PI_CMD_WVCRE 49  // Create a waveform from the pulses added, returns its ID
+#define PI_CMD_WVDEL 50  // Delete a waveform
+#define PI_CMD_WVTX 51   // Transmit a waveform once
+
+// gpio_server extensions (raspberry-pi/gpio_server.c); pigpiod rejects these
+#define GS_CMD_TRIGAT 200  // Trigger pulse at a server clock time
+#define GS_CMD_TIME 201    // Read server clock (CLOCK_MONOTONIC, microseconds)
+#define GS_CMD_UDPSTATS 202 // Read the server's UDP loss counters
+#define GS_CMD_BATCH 203   // Run several commands from one extension in one pass
+#define GS_CMD_SHMATTACH 204 // Use the shared-memory ring (same host only)
+#define GS_CMD_PATDEF 205  // Upload (part of) a stored multi-pin pattern
+#define GS_CMD_PATPLAY 206 // Play a stored pattern, now or at a server clock time
+#define GS_CMD_EDGE 207    // Watch a pin and read back its edge timestamps
+#define GS_CMD_EDGESTREAM 208 // Start or stop streaming the edges of a pin mask
+#define GS_CMD_EDGEREAD 209 // Read streamed edge records (the reply carries an extension)
+#define GS_CMD_HELLO 210   // Negotiate the protocol version and read the server's capabilities
+#define GS_CMD_FRAME 211   // Reply code of a compact frame that asked for a reply (never sent)
+#define GS_CMD_STATS 212   // Read (and optionally reset) one of the server's telemetry histograms
+
+// gpio_server protocol versions (HELLO)
+#define GS_PROTOCOL_PIGPIOD 1 // 16-byte pigpiod commands
+#define GS_PROTOCOL_COMPACT 2 // varint-packed frames of several ops (TCP only)
+
+// gpio_server capability bits (HELLO reply p1)
+#define GS_CAP_BATCH 0x01     // BATCH
+#define GS_CAP_SCHEDULE 0x02  // TIME and TRIGAT
+#define GS_CAP_PATTERNS 0x04  // PATDEF and PATPLAY
+#define GS_CAP_BANKS 0x08     // BS1 and BC1
+#define GS_CAP_EDGES 0x10     // EDGE, EDGESTREAM and EDGEREAD
+#define GS_CAP_SHM 0x20       // SHMATTACH
+#define GS_CAP_PWM 0x40       // PWM, PRS and PFS
+#define GS_CAP_HW_PWM 0x80    // HP
+#define GS_CAP_COMPACT 0x100  // compact frames
+#define GS_CAP_STATS 0x200    // STATS
+
+// gpio_server compact frame ops: an opcode byte, then unsigned LEB128 varint arguments
+#define GS_OP_CMD 0          // A whole pigpiod command with its extension; replied to as usual
+#define GS_OP_TRIG_HIGH 1    // gpio, pulse_us
+#define GS_OP_TRIG_LOW 2     // gpio, pulse_us
+#define GS_OP_TRIGAT_HIGH 3  // gpio, pulse_us, target_us
+#define GS_OP_TRIGAT_LOW 4   // gpio, pulse_us, target_us
+#define GS_OP_BS1 5          // mask
+#define GS_OP_BC1 6          // mask
+#define GS_OP_WRITE 7        // gpio, level
+#define GS_OP_PATPLAY 8      // pattern id
+#define GS_OP_PATPLAY_AT 9   // pattern id, target_us
+
+// gpio_server pattern library limits
+#define GS_MAX_PATTERNS 32
+#define GS_PATTERN_STEPS 256
+
+// gpio_server shared-memory ring (see SharedMemoryRing)
+#define GS_SHM_MAGIC 0x4D485347 // "GSHM"
+#define GS_SHM_VERSION 1
+#define GS_SHM_SLOTS 1024
+
+// gpio_server edge stream: each EDGEREAD reply carries up to GS_EDGE_READ_MAX
+// records of u32 time us low, u32 time us high, u32 gpio | level << 8
+#define GS_EDGE_RECORD_SIZE 12
+#define GS_EDGE_READ_MAX 64
+
+// gpio_server telemetry (STATS p1 selects the histogram, p2 = GS_STATS_RESET
+// starts it over first). The reply extension is a u32 counter, then the u32
+// counts of consecutive buckets from the one in reply p2, in LatencyHistogram's layout
+#define GS_STATS_RECEIPT 0   // recv() to register write of TRIG, WRITE, BS1 and BC1
+#define GS_STATS_OVERRUN 1   // how late the pulse thread fired each timed edge; counter = edges fired early (heap full)
+#define GS_STATS_WIDTH 2     // how far each pulse's width was off; counter = TRIGs timed inline (ring full)
+#define GS_STATS_COUNT 3
+#define GS_STATS_RESET 0x1
+#define GS_STATS_BUCKETS 528
+
+// Largest extension a gpio_server reply carries (a STATS reply with every bucket)
+#define GS_MAX_REPLY_EXT (4 + 4 * GS_STATS_BUCKETS)
+
+// Largest extension gpio_server accepts (a full BATCH)
+#define GS_MAX_EXT 2048
+
+// Largest compact frame payload (a GS_OP_CMD with a full extension fits)
+#define GS_COMPACT_MAX_PAYLOAD (32 + GS_MAX_EXT)
+
+// gpio_server UDP transport: each datagram is u32 sequence, u32 flags, then one command
+#define GS_UDP_HEADER_SIZE 8
+#define GS_UDP_ACK 0x1     // Ask the server to reply to this datagram
+
+// GPIO modes
+#define PI_INPUT 0
+#define PI_OUTPUT 1
+
+// Hardware PWM duty cycles are in millionths
+#define PI_HW_PWM_RANGE 1000000
+
+// GPIO levels
+#define PI_LOW 0
+#define PI_HIGH 1
+
+/** One step of a pigpiod waveform (gpioPulse_t): set and clear masks, then a delay */
+struct PigpiodWavePulse
+{
+    uint32_t gpioOn;
+    uint32_t gpioOff;
+    uint32_t usDelay;
+};
+
+/** One step of a gpio_server pattern: wait, then drive the clear and set masks */
+struct PigpiodPatternStep
+{
+    uint32_t deltaUs;   // after the previous step (or the start)
+    uint32_t setMask;   // GPIO 0-31 to drive high
+    uint32_t clearMask; // GPIO 0-31 to drive low
+};
+
+// Error codes
+#define PI_NOT_CONNECTED -1
+#define PI_SOCKET_ERROR -2
+#define PI_BAD_GPIO -3
+#define PI_TOO_MANY_PENDING -4
+#define PI_BAD_PARAM -5 // A command, count or size the client can't send (gpio_server's own is -2)
+
+// Server error codes
+#define PI_BAD_DUTYCYCLE -8
+#define PI_BAD_DUTYRANGE -21
+#define PI_NOT_PERMITTED -41 // gpio_server: pin is owned by another client
+#define PI_NOT_HPWM_GPIO -95 // Pin has no hardware PWM channel
+#define PI_BAD_HPWM_FREQ -96
+#define PI_BAD_HPWM_DUTY -97
+
+/**
+ * A pre-encoded pigpiod command, ready to be written to the socket as-is.
+ *
+ * Holds the 16-byte command header (cmd, p1, p2, p3) followed by up to
+ * 16 bytes of extension data, so a TRIG (16+4 bytes) or TRIGAT (16+12 bytes)
+ * fits without allocation.
+ * Words are stored in host byte order, matching the little-endian wire
+ * format used by pigpiod on the Raspberry Pi.
+ */
+struct PigpiodFrame
+{
+    /** cmd, p1, p2, p3, ext... */
+    uint32_t words[8];
+
+    /** Number of bytes to send (16 plus extension size) */
+    uint32_t size;
+
+    /** High resolution tick count at which the frame was queued */
+    int64_t enqueueTicks;
+
+    /** High resolution tick count before which the sender holds the frame back (0 = send at once) */
+    int64_t releaseTicks;
+
+    /** Encodes a command without extension data */
+    static PigpiodFrame command (uint32_t cmd, uint32_t p1 = 0, uint32_t p2 = 0, uint32_t p3 = 0)
+    {
+        PigpiodFrame frame;
+        frame.words[0] = cmd;
+        frame.words[1] = p1;
+        frame.words[2] = p2;
+        frame.words[3] = p3;
+        frame.words[4] = frame.words[5] = frame.words[6] = frame.words[7] = 0;
+        frame.size = 16;
+        frame.enqueueTicks = 0;
+        frame.releaseTicks = 0;
+        return frame;
+    }
+
+    /** Encodes a TRIG command: p1=gpio, p2=pulse length (us), p3=4, ext=level */
+    static PigpiodFrame trig (uint32_t gpio, uint32_t pulseLength, uint32_t level)
+    {
+        PigpiodFrame frame = command (PI_CMD_TRIG, gpio, pulseLength, sizeof (uint32_t));
+        frame.words[4] = level;
+        frame.size = 20;
+        return frame;
+    }
+
+    /** Encodes a TRIGAT command: a TRIG that starts at a server clock time
+     *
+     * p1=gpio, p2=pulse length (us), p3=12, ext=level + target time
+     * (64-bit CLOCK_MONOTONIC microseconds on the server)
+     */
+    static PigpiodFrame trigAt (uint32_t gpio, uint32_t pulseLength, uint32_t level, uint64_t serverTimeUs)
+    {
+        PigpiodFrame frame = command (GS_CMD_TRIGAT, gpio, pulseLength, 12);
+        frame.words[4] = level;
+        frame.words[5] = (uint32_t) serverTimeUs;
+        frame.words[6] = (uint32_t) (serverTimeUs >> 32);
+        frame.size = 28;
+        return frame;
+    }
+
+    /** Encodes a BS1 (set) or BC1 (clear) of every GPIO 0-31 whose bit is set in mask */
+    static PigpiodFrame bank (bool level, uint32_t mask)
+    {
+        return command (level ? PI_CMD_BS1 : PI_CMD_BC1, mask);
+    }
+
+    /** Builds a WVTX frame that plays a previously created waveform once */
+    static PigpiodFrame waveTx (uint32_t waveId)
+    {
+        return command (PI_CMD_WVTX, waveId);
+    }
+
+    /** Builds a PATPLAY frame that plays a stored gpio_server pattern now */
+    static PigpiodFrame patternPlay (uint32_t patternId)
+    {
+        return command (GS_CMD_PATPLAY, patternId);
+    }
+
+    /** Builds a PATPLAY frame that starts a stored pattern at a server clock time
+     *
+     * p1=pattern ID, p3=8, ext=start time (64-bit CLOCK_MONOTONIC microseconds)
+     */
+    static PigpiodFrame patternPlayAt (uint32_t patternId, uint64_t serverTimeUs)
+    {
+        PigpiodFrame frame = command (GS_CMD_PATPLAY, patternId, 0, 8);
+        frame.words[4] = (uint32_t) serverTimeUs;
+        frame.words[5] = (uint32_t) (serverTimeUs >> 32);
+        frame.size = 24;
+        return frame;
+    }
+
+    /** Builds a PWM frame: p1=gpio, p2=duty cycle (0 stops it, leaving the pin low) */
+    static PigpiodFrame pwm (uint32_t gpio, uint32_t dutyCycle)
+    {
+        return command (PI_CMD_PWM, gpio, dutyCycle);
+    }
+
+    /** Builds an HP frame: p1=gpio, p2=frequency (0 stops it), p3=4, ext=duty cycle in millionths */
+    static PigpiodFrame hardwarePwm (uint32_t gpio, uint32_t frequencyHz, uint32_t dutyCycle)
+    {
+        PigpiodFrame frame = command (PI_CMD_HP, gpio, frequencyHz, sizeof (uint32_t));
+        frame.words[4] = dutyCycle;
+        frame.size = 20;
+        return frame;
+    }
+
+    /** Returns the command code */
+    uint32_t getCommand() const { return words[0]; }
+
+    /** Returns a pointer to the bytes to be sent */
+    const void* getData() const { return words; }
+};
+
+/**
+ * Packs commands into one gpio_server compact frame (GS_PROTOCOL_COMPACT).
+ *
+ * A frame is a varint header (payload length << 1, plus 1 if it wants a
+ * reply) and a payload of ops. Pulses, bank writes and pattern starts
+ * become a few varint bytes each, so "pulse pin 17 for 50 us" is a 4-byte
+ * frame; anything else is carried whole in a GS_OP_CMD op.
+ */
+struct PigpiodCompactFrame
+{
+    /** Largest frame: the header varint and a full payload */
+    static constexpr uint32_t maxSize = 4 + GS_COMPACT_MAX_PAYLOAD;
+
+    /** Header space left in front of the payload, filled in by finish() */
+    uint8_t bytes[maxSize];
+
+    /** Payload bytes appended so far */
+    uint32_t payloadSize = 0;
+
+    /** Number of GS_OP_CMD ops appended; each gets its own reply */
+    int commandOps = 0;
+
+    /** True if an op's reply would report lateness (TRIGAT or a timed PATPLAY) */
+    bool scheduled = false;
+
+    /** Appends frame as one op
+     *
+     * @return false, appending nothing, if the payload is full
+     */
+    bool append (const PigpiodFrame& frame)
+    {
+        const uint32_t* w = frame.words;
+        uint8_t op[1 + 5 + 5 + 10];
+        uint32_t size = 0;
+        bool timed = false;
+
+        switch (frame.getCommand())
+        {
+            case PI_CMD_TRIG:
+                op[size++] = frame.size > 16 && w[4] == 0 ? GS_OP_TRIG_LOW : GS_OP_TRIG_HIGH;
+                size += putVarint (op + size, w[1]);
+                size += putVarint (op + size, w[2]);
+                break;
+
+            case GS_CMD_TRIGAT:
+                op[size++] = w[4] == 0 ? GS_OP_TRIGAT_LOW : GS_OP_TRIGAT_HIGH;
+                size += putVarint (op + size, w[1]);
+                size += putVarint (op + size, w[2]);
+                size += putVarint (op + size, (uint64_t) w[5] | ((uint64_t) w[6] << 32));
+                timed = true;
+                break;
+
+            case PI_CMD_BS1:
+            case PI_CMD_BC1:
+                op[size++] = frame.getCommand() == PI_CMD_BS1 ? GS_OP_BS1 : GS_OP_BC1;
+                size += putVarint (op + size, w[1]);
+                break;
+
+            case PI_CMD_WRITE:
+                op[size++] = GS_OP_WRITE;
+                size += putVarint (op + size, w[1]);
+                size += putVarint (op + size, w[2]);
+                break;
+
+            case GS_CMD_PATPLAY:
+                op[size++] = frame.size == 24 ? GS_OP_PATPLAY_AT : GS_OP_PATPLAY;
+                size += putVarint (op + size, w[1]);
+                if (frame.size == 24)
+                {
+                    size += putVarint (op + size, (uint64_t) w[4] | ((uint64_t) w[5] << 32));
+                    timed = true;
+                }
+                break;
+
+            default:
+                return appendCommand (frame.getData(), frame.size);
+        }
+
+        if (payloadSize + size > GS_COMPACT_MAX_PAYLOAD)
+            return false;
+
+        memcpy (bytes + 4 + payloadSize, op, size);
+        payloadSize += size;
+        scheduled = scheduled || timed;
+        return true;
+    }
+
+    /** Appends a whole pigpiod command (16-byte header and extension) as a GS_OP_CMD op
+     *
+     * @return false, appending nothing, if the payload is full
+     */
+    bool appendCommand (const void* command, uint32_t size)
+    {
+        if (payloadSize + 1 + size > GS_COMPACT_MAX_PAYLOAD)
+            return false;
+
+        bytes[4 + payloadSize] = GS_OP_CMD;
+        memcpy (bytes + 4 + payloadSize + 1, command, size);
+        payloadSize += 1 + size;
+        ++commandOps;
+        return true;
+    }
+
+    /** True if nothing has been appended */
+    bool isEmpty() const { return payloadSize == 0; }
+
+    /** Writes the header in front of the payload
+     *
+     * @param wantsReply Ask for one GS_CMD_FRAME reply after the frame's ops have run
+     * @param size Receives the number of bytes to send
+     * @return the start of the frame
+     */
+    const uint8_t* finish (bool wantsReply, uint32_t& size)
+    {
+        uint8_t header[5];
+        const uint32_t headerSize = putVarint (header, ((uint64_t) payloadSize << 1) | (wantsReply ? 1 : 0));
+        uint8_t* start = bytes + 4 - headerSize;
+        memcpy (start, header, headerSize);
+        size = headerSize + payloadSize;
+        return start;
+    }
+
+    /** Empties the frame for reuse */
+    void clear()
+    {
+        payloadSize = 0;
+        commandOps = 0;
+        scheduled = false;
+    }
+
+    /** Writes value as an unsigned LEB128 varint, returning its length (at most 10 bytes) */
+    static uint32_t putVarint (uint8_t* out, uint64_t value)
+    {
+        uint32_t size = 0;
+
+        while (value >= 0x80)
+        {
+            out[size++] = (uint8_t) (value | 0x80);
+            value >>= 7;
+        }
+
+        out[size++] = (uint8_t) value;
+        return size;
+    }
+};
@@ -0,0 +1,224 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "PigpiodReconnector.h"
+
+PigpiodReconnector::PigpiodReconnector (PigpiodClient& client_, Listener& listener_)
+    : juce::Thread ("Pigpiod Reconnect")
+    , client (client_)
+    , listener (listener_)
+    , state (State::idle)
+    , attempts (0)
+    , outages (0)
+    , outageStartTicks (0)
+    , outageEndTicks (0)
+    , port (8888)
+    , transport (PigpiodClient::Transport::tcp)
+{
+}
+
+PigpiodReconnector::~PigpiodReconnector()
+{
+    stop();
+}
+
+void PigpiodReconnector::connectAsync (const juce::StringArray& hosts_, int port_, PigpiodClient::Transport transport_)
+{
+    stop();
+
+    hosts = hosts_;
+    port = port_;
+    transport = transport_;
+
+    state.store (State::connecting, std::memory_order_release);
+    attempts.store (0);
+    outages.store (0);
+    startThread();
+}
+
+void PigpiodReconnector::start()
+{
+    stop();
+
+    state.store (State::up, std::memory_order_release);
+    attempts.store (0);
+    outages.store (0);
+    startThread();
+}
+
+void PigpiodReconnector::cancel()
+{
+    signalThreadShouldExit();
+    notify();
+}
+
+void PigpiodReconnector::stop()
+{
+    // A reconnect can block for the connect timeout plus a reply timeout
+    stopThread (8000);
+    state.store (State::idle, std::memory_order_release);
+}
+
+juce::String PigpiodReconnector::getLastError() const
+{
+    const juce::ScopedLock lock (errorLock);
+    return lastError;
+}
+
+void PigpiodReconnector::connectFirst()
+{
+    juce::String host = hosts[0];
+
+    // Several candidates: take whichever answers first
+    if (hosts.size() > 1)
+    {
+        const int winner = PigpiodClient::findFirstResponder (hosts, port, 3000);
+
+        if (winner < 0)
+        {
+            const juce::ScopedLock lock (errorLock);
+            lastError = "None of " + hosts.joinIntoString (", ") + " answered on port " + juce::String (port);
+            state.store (State::failed, std::memory_order_release);
+            return;
+        }
+
+        host = hosts[winner];
+    }
+
+    if (!client.connect (host, port, transport))
+    {
+        const juce::ScopedLock lock (errorLock);
+        lastError = client.getLastError();
+        state.store (State::failed, std::memory_order_release);
+        return;
+    }
+
+    client.warmUp (warmUpRoundTrips);
+    state.store (State::restoring, std::memory_order_release);
+}
+
+void PigpiodReconnector::restoreComplete()
+{
+    if (state.load (std::memory_order_acquire) == State::restoring)
+        state.store (State::up, std::memory_order_release);
+
+    notify();
+}
+
+double PigpiodReconnector::getOutageMs() const
+{
+    const juce::int64 start = outageStartTicks.load();
+
+    if (start == 0)
+        return 0.0;
+
+    const juce::int64 end = outageEndTicks.load();
+    const juce::int64 until = end != 0 ? end : juce::Time::getHighResolutionTicks();
+    return juce::Time::highResolutionTicksToSeconds (until - start) * 1000.0;
+}
+
+bool PigpiodReconnector::linkIsDown() const
+{
+    if (!client.isConnected())
+        return true;
+
+    // Without pings, silence just means nothing has been sent
+    return client.isPingingClock() && client.getMillisecondsSinceLastReply() > linkTimeoutMs;
+}
+
+void PigpiodReconnector::run()
+{
+    int backoffMs = firstBackoffMs;
+
+    while (!threadShouldExit())
+    {
+        const State current = state.load (std::memory_order_acquire);
+
+        if (current == State::connecting)
+        {
+            connectFirst();
+
+            // Cancelled while connecting: nobody is waiting for this connection
+            if (threadShouldExit())
+            {
+                client.disconnect();
+                state.store (State::idle, std::memory_order_release);
+                break;
+            }
+
+            if (state.load() == State::failed)
+            {
+                listener.connectionFailed();
+                break;
+            }
+
+            listener.connectionRestored();
+        }
+        else if (current == State::up)
+        {
+            if (!linkIsDown())
+            {
+                wait (pollIntervalMs);
+                continue;
+            }
+
+            outageStartTicks.store (juce::Time::getHighResolutionTicks());
+            outageEndTicks.store (0);
+            attempts.store (0);
+            outages.fetch_add (1);
+            backoffMs = firstBackoffMs;
+
+            state.store (State::down, std::memory_order_release);
+            listener.connectionLost();
+        }
+        else if (current == State::down)
+        {
+            // Wait first: a server that just dropped us is often still going down
+            wait (backoffMs);
+
+            if (threadShouldExit())
+                break;
+
+            attempts.fetch_add (1);
+
+            if (client.reconnect())
+            {
+                // The connect itself only proves the server answers; prime the path as well
+                client.warmUp (warmUpRoundTrips);
+
+                outageEndTicks.store (juce::Time::getHighResolutionTicks());
+                state.store (State::restoring, std::memory_order_release);
+                listener.connectionRestored();
+            }
+            else
+            {
+                backoffMs = juce::jmin (backoffMs * 2, maxBackoffMs);
+            }
+        }
+        else
+        {
+            // restoreComplete() wakes us
+            wait (pollIntervalMs);
+        }
+    }
+}
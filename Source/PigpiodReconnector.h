@@ -0,0 +1,168 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "PigpiodClient.h"
+
+/**
+ * Connects a PigpiodClient in the background and keeps it connected.
+ *
+ * connectAsync() makes the first connection off the message thread, racing
+ * several candidate hosts if given, so an unreachable Pi never freezes the
+ * GUI. After that the thread watches the link: it is down when the socket closes or, while
+ * clock pings are running, when no reply has arrived for linkTimeoutMs (a
+ * Wi-Fi drop or a rebooting Pi never closes the socket). It then reconnects
+ * with exponential backoff, makes a few warm-up round trips, and hands over
+ * to the Listener to set the server up again. Pulses should only flow once
+ * the listener has called restoreComplete().
+ */
+class PigpiodReconnector : public juce::Thread
+{
+public:
+    /** Receives link changes, on the reconnector thread */
+    class Listener
+    {
+    public:
+        virtual ~Listener() = default;
+
+        /** The link went down; stop sending pulses (keep this short) */
+        virtual void connectionLost() = 0;
+
+        /** Connected (or reconnected) and warmed up; set up pins and waveforms, then call restoreComplete() */
+        virtual void connectionRestored() = 0;
+
+        /** The first connection attempt failed; the thread has stopped */
+        virtual void connectionFailed() = 0;
+    };
+
+    /** Link state */
+    enum class State
+    {
+        /** Not started, or stopped */
+        idle,
+
+        /** Making the first connection */
+        connecting,
+
+        /** The first connection failed (see getLastError()) */
+        failed,
+
+        /** Connected and accepting pulses */
+        up,
+
+        /** Lost; reconnecting with backoff */
+        down,
+
+        /** Reconnected, waiting for the listener to finish setting up */
+        restoring
+    };
+
+    /** Delay before the first reconnect attempt; doubles after each failure */
+    static constexpr int firstBackoffMs = 250;
+
+    /** Longest delay between reconnect attempts */
+    static constexpr int maxBackoffMs = 8000;
+
+    /** Silence, while clock pings are running, after which the link is considered down */
+    static constexpr int linkTimeoutMs = 1500;
+
+    /** How often the link is checked while it is up */
+    static constexpr int pollIntervalMs = 100;
+
+    /** Blocking round trips made after reconnecting, before pulses flow */
+    static constexpr int warmUpRoundTrips = 8;
+
+    /** Constructor */
+    PigpiodReconnector (PigpiodClient& client, Listener& listener);
+
+    /** Destructor */
+    ~PigpiodReconnector() override;
+
+    /** Starts connecting to the first of hosts to answer, then keeps the connection up (message thread)
+     *
+     * Returns at once; the listener hears connectionRestored() or connectionFailed().
+     */
+    void connectAsync (const juce::StringArray& hosts, int port, PigpiodClient::Transport transport);
+
+    /** Starts watching a client that is already connected (message thread) */
+    void start();
+
+    /** Asks a first connection attempt to give up, without waiting for it (message thread)
+     *
+     * The attempt finishes in the background, disconnects and stays silent.
+     */
+    void cancel();
+
+    /** Stops watching and reconnecting; waits for an attempt in progress (message thread) */
+    void stop();
+
+    /** Called by the listener once the server is set up again */
+    void restoreComplete();
+
+    /** Current link state */
+    State getState() const { return state.load (std::memory_order_acquire); }
+
+    /** Reconnect attempts made during the current (or last) outage */
+    int getAttemptCount() const { return attempts.load (std::memory_order_relaxed); }
+
+    /** Number of times the link has gone down since start() */
+    juce::uint64 getOutageCount() const { return outages.load (std::memory_order_relaxed); }
+
+    /** Duration of the current (or last) outage, in milliseconds */
+    double getOutageMs() const;
+
+    /** Why the first connection failed */
+    juce::String getLastError() const;
+
+    /** Thread body */
+    void run() override;
+
+private:
+    /** True if the socket has closed or the server has gone quiet */
+    bool linkIsDown() const;
+
+    /** Makes the first connection (thread only) */
+    void connectFirst();
+
+    PigpiodClient& client;
+    Listener& listener;
+
+    std::atomic<State> state;
+    std::atomic<int> attempts;
+    std::atomic<juce::uint64> outages;
+
+    /** High resolution ticks when the current outage started, and when it ended (0 while down) */
+    std::atomic<juce::int64> outageStartTicks;
+    std::atomic<juce::int64> outageEndTicks;
+
+    /** First connection request (set before the thread starts) */
+    juce::StringArray hosts;
+    int port;
+    PigpiodClient::Transport transport;
+
+    juce::CriticalSection errorLock;
+    juce::String lastError;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodReconnector);
+};
@@ -0,0 +1,435 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "PigpiodRouter.h"
+
+static juce::int64 microsecondsToTicks (juce::int64 microseconds)
+{
+    return (juce::int64) ((double) microseconds * 1.0e-6 * (double) juce::Time::getHighResolutionTicksPerSecond());
+}
+
+PigpiodRouter::PigpiodRouter (PigpiodClient& client_, PigpiodDispatcher& dispatcher_, const Settings& settings_)
+    : client (client_)
+    , dispatcher (dispatcher_)
+    , settings (settings_)
+    , numTargets (0)
+    , numPendingPins (0)
+    , framesPending (false)
+    , missedCount (0)
+{
+}
+
+bool PigpiodRouter::needsEventTimes() const
+{
+    return settings.scheduleDelayUs > 0 || settings.coalescePolicy != CoalescePolicy::off;
+}
+
+void PigpiodRouter::reset()
+{
+    numPendingPins = 0;
+    framesPending = false;
+    missedCount.store (0);
+
+    for (auto& pin : pinStates)
+    {
+        pin.windowEndTicks = 0;
+        pin.pending = false;
+        pin.listed = false;
+        pin.coalescedCount.store (0);
+    }
+}
+
+void PigpiodRouter::addTarget (Target* target)
+{
+    const int index = numTargets.load();
+    jassert (index < maxTargets);
+
+    targets[index] = target;
+
+    // Published last: the audio thread only uses targets below numTargets
+    numTargets.store (index + 1, std::memory_order_release);
+}
+
+bool PigpiodRouter::routeEvent (const Route* routes, juce::int64 eventTicks, bool mainLinkUp)
+{
+    const int numTargetsNow = numTargets.load (std::memory_order_acquire);
+    bool missed = false;
+
+    // Fan out to every pin on the line; other Pis queue onto their own sender threads
+    for (int i = 0; i < maxRoutesPerLine && routes[i].gpio >= 0; ++i)
+    {
+        const Route& route = routes[i];
+
+        if (route.target >= numTargetsNow)
+            continue;
+
+        // Not replayed after an outage, unlike pulses, so not counted as missed either
+        if (route.pwm != PwmMode::none)
+        {
+            if (mainLinkUp)
+                switchPwm (route, true, eventTicks);
+
+            continue;
+        }
+
+        if (route.target < 0 && !mainLinkUp)
+        {
+            missed = true;
+            continue;
+        }
+
+        if (settings.coalescePolicy == CoalescePolicy::off)
+            sendRoute (route, eventTicks);
+        else
+            coalesceRoute (route, eventTicks, mainLinkUp);
+    }
+
+    return missed;
+}
+
+void PigpiodRouter::releaseEvent (const Route* routes, juce::int64 eventTicks, bool mainLinkUp)
+{
+    if (!mainLinkUp)
+        return;
+
+    for (int i = 0; i < maxRoutesPerLine && routes[i].gpio >= 0; ++i)
+        if (routes[i].pwm != PwmMode::none)
+            switchPwm (routes[i], false, eventTicks);
+}
+
+void PigpiodRouter::switchPwm (const Route& route, bool on, juce::int64 eventTicks)
+{
+    // TRIGAT has no PWM counterpart, so a fixed delay is always held on this computer
+    const juce::int64 releaseTicks = settings.scheduleDelayUs > 0 && eventTicks != 0
+        ? eventTicks + microsecondsToTicks (settings.scheduleDelayUs)
+        : 0;
+
+    if (route.pwm == PwmMode::hardware)
+    {
+        dispatcher.enqueueHardwarePwm (route.gpio, on ? route.pwmFrequencyHz : 0, on ? route.pwmDuty : 0, releaseTicks);
+    }
+    else
+    {
+        // Stopping is a duty cycle of 0, so the smallest duty cycle rounds up, not down
+        const int duty = juce::jmax (1, (int) ((juce::int64) route.pwmDuty * pwmRange / PI_HW_PWM_RANGE));
+        dispatcher.enqueuePwm (route.gpio, on ? duty : 0, releaseTicks);
+    }
+
+    framesPending = true;
+}
+
+void PigpiodRouter::flush (bool mainLinkUp)
+{
+    // Merged and extended pulses go out once the whole block has been seen
+    for (int i = 0; i < numPendingPins; ++i)
+    {
+        PinState& pin = pinStates[pendingPins[i]];
+
+        if (pin.pending)
+            sendPendingPulse (pin, mainLinkUp);
+
+        pin.listed = false;
+    }
+
+    numPendingPins = 0;
+
+    // One wake-up per block for everything queued
+    if (framesPending)
+    {
+        dispatcher.flush();
+        framesPending = false;
+    }
+
+    for (int i = 0; i < numTargets.load (std::memory_order_acquire); ++i)
+        targets[i]->flush();
+}
+
+void PigpiodRouter::sendRoute (const Route& route, juce::int64 eventTicks)
+{
+    if (route.target >= 0)
+    {
+        targets[route.target]->trigger (route.gpio, route.pulseUs, route.level, settings.trainPulses,
+                                        settings.trainPeriodUs, eventTicks, settings.scheduleDelayUs);
+        return;
+    }
+
+    const juce::uint64 startUs = settings.schedulePulses
+        ? client.hostTicksToServerMicros (eventTicks) + (juce::uint64) settings.scheduleDelayUs
+        : 0;
+
+    triggerRoute (route, startUs, settings.scheduleDelayUs > 0 && !settings.schedulePulses
+                                      ? eventTicks + microsecondsToTicks (settings.scheduleDelayUs)
+                                      : 0);
+}
+
+void PigpiodRouter::coalesceRoute (const Route& route, juce::int64 eventTicks, bool mainLinkUp)
+{
+    const int index = (route.target + 1) * numPinsPerPi + route.gpio;
+
+    if (route.gpio >= numPinsPerPi || index >= numPinStates)
+    {
+        sendRoute (route, eventTicks);
+        return;
+    }
+
+    PinState& pin = pinStates[index];
+
+    // Fold the trigger into this block's pulse if it lands inside that pulse's window
+    if (pin.pending)
+    {
+        if (eventTicks < pin.firstTicks + getCoalesceWindowTicks (pin.route))
+        {
+            pin.lastTicks = eventTicks;
+            pin.coalescedCount.fetch_add (1, std::memory_order_relaxed);
+            return;
+        }
+
+        sendPendingPulse (pin, mainLinkUp);
+    }
+
+    // A pulse that has already gone out can't be changed, so a trigger inside its window is lost
+    if (eventTicks < pin.windowEndTicks)
+    {
+        pin.coalescedCount.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (settings.coalescePolicy == CoalescePolicy::drop)
+    {
+        pin.windowEndTicks = eventTicks + getCoalesceWindowTicks (route);
+        sendRoute (route, eventTicks);
+        return;
+    }
+
+    pin.pending = true;
+    pin.route = route;
+    pin.firstTicks = eventTicks;
+    pin.lastTicks = eventTicks;
+
+    if (!pin.listed)
+    {
+        pin.listed = true;
+        pendingPins[numPendingPins++] = index;
+    }
+}
+
+void PigpiodRouter::sendPendingPulse (PinState& pin, bool mainLinkUp)
+{
+    Route route = pin.route;
+    juce::int64 eventTicks = pin.lastTicks;
+
+    // Extending keeps the first trigger's start and moves the end; stored trains can only be merged
+    if (settings.coalescePolicy == CoalescePolicy::extend && !(settings.trainPulses > 1 && route.trainId >= 0))
+    {
+        const int extraUs = (int) (juce::Time::highResolutionTicksToSeconds (pin.lastTicks - pin.firstTicks) * 1.0e6);
+        route.pulseUs = juce::jmin (maxPulseUs, route.pulseUs + extraUs);
+        eventTicks = pin.firstTicks;
+    }
+
+    pin.pending = false;
+    pin.windowEndTicks = eventTicks + getCoalesceWindowTicks (route);
+
+    // The main link may have dropped since the trigger arrived
+    if (route.target < 0 && !mainLinkUp)
+    {
+        missedCount.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+
+    sendRoute (route, eventTicks);
+}
+
+juce::int64 PigpiodRouter::getCoalesceWindowTicks (const Route& route) const
+{
+    const int busyUs = settings.trainPulses > 1 ? (settings.trainPulses - 1) * settings.trainPeriodUs + route.pulseUs
+                                                : route.pulseUs;
+    return microsecondsToTicks (juce::jmax (settings.refractoryUs, busyUs));
+}
+
+juce::uint64 PigpiodRouter::getCoalescedCount() const
+{
+    juce::uint64 total = 0;
+
+    for (auto& pin : pinStates)
+        total += pin.coalescedCount.load (std::memory_order_relaxed);
+
+    return total;
+}
+
+void PigpiodRouter::triggerRoute (const Route& route, juce::uint64 startUs, juce::int64 releaseTicks)
+{
+    // Queue the pulse for the sender thread; never touches the socket here
+    if (settings.trainPulses > 1 && route.trainId >= 0)
+    {
+        // The whole train is already on the Pi
+        if (settings.trainEngine == TrainEngine::patterns)
+            dispatcher.enqueuePatternPlay (route.trainId, startUs);
+        else
+            dispatcher.enqueueWaveTx (route.trainId, releaseTicks);
+    }
+    else if (startUs != 0)
+    {
+        // Without a stored train, a train is one scheduled pulse per period
+        for (int i = 0; i < settings.trainPulses; ++i)
+            dispatcher.enqueueTrigAt (route.gpio, route.pulseUs, route.level,
+                                      startUs + (juce::uint64) i * (juce::uint64) settings.trainPeriodUs);
+    }
+    else
+    {
+        dispatcher.enqueueTrig (route.gpio, route.pulseUs, route.level, releaseTicks);
+    }
+
+    framesPending = true;
+}
+
+void PigpiodRouter::queuePulses (PigpiodClient& client, PigpiodDispatcher& dispatcher, bool schedule,
+                                 int gpio, int pulseUs, int level, int numPulses, int periodUs,
+                                 juce::int64 eventTicks, int delayUs)
+{
+    if (schedule && eventTicks != 0)
+    {
+        // Converted with this Pi's own clock model
+        const juce::uint64 startUs = client.hostTicksToServerMicros (eventTicks) + (juce::uint64) delayUs;
+
+        for (int i = 0; i < numPulses; ++i)
+            dispatcher.enqueueTrigAt (gpio, pulseUs, level, startUs + (juce::uint64) i * (juce::uint64) periodUs);
+    }
+    else
+    {
+        // Servers without TRIGAT get the delay on this computer instead: the sender holds the frame
+        const juce::int64 releaseTicks = eventTicks != 0 && delayUs > 0 ? eventTicks + microsecondsToTicks (delayUs) : 0;
+
+        dispatcher.enqueueTrig (gpio, pulseUs, level, releaseTicks);
+    }
+}
+
+juce::String PigpiodRouter::parseRoutes (const juce::String& text, Route* routes, int defaultPulseUs,
+                                         const juce::StringArray& mainHosts, juce::StringArray& targetHosts)
+{
+    juce::String error;
+
+    // The first explicit route for a line replaces its default one; further routes add to it
+    int numRoutes[maxRoutedLines] = {};
+    bool lineHasExplicitRoute[maxRoutedLines] = {};
+
+    for (auto& entry : juce::StringArray::fromTokens (text, ",", ""))
+    {
+        juce::StringArray fields = juce::StringArray::fromTokens (entry.trim(), ":", "");
+        fields.trim();
+        fields.removeEmptyStrings();
+
+        if (fields.isEmpty())
+            continue;
+
+        const juce::String mode = fields.size() > 2 ? fields[2].toLowerCase() : juce::String();
+        const PwmMode pwm = mode == "pwm" ? PwmMode::software : mode == "hp" ? PwmMode::hardware : PwmMode::none;
+
+        if (fields.size() < 2 || fields.size() > (pwm != PwmMode::none ? 5 : 4)
+            || (pwm != PwmMode::none && fields.size() < 4))
+        {
+            error = error.isEmpty() ? "\"" + entry.trim() + "\" (expected line:gpio[@host][:us[:high|low]] or line:gpio:pwm|hp:hz[:duty%])" : error;
+            continue;
+        }
+
+        const int line = fields[0].getIntValue();
+        const int gpio = fields[1].upToFirstOccurrenceOf ("@", false, false).getIntValue();
+        const juce::String host = fields[1].fromFirstOccurrenceOf ("@", false, false).trim();
+        const int pulseUs = fields.size() > 2 && pwm == PwmMode::none ? fields[2].getIntValue() : defaultPulseUs;
+        const juce::String polarity = fields.size() > 3 && pwm == PwmMode::none ? fields[3].toLowerCase() : "high";
+
+        if (line < 1 || line > maxRoutedLines || gpio < 2 || gpio > 27 || pulseUs < 1 || pulseUs > maxPulseUs
+            || (polarity != "high" && polarity != "low"))
+        {
+            error = error.isEmpty() ? "\"" + entry.trim() + "\" is out of range" : error;
+            continue;
+        }
+
+        const int frequencyHz = pwm != PwmMode::none ? fields[3].getIntValue() : 0;
+        const double dutyPercent = fields.size() > 4 ? fields[4].upToFirstOccurrenceOf ("%", false, false).getDoubleValue() : 50.0;
+
+        // pigpiod and gpio_server both cap software PWM at 40 kHz
+        if (pwm != PwmMode::none
+            && (frequencyHz < 1 || frequencyHz > (pwm == PwmMode::software ? 40000 : 125000000)
+                || dutyPercent <= 0.0 || dutyPercent > 100.0))
+        {
+            error = error.isEmpty() ? "\"" + entry.trim() + "\" is out of range" : error;
+            continue;
+        }
+
+        if (pwm == PwmMode::hardware && gpio != 12 && gpio != 13 && gpio != 18 && gpio != 19)
+        {
+            error = error.isEmpty() ? "\"" + entry.trim() + "\": GPIO " + juce::String (gpio) + " has no hardware PWM" : error;
+            continue;
+        }
+
+        if (pwm != PwmMode::none && host.isNotEmpty() && !mainHosts.contains (host, true))
+        {
+            error = error.isEmpty() ? "\"" + entry.trim() + "\": PWM routes only drive the main Pi" : error;
+            continue;
+        }
+
+        int target = -1;
+
+        if (host.isNotEmpty() && !mainHosts.contains (host, true))
+        {
+            target = targetHosts.indexOf (host, true);
+
+            if (target < 0 && targetHosts.size() < maxTargets)
+            {
+                targetHosts.add (host);
+                target = targetHosts.size() - 1;
+            }
+
+            if (target < 0)
+            {
+                error = error.isEmpty() ? "\"" + entry.trim() + "\" names more than " + juce::String (maxTargets) + " other Pis" : error;
+                continue;
+            }
+        }
+
+        Route* lineRoutes = routes + (line - 1) * maxRoutesPerLine;
+
+        if (!lineHasExplicitRoute[line - 1])
+        {
+            std::fill (lineRoutes, lineRoutes + maxRoutesPerLine, Route());
+            lineHasExplicitRoute[line - 1] = true;
+        }
+
+        if (numRoutes[line - 1] == maxRoutesPerLine)
+        {
+            error = error.isEmpty() ? "TTL line " + juce::String (line) + " has more than " + juce::String (maxRoutesPerLine) + " routes" : error;
+            continue;
+        }
+
+        Route& route = lineRoutes[numRoutes[line - 1]++];
+        route.gpio = gpio;
+        route.pulseUs = pulseUs;
+        route.level = polarity == "low" ? PI_LOW : PI_HIGH;
+        route.target = target;
+        route.pwm = pwm;
+        route.pwmFrequencyHz = frequencyHz;
+        route.pwmDuty = (int) (dutyPercent * (double) PI_HW_PWM_RANGE / 100.0 + 0.5);
+    }
+
+    return error;
+}
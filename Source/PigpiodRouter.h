@@ -0,0 +1,306 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "PigpiodClient.h"
+#include "PigpiodDispatcher.h"
+
+/**
+ * Turns a rising edge on a TTL line into the pulses its routes ask for.
+ *
+ * This is the part of the sink's event handling that comes after the gate and
+ * stream lookup: fanning the line out to its pins, coalescing triggers that
+ * land inside a pin's refractory window, timing pulses at a fixed delay
+ * (TRIGAT, or held on this computer), playing trains, and handing pulses for
+ * other Pis to their targets. PWM routes instead switch a continuous
+ * waveform on at the rising edge and off at the falling one, with one
+ * command each. It only needs juce_core, so dispatch-replay runs exactly the
+ * code the sink does.
+ */
+class PigpiodRouter
+{
+public:
+    /** Number of TTL lines per stream that can be routed to a GPIO pin */
+    static constexpr int maxRoutedLines = 16;
+
+    /** Number of pins one TTL line can fan out to */
+    static constexpr int maxRoutesPerLine = 4;
+
+    /** Number of Pis besides the main connection that routes can name */
+    static constexpr int maxTargets = 4;
+
+    /** Longest pulse a TRIG can carry (microseconds) */
+    static constexpr int maxPulseUs = 100;
+
+    /** GPIOs per Pi tracked for coalescing (routes only use GPIO 2-27) */
+    static constexpr int numPinsPerPi = 32;
+
+    /** Coalescing state slots: the main Pi's pins, then each target's */
+    static constexpr int numPinStates = (maxTargets + 1) * numPinsPerPi;
+
+    /** Range (PRS) software PWM routes' pins are set to, so duty cycles have 0.1% steps */
+    static constexpr int pwmRange = 1000;
+
+    /** How a route drives its pin while its TTL line is high */
+    enum class PwmMode
+    {
+        none,       // pulses on each rising edge
+        software,   // PWM/PFS/PRS: timed by pigpiod's DMA or gpio_server's pulse thread
+        hardware    // HP: clocked by the PWM peripheral (GPIO 12, 13, 18 and 19)
+    };
+
+    /** Where a rising edge on one TTL line is sent */
+    struct Route
+    {
+        /** GPIO pin (BCM numbering); -1 if the line is not routed */
+        int gpio = -1;
+
+        /** Pulse length in microseconds */
+        int pulseUs = 0;
+
+        /** PI_HIGH for a high-going pulse, PI_LOW for a low-going one */
+        int level = PI_HIGH;
+
+        /** Stored train (pigpiod waveform or gpio_server pattern ID); -1 to send pulses individually */
+        int trainId = -1;
+
+        /** Additional Pi the pin is on (index into the targets); -1 for the main connection */
+        int target = -1;
+
+        /** PWM while the line is high instead of pulses; PWM routes are on the main Pi only */
+        PwmMode pwm = PwmMode::none;
+
+        /** PWM frequency (Hz) */
+        int pwmFrequencyHz = 0;
+
+        /** PWM duty cycle in millionths (PI_HW_PWM_RANGE is always on) */
+        int pwmDuty = 0;
+    };
+
+    /** What happens to a trigger that arrives inside its pin's refractory window */
+    enum class CoalescePolicy
+    {
+        off,    // send every trigger
+        drop,   // discard the later trigger
+        merge,  // one pulse per window, at the latest trigger's time ("latest wins")
+        extend  // one pulse per window, from the first trigger until a pulse length after the latest
+    };
+
+    /** How the main server stores trains (probed once per connection) */
+    enum class TrainEngine
+    {
+        unknown,
+        waveforms,  // pigpiod WVAG/WVCRE, played with WVTX
+        patterns,   // gpio_server PATDEF, played with PATPLAY
+        none
+    };
+
+    /** How pulses are timed, coalesced and repeated */
+    struct Settings
+    {
+        /** Delay after each event (microseconds); 0 sends pulses as soon as possible */
+        int scheduleDelayUs = 0;
+
+        /** True if the main Pi gets TRIGAT at event time + scheduleDelayUs (needs a server that supports it) */
+        bool schedulePulses = false;
+
+        CoalescePolicy coalescePolicy = CoalescePolicy::off;
+
+        /** Refractory window (microseconds); 0 makes the window the pulse itself */
+        int refractoryUs = 0;
+
+        /** Pulses per event; 1 sends a single pulse */
+        int trainPulses = 1;
+
+        /** Pulse period within a train (microseconds) */
+        int trainPeriodUs = 25000;
+
+        /** Stored trains are played through this; without one a train is one scheduled pulse per period */
+        TrainEngine trainEngine = TrainEngine::unknown;
+    };
+
+    /** Another Pi that routes can send pulses to, with its own sender thread (see PigpiodTarget) */
+    class Target
+    {
+    public:
+        virtual ~Target() = default;
+
+        /** Queues a pulse or a train of scheduled pulses (audio thread only)
+         *
+         * @param eventTicks High resolution ticks at which the event was acquired, or 0 to fire on arrival
+         * @param delayUs Delay after eventTicks
+         */
+        virtual void trigger (int gpio, int pulseUs, int level, int numPulses, int periodUs,
+                              juce::int64 eventTicks, int delayUs) = 0;
+
+        /** Wakes the sender thread if anything was queued since the last flush (audio thread only) */
+        virtual void flush() = 0;
+    };
+
+    /** Constructor
+     *
+     * @param settings Read on the audio thread; the owner keeps it up to date
+     */
+    PigpiodRouter (PigpiodClient& client, PigpiodDispatcher& dispatcher, const Settings& settings);
+
+    /** True if routeEvent() needs event times: a fixed delay or coalescing is set */
+    bool needsEventTimes() const;
+
+    /** Starts coalescing afresh, with no pin inside a window, and clears the counters (audio thread stopped) */
+    void reset();
+
+    /** Makes a target available to routes naming the next target index (message thread)
+     *
+     * The pool only grows, so the audio thread can index it without a lock.
+     */
+    void addTarget (Target* target);
+
+    /** Number of targets added so far */
+    int getNumTargets() const { return numTargets.load (std::memory_order_acquire); }
+
+    /** Sends, or coalesces until flush(), the pulses for one rising edge (audio thread)
+     *
+     * @param routes The line's maxRoutesPerLine slots; the first unused slot has gpio -1
+     * @param eventTicks High resolution ticks at which the event was acquired, or 0 if needsEventTimes() is false
+     * @param mainLinkUp False while the main connection is down; its routes are then skipped
+     * @return true if a route to the main Pi was skipped
+     */
+    bool routeEvent (const Route* routes, juce::int64 eventTicks, bool mainLinkUp);
+
+    /** Stops the PWM a line's rising edge started (audio thread)
+     *
+     * Pulse routes ignore falling edges. Call it whatever the gate says, so a
+     * gate closing while the line is high can't leave PWM running.
+     *
+     * @param eventTicks As for routeEvent()
+     */
+    void releaseEvent (const Route* routes, juce::int64 eventTicks, bool mainLinkUp);
+
+    /** Queues one route's pulse or train on the main Pi, bypassing coalescing (audio thread)
+     *
+     * @param startUs Server clock time to start at, or 0 to fire on arrival
+     * @param releaseTicks High resolution ticks to hold an unscheduled pulse until, or 0 to send at once
+     */
+    void triggerRoute (const Route& route, juce::uint64 startUs, juce::int64 releaseTicks = 0);
+
+    /** Sends the pulses merged or extended during the block and wakes every sender thread (audio thread, end of block) */
+    void flush (bool mainLinkUp);
+
+    /** Triggers dropped or folded into another pulse on one pin, by (target + 1) * numPinsPerPi + gpio */
+    juce::uint64 getCoalescedCount (int index) const { return pinStates[index].coalescedCount.load (std::memory_order_relaxed); }
+
+    /** Triggers dropped or folded into another pulse, over all pins */
+    juce::uint64 getCoalescedCount() const;
+
+    /** Merged or extended pulses for the main Pi lost because its link went down before they were sent */
+    juce::uint64 getMissedCount() const { return missedCount.load (std::memory_order_relaxed); }
+
+    /** Queues a pulse, or a train of scheduled pulses, on one Pi's sender thread (audio thread)
+     *
+     * For Target implementations, which each time pulses with their own client's clock.
+     *
+     * @param schedule true to send TRIGAT at eventTicks + delayUs; false holds a delayed pulse on this computer
+     */
+    static void queuePulses (PigpiodClient& client, PigpiodDispatcher& dispatcher, bool schedule,
+                             int gpio, int pulseUs, int level, int numPulses, int periodUs,
+                             juce::int64 eventTicks, int delayUs);
+
+    /** Parses a "routes" parameter into a route table
+     *
+     * Entries are comma-separated "line:gpio[@host][:us[:high|low]]", with
+     * 1-based TTL lines, BCM GPIO numbers, an optional Pi and an optional
+     * pulse length / polarity. "line:gpio:pwm:hz[:duty%]" (software) and
+     * "line:gpio:hp:hz[:duty%]" (hardware) run PWM on the main Pi instead,
+     * at 50% duty unless given, for as long as the line is high. Several
+     * entries for one line fan its events out to all of their pins.
+     *
+     * @param routes maxRoutedLines * maxRoutesPerLine slots
+     * @param mainHosts Hosts that mean the main connection (as is leaving the host out)
+     * @param targetHosts Additional Pis, by target index; hosts not yet in it are appended
+     * @return an empty string, or a description of the first invalid entry
+     */
+    static juce::String parseRoutes (const juce::String& text, Route* routes, int defaultPulseUs,
+                                     const juce::StringArray& mainHosts, juce::StringArray& targetHosts);
+
+private:
+    /** Coalescing state of one pin on one Pi (audio thread, apart from the counter) */
+    struct PinState
+    {
+        /** Triggers before this tick count fall inside the last sent pulse's window */
+        juce::int64 windowEndTicks = 0;
+
+        /** True if a merged or extended pulse is waiting for the end of the block */
+        bool pending = false;
+
+        /** True while the pin is in pendingPins */
+        bool listed = false;
+
+        /** Route of the pending pulse */
+        Route route;
+
+        /** Times of the first and latest triggers folded into the pending pulse */
+        juce::int64 firstTicks = 0;
+        juce::int64 lastTicks = 0;
+
+        /** Triggers dropped or folded into another pulse */
+        std::atomic<juce::uint64> coalescedCount { 0 };
+    };
+
+    /** Queues the PWM command that switches a PWM route on or off, after the fixed delay if one is set */
+    void switchPwm (const Route& route, bool on, juce::int64 eventTicks);
+
+    /** Sends one route's pulse for an event, to whichever Pi the route names */
+    void sendRoute (const Route& route, juce::int64 eventTicks);
+
+    /** Applies the coalescing policy to one route's trigger, sending it now or at the end of the block */
+    void coalesceRoute (const Route& route, juce::int64 eventTicks, bool mainLinkUp);
+
+    /** Sends a pin's merged or extended pulse and starts its refractory window */
+    void sendPendingPulse (PinState& pin, bool mainLinkUp);
+
+    /** Length of the window a route's pulse (or whole train) keeps its pin busy for */
+    juce::int64 getCoalesceWindowTicks (const Route& route) const;
+
+    PigpiodClient& client;
+    PigpiodDispatcher& dispatcher;
+    const Settings& settings;
+
+    /** Additional Pis, published through numTargets */
+    Target* targets[maxTargets] = {};
+    std::atomic<int> numTargets;
+
+    /** Coalescing state by (target + 1) * numPinsPerPi + gpio */
+    PinState pinStates[numPinStates];
+
+    /** Indices into pinStates with a pulse pending this block */
+    int pendingPins[numPinStates];
+    int numPendingPins;
+
+    /** True if a frame was queued on the main dispatcher since the last flush */
+    bool framesPending;
+
+    std::atomic<juce::uint64> missedCount;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodRouter);
+};
@@ -0,0 +1,292 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "PigpiodTarget.h"
+
+#include <ProcessorHeaders.h>
+
+PigpiodTarget::PigpiodTarget (const juce::String& host_)
+    : host (host_)
+    , dispatcher (client)
+    , connected (false)
+    , connectPending (false)
+    , linkUp (false)
+    , scheduleWanted (false)
+    , schedulePulses (false)
+    , framesPending (false)
+    , missedCount (0)
+    , status ("Disconnected")
+    , reconnector (client, *this)
+{
+    std::fill (std::begin (idleLevel), std::end (idleLevel), -1);
+}
+
+PigpiodTarget::~PigpiodTarget()
+{
+    dispatcher.stopThread (1000);
+    disconnect();
+    reconnector.stop();
+    cancelPendingUpdate();
+}
+
+void PigpiodTarget::connect (int port, PigpiodClient::Transport transport)
+{
+    if (connected || connectPending)
+        disconnect();
+
+    LOGC ("Connecting to pigpiod at ", host, ":", port);
+
+    linkUp.store (false, std::memory_order_release);
+    connectPending = true;
+    status = "Connecting";
+    reconnector.connectAsync (juce::StringArray (host), port, transport);
+}
+
+void PigpiodTarget::disconnect()
+{
+    if (connected)
+    {
+        reconnector.stop();
+        linkUp.store (false, std::memory_order_release);
+
+        if (client.isConnected())
+            driveIdleLevels (client, idleLevel, true);
+
+        client.disconnect();
+        connected = false;
+        LOGC ("Disconnected from ", host);
+    }
+    else if (connectPending)
+    {
+        connectPending = false;
+
+        // As for the main connection, don't wait out a connect timeout
+        if (reconnector.getState() == PigpiodReconnector::State::connecting)
+        {
+            reconnector.cancel();
+        }
+        else
+        {
+            reconnector.stop();
+            client.disconnect();
+        }
+    }
+
+    status = "Disconnected";
+}
+
+void PigpiodTarget::setIdleLevels (const int* levels)
+{
+    // Only pins that changed are written, so re-sending the same table is free
+    int changed[numPins];
+    bool anyChanged = false;
+
+    for (int gpio = 0; gpio < numPins; ++gpio)
+    {
+        changed[gpio] = levels[gpio] != idleLevel[gpio] ? levels[gpio] : -1;
+        anyChanged = anyChanged || changed[gpio] >= 0;
+        idleLevel[gpio] = levels[gpio];
+    }
+
+    if (anyChanged && connected && isLinkUp())
+        driveIdleLevels (client, changed, false);
+}
+
+void PigpiodTarget::setSenderSettings (const PigpiodDispatcher::ThreadSettings& settings)
+{
+    dispatcher.setThreadSettings (settings);
+    client.setBusyPoll (settings.busyPoll);
+}
+
+void PigpiodTarget::startAcquisition (bool wantScheduledPulses)
+{
+    dispatcher.resetStatistics();
+    client.resetRoundTripLatency();
+    missedCount.store (0);
+    framesPending = false;
+
+    scheduleWanted = wantScheduledPulses;
+    schedulePulses = scheduleWanted && client.isConnected() && client.supportsScheduledPulses();
+
+    // Started even while connecting; trigger() sends nothing until the link is up
+    dispatcher.startThread();
+}
+
+void PigpiodTarget::stopAcquisition()
+{
+    dispatcher.stopThread (1000);
+
+    if (connected && isLinkUp())
+        driveIdleLevels (client, idleLevel, true);
+}
+
+void PigpiodTarget::trigger (int gpio, int pulseUs, int level, int numPulses, int periodUs,
+                             juce::int64 eventTicks, int delayUs)
+{
+    if (!linkUp.load (std::memory_order_acquire))
+    {
+        missedCount.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+
+    PigpiodRouter::queuePulses (client, dispatcher, schedulePulses, gpio, pulseUs, level, numPulses, periodUs,
+                                eventTicks, delayUs);
+    framesPending = true;
+}
+
+void PigpiodTarget::flush()
+{
+    if (framesPending)
+    {
+        dispatcher.flush();
+        framesPending = false;
+    }
+}
+
+juce::String PigpiodTarget::getStatus() const
+{
+    if (connected && !isLinkUp())
+        return "Reconnecting (" + juce::String (reconnector.getAttemptCount()) + ")";
+
+    return status;
+}
+
+void PigpiodTarget::connectionLost()
+{
+    linkUp.store (false, std::memory_order_release);
+    triggerAsyncUpdate();
+}
+
+void PigpiodTarget::connectionRestored()
+{
+    triggerAsyncUpdate();
+}
+
+void PigpiodTarget::connectionFailed()
+{
+    triggerAsyncUpdate();
+}
+
+void PigpiodTarget::handleAsyncUpdate()
+{
+    const PigpiodReconnector::State state = reconnector.getState();
+
+    if (!connected)
+    {
+        if (state == PigpiodReconnector::State::restoring)
+        {
+            if (connectPending)
+            {
+                connectPending = false;
+                connected = true;
+                restore();
+                LOGC ("Connected to pigpiod at ", host, ", version ", client.getVersion());
+            }
+            else
+            {
+                reconnector.stop();
+                client.disconnect();
+            }
+        }
+        else if (state == PigpiodReconnector::State::failed && connectPending)
+        {
+            connectPending = false;
+            status = "Error: " + reconnector.getLastError();
+            LOGC ("Failed to connect to ", host, ": ", reconnector.getLastError());
+        }
+
+        return;
+    }
+
+    if (state == PigpiodReconnector::State::down)
+    {
+        LOGC ("Lost connection to ", host, "; reconnecting");
+    }
+    else if (state == PigpiodReconnector::State::restoring)
+    {
+        restore();
+        LOGC ("Reconnected to ", host, " after ", juce::String (reconnector.getOutageMs(), 0), " ms");
+    }
+}
+
+void PigpiodTarget::restore()
+{
+    // A rebooted Pi has its pins back as inputs
+    driveIdleLevels (client, idleLevel, false);
+
+    schedulePulses = scheduleWanted && client.supportsScheduledPulses();
+
+    linkUp.store (true, std::memory_order_release);
+    reconnector.restoreComplete();
+    status = "Connected";
+}
+
+void PigpiodTarget::driveIdleLevels (PigpiodClient& client, const int* idleLevel, bool pinsAreOutputs)
+{
+    // Pins the client knows are already idle are left alone, unless a pulse or train
+    // may still be running on them (the mirror doesn't see those). Outputs change
+    // together with one BC1 and one BS1; pins that may not be outputs, or may be
+    // running PWM, need a WRITE each
+    uint32_t lowMask = 0, highMask = 0;
+
+    for (int gpio = 0; gpio < numPins; ++gpio)
+    {
+        if (idleLevel[gpio] < 0)
+            continue;
+
+        if (!pinsAreOutputs && client.isKnownAt (gpio, idleLevel[gpio]))
+            continue;
+
+        if (gpio < 32 && client.getKnownMode (gpio) == PI_OUTPUT)
+        {
+            (idleLevel[gpio] == PI_LOW ? lowMask : highMask) |= 1u << gpio;
+            continue;
+        }
+
+        // WRITE implicitly sets the pin to OUTPUT mode (required for TRIG to work)
+        int writeResult = client.write (gpio, idleLevel[gpio]);
+        if (writeResult == PI_NOT_PERMITTED)
+        {
+            LOGC ("Warning: GPIO ", gpio, " on ", client.getHostname(), " is in use by another client of the server");
+        }
+        else if (writeResult < 0)
+        {
+            LOGC ("Warning: Failed to initialize GPIO ", gpio, " on ", client.getHostname(), " to ",
+                  idleLevel[gpio] ? "HIGH" : "LOW", ": ", writeResult);
+        }
+        else
+        {
+            LOGC ("Initialized GPIO ", gpio, " on ", client.getHostname(), " to ", idleLevel[gpio] ? "HIGH" : "LOW");
+        }
+    }
+
+    int result = lowMask != 0 ? client.clearBank (lowMask) : 0;
+    if (result >= 0 && highMask != 0)
+        result = client.setBank (highMask);
+
+    if (result < 0)
+        LOGC ("Warning: Failed to reset GPIO bank on ", client.getHostname(), " (low 0x",
+              juce::String::toHexString ((juce::int64) lowMask), ", high 0x",
+              juce::String::toHexString ((juce::int64) highMask), "): ", result);
+}
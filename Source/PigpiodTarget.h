@@ -0,0 +1,174 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#pragma once
+
+#include "PigpiodClient.h"
+#include "PigpiodDispatcher.h"
+#include "PigpiodReconnector.h"
+#include "PigpiodRouter.h"
+
+/**
+ * One more Raspberry Pi that routes can send pulses to, alongside the main connection.
+ *
+ * Each target has its own client, sender thread and reconnector, so pulses
+ * fanned out to several Pis leave in parallel and a slow or unreachable Pi
+ * only delays the pulses routed to it. Targets send single pulses, or trains
+ * as scheduled pulses when the server supports TRIGAT; stored trains are
+ * only uploaded to the main Pi.
+ */
+class PigpiodTarget : public PigpiodRouter::Target,
+                      private PigpiodReconnector::Listener,
+                      private juce::AsyncUpdater
+{
+public:
+    /** Number of entries in an idle level table (one per GPIO) */
+    static constexpr int numPins = 64;
+
+    /** Constructor */
+    explicit PigpiodTarget (const juce::String& host);
+
+    /** Destructor */
+    ~PigpiodTarget() override;
+
+    /** Host this target connects to */
+    const juce::String& getHost() const { return host; }
+
+    /** Starts connecting in the background (message thread) */
+    void connect (int port, PigpiodClient::Transport transport);
+
+    /** Returns the pins to idle and closes the connection, or gives up connecting (message thread) */
+    void disconnect();
+
+    /** True while pulses can be sent */
+    bool isLinkUp() const { return linkUp.load (std::memory_order_acquire); }
+
+    /** Sets the idle level of every GPIO routed to this Pi, -1 for unused pins (message thread)
+     *
+     * Pins whose level changed are driven to it at once if connected.
+     */
+    void setIdleLevels (const int* levels);
+
+    /** Sets how the sender thread is scheduled and whether the socket busy-polls (message thread)
+     *
+     * The thread settings apply from the next acquisition start, busy polling from the next connect.
+     */
+    void setSenderSettings (const PigpiodDispatcher::ThreadSettings& settings);
+
+    /** Asks for gpio_server's compact frames from the next connect (message thread) */
+    void setCompactProtocol (bool enabled) { client.setCompactProtocol (enabled); }
+
+    /** Resets the statistics and starts the sender thread (message thread)
+     *
+     * @param wantScheduledPulses true to send TRIGAT at event time + delay, if the server supports it
+     */
+    void startAcquisition (bool wantScheduledPulses);
+
+    /** True between startAcquisition() and stopAcquisition() */
+    bool isSending() const { return dispatcher.isThreadRunning(); }
+
+    /** Stops the sender thread and returns the pins to idle (message thread) */
+    void stopAcquisition();
+
+    /** Queues a pulse or a train of scheduled pulses (audio thread only)
+     *
+     * @param eventTicks High resolution ticks at which the event was acquired, or 0 to fire on arrival
+     * @param delayUs Delay after eventTicks; held on this computer if the server can't schedule pulses
+     */
+    void trigger (int gpio, int pulseUs, int level, int numPulses, int periodUs,
+                  juce::int64 eventTicks, int delayUs) override;
+
+    /** Wakes the sender thread if anything was queued since the last flush (audio thread only) */
+    void flush() override;
+
+    /** Short connection state for the editor */
+    juce::String getStatus() const;
+
+    /** Triggers that arrived while this Pi was unreachable */
+    juce::uint64 getMissedCount() const { return missedCount.load (std::memory_order_relaxed); }
+
+    /** Client, for round-trip and clock statistics */
+    const PigpiodClient& getClient() const { return client; }
+
+    /** Sender thread, for queue statistics */
+    const PigpiodDispatcher& getDispatcher() const { return dispatcher; }
+
+    /** Drives pins to their idle levels (blocking)
+     *
+     * Pins the client's mirror already has at their idle level are skipped, and
+     * pins it knows are outputs are reset with bank commands, so repeating this
+     * with nothing changed costs no round trips.
+     *
+     * @param idleLevel numPins entries: PI_LOW, PI_HIGH or -1 to leave the pin alone
+     * @param pinsAreOutputs true if the pins were already initialised and pulses may
+     *        still be running on them (at stop and disconnect): every pin is then
+     *        reset, even if the mirror has it idle; PWM is stopped with a WRITE
+     */
+    static void driveIdleLevels (PigpiodClient& client, const int* idleLevel, bool pinsAreOutputs);
+
+private:
+    /** PigpiodReconnector::Listener */
+    void connectionLost() override;
+    void connectionRestored() override;
+    void connectionFailed() override;
+
+    /** Finishes a connect or reconnect on the message thread */
+    void handleAsyncUpdate() override;
+
+    /** Sets the pins up after (re)connecting and lets pulses flow (message thread) */
+    void restore();
+
+    const juce::String host;
+
+    PigpiodClient client;
+    PigpiodDispatcher dispatcher;
+
+    /** Message thread: true from a successful connect until disconnect() */
+    bool connected;
+
+    /** Message thread: true from connect() until the attempt succeeds, fails or is cancelled */
+    bool connectPending;
+
+    /** False while the link is down or being set up; gates trigger() */
+    std::atomic<bool> linkUp;
+
+    /** Set by startAcquisition(); schedulePulses also needs a server that supports it */
+    bool scheduleWanted;
+    bool schedulePulses;
+
+    /** True if trigger() queued a frame since the last flush() */
+    bool framesPending;
+
+    /** Idle level of each routed pin (message thread) */
+    int idleLevel[numPins];
+
+    std::atomic<juce::uint64> missedCount;
+
+    juce::String status;
+
+    /** Declared last: its thread uses client and calls back into this */
+    PigpiodReconnector reconnector;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PigpiodTarget);
+};
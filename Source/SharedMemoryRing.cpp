@@ -0,0 +1,113 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SharedMemoryRing.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+SharedMemoryRing::SharedMemoryRing()
+    : region (nullptr)
+{
+}
+
+SharedMemoryRing::~SharedMemoryRing()
+{
+    close();
+}
+
+bool SharedMemoryRing::open (int port)
+{
+    close();
+
+    char name[32];
+    snprintf (name, sizeof (name), "/gpio_server_%d", port);
+
+    const int fd = shm_open (name, O_RDWR, 0);
+
+    if (fd < 0)
+        return false;
+
+    void* map = mmap (nullptr, sizeof (Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close (fd);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    Layout* mapped = static_cast<Layout*> (map);
+
+    if (mapped->magic != GS_SHM_MAGIC || mapped->version != GS_SHM_VERSION
+        || mapped->numSlots != GS_SHM_SLOTS || mapped->slotSize != sizeof (Slot))
+    {
+        munmap (map, sizeof (Layout));
+        return false;
+    }
+
+    region = mapped;
+    return true;
+}
+
+void SharedMemoryRing::close()
+{
+    if (region != nullptr)
+    {
+        munmap (region, sizeof (Layout));
+        region = nullptr;
+    }
+}
+
+bool SharedMemoryRing::push (const PigpiodFrame& frame)
+{
+    if (frame.size > sizeof (Slot::words))
+        return false;
+
+    const uint32_t head = region->head.load (std::memory_order_relaxed);
+
+    if (head - region->tail.load (std::memory_order_acquire) >= GS_SHM_SLOTS)
+        return false;
+
+    Slot& slot = region->slots[head & (GS_SHM_SLOTS - 1)];
+    slot.size = frame.size;
+    memcpy (slot.words, frame.words, frame.size);
+
+    region->head.store (head + 1, std::memory_order_release);
+    return true;
+}
+
+uint64_t SharedMemoryRing::getConsumedCount() const
+{
+    return region != nullptr ? region->consumed.load (std::memory_order_relaxed) : 0;
+}
+
+uint64_t SharedMemoryRing::getLateCount() const
+{
+    return region != nullptr ? region->late.load (std::memory_order_relaxed) : 0;
+}
+
+uint64_t SharedMemoryRing::getRejectedCount() const
+{
+    return region != nullptr ? region->rejected.load (std::memory_order_relaxed) : 0;
+}
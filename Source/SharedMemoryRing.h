@@ -0,0 +1,117 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "PigpiodProtocol.h"
+
+/**
+ * Producer side of gpio_server's shared-memory ring.
+ *
+ * When the GUI and gpio_server run on the same machine, commands can be
+ * written straight into a POSIX shared memory region (/gpio_server_<port>)
+ * that the server's pulse thread polls from its own core. Nothing goes
+ * through the kernel on either side. The layout must match gs_shm_t in
+ * gpio_server.c.
+ *
+ * The ring has a single producer: only one thread may call push().
+ */
+class SharedMemoryRing
+{
+public:
+    SharedMemoryRing();
+    ~SharedMemoryRing();
+
+    /** Maps the region gpio_server created for a port
+     *
+     * @return true if the region exists and has the expected layout
+     */
+    bool open (int port);
+
+    /** Unmaps the region */
+    void close();
+
+    /** True if the region is mapped */
+    bool isOpen() const { return region != nullptr; }
+
+    /** Copies a frame into the ring for the server to run (single producer)
+     *
+     * @return false if the ring is full or the frame is larger than a slot
+     */
+    bool push (const PigpiodFrame& frame);
+
+    /** True if the server runs this command from the ring; anything else has to go over the socket */
+    static bool carries (uint32_t command)
+    {
+        return command == PI_CMD_WRITE || command == PI_CMD_BS1 || command == PI_CMD_BC1
+            || command == PI_CMD_TRIG || command == GS_CMD_TRIGAT || command == GS_CMD_PATPLAY;
+    }
+
+    /** Commands the server has run from the ring */
+    uint64_t getConsumedCount() const;
+
+    /** Scheduled pulses from the ring that started after their deadline */
+    uint64_t getLateCount() const;
+
+    /** Commands the server refused (unknown, or on a pin this client doesn't own) */
+    uint64_t getRejectedCount() const;
+
+private:
+    struct Slot
+    {
+        uint32_t size;
+        uint32_t words[8];
+        uint32_t pad[7];
+    };
+
+    struct Layout
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numSlots;
+        uint32_t slotSize;
+        uint8_t pad0[48];
+        std::atomic<uint32_t> head;
+        uint8_t pad1[60];
+        std::atomic<uint32_t> tail;
+        uint8_t pad2[60];
+        std::atomic<uint64_t> consumed;
+        std::atomic<uint64_t> late;
+        std::atomic<uint64_t> rejected;
+        uint8_t pad3[40];
+        Slot slots[GS_SHM_SLOTS];
+    };
+
+    static_assert (sizeof (Slot) == 64, "Slot must match gs_shm_slot_t");
+    static_assert (offsetof (Layout, head) == 64 && offsetof (Layout, tail) == 128
+                       && offsetof (Layout, consumed) == 192 && offsetof (Layout, slots) == 256,
+                   "Layout must match gs_shm_t");
+    static_assert (std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+                   "Shared atomics must be lock-free to work across processes");
+
+    Layout* region;
+};
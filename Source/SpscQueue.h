@@ -0,0 +1,96 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Fixed-capacity, allocation-free single-producer/single-consumer ring buffer.
+ *
+ * push() may only be called from one thread (e.g. the audio thread) and pop()
+ * from one other thread (e.g. a network sender). Neither call blocks or
+ * allocates, so the producer side is safe to use inside process().
+ *
+ * Capacity must be a power of two; one slot is never used, so at most
+ * Capacity - 1 items can be queued.
+ */
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert (Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                   "SpscQueue capacity must be a power of two");
+
+public:
+    SpscQueue() : head (0), tail (0) {}
+
+    /** Adds an item; returns false without blocking if the queue is full (producer only) */
+    bool push (const T& item)
+    {
+        const size_t t = tail.load (std::memory_order_relaxed);
+        const size_t next = (t + 1) & mask;
+
+        if (next == head.load (std::memory_order_acquire))
+            return false;
+
+        items[t] = item;
+        tail.store (next, std::memory_order_release);
+        return true;
+    }
+
+    /** Removes the oldest item; returns false if the queue is empty (consumer only) */
+    bool pop (T& item)
+    {
+        const size_t h = head.load (std::memory_order_relaxed);
+
+        if (h == tail.load (std::memory_order_acquire))
+            return false;
+
+        item = items[h];
+        head.store ((h + 1) & mask, std::memory_order_release);
+        return true;
+    }
+
+    /** Returns the number of queued items (approximate if called concurrently) */
+    size_t size() const
+    {
+        const size_t t = tail.load (std::memory_order_acquire);
+        const size_t h = head.load (std::memory_order_acquire);
+        return (t - h) & mask;
+    }
+
+    /** Returns true if no items are queued */
+    bool isEmpty() const { return size() == 0; }
+
+    /** Maximum number of items that can be queued at once */
+    static constexpr size_t capacity() { return Capacity - 1; }
+
+private:
+    static constexpr size_t mask = Capacity - 1;
+
+    T items[Capacity];
+
+    alignas (64) std::atomic<size_t> head;
+    alignas (64) std::atomic<size_t> tail;
+};
@@ -3,51 +3,373 @@
  *
  * Implements a subset of pigpiod protocol for minimal latency:
  * - WRITE command (4): Set GPIO level
+ * - BC1 command (12): Clear GPIO 0-31 by mask
+ * - BS1 command (14): Set GPIO 0-31 by mask
  * - TRIG command (37): Generate pulse
+ * - TRIGAT command (200): Generate pulse at a given server time
+ * - TIME command (201): Read the server clock
+ * - UDPSTATS command (202): Read UDP loss counters
+ * - BATCH command (203): Run several commands in one pass
+ * - SHMATTACH command (204): Use the shared-memory ring (same host only)
+ * - EDGESTREAM/EDGEREAD commands (208/209): Stream input edges to the client
+ * - PWM/PRS/PFS commands (5/6/7): Software PWM on any pin, from the pulse thread
+ * - HP command (86): Hardware PWM on the PWM peripheral's pins (BCM2835/BCM2711)
+ * - HELLO command (210): Report capabilities and switch TCP to compact frames
+ * - STATS command (212): Read the server's own latency histograms
  *
- * Uses direct /dev/gpiomem access for fastest possible GPIO control.
+ * Commands are accepted over TCP (pigpiod framing, or compact v2 frames
+ * after HELLO) and, on the same port, over UDP as one sequence-numbered
+ * datagram per command. A single epoll
+ * loop serves every client; each client's commands run in arrival order,
+ * and the first client to drive a pin owns it until it disconnects.
+ * A client on the same host can also attach to a shared-memory ring that
+ * the pulse thread polls, which takes the kernel out of the pulse path.
  *
- * Compile: gcc -O3 -o gpio_server gpio_server.c -lpthread
- * Run: sudo ./gpio_server
+ * Uses direct /dev/gpiomem access for fastest possible GPIO control. The
+ * register layout is picked from the device tree: BCM2835/BCM2711 on
+ * Pi 1-4, and RP1's RIO block on Pi 5 (through /dev/gpiomem0).
+ *
+ * Pulses are generated by a pulse engine: the command loop sets the pin and
+ * queues the clear edge, and a dedicated thread pinned to its own core
+ * busy-polls CLOCK_MONOTONIC to fire it on time. The command loop never
+ * sleeps, so commands keep flowing while pulses are high.
+ *
+ * Compile: gcc -O3 -o gpio_server gpio_server.c -lpthread -lrt
+ * Run: sudo ./gpio_server [-p port] [-c pulse_cpu] [-s] [-b backend]
  */
 
+#define _GNU_SOURCE     // pthread_setaffinity_np, CPU_SET
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <pwd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
 #include <stdint.h>
 #include <time.h>
 #include <errno.h>
 #include <sched.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
-// GPIO Memory Map
+// GPIO Memory Map (physical addresses, only used when /dev/gpiomem* is missing)
+#define BCM2708_PERI_BASE   0x20000000  // RPi 1/Zero
 #define BCM2835_PERI_BASE   0x3F000000  // RPi 2/3
 #define BCM2711_PERI_BASE   0xFE000000  // RPi 4
 #define GPIO_BASE_OFFSET    0x200000
+#define CLK_BASE_OFFSET     0x101000    // clock manager (needs /dev/mem)
+#define PWM_BASE_OFFSET     0x20C000    // PWM peripheral (needs /dev/mem)
+#define RP1_GPIO_PHYS       0x1f000d0000ull // RPi 5: RP1 IO_BANK0, behind PCIe
 #define BLOCK_SIZE          (4*1024)
 
-// GPIO Register offsets
+// BCM2835/BCM2711 GPIO register offsets (32-bit words)
 #define GPFSEL0     0   // Function select
 #define GPSET0      7   // Pin output set
 #define GPCLR0      10  // Pin output clear
 #define GPLEV0      13  // Pin level
 
+// Clock manager and PWM registers (word offsets)
+#define CM_PWMCTL   (0xA0 / 4)
+#define CM_PWMDIV   (0xA4 / 4)
+#define CM_PASSWD   0x5A000000
+#define CM_ENAB     0x10
+#define CM_BUSY     0x80
+#define CM_SRC_PLLD 6
+#define PWM_CTL     0
+#define PWM_RNG1    (0x10 / 4)
+#define PWM_DAT1    (0x14 / 4)
+#define PWM_RNG2    (0x20 / 4)
+#define PWM_DAT2    (0x24 / 4)
+#define PWM_PWEN1   0x01        // channel 1 enable (channel 2 is 8 bits up)
+#define PWM_MSEN1   0x80        // mark-space mode, rather than PWM's bit spreading
+
+// RP1 register blocks within /dev/gpiomem0 (32-bit words)
+#define RP1_IO_BANK0        (0x00000 / 4)   // STATUS, CTRL per GPIO
+#define RP1_SYS_RIO0        (0x10000 / 4)   // OUT, OE, NOSYNC_IN, SYNC_IN
+#define RP1_PADS_BANK0      (0x20000 / 4)   // VOLTAGE_SELECT, then one pad per GPIO
+#define RP1_MAP_SIZE        0x30000
+#define RP1_SET_ALIAS       (0x2000 / 4)    // atomic set/clear views of a block
+#define RP1_CLR_ALIAS       (0x3000 / 4)
+#define RP1_RIO_OUT         0
+#define RP1_RIO_OE          1
+#define RP1_RIO_SYNC_IN     3
+#define RP1_FUNCSEL_MASK    0x1f
+#define RP1_FUNCSEL_RIO     5               // pin driven by software through RIO
+#define RP1_PAD_OD          0x80            // output disable
+#define RP1_PAD_IE          0x40            // input enable
+#define RP1_NUM_GPIO        28              // bank 0: the 40-pin header
+
+#define MAX_GPIO    58
+
 // Command codes
+#define PI_CMD_MODES    0
+#define PI_CMD_MODEG    1
+#define PI_CMD_READ     3
 #define PI_CMD_WRITE    4
+#define PI_CMD_PWM      5
+#define PI_CMD_PRS      6
+#define PI_CMD_PFS      7
+#define PI_CMD_BC1      12
+#define PI_CMD_BS1      14
 #define PI_CMD_TRIG     37
 #define PI_CMD_PIGPV    26
+#define PI_CMD_HP       86
+
+// gpio_server extensions (not in pigpiod, which rejects them)
+#define GS_CMD_TRIGAT   200     // Pulse at a CLOCK_MONOTONIC time
+#define GS_CMD_TIME     201     // Read CLOCK_MONOTONIC (us)
+#define GS_CMD_UDPSTATS 202     // Read UDP loss counters
+#define GS_CMD_BATCH    203     // Run the commands packed in the extension
+#define GS_CMD_SHMATTACH 204    // Let this client use the shared-memory ring
+#define GS_CMD_PATDEF   205     // Upload (part of) a stored pattern
+#define GS_CMD_PATPLAY  206     // Play a stored pattern, now or at a given time
+#define GS_CMD_EDGE     207     // Watch a pin and read its edge timestamps
+#define GS_CMD_EDGESTREAM 208   // Start/stop streaming edges on a pin mask
+#define GS_CMD_EDGEREAD 209     // Read streamed edge records (reply has an extension)
+#define GS_CMD_HELLO    210     // Negotiate the protocol version, read capabilities
+#define GS_CMD_FRAME    211     // Reply code of a compact frame (never a command)
+#define GS_CMD_STATS    212     // Read (and optionally reset) a telemetry histogram
+
+// Protocol versions (HELLO)
+#define GS_PROTOCOL_PIGPIOD 1   // 16-byte pigpiod commands
+#define GS_PROTOCOL_COMPACT 2   // varint-packed frames of several ops (TCP only)
+
+// Capability bits (HELLO reply p1)
+#define GS_CAP_BATCH    0x01    // BATCH
+#define GS_CAP_SCHEDULE 0x02    // TIME and TRIGAT
+#define GS_CAP_PATTERNS 0x04    // PATDEF and PATPLAY
+#define GS_CAP_BANKS    0x08    // BS1 and BC1
+#define GS_CAP_EDGES    0x10    // EDGE, EDGESTREAM and EDGEREAD
+#define GS_CAP_SHM      0x20    // SHMATTACH
+#define GS_CAP_PWM      0x40    // PWM, PRS and PFS
+#define GS_CAP_HW_PWM   0x80    // HP
+#define GS_CAP_COMPACT  0x100   // compact frames
+#define GS_CAP_STATS    0x200   // STATS
+
+// Telemetry histograms (STATS p1)
+#define GS_STATS_RECEIPT 0      // recv() to register write, for TRIG/WRITE/BS1/BC1
+#define GS_STATS_OVERRUN 1      // how late the pulse thread fired each timed edge
+#define GS_STATS_WIDTH   2      // how far each pulse's width was off
+#define GS_STATS_COUNT   3
+#define GS_STATS_RESET   0x1    // STATS p2: start the histogram over before reading it
+
+// Compact frame ops: an opcode byte, then unsigned LEB128 varint arguments
+#define GS_OP_CMD           0   // a whole pigpiod command with its extension; replied to as usual
+#define GS_OP_TRIG_HIGH     1   // gpio, pulse_us
+#define GS_OP_TRIG_LOW      2   // gpio, pulse_us
+#define GS_OP_TRIGAT_HIGH   3   // gpio, pulse_us, target_us
+#define GS_OP_TRIGAT_LOW    4   // gpio, pulse_us, target_us
+#define GS_OP_BS1           5   // mask
+#define GS_OP_BC1           6   // mask
+#define GS_OP_WRITE         7   // gpio, level
+#define GS_OP_PATPLAY       8   // pattern id
+#define GS_OP_PATPLAY_AT    9   // pattern id, target_us
+
+// UDP transport: each datagram is u32 seq, u32 flags, then a normal command
+#define UDP_HEADER_SIZE 8
+#define GS_UDP_ACK      0x1     // Reply even if the client doesn't wait for it
+
+#define MAX_EXT         2048    // Largest extension any command carries (BATCH)
+#define COMPACT_MAX_PAYLOAD (32 + MAX_EXT)  // room for a GS_OP_CMD with a full extension
+
+#define MAX_CLIENTS     16      // Concurrent TCP clients
+#define UDP_OWNER       (MAX_CLIENTS + 1)
+
+// epoll tags for the listening sockets (client sockets use their slot)
+#define EV_LISTEN       MAX_CLIENTS
+#define EV_UDP          (MAX_CLIENTS + 1)
+#define EV_PWM_STOP     (MAX_CLIENTS + 2)
+
+#define PI_INIT_FAILED  -1      // needed hardware unavailable (no /dev/mem, or rp1)
+#define PI_BAD_PARAM    -2
+#define PI_BAD_GPIO     -3
+#define PI_BAD_MODE     -4
+#define PI_NOT_PERMITTED -41    // GPIO owned by another client
+#define PI_BAD_DUTYCYCLE -8
+#define PI_BAD_DUTYRANGE -21
+#define PI_NOT_HPWM_GPIO -95
+#define PI_BAD_HPWM_FREQ -96
+#define PI_BAD_HPWM_DUTY -97
 
+// GPIO modes, as pigpiod numbers them (0-7, the same codes as GPFSEL)
+#define PI_INPUT        0
 #define PI_OUTPUT       1
+#define PI_ALT0         4
+#define PI_ALT1         5
+#define PI_ALT5         2
 
 // Global GPIO memory pointer
 volatile uint32_t *gpio_map = NULL;
 
+// Function of each pin, cached so the hot path never reads GPFSEL
+// (command loop only)
+static uint8_t pin_mode[MAX_GPIO];
+
+/*
+ * GPIO backends
+ *
+ * Each SoC family has a small function table for reading and setting pin
+ * modes. Levels are set, cleared and read through register pointers the
+ * backend fills in at startup, so on every board the hot path stays a
+ * single store with no indirect call.
+ */
+
+typedef struct {
+    const char *name;
+    const char *device;     // gpiomem device exposing just the GPIO block
+    size_t map_size;
+    int num_gpio;
+    uint32_t plld_hz;       // PWM clock source; 0 if the board has no BCM PWM block
+    void (*setup)(void);                // fill in the level register pointers
+    int (*get_mode)(int gpio);          // hardware mode, pigpiod numbering
+    void (*set_mode)(int gpio, int mode);
+} gpio_backend_t;
+
+static const gpio_backend_t *gpio_backend = NULL;
+
+// Physical address of the GPIO block, if the board is known (for hardware PWM)
+static uint64_t gpio_phys_base = 0;
+
+// Pins the board has (commands on other pins fail with PI_BAD_GPIO)
+static int gpio_count = MAX_GPIO;
+static uint32_t gpio_bank0_mask = 0xFFFFFFFF;
+
+// Write-1-to-set, write-1-to-clear and level registers for GPIO 0-31 and 32+
+// (bank 1 is NULL on boards with 32 pins or fewer)
+static volatile uint32_t *gpio_set_reg[2];
+static volatile uint32_t *gpio_clr_reg[2];
+static volatile uint32_t *gpio_lev_reg[2];
+
+static void bcm2835_setup(void)
+{
+    for (int bank = 0; bank < 2; bank++) {
+        gpio_set_reg[bank] = &gpio_map[GPSET0 + bank];
+        gpio_clr_reg[bank] = &gpio_map[GPCLR0 + bank];
+        gpio_lev_reg[bank] = &gpio_map[GPLEV0 + bank];
+    }
+}
+
+static int bcm2835_get_mode(int gpio)
+{
+    return (gpio_map[GPFSEL0 + gpio / 10] >> ((gpio % 10) * 3)) & 7;
+}
+
+static void bcm2835_set_mode(int gpio, int mode)
+{
+    int reg = gpio / 10;
+    int shift = (gpio % 10) * 3;
+
+    uint32_t value = gpio_map[GPFSEL0 + reg];
+    value &= ~(7 << shift);  // Clear 3 bits
+    value |= (uint32_t)(mode & 7) << shift;
+    gpio_map[GPFSEL0 + reg] = value;
+}
+
+// pigpiod codes ALT0-ALT5 as RP1 function numbers, and back
+static const uint8_t rp1_mode_to_funcsel[8] = { 0, 0, 5, 4, 0, 1, 2, 3 };
+static const uint8_t rp1_funcsel_to_mode[6] = { 4, 5, 6, 7, 3, 2 };
+
+static void rp1_setup(void)
+{
+    gpio_set_reg[0] = &gpio_map[RP1_SYS_RIO0 + RP1_SET_ALIAS + RP1_RIO_OUT];
+    gpio_clr_reg[0] = &gpio_map[RP1_SYS_RIO0 + RP1_CLR_ALIAS + RP1_RIO_OUT];
+    gpio_lev_reg[0] = &gpio_map[RP1_SYS_RIO0 + RP1_RIO_SYNC_IN];
+    gpio_set_reg[1] = gpio_clr_reg[1] = gpio_lev_reg[1] = NULL;
+}
+
+static int rp1_get_mode(int gpio)
+{
+    uint32_t funcsel = gpio_map[RP1_IO_BANK0 + gpio * 2 + 1] & RP1_FUNCSEL_MASK;
+
+    if (funcsel == RP1_FUNCSEL_RIO) {
+        return (gpio_map[RP1_SYS_RIO0 + RP1_RIO_OE] >> gpio & 1) ? PI_OUTPUT : PI_INPUT;
+    }
+    // ALT6-8 and "no function" have no pigpiod code; report them as inputs
+    return funcsel < 6 ? rp1_funcsel_to_mode[funcsel] : PI_INPUT;
+}
+
+static void rp1_set_mode(int gpio, int mode)
+{
+    volatile uint32_t *ctrl = &gpio_map[RP1_IO_BANK0 + gpio * 2 + 1];
+    volatile uint32_t *pad = &gpio_map[RP1_PADS_BANK0 + 1 + gpio];
+    uint32_t funcsel = RP1_FUNCSEL_RIO;
+
+    if (mode == PI_INPUT || mode == PI_OUTPUT) {
+        // Direction before function, so the pin never drives with a stale OE
+        volatile uint32_t *oe = &gpio_map[RP1_SYS_RIO0 + RP1_RIO_OE];
+        oe[mode == PI_OUTPUT ? RP1_SET_ALIAS : RP1_CLR_ALIAS] = 1u << gpio;
+    } else {
+        funcsel = rp1_mode_to_funcsel[mode & 7];
+    }
+
+    *ctrl = (*ctrl & ~RP1_FUNCSEL_MASK) | funcsel;
+
+    // Pads come out of reset isolated; RIO's OE decides the direction
+    *pad = (*pad & ~RP1_PAD_OD) | RP1_PAD_IE;
+}
+
+static const gpio_backend_t bcm2835_backend = {
+    "bcm2835", "/dev/gpiomem", BLOCK_SIZE, 54, 500000000, bcm2835_setup, bcm2835_get_mode, bcm2835_set_mode
+};
+
+// Same GPIO registers as BCM2835, with four more pins
+static const gpio_backend_t bcm2711_backend = {
+    "bcm2711", "/dev/gpiomem", BLOCK_SIZE, 58, 750000000, bcm2835_setup, bcm2835_get_mode, bcm2835_set_mode
+};
+
+static const gpio_backend_t rp1_backend = {
+    "rp1", "/dev/gpiomem0", RP1_MAP_SIZE, RP1_NUM_GPIO, 0, rp1_setup, rp1_get_mode, rp1_set_mode
+};
+
+// Boards by their device-tree compatible string, newest first
+static const struct {
+    const char *compatible;
+    const gpio_backend_t *backend;
+    uint64_t phys_base;     // for mapping /dev/mem without gpiomem
+} gpio_boards[] = {
+    { "brcm,bcm2712", &rp1_backend, RP1_GPIO_PHYS },
+    { "brcm,bcm2711", &bcm2711_backend, BCM2711_PERI_BASE + GPIO_BASE_OFFSET },
+    { "brcm,bcm2837", &bcm2835_backend, BCM2835_PERI_BASE + GPIO_BASE_OFFSET },
+    { "brcm,bcm2836", &bcm2835_backend, BCM2835_PERI_BASE + GPIO_BASE_OFFSET },
+    { "brcm,bcm2835", &bcm2835_backend, BCM2708_PERI_BASE + GPIO_BASE_OFFSET },
+};
+#define NUM_GPIO_BOARDS (int)(sizeof(gpio_boards) / sizeof(gpio_boards[0]))
+
+// Index into gpio_boards of the board we run on, or -1 if it isn't one of them
+static int detect_board(void)
+{
+    char compatible[512];
+    int fd = open("/proc/device-tree/compatible", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t len = read(fd, compatible, sizeof(compatible) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    compatible[len] = '\0';
+
+    // A NUL-separated list, most specific first ("raspberrypi,5-model-b", "brcm,bcm2712")
+    for (int i = 0; i < NUM_GPIO_BOARDS; i++) {
+        for (char *entry = compatible; entry < compatible + len; entry += strlen(entry) + 1) {
+            if (strcmp(entry, gpio_boards[i].compatible) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
 // Microsecond delay using nanosleep
 void delay_us(uint32_t us)
 {
@@ -57,22 +379,50 @@ void delay_us(uint32_t us)
     nanosleep(&ts, NULL);
 }
 
-// Initialize GPIO memory mapping
-int init_gpio()
+// Initialize GPIO memory mapping. backend_name forces a backend (-b);
+// NULL picks one from the device tree.
+int init_gpio(const char *backend_name)
 {
-    int mem_fd;
-    void *gpio_base;
-    uint32_t peri_base;
+    int board = detect_board();
+    uint64_t phys_base = board >= 0 ? gpio_boards[board].phys_base : 0;
+
+    if (backend_name != NULL) {
+        const gpio_backend_t *all[] = { &bcm2835_backend, &bcm2711_backend, &rp1_backend };
+        for (int i = 0; i < 3; i++) {
+            if (strcmp(backend_name, all[i]->name) == 0) {
+                gpio_backend = all[i];
+            }
+        }
+        if (gpio_backend == NULL) {
+            fprintf(stderr, "Unknown GPIO backend '%s' (bcm2835, bcm2711 or rp1)\n", backend_name);
+            return -1;
+        }
+        if (board < 0 || gpio_boards[board].backend != gpio_backend) {
+            phys_base = 0;
+        }
+    } else if (board >= 0) {
+        gpio_backend = gpio_boards[board].backend;
+    } else {
+        fprintf(stderr, "Warning: board not recognised, assuming BCM2835 GPIO registers\n");
+        gpio_backend = &bcm2835_backend;
+    }
 
-    // Try to detect Pi version by trying different base addresses
-    mem_fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
+    // gpiomem needs no root and maps just the GPIO block at offset 0;
+    // /dev/mem is only tried where gpiomem is missing
+    off_t offset = 0;
+    int mem_fd = open(gpio_backend->device, O_RDWR | O_SYNC);
+    if (mem_fd < 0 && phys_base != 0) {
+        fprintf(stderr, "Warning: %s: %s, trying /dev/mem\n", gpio_backend->device, strerror(errno));
+        mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+        offset = (off_t)phys_base;
+    }
     if (mem_fd < 0) {
-        perror("Failed to open /dev/gpiomem");
+        perror("Failed to open GPIO memory");
         return -1;
     }
 
     // Map GPIO memory
-    gpio_base = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    void *gpio_base = mmap(NULL, gpio_backend->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, offset);
     close(mem_fd);
 
     if (gpio_base == MAP_FAILED) {
@@ -81,34 +431,65 @@ int init_gpio()
     }
 
     gpio_map = (volatile uint32_t *)gpio_base;
-    printf("GPIO initialized\n");
+    gpio_phys_base = phys_base;
+    gpio_count = gpio_backend->num_gpio;
+    gpio_bank0_mask = gpio_count < 32 ? (1u << gpio_count) - 1 : 0xFFFFFFFF;
+    gpio_backend->setup();
+
+    // Read every pin's function once; after this only gpio_set_mode changes it
+    for (int gpio = 0; gpio < gpio_count; gpio++) {
+        pin_mode[gpio] = (uint8_t)gpio_backend->get_mode(gpio);
+    }
+
+    printf("GPIO initialized (%s backend, %d pins)\n", gpio_backend->name, gpio_count);
     return 0;
 }
 
-// Set GPIO function (INPUT=0, OUTPUT=1)
+// Set GPIO function (a pigpiod mode, 0-7). This is the only writer of
+// the function registers, so pin_mode always matches the hardware.
 void gpio_set_mode(int gpio, int mode)
 {
-    int reg = gpio / 10;
-    int shift = (gpio % 10) * 3;
+    gpio_backend->set_mode(gpio, mode & 7);
+    pin_mode[gpio] = (uint8_t)(mode & 7);
+}
 
-    uint32_t value = gpio_map[GPFSEL0 + reg];
-    value &= ~(7 << shift);  // Clear 3 bits
-    if (mode == PI_OUTPUT) {
-        value |= (1 << shift);  // Set to output
+// Make a pin an output if it isn't one already. Only the first use of a pin
+// costs a GPFSEL read-modify-write; after that this is a cached compare.
+static inline void gpio_ensure_output(int gpio)
+{
+    if (pin_mode[gpio] != PI_OUTPUT) {
+        gpio_set_mode(gpio, PI_OUTPUT);
     }
-    gpio_map[GPFSEL0 + reg] = value;
 }
 
 // Set GPIO high
 void gpio_set(int gpio)
 {
-    gpio_map[GPSET0 + gpio/32] = 1 << (gpio % 32);
+    *gpio_set_reg[gpio / 32] = 1u << (gpio % 32);
 }
 
 // Set GPIO low
 void gpio_clear(int gpio)
 {
-    gpio_map[GPCLR0 + gpio/32] = 1 << (gpio % 32);
+    *gpio_clr_reg[gpio / 32] = 1u << (gpio % 32);
+}
+
+// Read GPIO level
+static inline int gpio_read(int gpio)
+{
+    return (*gpio_lev_reg[gpio / 32] >> (gpio % 32)) & 1;
+}
+
+// Set every GPIO 0-31 whose bit is set, in one register store
+void gpio_set_bank(uint32_t mask)
+{
+    *gpio_set_reg[0] = mask & gpio_bank0_mask;
+}
+
+// Clear every GPIO 0-31 whose bit is set, in one register store
+void gpio_clear_bank(uint32_t mask)
+{
+    *gpio_clr_reg[0] = mask & gpio_bank0_mask;
 }
 
 // Write GPIO level
@@ -121,176 +502,2616 @@ void gpio_write(int gpio, int level)
     }
 }
 
-// Trigger pulse (set high, delay, set low)
-void gpio_trig(int gpio, uint32_t pulse_us, int level)
+// Monotonic time in nanoseconds
+static inline uint64_t now_ns(void)
 {
-    if (level) {
-        // High pulse
-        gpio_set(gpio);
-        delay_us(pulse_us);
-        gpio_clear(gpio);
-    } else {
-        // Low pulse
-        gpio_clear(gpio);
-        delay_us(pulse_us);
-        gpio_set(gpio);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Spin-loop hint
+static inline void cpu_relax(void)
+{
+#if defined(__aarch64__) || defined(__arm__)
+    __asm__ volatile("yield");
+#elif defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile("pause");
+#endif
+}
+
+/*
+ * Telemetry
+ *
+ * The command loop records how long each TRIG, WRITE, BS1 and BC1 took from
+ * recv() returning to its register write; the pulse thread records how late
+ * it fired each timed edge and how far each pulse's width was off. Every
+ * histogram has a single writer, so recording is a relaxed load and store
+ * on the writer's own core, with no locked instructions. STATS reads them.
+ * The buckets match the plugin's LatencyHistogram: 16 linear steps per
+ * power of two of nanoseconds.
+ */
+
+#define STATS_SUB_BITS  4
+#define STATS_SUBS      (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP   36
+#define STATS_BUCKETS   ((STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUBS)
+
+typedef struct {
+    _Atomic uint32_t counts[STATS_BUCKETS];     // written by one thread only
+    uint32_t baseline[STATS_BUCKETS];           // counts at the last reset (command loop only)
+    uint32_t counter_baseline;                  // its counter at the last reset (command loop only)
+} stats_hist_t;
+
+static stats_hist_t stats[GS_STATS_COUNT];
+
+// Reported along with the histograms
+static _Atomic uint32_t stats_heap_full = 0;    // edges fired early because the heap was full (pulse thread)
+static _Atomic uint32_t stats_inline = 0;       // TRIGs timed inline, with no room in the ring (command loop)
+
+// When the bytes of the command being run arrived (command loop only)
+static uint64_t receipt_ns = 0;
+
+static int stats_bucket(uint64_t ns)
+{
+    if (ns < STATS_SUBS) {
+        return (int)ns;
     }
+
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= STATS_MAX_EXP) {
+        return STATS_BUCKETS - 1;
+    }
+
+    int sub = (int)((ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUBS - 1));
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUBS + sub;
+}
+
+// Record one value (only from the histogram's own thread)
+static inline void stats_record(int id, uint64_t ns)
+{
+    _Atomic uint32_t *count = &stats[id].counts[stats_bucket(ns)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
 }
 
-// Handle client connection
-void handle_client(int client_fd)
+static inline void stats_bump(_Atomic uint32_t *counter)
 {
-    uint8_t cmd_buf[16];
-    uint32_t cmd, p1, p2, p3;
-    int n;
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
 
-    // Set TCP_NODELAY for minimal latency
-    int flag = 1;
-    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+// Record how long the command being run took to reach the pins (command loop only)
+static inline void stats_receipt(void)
+{
+    if (receipt_ns != 0) {
+        stats_record(GS_STATS_RECEIPT, now_ns() - receipt_ns);
+    }
+}
 
-    printf("Client connected\n");
+// Copy histogram id's counts since its last reset into out, as a run of
+// u32 counts from its first non-empty bucket to its last. Returns the
+// number of counts and puts the first bucket in *first. With reset the
+// histogram starts over first, so the run is empty (command loop only).
+static int stats_read(uint32_t id, int reset, uint8_t *out, uint32_t *first)
+{
+    stats_hist_t *h = &stats[id];
+    int lo = -1, hi = -1;
 
-    while (1) {
-        // Read 16-byte command header
-        n = recv(client_fd, cmd_buf, 16, MSG_WAITALL);
-        if (n != 16) {
-            if (n == 0) {
-                printf("Client disconnected\n");
-            } else {
-                perror("recv failed");
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        uint32_t count = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (reset) {
+            h->baseline[i] = count;
+        }
+        if (count != h->baseline[i]) {
+            if (lo < 0) {
+                lo = i;
             }
-            break;
+            hi = i;
         }
+    }
 
-        // Parse command
-        memcpy(&cmd, cmd_buf + 0, 4);
-        memcpy(&p1, cmd_buf + 4, 4);
-        memcpy(&p2, cmd_buf + 8, 4);
-        memcpy(&p3, cmd_buf + 12, 4);
+    *first = lo < 0 ? 0 : (uint32_t)lo;
+    for (int i = lo; lo >= 0 && i <= hi; i++) {
+        uint32_t count = atomic_load_explicit(&h->counts[i], memory_order_relaxed) - h->baseline[i];
+        memcpy(out + (i - lo) * 4, &count, 4);
+    }
+    return lo < 0 ? 0 : hi - lo + 1;
+}
 
-        // Response buffer
-        uint8_t res_buf[16] = {0};
-        int32_t status = 0;
+/*
+ * Pulse engine
+ *
+ * The command loop (producer) pushes timed edges onto a lock-free SPSC ring.
+ * The pulse thread (consumer) moves them into a min-heap ordered by deadline
+ * and writes each edge as soon as its deadline passes.
+ *
+ * Each pulse is a START edge (pin to its pulse level) and an END edge (back
+ * to idle). The pulse thread counts active pulses per pin and only returns a
+ * pin to idle when the last overlapping pulse ends, so re-triggering a pin
+ * that is still high extends the pulse instead of ending it early.
+ *
+ * The ring also carries PATTERN entries, which start a stored pattern (see
+ * below) at their deadline.
+ */
 
-        switch (cmd) {
-            case PI_CMD_WRITE: {
-                // WRITE: p1=gpio, p2=level
-                gpio_set_mode(p1, PI_OUTPUT);
-                gpio_write(p1, p2);
-                break;
-            }
+#define PULSE_RING_SIZE     1024    // power of two
+#define PULSE_HEAP_SIZE     4096
 
-            case PI_CMD_TRIG: {
-                // TRIG: p1=gpio, p2=pulse_us, p3=ext_size
-                // Read extension data (level)
-                uint32_t level = 1;
-                if (p3 == 4) {
-                    recv(client_fd, &level, 4, MSG_WAITALL);
-                }
+#define EDGE_START          0
+#define EDGE_END            1
+#define EDGE_PATTERN        2   // start pattern number "gpio" at the deadline
+#define EDGE_PWM            3   // start software PWM on "gpio", or retime it
+#define EDGE_PWM_STOP       4   // stop software PWM on "gpio", leaving it at "level"
 
-                // Ensure GPIO is in output mode
-                gpio_set_mode(p1, PI_OUTPUT);
+#define EDGE_WRITTEN        0x1 // START the command loop already wrote (TRIG): not timed
 
-                // Trigger pulse
-                gpio_trig(p1, p2, level);
-                break;
-            }
+typedef struct {
+    uint64_t deadline_ns;   // CLOCK_MONOTONIC time to write the edge
+    uint8_t gpio;
+    uint8_t level;          // level to write at the deadline
+    uint8_t kind;           // EDGE_START, EDGE_END, ...
+    uint8_t flags;          // EDGE_WRITTEN
+} pulse_edge_t;
 
-            case PI_CMD_PIGPV: {
-                // Version command
-                status = 79;  // Pretend to be pigpio v79
-                break;
-            }
+static pulse_edge_t pulse_ring[PULSE_RING_SIZE];
+static _Atomic uint32_t pulse_ring_head = 0;    // consumer index
+static _Atomic uint32_t pulse_ring_tail = 0;    // producer index
 
-            default:
-                printf("Unknown command: %u\n", cmd);
-                status = -1;
-                break;
-        }
+// Pulses currently running on each pin (pulse thread only)
+static uint32_t pin_active[MAX_GPIO];
 
-        // Send response
-        memcpy(res_buf, &status, 4);
-        send(client_fd, res_buf, 16, 0);
-    }
+// How late the START of each pin's running pulse fired, and whether another
+// pulse overlapped it, which leaves no single width to check (pulse thread only)
+static uint64_t pin_start_late[MAX_GPIO];
+static uint8_t pin_overlapped[MAX_GPIO];
 
-    close(client_fd);
-}
+static pulse_edge_t pulse_heap[PULSE_HEAP_SIZE];
+static int pulse_heap_size = 0;
 
-int main(int argc, char *argv[])
+static int pulse_engine_running = 0;
+
+// Busy-poll for deadlines (needs a core of its own); otherwise sleep until
+// the next deadline, which is what a single-core Pi has to do
+static int pulse_spin = 1;
+
+// Queue a pulse's START and END edges (command loop only); returns 0 if the
+// ring is full. flags go on the START edge
+static int pulse_push(uint64_t start_ns, uint64_t end_ns, uint32_t gpio, uint32_t level, uint8_t flags)
 {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-    int port = 8888;
+    uint32_t tail = atomic_load_explicit(&pulse_ring_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&pulse_ring_head, memory_order_acquire);
 
-    // Set real-time scheduling priority for minimal latency
-    struct sched_param param;
-    param.sched_priority = 99;  // Highest priority
-    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
-        fprintf(stderr, "Warning: Failed to set real-time priority (run with sudo): %s\n", strerror(errno));
-    } else {
-        printf("Real-time priority enabled (SCHED_FIFO, priority 99)\n");
+    if (((head - tail - 1) & (PULSE_RING_SIZE - 1)) < 2) {
+        return 0;
     }
 
-    // Lock memory to prevent paging delays
-    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
-        fprintf(stderr, "Warning: Failed to lock memory: %s\n", strerror(errno));
-    } else {
-        printf("Memory locked to prevent paging\n");
+    pulse_edge_t *start = &pulse_ring[tail];
+    start->deadline_ns = start_ns;
+    start->gpio = (uint8_t)gpio;
+    start->level = (uint8_t)(level != 0);
+    start->kind = EDGE_START;
+    start->flags = flags;
+
+    pulse_edge_t *end = &pulse_ring[(tail + 1) & (PULSE_RING_SIZE - 1)];
+    end->deadline_ns = end_ns;
+    end->gpio = (uint8_t)gpio;
+    end->level = (uint8_t)(level == 0);
+    end->kind = EDGE_END;
+    end->flags = 0;
+
+    atomic_store_explicit(&pulse_ring_tail, (tail + 2) & (PULSE_RING_SIZE - 1), memory_order_release);
+    return 1;
+}
+
+static int edge_before(const pulse_edge_t *a, const pulse_edge_t *b)
+{
+    // END before START at the same instant, so back-to-back pulses don't merge
+    if (a->deadline_ns != b->deadline_ns) {
+        return a->deadline_ns < b->deadline_ns;
     }
+    return a->kind > b->kind;
+}
 
-    // Initialize GPIO
-    if (init_gpio() < 0) {
-        fprintf(stderr, "Failed to initialize GPIO\n");
-        return 1;
+static void pulse_heap_push(const pulse_edge_t *edge)
+{
+    int i = pulse_heap_size++;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!edge_before(edge, &pulse_heap[parent])) {
+            break;
+        }
+        pulse_heap[i] = pulse_heap[parent];
+        i = parent;
     }
+    pulse_heap[i] = *edge;
+}
 
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket failed");
-        return 1;
+static void pulse_heap_pop(void)
+{
+    pulse_edge_t last = pulse_heap[--pulse_heap_size];
+    int i = 0;
+
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= pulse_heap_size) {
+            break;
+        }
+        if (child + 1 < pulse_heap_size && edge_before(&pulse_heap[child + 1], &pulse_heap[child])) {
+            child++;
+        }
+        if (!edge_before(&pulse_heap[child], &last)) {
+            break;
+        }
+        pulse_heap[i] = pulse_heap[child];
+        i = child;
     }
+    pulse_heap[i] = last;
+}
 
-    // Set SO_REUSEADDR to allow quick restarts
-    int reuse = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+/*
+ * Pattern library
+ *
+ * A client uploads a multi-pin edge sequence once (PATDEF) and then starts it
+ * with a single PATPLAY, instead of sending a command per edge. Each step
+ * waits delta_us after the previous one (the first after the start), then
+ * drives its clear_mask pins low and its set_mask pins high with one register
+ * store each. The steps sit in a fixed array covered by mlockall, and the
+ * pulse thread walks them in place.
+ */
 
-    // Bind to port
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+#define GS_MAX_PATTERNS     32
+#define GS_PATTERN_STEPS    256     // steps per pattern (uploaded in chunks)
+#define MAX_PLAYING         64      // plays queued or playing at once, across all patterns
+#define PATTERN_DEFINING    0x80000000u // in queued: PATDEF is rewriting the steps
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind failed");
-        close(server_fd);
-        return 1;
+typedef struct {
+    uint32_t delta_us;      // wait after the previous step
+    uint32_t set_mask;      // GPIO 0-31 to drive high
+    uint32_t clear_mask;    // GPIO 0-31 to drive low
+} pattern_step_t;
+
+typedef struct {
+    pattern_step_t steps[GS_PATTERN_STEPS];
+    uint32_t num_steps;
+    uint32_t pins;              // every pin the steps drive
+    _Atomic int owner;          // client that defined it (0 = free)
+    _Atomic uint32_t queued;    // plays queued or running, or PATTERN_DEFINING
+} pattern_t;
+
+static pattern_t patterns[GS_MAX_PATTERNS];
+
+// Plays queued or running across all patterns; a play holds its place from
+// the moment it is queued, so the pulse thread always has a slot for it
+static _Atomic uint32_t plays_queued = 0;
+
+typedef struct {
+    pattern_t *pattern;
+    uint32_t step;          // next step to write
+    uint64_t next_ns;       // when to write it
+} pattern_play_t;
+
+// Patterns currently playing (pulse thread only)
+static pattern_play_t playing[MAX_PLAYING];
+static int num_playing = 0;
+
+// Count a play of pattern before it is queued. Returns 0 if MAX_PLAYING
+// plays are already queued or running, or PATDEF is rewriting the pattern
+static int pattern_queue(pattern_t *pattern)
+{
+    if (atomic_fetch_add_explicit(&plays_queued, 1, memory_order_relaxed) >= MAX_PLAYING) {
+        atomic_fetch_sub_explicit(&plays_queued, 1, memory_order_relaxed);
+        return 0;
     }
 
-    // Listen
-    if (listen(server_fd, 5) < 0) {
-        perror("listen failed");
-        close(server_fd);
-        return 1;
+    // Acquire pairs with PATDEF's release, so the play sees the new steps
+    uint32_t queued = atomic_load_explicit(&pattern->queued, memory_order_relaxed);
+    do {
+        if (queued & PATTERN_DEFINING) {
+            atomic_fetch_sub_explicit(&plays_queued, 1, memory_order_relaxed);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&pattern->queued, &queued, queued + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+    return 1;
+}
+
+static void pattern_done(pattern_t *pattern)
+{
+    atomic_fetch_sub_explicit(&pattern->queued, 1, memory_order_release);
+    atomic_fetch_sub_explicit(&plays_queued, 1, memory_order_relaxed);
+}
+
+// Start playing a pattern from start_ns (pulse thread only). The play was
+// counted by pattern_queue(), so there is always a slot for it
+static void pattern_start(pattern_t *pattern, uint64_t start_ns)
+{
+    if (pattern->num_steps == 0) {
+        pattern_done(pattern);
+        return;
     }
 
-    printf("GPIO server listening on port %d\n", port);
+    pattern_play_t *play = &playing[num_playing++];
+    play->pattern = pattern;
+    play->step = 0;
+    play->next_ns = start_ns + (uint64_t)pattern->steps[0].delta_us * 1000;
+}
 
-    // Accept connections
-    while (1) {
-        client_len = sizeof(client_addr);
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+// Write every pattern step that is due (pulse thread only). Steps keep to
+// the pattern's own timeline, so a step written late doesn't delay the rest.
+static void pattern_advance(uint64_t now)
+{
+    int i = 0;
 
-        if (client_fd < 0) {
-            perror("accept failed");
-            continue;
+    while (i < num_playing) {
+        pattern_play_t *play = &playing[i];
+        const pattern_t *pattern = play->pattern;
+
+        while (play->step < pattern->num_steps && play->next_ns <= now) {
+            const pattern_step_t *step = &pattern->steps[play->step];
+            if (step->clear_mask) {
+                gpio_clear_bank(step->clear_mask);
+            }
+            if (step->set_mask) {
+                gpio_set_bank(step->set_mask);
+            }
+            if (++play->step < pattern->num_steps) {
+                play->next_ns += (uint64_t)pattern->steps[play->step].delta_us * 1000;
+            }
+        }
+
+        if (play->step == pattern->num_steps) {
+            pattern_done(play->pattern);
+            playing[i] = playing[--num_playing];
+        } else {
+            i++;
         }
+    }
+}
+
+// Earliest pending pattern step (pulse thread only; UINT64_MAX if none)
+static uint64_t pattern_next_deadline(void)
+{
+    uint64_t next = UINT64_MAX;
 
-        // Handle client (single-threaded for now)
-        handle_client(client_fd);
+    for (int i = 0; i < num_playing; i++) {
+        if (playing[i].next_ns < next) {
+            next = playing[i].next_ns;
+        }
+    }
+    return next;
+}
+
+/*
+ * Edge capture
+ *
+ * EDGE starts watching a pin (usually an input wired back from an output),
+ * and the pulse thread samples the level registers on every pass. Each edge
+ * is counted and its time kept in a small per-pin log, which EDGE reads back
+ * by edge number. Only the pulse thread writes the log, so numbering edges
+ * instead of re-arming a watch needs no handshake with the command loop.
+ * With the busy-poll engine a timestamp is within a pass (well under a
+ * microsecond) of the edge; with -s it is only as good as EDGE_POLL_US.
+ */
+
+#define EDGE_LOG_SIZE       16      // timestamps kept per pin (power of two)
+#define EDGE_POLL_US        10      // longest sleep while a pin is watched (-s)
+
+static _Atomic uint64_t edge_watched = 0;   // pins being watched (command loop sets)
+static _Atomic uint32_t edge_count[MAX_GPIO];
+static uint64_t edge_time_ns[MAX_GPIO][EDGE_LOG_SIZE];
+
+/*
+ * Edge streaming
+ *
+ * Pins in edge_streamed are sampled like watched pins, and each of their
+ * edges is also appended to one server-wide record ring. EDGEREAD returns
+ * the records from a sequence number the client keeps, so polling needs no
+ * per-client state here, and a client that falls behind only loses the
+ * records that have since been overwritten (and is told how many).
+ */
+#define EDGE_STREAM_SIZE    4096    // records kept (power of two)
+#define EDGE_READ_MAX       64      // records returned by one EDGEREAD
+#define EDGE_RECORD_SIZE    12
+
+typedef struct {
+    uint32_t time_lo;       // CLOCK_MONOTONIC us
+    uint32_t time_hi;
+    uint32_t gpio_level;    // gpio | new level << 8
+} edge_record_t;
+
+static _Atomic uint64_t edge_streamed = 0;  // pins whose edges are streamed (command loop sets)
+static edge_record_t edge_stream[EDGE_STREAM_SIZE];
+static _Atomic uint32_t edge_stream_head = 0;  // records written so far (pulse thread)
+
+// Sample the watched and streamed pins and log any edges (pulse thread only)
+static void edge_poll(uint64_t watched)
+{
+    static uint64_t prev_watched = 0;
+    static uint64_t prev_level = 0;
+
+    uint64_t level = *gpio_lev_reg[0];
+    if (watched >> 32) {
+        level |= (uint64_t)*gpio_lev_reg[1] << 32;
+    }
+
+    // A newly watched pin only sets its reference level
+    uint64_t changed = (level ^ prev_level) & watched & prev_watched;
+    prev_level = level;
+    prev_watched = watched;
+
+    if (changed == 0) {
+        return;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t streamed = atomic_load_explicit(&edge_streamed, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&edge_stream_head, memory_order_relaxed);
+
+    for (int gpio = 0; gpio < gpio_count; gpio++) {
+        if (changed >> gpio & 1) {
+            uint32_t n = atomic_load_explicit(&edge_count[gpio], memory_order_relaxed) + 1;
+            edge_time_ns[gpio][n & (EDGE_LOG_SIZE - 1)] = now;
+            atomic_store_explicit(&edge_count[gpio], n, memory_order_release);
+
+            if (streamed >> gpio & 1) {
+                // Each record is published before the next one is written, so
+                // the only slot ever being overwritten is the one at the
+                // published head; the fence keeps that publish ahead of the
+                // overwrite for edge_stream_read's re-check
+                atomic_thread_fence(memory_order_release);
+                edge_record_t *record = &edge_stream[head & (EDGE_STREAM_SIZE - 1)];
+                record->time_lo = (uint32_t)(now / 1000);
+                record->time_hi = (uint32_t)(now / 1000 >> 32);
+                record->gpio_level = (uint32_t)gpio | (uint32_t)(level >> gpio & 1) << 8;
+                atomic_store_explicit(&edge_stream_head, ++head, memory_order_release);
+            }
+        }
+    }
+}
+
+// Copy up to max streamed records, starting at sequence number *next, into
+// out. Advances *next past what was copied and returns the number copied;
+// *lost receives how many records before them had already been overwritten.
+// (command loop only)
+static int edge_stream_read(uint32_t *next, uint8_t *out, int max, uint32_t *lost)
+{
+    uint32_t head = atomic_load_explicit(&edge_stream_head, memory_order_acquire);
+    uint32_t seq = *next;
+
+    *lost = 0;
+    if ((int32_t)(head - seq) < 0) {
+        seq = head;     // a sequence from the future (server restarted): start over
+    } else if (head - seq > EDGE_STREAM_SIZE) {
+        *lost = head - seq - EDGE_STREAM_SIZE;
+        seq = head - EDGE_STREAM_SIZE;
+    }
+
+    int count = 0;
+    while (seq != head && count < max) {
+        memcpy(out + count * EDGE_RECORD_SIZE, &edge_stream[seq & (EDGE_STREAM_SIZE - 1)], EDGE_RECORD_SIZE);
+        seq++;
+        count++;
+    }
+
+    // Records the pulse thread overwrote while we copied them are lost too,
+    // including the one in the slot it may be writing now (sequence
+    // after - EDGE_STREAM_SIZE), which could be torn
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t after = atomic_load_explicit(&edge_stream_head, memory_order_relaxed);
+    uint32_t first = seq - (uint32_t)count;
+    if (after - first >= EDGE_STREAM_SIZE) {
+        uint32_t stale = after - first - EDGE_STREAM_SIZE + 1;
+        if (stale > (uint32_t)count) {
+            stale = (uint32_t)count;
+        }
+        memmove(out, out + stale * EDGE_RECORD_SIZE, (count - stale) * EDGE_RECORD_SIZE);
+        count -= (int)stale;
+        *lost += stale;
+    }
+
+    *next = seq;
+    return count;
+}
+
+// Time of edge number n on gpio, in ns (0 if it hasn't happened or has
+// dropped out of the log)
+static uint64_t edge_time(int gpio, uint32_t n)
+{
+    uint32_t count = atomic_load_explicit(&edge_count[gpio], memory_order_acquire);
+
+    if (n == 0 || n > count || count - n >= EDGE_LOG_SIZE) {
+        return 0;
+    }
+    return edge_time_ns[gpio][n & (EDGE_LOG_SIZE - 1)];
+}
+
+/*
+ * Software PWM
+ *
+ * PWM/PRS/PFS run pigpio-style PWM on any output pin, timed by the pulse
+ * thread. The command loop publishes each pin's period and high time, then
+ * queues a PWM ring entry to start the pin or a PWM_STOP entry to stop it;
+ * a running pin picks up new timings at the start of its next cycle. Edges
+ * land within the pulse loop's jitter, which suits the default 800 Hz well
+ * and makes PWM_MAX_FREQ the practical limit.
+ */
+
+#define PWM_DEFAULT_FREQ    800
+#define PWM_DEFAULT_RANGE   255
+#define PWM_MAX_FREQ        40000
+#define PWM_MIN_RANGE       25
+#define PWM_MAX_RANGE       40000
+#define PWM_LEVEL_KEEP      2       // PWM_STOP level: leave the pin as it is
+
+// Each pin's timing, written by the command loop before it queues a PWM entry
+static _Atomic uint32_t pwm_period_ns[MAX_GPIO];
+static _Atomic uint32_t pwm_high_ns[MAX_GPIO];
+
+// PWM/PRS/PFS settings as the client gave them (command loop only)
+static uint32_t pwm_range[MAX_GPIO];
+static uint32_t pwm_freq[MAX_GPIO];
+static uint32_t pwm_duty[MAX_GPIO];
+static uint64_t pwm_pins = 0;       // pins the pulse thread has been told to run
+
+// Running cycles (pulse thread only)
+static uint64_t pwm_running = 0;
+static uint64_t pwm_high = 0;       // running pins in the high part of their cycle
+static uint64_t pwm_cycle_start[MAX_GPIO];
+static uint32_t pwm_cycle_period[MAX_GPIO];
+static uint32_t pwm_cycle_high[MAX_GPIO];
+
+// Queue a single ring entry (command loop only); returns 0 if the ring is full
+static int pulse_push_entry(uint64_t deadline_ns, uint32_t gpio, uint32_t level, uint8_t kind)
+{
+    uint32_t tail = atomic_load_explicit(&pulse_ring_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&pulse_ring_head, memory_order_acquire);
+
+    if (((head - tail - 1) & (PULSE_RING_SIZE - 1)) < 1) {
+        return 0;
+    }
+
+    pulse_edge_t *entry = &pulse_ring[tail];
+    entry->deadline_ns = deadline_ns;
+    entry->gpio = (uint8_t)gpio;
+    entry->level = (uint8_t)level;
+    entry->kind = kind;
+    entry->flags = 0;
+
+    atomic_store_explicit(&pulse_ring_tail, (tail + 1) & (PULSE_RING_SIZE - 1), memory_order_release);
+    return 1;
+}
+
+// Start a cycle at start with the pin's latest timing (pulse thread only)
+static void soft_pwm_begin_cycle(int gpio, uint64_t start)
+{
+    uint64_t bit = 1ull << gpio;
+
+    pwm_cycle_start[gpio] = start;
+    pwm_cycle_period[gpio] = atomic_load_explicit(&pwm_period_ns[gpio], memory_order_relaxed);
+    pwm_cycle_high[gpio] = atomic_load_explicit(&pwm_high_ns[gpio], memory_order_relaxed);
+
+    if (pwm_cycle_high[gpio] > 0 && !(pwm_high & bit)) {
+        gpio_write(gpio, 1);
+        pwm_high |= bit;
+    } else if (pwm_cycle_high[gpio] == 0 && (pwm_high & bit)) {
+        gpio_write(gpio, 0);
+        pwm_high &= ~bit;
+    }
+}
+
+// Stop a pin's cycles where they are (pulse thread only)
+static void soft_pwm_halt(int gpio)
+{
+    pwm_running &= ~(1ull << gpio);
+    pwm_high &= ~(1ull << gpio);
+}
+
+// Act on a PWM or PWM_STOP ring entry (pulse thread only)
+static void soft_pwm_control(const pulse_edge_t *entry)
+{
+    uint64_t bit = 1ull << entry->gpio;
+
+    if (entry->kind == EDGE_PWM_STOP) {
+        soft_pwm_halt(entry->gpio);
+        if (entry->level != PWM_LEVEL_KEEP) {
+            gpio_write(entry->gpio, entry->level);
+        }
+    } else if (!(pwm_running & bit)) {
+        pwm_running |= bit;
+        soft_pwm_begin_cycle(entry->gpio, now_ns());
+    }
+    // A pin already running takes its new timing at its next cycle
+}
+
+// Write the PWM edges that are due. Returns when the next one is due
+// (UINT64_MAX if no pin is running). Pulse thread only.
+static uint64_t soft_pwm_advance(uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (int gpio = 0; gpio < gpio_count; gpio++) {
+        uint64_t bit = 1ull << gpio;
+        if (!(pwm_running & bit)) {
+            continue;
+        }
+
+        uint64_t end = pwm_cycle_start[gpio] + pwm_cycle_period[gpio];
+        if (now >= end) {
+            // Cycles missed entirely (the thread was held up) are skipped, not replayed
+            soft_pwm_begin_cycle(gpio, now - end >= pwm_cycle_period[gpio] ? now : end);
+            end = pwm_cycle_start[gpio] + pwm_cycle_period[gpio];
+        }
+
+        // A full duty cycle never falls
+        if ((pwm_high & bit) && pwm_cycle_high[gpio] < pwm_cycle_period[gpio]) {
+            uint64_t fall = pwm_cycle_start[gpio] + pwm_cycle_high[gpio];
+            if (now >= fall) {
+                gpio_write(gpio, 0);
+                pwm_high &= ~bit;
+            } else if (fall < next) {
+                next = fall;
+            }
+        }
+
+        if (end < next) {
+            next = end;
+        }
+    }
+
+    return next;
+}
+
+// Publish gpio's timing and start, retime or stop its PWM to match
+// pwm_duty (command loop only). Returns 0, or -1 if it couldn't be queued.
+static int soft_pwm_update(uint32_t gpio)
+{
+    uint64_t bit = 1ull << gpio;
+
+    if (!pulse_engine_running) {
+        return -1;
+    }
+
+    if (pwm_duty[gpio] == 0) {
+        if (pwm_pins & bit) {
+            if (!pulse_push_entry(0, gpio, 0, EDGE_PWM_STOP)) {
+                return -1;
+            }
+            pwm_pins &= ~bit;
+        }
+        return 0;
+    }
+
+    uint32_t period = 1000000000u / pwm_freq[gpio];
+    uint32_t high = (uint32_t)((uint64_t)period * pwm_duty[gpio] / pwm_range[gpio]);
+    atomic_store_explicit(&pwm_period_ns[gpio], period, memory_order_relaxed);
+    atomic_store_explicit(&pwm_high_ns[gpio], high, memory_order_relaxed);
+
+    // The ring's release store publishes the timing with the entry
+    if (!pulse_push_entry(0, gpio, 0, EDGE_PWM)) {
+        return -1;
+    }
+    pwm_pins |= bit;
+    return 0;
+}
+
+// Stop software PWM on gpio before something else drives it, leaving the
+// pin at level (or PWM_LEVEL_KEEP). Returns 0, or -1 if the stop couldn't
+// be queued and the pin is still running. Command loop only.
+static int soft_pwm_stop(uint32_t gpio, uint32_t level)
+{
+    uint64_t bit = 1ull << gpio;
+
+    pwm_duty[gpio] = 0;
+    if (pwm_pins & bit) {
+        if (!pulse_push_entry(0, gpio, level, EDGE_PWM_STOP)) {
+            return -1;
+        }
+        pwm_pins &= ~bit;
+    }
+    return 0;
+}
+
+static void pulse_edge_fire(const pulse_edge_t *edge)
+{
+    if (edge->kind == EDGE_PATTERN) {
+        pattern_start(&patterns[edge->gpio], edge->deadline_ns);
+    } else if (edge->kind == EDGE_START) {
+        pin_active[edge->gpio]++;
+        gpio_write(edge->gpio, edge->level);
+    } else if (pin_active[edge->gpio] > 0 && --pin_active[edge->gpio] == 0) {
+        gpio_write(edge->gpio, edge->level);
+    }
+}
+
+// Fire a due edge from the heap and record how late it was; the END that
+// returns a pin to idle also records how far its pulse's width was off
+// (pulse thread only)
+static void pulse_edge_fire_timed(const pulse_edge_t *edge)
+{
+    int was_active = edge->kind == EDGE_PATTERN ? 0 : pin_active[edge->gpio] > 0;
+
+    pulse_edge_fire(edge);
+
+    uint64_t late = now_ns() - edge->deadline_ns;
+
+    if (edge->kind == EDGE_START) {
+        if (!was_active) {
+            pin_start_late[edge->gpio] = (edge->flags & EDGE_WRITTEN) ? 0 : late;
+            pin_overlapped[edge->gpio] = 0;
+        } else {
+            pin_overlapped[edge->gpio] = 1;
+        }
+        if (edge->flags & EDGE_WRITTEN) {
+            return;
+        }
+    } else if (edge->kind == EDGE_END && was_active && pin_active[edge->gpio] == 0
+               && !pin_overlapped[edge->gpio]) {
+        uint64_t start_late = pin_start_late[edge->gpio];
+        stats_record(GS_STATS_WIDTH, late > start_late ? late - start_late : start_late - late);
+    }
+
+    stats_record(GS_STATS_OVERRUN, late);
+}
+
+static void shm_poll(void);
+
+// Pulse thread: drain the ring, fire due edges, spin
+static void *pulse_thread(void *arg)
+{
+    int cpu = *(int *)arg;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Warning: Failed to pin pulse thread to CPU %d\n", cpu);
+        } else {
+            printf("Pulse thread pinned to CPU %d\n", cpu);
+        }
+    }
+
+    struct sched_param param;
+    param.sched_priority = 99;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    while (1) {
+        uint32_t head = atomic_load_explicit(&pulse_ring_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&pulse_ring_tail, memory_order_acquire);
+
+        while (head != tail) {
+            pulse_edge_t edge = pulse_ring[head];
+            head = (head + 1) & (PULSE_RING_SIZE - 1);
+
+            if (edge.kind == EDGE_PWM || edge.kind == EDGE_PWM_STOP) {
+                soft_pwm_control(&edge);
+            } else if (pulse_heap_size < PULSE_HEAP_SIZE) {
+                pulse_heap_push(&edge);
+            } else {
+                // Heap full: fire early rather than lose the edge
+                if (edge.kind == EDGE_START || edge.kind == EDGE_END) {
+                    pin_overlapped[edge.gpio] = 1;
+                }
+                stats_bump(&stats_heap_full);
+                pulse_edge_fire(&edge);
+            }
+        }
+        atomic_store_explicit(&pulse_ring_head, head, memory_order_release);
+
+        // Commands from a same-host client arrive here without a syscall
+        shm_poll();
+
+        uint64_t pwm_next = UINT64_MAX;
+        if (pulse_heap_size > 0 || num_playing > 0 || pwm_running) {
+            uint64_t now = now_ns();
+            while (pulse_heap_size > 0 && pulse_heap[0].deadline_ns <= now) {
+                pulse_edge_t edge = pulse_heap[0];
+                pulse_heap_pop();
+                pulse_edge_fire_timed(&edge);
+            }
+            pattern_advance(now);
+            if (pwm_running) {
+                pwm_next = soft_pwm_advance(now);
+            }
+        }
+
+        uint64_t watched = atomic_load_explicit(&edge_watched, memory_order_acquire)
+                         | atomic_load_explicit(&edge_streamed, memory_order_acquire);
+        if (watched) {
+            edge_poll(watched);
+        }
+
+        if (pulse_spin) {
+            cpu_relax();
+        } else {
+            // Sleep until the next deadline, or briefly when idle
+            uint64_t wake = pulse_heap_size > 0 ? pulse_heap[0].deadline_ns : now_ns() + 100000;
+            uint64_t step = pattern_next_deadline();
+            if (step < wake) {
+                wake = step;
+            }
+            if (pwm_next < wake) {
+                wake = pwm_next;
+            }
+            if (watched && now_ns() + EDGE_POLL_US * 1000 < wake) {
+                wake = now_ns() + EDGE_POLL_US * 1000;
+            }
+            struct timespec ts;
+            ts.tv_sec = (time_t)(wake / 1000000000ull);
+            ts.tv_nsec = (long)(wake % 1000000000ull);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+// Start the pulse thread, pinned to the given CPU (-1 for no pinning)
+int start_pulse_engine(int *cpu)
+{
+    pthread_t thread;
+
+    for (int gpio = 0; gpio < MAX_GPIO; gpio++) {
+        pwm_range[gpio] = PWM_DEFAULT_RANGE;
+        pwm_freq[gpio] = PWM_DEFAULT_FREQ;
+    }
+
+    if (pthread_create(&thread, NULL, pulse_thread, cpu) != 0) {
+        perror("Failed to start pulse thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    pulse_engine_running = 1;
+    printf("Pulse engine started (%s)\n", pulse_spin ? "busy-poll" : "sleep until deadline");
+    return 0;
+}
+
+// Trigger pulse: set the pin now and let the pulse engine restore it
+void gpio_trig(int gpio, uint32_t pulse_us, int level)
+{
+    if (gpio < 0 || gpio >= gpio_count) {
+        return;
+    }
+
+    // Queue the edges before driving the pin: the START, due now, then fires
+    // after any older END on this pin that is already due, so that END can't
+    // cut the new pulse short. It repeats the write below; it only registers
+    // the pulse
+    uint64_t now = now_ns();
+    if (pulse_engine_running && pulse_push(now, now + (uint64_t)pulse_us * 1000, gpio, level, EDGE_WRITTEN)) {
+        gpio_write(gpio, level);
+        return;
+    }
+
+    // No engine or ring full: fall back to timing the pulse inline
+    stats_bump(&stats_inline);
+    gpio_write(gpio, level);
+    delay_us(pulse_us);
+    gpio_write(gpio, !level);
+}
+
+// Schedule a pulse to start at target_us (CLOCK_MONOTONIC microseconds).
+// Returns how late the pulse started in microseconds (0 if on time),
+// or -1 if it could not be queued.
+int32_t gpio_trig_at(int gpio, uint32_t pulse_us, int level, uint64_t target_us)
+{
+    if (gpio < 0 || gpio >= gpio_count || !pulse_engine_running) {
+        return -1;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t start = target_us * 1000;
+    int32_t late_us = 0;
+
+    if (start < now) {
+        uint64_t late = (now - start) / 1000;
+        late_us = late > INT32_MAX ? INT32_MAX : (int32_t)late;
+        start = now;
+    }
+
+    if (!pulse_push(start, start + (uint64_t)pulse_us * 1000, gpio, level, 0)) {
+        return -1;
+    }
+    return late_us;
+}
+
+// Queue a PATTERN entry that starts pattern id at start_ns (command loop
+// only); returns 0 if the ring is full
+static int pattern_push(uint64_t start_ns, uint32_t id)
+{
+    return pulse_push_entry(start_ns, id, 0, EDGE_PATTERN);
+}
+
+// Play pattern id at target_us (CLOCK_MONOTONIC microseconds), or now if
+// target_us is 0. Returns how late it started in microseconds (0 if on
+// time), or -1 if it could not be queued (ring full, or MAX_PLAYING plays
+// already queued or running).
+int32_t pattern_play_at(uint32_t id, uint64_t target_us)
+{
+    if (!pulse_engine_running) {
+        return -1;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t start = target_us * 1000;
+    int32_t late_us = 0;
+
+    if (start < now) {
+        if (target_us != 0) {
+            uint64_t late = (now - start) / 1000;
+            late_us = late > INT32_MAX ? INT32_MAX : (int32_t)late;
+        }
+        start = now;
+    }
+
+    if (!pattern_queue(&patterns[id])) {
+        return -1;
+    }
+    if (!pattern_push(start, id)) {
+        pattern_done(&patterns[id]);
+        return -1;
+    }
+    return late_us;
+}
+
+// Commands whose p3 is the length of extension data following the header
+static int command_has_ext(uint32_t cmd)
+{
+    return cmd == PI_CMD_TRIG || cmd == GS_CMD_TRIGAT || cmd == GS_CMD_BATCH
+        || cmd == GS_CMD_PATDEF || cmd == GS_CMD_PATPLAY || cmd == PI_CMD_HP;
+}
+
+// UDP sender state: one active peer, identified by its address
+typedef struct {
+    struct sockaddr_in addr;
+    uint32_t last_seq;
+    uint64_t received;
+    uint64_t dropped;   // sequence numbers skipped (datagrams lost on the way)
+    uint64_t late;      // datagrams arriving after a newer one (discarded)
+} udp_peer_t;
+
+static udp_peer_t udp_peer;
+
+// TCP client state. Commands are parsed incrementally, so a client that
+// stalls mid-command never blocks the others.
+typedef struct {
+    int fd;                     // -1 if the slot is free
+    uint8_t buf[COMPACT_MAX_PAYLOAD];
+    uint32_t have;              // bytes of the current command received
+    uint32_t need;              // bytes of it kept in buf (16 until the header is parsed)
+    uint32_t skip;              // extension bytes beyond MAX_EXT still to discard
+    int compact;                // sending compact frames (after HELLO)
+    int reply;                  // compact: the frame being read asked for a reply
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+
+// Pin ownership: the first client to drive a pin owns it until it disconnects.
+// Owner ids are the client slot + 1 for TCP and UDP_OWNER for the UDP peer.
+// Atomic because the pulse thread checks it for shared-memory commands.
+static _Atomic int pin_owner[MAX_GPIO];
+
+// Claim every pin in mask for owner. Fails, claiming nothing, if any of
+// them belongs to someone else.
+static int claim_pins(uint64_t mask, int owner)
+{
+    for (int gpio = 0; gpio < MAX_GPIO; gpio++) {
+        if ((mask >> gpio & 1) && pin_owner[gpio] != 0 && pin_owner[gpio] != owner) {
+            return 0;
+        }
+    }
+    for (int gpio = 0; gpio < MAX_GPIO; gpio++) {
+        if (mask >> gpio & 1) {
+            pin_owner[gpio] = owner;
+        }
+    }
+    return 1;
+}
+
+static int pwm_stop(uint32_t gpio, uint32_t level);
+
+static void release_pins(int owner)
+{
+    uint64_t released = 0;
+
+    for (int gpio = 0; gpio < MAX_GPIO; gpio++) {
+        if (pin_owner[gpio] == owner) {
+            pin_owner[gpio] = 0;
+            released |= 1ull << gpio;
+            if (pwm_stop(gpio, 0) < 0) {
+                fprintf(stderr, "Warning: GPIO %d left running PWM (pulse ring full)\n", gpio);
+            }
+        }
+    }
+
+    // Stop watching pins nobody owns any more (their edge counts carry on)
+    atomic_fetch_and_explicit(&edge_watched, ~released, memory_order_release);
+    atomic_fetch_and_explicit(&edge_streamed, ~released, memory_order_release);
+
+    // A pattern still playing finishes; it can't be redefined until then
+    for (int id = 0; id < GS_MAX_PATTERNS; id++) {
+        if (patterns[id].owner == owner) {
+            patterns[id].owner = 0;
+        }
+    }
+}
+
+// Pins a command drives (0 for commands that don't touch any)
+static uint64_t command_pins(uint32_t cmd, uint32_t p1)
+{
+    switch (cmd) {
+        case PI_CMD_MODES:
+        case PI_CMD_WRITE:
+        case PI_CMD_TRIG:
+        case GS_CMD_TRIGAT:
+        case GS_CMD_EDGE:
+        case PI_CMD_PWM:
+        case PI_CMD_PRS:
+        case PI_CMD_PFS:
+        case PI_CMD_HP:
+            return p1 < (uint32_t)gpio_count ? 1ull << p1 : 0;
+        case PI_CMD_BS1:
+        case PI_CMD_BC1:
+        case GS_CMD_EDGESTREAM:
+            return p1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Hardware PWM
+ *
+ * HP drives one of the BCM PWM peripheral's two channels in mark-space
+ * mode, clocked from PLLD / 2, so its edges carry no software jitter. The
+ * clock manager and PWM blocks aren't part of gpiomem: the first HP maps
+ * them from /dev/mem, which needs root. RP1 boards have a different PWM
+ * block and no HP.
+ */
+
+#define HPWM_CLOCK_DIV      2
+#define HPWM_DUTY_RANGE     1000000     // HP duty cycles are in millionths
+
+typedef struct {
+    uint8_t gpio;
+    uint8_t channel;
+    uint8_t mode;           // function that routes the channel to the pin
+} hw_pwm_pin_t;
+
+static const hw_pwm_pin_t hw_pwm_pins[] = {
+    { 12, 0, PI_ALT0 }, { 13, 1, PI_ALT0 }, { 18, 0, PI_ALT5 }, { 19, 1, PI_ALT5 },
+    { 40, 0, PI_ALT0 }, { 41, 1, PI_ALT0 }, { 45, 1, PI_ALT0 },
+    { 52, 0, PI_ALT1 }, { 53, 1, PI_ALT1 },
+};
+
+static volatile uint32_t *clk_map = NULL;
+static volatile uint32_t *pwm_map = NULL;
+static int hw_pwm_state = 0;            // 0 = not mapped yet, 1 = ready, -1 = unavailable
+static int hw_pwm_gpio[2] = { -1, -1 }; // pin each channel is routed to
+static _Atomic uint64_t hw_pwm_mask = 0; // the same pins, for the pulse thread
+
+static const hw_pwm_pin_t *hw_pwm_pin(uint32_t gpio)
+{
+    if (gpio_backend->plld_hz == 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(hw_pwm_pins) / sizeof(hw_pwm_pins[0]); i++) {
+        if (hw_pwm_pins[i].gpio == gpio && gpio < (uint32_t)gpio_count) {
+            return &hw_pwm_pins[i];
+        }
+    }
+    return NULL;
+}
+
+// Map the clock and PWM blocks and start the PWM clock. Tried once; returns 0 if usable
+static int hw_pwm_init(void)
+{
+    if (hw_pwm_state != 0) {
+        return hw_pwm_state > 0 ? 0 : -1;
+    }
+    hw_pwm_state = -1;
+
+    if (gpio_phys_base == 0) {
+        fprintf(stderr, "Hardware PWM unavailable: board not recognised\n");
+        return -1;
+    }
+
+    uint64_t peri_base = gpio_phys_base - GPIO_BASE_OFFSET;
+    int mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (mem_fd < 0) {
+        fprintf(stderr, "Hardware PWM unavailable: /dev/mem: %s (run with sudo)\n", strerror(errno));
+        return -1;
+    }
+
+    void *clk = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, (off_t)(peri_base + CLK_BASE_OFFSET));
+    void *pwm = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, (off_t)(peri_base + PWM_BASE_OFFSET));
+    close(mem_fd);
+
+    if (clk == MAP_FAILED || pwm == MAP_FAILED) {
+        perror("Hardware PWM unavailable: mmap failed");
+        if (clk != MAP_FAILED) {
+            munmap(clk, BLOCK_SIZE);
+        }
+        if (pwm != MAP_FAILED) {
+            munmap(pwm, BLOCK_SIZE);
+        }
+        return -1;
+    }
+
+    clk_map = (volatile uint32_t *)clk;
+    pwm_map = (volatile uint32_t *)pwm;
+
+    // The divider only changes with the clock stopped, and PWM off while it is
+    pwm_map[PWM_CTL] = 0;
+    clk_map[CM_PWMCTL] = CM_PASSWD | CM_SRC_PLLD;
+    for (int i = 0; i < 1000 && (clk_map[CM_PWMCTL] & CM_BUSY); i++) {
+        delay_us(1);
+    }
+    clk_map[CM_PWMDIV] = CM_PASSWD | (HPWM_CLOCK_DIV << 12);
+    clk_map[CM_PWMCTL] = CM_PASSWD | CM_SRC_PLLD | CM_ENAB;
+
+    hw_pwm_state = 1;
+    printf("Hardware PWM clock at %u Hz\n", gpio_backend->plld_hz / HPWM_CLOCK_DIV);
+    return 0;
+}
+
+// Turn a channel off and leave its pin an output, low (command loop only)
+static void hw_pwm_off(int channel)
+{
+    int gpio = hw_pwm_gpio[channel];
+
+    pwm_map[PWM_CTL] &= ~((uint32_t)(PWM_PWEN1 | PWM_MSEN1) << (channel * 8));
+    gpio_clear(gpio);
+    gpio_set_mode(gpio, PI_OUTPUT);
+    hw_pwm_gpio[channel] = -1;
+    atomic_fetch_and_explicit(&hw_pwm_mask, ~(1ull << gpio), memory_order_release);
+}
+
+// Start, change or (freq 0) stop hardware PWM on gpio for owner. Returns
+// 0 or a pigpiod error; a channel can only move to another pin of owner's.
+static int32_t hw_pwm_set(uint32_t gpio, uint32_t freq, uint32_t duty, int owner)
+{
+    const hw_pwm_pin_t *pin = hw_pwm_pin(gpio);
+
+    if (pin == NULL) {
+        return PI_NOT_HPWM_GPIO;
+    }
+    if (duty > HPWM_DUTY_RANGE) {
+        return PI_BAD_HPWM_DUTY;
+    }
+
+    int other = hw_pwm_gpio[pin->channel];
+    if (freq == 0) {
+        if (other == (int)gpio) {
+            hw_pwm_off(pin->channel);
+        }
+        return 0;
+    }
+
+    uint32_t clock = gpio_backend->plld_hz / HPWM_CLOCK_DIV;
+    if (freq > clock / 2) {
+        return PI_BAD_HPWM_FREQ;
+    }
+    if (hw_pwm_init() < 0) {
+        return PI_INIT_FAILED;
+    }
+    if (other >= 0 && other != (int)gpio) {
+        if (pin_owner[other] != owner) {
+            return PI_NOT_PERMITTED;
+        }
+        hw_pwm_off(pin->channel);
+    }
+
+    uint32_t range = clock / freq;
+    uint32_t data = (uint32_t)((uint64_t)range * duty / HPWM_DUTY_RANGE);
+    int shift = pin->channel * 8;
+
+    if (soft_pwm_stop(gpio, PWM_LEVEL_KEEP) < 0) {
+        return PI_INIT_FAILED;
+    }
+    pwm_map[pin->channel ? PWM_RNG2 : PWM_RNG1] = range;
+    pwm_map[pin->channel ? PWM_DAT2 : PWM_DAT1] = data;
+    pwm_map[PWM_CTL] |= (uint32_t)(PWM_PWEN1 | PWM_MSEN1) << shift;
+    if (pin_mode[gpio] != pin->mode) {
+        gpio_set_mode(gpio, pin->mode);
+    }
+    hw_pwm_gpio[pin->channel] = (int)gpio;
+    atomic_fetch_or_explicit(&hw_pwm_mask, 1ull << gpio, memory_order_release);
+    return 0;
+}
+
+// Stop whatever PWM drives gpio before something else does, leaving a
+// software PWM pin at level (or PWM_LEVEL_KEEP). Returns 0, or -1 if
+// software PWM is still running (its ring is full); command loop only
+static int pwm_stop(uint32_t gpio, uint32_t level)
+{
+    if ((pwm_pins >> gpio & 1) && soft_pwm_stop(gpio, level) < 0) {
+        return -1;
+    }
+    for (int channel = 0; channel < 2; channel++) {
+        if (hw_pwm_gpio[channel] == (int)gpio) {
+            hw_pwm_off(channel);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Shared-memory transport
+ *
+ * A client on the same host attaches over TCP (SHMATTACH), then writes
+ * commands into a single-producer ring in the POSIX shared memory region
+ * /gpio_server_<port>. The pulse thread consumes them on its own core, so a
+ * pulse costs no syscall on either side. Only pin commands on pins the
+ * attached client already owns are accepted (so pins must be set up over
+ * TCP first); there are no replies, just counters in the region.
+ */
+
+#define GS_SHM_MAGIC    0x4D485347  // "GSHM"
+#define GS_SHM_VERSION  1
+#define GS_SHM_SLOTS    1024        // power of two
+
+typedef struct {
+    uint32_t size;          // bytes used in words (header + extension)
+    uint32_t words[8];      // command header and extension, as on the wire
+    uint32_t pad[7];
+} gs_shm_slot_t;            // one cache line
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint8_t pad0[48];
+    _Atomic uint32_t head;      // producer index (free-running)
+    uint8_t pad1[60];
+    _Atomic uint32_t tail;      // consumer index (free-running)
+    uint8_t pad2[60];
+    _Atomic uint64_t consumed;
+    _Atomic uint64_t late;      // TRIGATs that started after their deadline
+    _Atomic uint64_t rejected;  // unknown commands, pins not owned, or on hardware PWM
+    uint8_t pad3[40];
+    gs_shm_slot_t slots[GS_SHM_SLOTS];
+} gs_shm_t;
+
+static gs_shm_t *shm = NULL;
+static _Atomic int shm_owner = 0;   // client allowed to use the ring (0 = none)
+
+static char shm_name[32];
+
+// Pins whose PWM a ring command ran into. The pulse thread sets them and
+// wakes the command loop through pwm_stop_fd, which finishes the stop with
+// pwm_stop() so its PWM settings can't restart the pin later
+static _Atomic uint64_t shm_pwm_stops = 0;
+static int pwm_stop_fd = -1;
+
+// Create the shared-memory region for this port, readable and writable
+// only by uid (0 on success)
+static int shm_init(int port, uid_t uid, gid_t gid)
+{
+    snprintf(shm_name, sizeof(shm_name), "/gpio_server_%d", port);
+    shm_unlink(shm_name);
+
+    int fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // The GUI usually runs as a normal user while the server runs as root,
+    // so the region is handed to that user rather than opened to everyone
+    if (fchown(fd, uid, gid) < 0 || fchmod(fd, 0600) < 0) {
+        close(fd);
+        shm_unlink(shm_name);
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(gs_shm_t)) < 0) {
+        close(fd);
+        shm_unlink(shm_name);
+        return -1;
+    }
+
+    void *map = mmap(NULL, sizeof(gs_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(shm_name);
+        return -1;
+    }
+
+    gs_shm_t *region = map;
+    memset(region, 0, sizeof(*region));
+    region->version = GS_SHM_VERSION;
+    region->num_slots = GS_SHM_SLOTS;
+    region->slot_size = sizeof(gs_shm_slot_t);
+    atomic_thread_fence(memory_order_release);
+    region->magic = GS_SHM_MAGIC;
+
+    shm = region;
+    return 0;
+}
+
+static int pins_owned_by(uint64_t mask, int owner)
+{
+    for (int gpio = 0; gpio < MAX_GPIO; gpio++) {
+        if ((mask >> gpio & 1) && pin_owner[gpio] != owner) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Queue a pulse straight into the heap (pulse thread only)
+static int shm_pulse(uint64_t start_ns, uint32_t gpio, uint32_t pulse_us, uint32_t level)
+{
+    if (pulse_heap_size > PULSE_HEAP_SIZE - 2) {
+        return 0;
+    }
+
+    pulse_edge_t start = { start_ns, (uint8_t)gpio, (uint8_t)(level != 0), EDGE_START, 0 };
+    pulse_edge_t end = { start_ns + (uint64_t)pulse_us * 1000, (uint8_t)gpio, (uint8_t)(level == 0), EDGE_END, 0 };
+    pulse_heap_push(&start);
+    pulse_heap_push(&end);
+    return 1;
+}
+
+// Start a pattern from a PATPLAY in the ring (pulse thread only)
+static int shm_pattern(const gs_shm_slot_t *slot, int owner)
+{
+    uint32_t id = slot->words[1], p3 = slot->words[3];
+
+    if (owner == 0 || id >= GS_MAX_PATTERNS || patterns[id].owner != owner
+        || pulse_heap_size >= PULSE_HEAP_SIZE) {
+        return 0;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t start = now;
+    if (p3 == 8 && slot->size >= 24) {
+        start = ((uint64_t)slot->words[4] | ((uint64_t)slot->words[5] << 32)) * 1000;
+        if (start < now) {
+            atomic_fetch_add_explicit(&shm->late, 1, memory_order_relaxed);
+            start = now;
+        }
+    }
+
+    if (!pattern_queue(&patterns[id])) {
+        return 0;
+    }
+    pulse_edge_t entry = { start, (uint8_t)id, 0, EDGE_PATTERN, 0 };
+    pulse_heap_push(&entry);
+    return 1;
+}
+
+// Make way for a ring command on gpio (pulse thread only). Software PWM
+// halts at once; hardware PWM can only be switched off by the command loop,
+// so the command is refused (returns 0) and later ones go through
+static int shm_claim_pin(uint32_t gpio)
+{
+    uint64_t bit = 1ull << gpio;
+    int hardware = (atomic_load_explicit(&hw_pwm_mask, memory_order_acquire) & bit) != 0;
+
+    if (!(pwm_running & bit) && !hardware) {
+        return 1;
+    }
+
+    soft_pwm_halt(gpio);
+    atomic_fetch_or_explicit(&shm_pwm_stops, bit, memory_order_release);
+
+    uint64_t one = 1;
+    if (write(pwm_stop_fd, &one, sizeof(one)) < 0) {
+        // Non-blocking: a wakeup already pending is just as good
+    }
+    return !hardware;
+}
+
+// Finish the stops shm_claim_pin() asked for (command loop only). If the
+// pulse ring is full the pin keeps pwm_pins, but its duty is already 0, so
+// the next PWM command queues the stop instead of restarting it
+static void shm_pwm_drain(void)
+{
+    uint64_t count;
+    if (read(pwm_stop_fd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    uint64_t pins = atomic_exchange_explicit(&shm_pwm_stops, 0, memory_order_acquire);
+    for (int gpio = 0; gpio < MAX_GPIO; gpio++) {
+        if (pins >> gpio & 1) {
+            pwm_stop(gpio, PWM_LEVEL_KEEP);
+        }
+    }
+}
+
+// Run one command from the ring (pulse thread only)
+static void shm_execute(const gs_shm_slot_t *slot, int owner)
+{
+    uint32_t cmd = slot->words[0], p1 = slot->words[1], p2 = slot->words[2], p3 = slot->words[3];
+    uint64_t mask = command_pins(cmd, p1);
+    int ok = 0;
+
+    if (cmd == GS_CMD_PATPLAY) {
+        // Patterns are defined over TCP; this only starts one
+        ok = shm_pattern(slot, owner);
+    } else if (owner != 0 && mask != 0 && pins_owned_by(mask, owner)) {
+        switch (cmd) {
+            case PI_CMD_WRITE:
+                if (shm_claim_pin(p1)) {
+                    gpio_write(p1, p2);
+                    ok = 1;
+                }
+                break;
+
+            case PI_CMD_BS1:
+                gpio_set_bank(p1);
+                ok = 1;
+                break;
+
+            case PI_CMD_BC1:
+                gpio_clear_bank(p1);
+                ok = 1;
+                break;
+
+            case PI_CMD_TRIG: {
+                uint32_t level = (p3 == 4 && slot->size >= 20) ? slot->words[4] : 1;
+                ok = shm_claim_pin(p1) && shm_pulse(now_ns(), p1, p2, level);
+                break;
+            }
+
+            case GS_CMD_TRIGAT: {
+                if (p3 != 12 || slot->size < 28) {
+                    break;
+                }
+                uint64_t start = ((uint64_t)slot->words[5] | ((uint64_t)slot->words[6] << 32)) * 1000;
+                uint64_t now = now_ns();
+                if (start < now) {
+                    atomic_fetch_add_explicit(&shm->late, 1, memory_order_relaxed);
+                    start = now;
+                }
+                ok = shm_claim_pin(p1) && shm_pulse(start, p1, p2, slot->words[4]);
+                break;
+            }
+        }
+    }
+
+    atomic_fetch_add_explicit(ok ? &shm->consumed : &shm->rejected, 1, memory_order_relaxed);
+}
+
+// Drain the shared-memory ring (pulse thread only)
+static void shm_poll(void)
+{
+    if (shm == NULL) {
+        return;
+    }
+
+    uint32_t tail = atomic_load_explicit(&shm->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&shm->head, memory_order_acquire);
+
+    if (tail == head) {
+        return;
+    }
+
+    int owner = atomic_load_explicit(&shm_owner, memory_order_relaxed);
+
+    while (tail != head) {
+        shm_execute(&shm->slots[tail & (GS_SHM_SLOTS - 1)], owner);
+        tail++;
+    }
+    atomic_store_explicit(&shm->tail, tail, memory_order_release);
+}
+
+int32_t execute_command(int owner, uint32_t cmd, uint32_t p1, uint32_t p2,
+                        const uint8_t *ext, uint32_t ext_len,
+                        uint32_t *res_p1, uint32_t *res_p2);
+
+// Data a command returns after its reply, like pigpiod's extended replies
+// (EDGEREAD and STATS). Cleared before each command, command loop only.
+#define REPLY_EXT_MAX (4 + STATS_BUCKETS * 4 > EDGE_READ_MAX * EDGE_RECORD_SIZE \
+                       ? 4 + STATS_BUCKETS * 4 : EDGE_READ_MAX * EDGE_RECORD_SIZE)
+static uint8_t reply_ext[REPLY_EXT_MAX];
+static uint32_t reply_ext_len = 0;
+
+// Run the commands packed back to back (header + extension each) in a BATCH
+// extension. Returns the number run; failed and late count the sub-commands
+// that returned an error or started late.
+static int32_t execute_batch(int owner, const uint8_t *ext, uint32_t ext_len,
+                             uint32_t *failed, uint32_t *late)
+{
+    uint32_t off = 0;
+    int32_t count = 0;
+
+    *failed = 0;
+    *late = 0;
+
+    while (off + 16 <= ext_len) {
+        uint32_t cmd, p1, p2, p3;
+        memcpy(&cmd, ext + off, 4);
+        memcpy(&p1, ext + off + 4, 4);
+        memcpy(&p2, ext + off + 8, 4);
+        memcpy(&p3, ext + off + 12, 4);
+        off += 16;
+
+        uint32_t sub_len = command_has_ext(cmd) ? p3 : 0;
+        if (cmd == GS_CMD_BATCH || sub_len > ext_len - off) {
+            (*failed)++;
+            break;  // no nesting, and a truncated command ends the batch
+        }
+
+        uint32_t res_p1 = p1, res_p2 = p2;
+        int32_t status = execute_command(owner, cmd, p1, p2, ext + off, sub_len, &res_p1, &res_p2);
+        off += sub_len;
+        count++;
+
+        // A batch only has the one reply, with no room for returned data
+        reply_ext_len = 0;
+
+        if (status < 0) {
+            (*failed)++;
+        } else if ((cmd == GS_CMD_TRIGAT || cmd == GS_CMD_PATPLAY) && status > 0) {
+            (*late)++;
+        }
+    }
+
+    return count;
+}
+
+// What this server can do, for HELLO
+static uint32_t server_capabilities(void)
+{
+    uint32_t caps = GS_CAP_BATCH | GS_CAP_BANKS | GS_CAP_COMPACT | GS_CAP_STATS;
+
+    // Everything timed runs on the pulse thread
+    if (pulse_engine_running) {
+        caps |= GS_CAP_SCHEDULE | GS_CAP_PATTERNS | GS_CAP_EDGES | GS_CAP_PWM;
+        if (shm != NULL) {
+            caps |= GS_CAP_SHM;
+        }
+    }
+    if (gpio_backend->plld_hz != 0) {
+        caps |= GS_CAP_HW_PWM;
+    }
+    return caps;
+}
+
+// Execute one command for owner. res_p1/res_p2 hold the echoed p1/p2 on
+// entry and may be overwritten by commands that return data. Returns the
+// reply status.
+int32_t execute_command(int owner, uint32_t cmd, uint32_t p1, uint32_t p2,
+                        const uint8_t *ext, uint32_t ext_len,
+                        uint32_t *res_p1, uint32_t *res_p2)
+{
+    int32_t status = 0;
+
+    if (!claim_pins(command_pins(cmd, p1), owner)) {
+        return PI_NOT_PERMITTED;
+    }
+
+    switch (cmd) {
+        case PI_CMD_MODES:
+        case PI_CMD_MODEG:
+        case PI_CMD_READ:
+        case PI_CMD_WRITE:
+        case PI_CMD_TRIG:
+        case GS_CMD_TRIGAT:
+        case GS_CMD_EDGE:
+        case PI_CMD_PWM:
+        case PI_CMD_PRS:
+        case PI_CMD_PFS:
+        case PI_CMD_HP:
+            if (p1 >= (uint32_t)gpio_count) {
+                return PI_BAD_GPIO;
+            }
+            break;
+    }
+
+    switch (cmd) {
+        case PI_CMD_MODES: {
+            // MODES: p1=gpio, p2=mode. Always written, so a client can
+            // re-assert a mode that something outside the server changed
+            if (p2 > 7) {
+                status = PI_BAD_MODE;
+                break;
+            }
+            status = pwm_stop(p1, PWM_LEVEL_KEEP);
+            if (status < 0) {
+                break;
+            }
+            gpio_set_mode(p1, p2);
+            break;
+        }
+
+        case PI_CMD_MODEG: {
+            // MODEG: p1=gpio, status = mode (from the cache)
+            status = pin_mode[p1];
+            break;
+        }
+
+        case PI_CMD_READ: {
+            // READ: p1=gpio, status = level
+            status = gpio_read(p1);
+            break;
+        }
+
+        case PI_CMD_WRITE: {
+            // WRITE: p1=gpio, p2=level
+            status = pwm_stop(p1, p2 != 0);
+            if (status < 0) {
+                break;
+            }
+            gpio_ensure_output(p1);
+            gpio_write(p1, p2);
+            stats_receipt();
+            break;
+        }
+
+        case PI_CMD_BS1: {
+            // BS1: p1=mask, pins change together with zero skew
+            gpio_set_bank(p1);
+            stats_receipt();
+            break;
+        }
+
+        case PI_CMD_BC1: {
+            // BC1: p1=mask
+            gpio_clear_bank(p1);
+            stats_receipt();
+            break;
+        }
+
+        case PI_CMD_TRIG: {
+            // TRIG: p1=gpio, p2=pulse_us, ext=level (optional)
+            uint32_t level = 1;
+            if (ext_len == 4) {
+                memcpy(&level, ext, 4);
+            }
+
+            // Ensure GPIO is in output mode
+            status = pwm_stop(p1, PWM_LEVEL_KEEP);
+            if (status < 0) {
+                break;
+            }
+            gpio_ensure_output(p1);
+
+            // Trigger pulse
+            gpio_trig(p1, p2, level);
+            stats_receipt();
+            break;
+        }
+
+        case GS_CMD_TRIGAT: {
+            // TRIGAT: p1=gpio, p2=pulse_us,
+            // ext = level (u32) + target time (u64, CLOCK_MONOTONIC us)
+            if (ext_len != 12) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+
+            uint32_t level;
+            uint64_t target_us;
+            memcpy(&level, ext, 4);
+            memcpy(&target_us, ext + 4, 8);
+
+            status = pwm_stop(p1, PWM_LEVEL_KEEP);
+            if (status < 0) {
+                break;
+            }
+            gpio_ensure_output(p1);
+
+            // Status is how late the pulse started (0 = on time)
+            status = gpio_trig_at(p1, p2, level, target_us);
+            break;
+        }
+
+        case PI_CMD_PWM: {
+            // PWM: p1=gpio, p2=duty cycle (0 = off, up to the pin's range)
+            if (p2 > pwm_range[p1]) {
+                status = PI_BAD_DUTYCYCLE;
+                break;
+            }
+            for (int channel = 0; channel < 2; channel++) {
+                if (hw_pwm_gpio[channel] == (int)p1) {
+                    hw_pwm_off(channel);
+                }
+            }
+            gpio_ensure_output(p1);
+            pwm_duty[p1] = p2;
+            status = soft_pwm_update(p1);
+            break;
+        }
+
+        case PI_CMD_PRS: {
+            // PRS: p1=gpio, p2=range. A running duty cycle keeps its
+            // proportion. Status = the range set
+            if (p2 < PWM_MIN_RANGE || p2 > PWM_MAX_RANGE) {
+                status = PI_BAD_DUTYRANGE;
+                break;
+            }
+            pwm_duty[p1] = (uint32_t)((uint64_t)pwm_duty[p1] * p2 / pwm_range[p1]);
+            pwm_range[p1] = p2;
+            status = soft_pwm_update(p1);
+            if (status == 0) {
+                status = (int32_t)p2;
+            }
+            break;
+        }
+
+        case PI_CMD_PFS: {
+            // PFS: p1=gpio, p2=frequency in Hz (above PWM_MAX_FREQ is
+            // capped). Status = the frequency set
+            if (p2 == 0) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+            pwm_freq[p1] = p2 > PWM_MAX_FREQ ? PWM_MAX_FREQ : p2;
+            status = soft_pwm_update(p1);
+            if (status == 0) {
+                status = (int32_t)pwm_freq[p1];
+            }
+            break;
+        }
+
+        case PI_CMD_HP: {
+            // HP: p1=gpio, p2=frequency in Hz (0 = off),
+            // ext = duty cycle (u32, millionths)
+            if (ext_len != 4) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+
+            uint32_t duty;
+            memcpy(&duty, ext, 4);
+            status = hw_pwm_set(p1, p2, duty, owner);
+            break;
+        }
+
+        case GS_CMD_TIME: {
+            // TIME: returns CLOCK_MONOTONIC in us in p1 (low) / p2 (high)
+            uint64_t t = now_ns() / 1000;
+            *res_p1 = (uint32_t)t;
+            *res_p2 = (uint32_t)(t >> 32);
+            break;
+        }
+
+        case GS_CMD_UDPSTATS: {
+            // UDPSTATS: p1 = datagrams lost, p2 = datagrams late, status = received
+            *res_p1 = (uint32_t)udp_peer.dropped;
+            *res_p2 = (uint32_t)udp_peer.late;
+            status = (int32_t)(udp_peer.received & INT32_MAX);
+            break;
+        }
+
+        case GS_CMD_BATCH: {
+            // BATCH: p1 = command count (informational), ext = the commands.
+            // One reply: p1 = commands failed, p2 = pulses late, status = commands run
+            status = execute_batch(owner, ext, ext_len, res_p1, res_p2);
+            break;
+        }
+
+        case GS_CMD_PATDEF: {
+            // PATDEF: p1 = pattern id, p2 = index of the first step in ext
+            // (0 starts over, otherwise the current length, to append),
+            // ext = {delta_us, set_mask, clear_mask} steps. An empty
+            // definition frees the pattern. Status = steps defined
+            uint32_t count = ext_len / sizeof(pattern_step_t);
+            if (p1 >= GS_MAX_PATTERNS || ext_len % sizeof(pattern_step_t) != 0) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+
+            pattern_t *pattern = &patterns[p1];
+            if (pattern->owner != 0 && pattern->owner != owner) {
+                status = PI_NOT_PERMITTED;
+                break;
+            }
+            if ((p2 != 0 && p2 != pattern->num_steps) || p2 + count > GS_PATTERN_STEPS) {
+                status = PI_BAD_PARAM;  // bad offset or too long
+                break;
+            }
+
+            // Lock the pattern while the steps change: a PATPLAY from the
+            // shared-memory ring can't queue it until the release below
+            uint32_t idle = 0;
+            if (!atomic_compare_exchange_strong_explicit(&pattern->queued, &idle, PATTERN_DEFINING,
+                                                         memory_order_acquire, memory_order_relaxed)) {
+                status = PI_BAD_PARAM;  // still playing
+                break;
+            }
+
+            uint32_t pins = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                pattern_step_t step;
+                memcpy(&step, ext + i * sizeof(step), sizeof(step));
+                pins |= step.set_mask | step.clear_mask;
+            }
+            if (!claim_pins(pins, owner)) {
+                atomic_store_explicit(&pattern->queued, 0, memory_order_release);
+                status = PI_NOT_PERMITTED;
+                break;
+            }
+            for (int gpio = 0; gpio < 32; gpio++) {
+                if (pins >> gpio & 1) {
+                    gpio_ensure_output(gpio);
+                }
+            }
+
+            memcpy(&pattern->steps[p2], ext, ext_len);
+            pattern->num_steps = p2 + count;
+            pattern->pins = (p2 == 0 ? 0 : pattern->pins) | pins;
+            pattern->owner = pattern->num_steps > 0 ? owner : 0;
+            atomic_store_explicit(&pattern->queued, 0, memory_order_release);
+            status = (int32_t)pattern->num_steps;
+            break;
+        }
+
+        case GS_CMD_PATPLAY: {
+            // PATPLAY: p1 = pattern id, ext = start time (u64, CLOCK_MONOTONIC
+            // us; optional, default now). Status = how late it started
+            if (p1 >= GS_MAX_PATTERNS || (ext_len != 0 && ext_len != 8)) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+            if (patterns[p1].owner != owner) {
+                status = patterns[p1].owner == 0 ? PI_BAD_PARAM : PI_NOT_PERMITTED;
+                break;
+            }
+
+            uint64_t target_us = 0;
+            if (ext_len == 8) {
+                memcpy(&target_us, ext, 8);
+            }
+            status = pattern_play_at(p1, target_us);
+            break;
+        }
+
+        case GS_CMD_EDGE: {
+            // EDGE: p1 = gpio, p2 = edge number (1-based; 0 for none).
+            // Starts watching the pin if it isn't watched yet. Status =
+            // edges seen so far; p1 (low) / p2 (high) = CLOCK_MONOTONIC time
+            // of edge p2 in us, or 0 if it hasn't happened or is too old
+            if (!pulse_engine_running) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+            atomic_fetch_or_explicit(&edge_watched, 1ull << p1, memory_order_release);
+
+            uint64_t t = edge_time(p1, p2) / 1000;
+            *res_p1 = (uint32_t)t;
+            *res_p2 = (uint32_t)(t >> 32);
+            status = (int32_t)(atomic_load_explicit(&edge_count[p1], memory_order_acquire) & INT32_MAX);
+            break;
+        }
+
+        case GS_CMD_EDGESTREAM: {
+            // EDGESTREAM: p1 = mask of GPIO 0-31, p2 = 1 to stream their
+            // edges, 0 to stop. p1 (reply) = sequence number of the next
+            // record, where the client's first EDGEREAD should start
+            if (!pulse_engine_running) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+            if (p1 & ~gpio_bank0_mask) {
+                status = PI_BAD_GPIO;
+                break;
+            }
+            if (p2) {
+                atomic_fetch_or_explicit(&edge_streamed, (uint64_t)p1, memory_order_release);
+            } else {
+                atomic_fetch_and_explicit(&edge_streamed, ~(uint64_t)p1, memory_order_release);
+            }
+            *res_p1 = atomic_load_explicit(&edge_stream_head, memory_order_acquire);
+            break;
+        }
+
+        case GS_CMD_EDGEREAD: {
+            // EDGEREAD: p1 = sequence number of the first record wanted.
+            // Extension = up to EDGE_READ_MAX 12-byte records (time us low,
+            // time us high, gpio | level << 8), status = its size in bytes,
+            // p1 = sequence number to ask for next, p2 = records lost before
+            // these because the client fell more than a ring behind
+            uint32_t next = p1, lost = 0;
+            int count = edge_stream_read(&next, reply_ext, EDGE_READ_MAX, &lost);
+            reply_ext_len = (uint32_t)count * EDGE_RECORD_SIZE;
+            *res_p1 = next;
+            *res_p2 = lost;
+            status = (int32_t)reply_ext_len;
+            break;
+        }
+
+        case GS_CMD_SHMATTACH: {
+            // SHMATTACH: hand the ring to this client; p1 = ring slots.
+            // Needs the pulse thread, which is what consumes the ring. The
+            // ring has one producer: it stays with its client until that
+            // client disconnects
+            if (shm == NULL || !pulse_engine_running || owner == UDP_OWNER) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+            int attached = 0;
+            if (!atomic_compare_exchange_strong(&shm_owner, &attached, owner) && attached != owner) {
+                status = PI_NOT_PERMITTED;
+                break;
+            }
+            *res_p1 = GS_SHM_SLOTS;
+            break;
+        }
+
+        case GS_CMD_HELLO: {
+            // HELLO: p1 = highest protocol version the client speaks.
+            // Status = the version this connection uses from the next
+            // command on (compact frames are TCP only), p1 = capability
+            // bits, p2 = largest compact frame payload
+            status = p1 >= GS_PROTOCOL_COMPACT && owner != UDP_OWNER ? GS_PROTOCOL_COMPACT : GS_PROTOCOL_PIGPIOD;
+            *res_p1 = server_capabilities();
+            *res_p2 = COMPACT_MAX_PAYLOAD;
+            break;
+        }
+
+        case GS_CMD_STATS: {
+            // STATS: p1 = histogram (GS_STATS_*), p2 = GS_STATS_RESET to
+            // start it and its counter over first. Extension = a u32
+            // counter (edges fired early with the heap full for OVERRUN,
+            // TRIGs timed inline with the ring full for WIDTH, else 0), then
+            // u32 counts of consecutive buckets, both since the last reset.
+            // Status = its size in bytes, p2 = the first bucket
+            if (p1 >= GS_STATS_COUNT) {
+                status = PI_BAD_PARAM;
+                break;
+            }
+            uint32_t first, counter = p1 == GS_STATS_OVERRUN ? atomic_load(&stats_heap_full)
+                                    : p1 == GS_STATS_WIDTH ? atomic_load(&stats_inline) : 0;
+            if (p2 & GS_STATS_RESET) {
+                stats[p1].counter_baseline = counter;
+            }
+            counter -= stats[p1].counter_baseline;
+            int count = stats_read(p1, (p2 & GS_STATS_RESET) != 0, reply_ext + 4, &first);
+            memcpy(reply_ext, &counter, 4);
+            reply_ext_len = 4 + (uint32_t)count * 4;
+            *res_p2 = first;
+            status = (int32_t)reply_ext_len;
+            break;
+        }
+
+        case PI_CMD_PIGPV: {
+            // Version command
+            status = 79;  // Pretend to be pigpio v79
+            break;
+        }
+
+        default:
+            printf("Unknown command: %u\n", cmd);
+            status = -1;
+            break;
+    }
+
+    return status;
+}
+
+// Encode a reply in pigpiod format: echo cmd, p1, p2 and put the result in
+// the last word, so the client can match it to its command
+static void encode_reply(uint8_t *res_buf, uint32_t cmd, uint32_t res_p1, uint32_t res_p2, int32_t status)
+{
+    memcpy(res_buf, &cmd, 4);
+    memcpy(res_buf + 4, &res_p1, 4);
+    memcpy(res_buf + 8, &res_p2, 4);
+    memcpy(res_buf + 12, &status, 4);
+}
+
+// Queue a reply (and any reply extension) to client c. Returns -1 if the
+// client has stopped reading its replies.
+static int send_client_reply(client_t *c, uint32_t cmd, uint32_t res_p1, uint32_t res_p2, int32_t status)
+{
+    // The socket buffer holds thousands of replies; if it is full the client is gone
+    uint8_t res_buf[16 + sizeof(reply_ext)];
+    encode_reply(res_buf, cmd, res_p1, res_p2, status);
+    memcpy(res_buf + 16, reply_ext, reply_ext_len);
+    ssize_t len = 16 + (ssize_t)reply_ext_len;
+    if (send(c->fd, res_buf, (size_t)len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+// Run the 16-byte command at header (followed by ext_len bytes of
+// extension) for client c and queue its reply. Returns the reply status
+// in *status, and -1 if the client has stopped reading its replies.
+static int run_client_command(client_t *c, int owner, const uint8_t *header, uint32_t ext_len, int32_t *status)
+{
+    uint32_t cmd, p1, p2;
+    memcpy(&cmd, header + 0, 4);
+    memcpy(&p1, header + 4, 4);
+    memcpy(&p2, header + 8, 4);
+
+    uint32_t res_p1 = p1, res_p2 = p2;
+    reply_ext_len = 0;
+    *status = execute_command(owner, cmd, p1, p2, header + 16, ext_len, &res_p1, &res_p2);
+    return send_client_reply(c, cmd, res_p1, res_p2, *status);
+}
+
+// Read one unsigned LEB128 varint of at most 32 bits, advancing *p.
+// Returns 0 if it runs past end or doesn't fit.
+static int get_varint32(const uint8_t **p, const uint8_t *end, uint32_t *value)
+{
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 35; shift += 7) {
+        uint8_t byte = *(*p)++;
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = (uint32_t)v;
+            return v <= UINT32_MAX;
+        }
+    }
+    return 0;
+}
+
+// As get_varint32, for a 64-bit value
+static int get_varint64(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run the compact frame buffered for client c: each op is the pigpiod
+// command it stands for, so ownership and checks are the same. GS_OP_CMD
+// ops reply as they run; the frame itself replies only if it asked to, once
+// (like BATCH: p1 = ops failed, apart from GS_OP_CMD ones, p2 = pulses
+// late, status = ops run).
+// Returns -1 if the client has stopped reading its replies.
+static int run_compact_frame(client_t *c, int owner)
+{
+    const uint8_t *p = c->buf, *end = c->buf + c->need;
+    uint32_t ran = 0, failed = 0, late = 0;
+
+    while (p < end) {
+        uint8_t op = *p++;
+        uint32_t cmd = 0, p1 = 0, p2 = 0, level = 1;
+        uint64_t target_us = 0;
+        uint8_t ext[12];
+        uint32_t ext_len = 0;
+        int ok = 0;
+
+        switch (op) {
+            case GS_OP_CMD: {
+                uint32_t p3 = 0;
+                if (end - p >= 16) {
+                    memcpy(&cmd, p, 4);
+                    memcpy(&p3, p + 12, 4);
+                    ext_len = command_has_ext(cmd) ? p3 : 0;
+                }
+                if (end - p < 16 || ext_len > (uint32_t)(end - p - 16)) {
+                    break;
+                }
+
+                int32_t status;
+                if (run_client_command(c, owner, p, ext_len, &status) < 0) {
+                    return -1;
+                }
+                // Its own reply carries any error, so it isn't counted in p1 too
+                ran++;
+                p += 16 + ext_len;
+                continue;
+            }
+
+            case GS_OP_TRIG_LOW:
+                level = 0;
+                // fall through
+            case GS_OP_TRIG_HIGH:
+                cmd = PI_CMD_TRIG;
+                ok = get_varint32(&p, end, &p1) && get_varint32(&p, end, &p2);
+                memcpy(ext, &level, 4);
+                ext_len = 4;
+                break;
+
+            case GS_OP_TRIGAT_LOW:
+                level = 0;
+                // fall through
+            case GS_OP_TRIGAT_HIGH:
+                cmd = GS_CMD_TRIGAT;
+                ok = get_varint32(&p, end, &p1) && get_varint32(&p, end, &p2)
+                  && get_varint64(&p, end, &target_us);
+                memcpy(ext, &level, 4);
+                memcpy(ext + 4, &target_us, 8);
+                ext_len = 12;
+                break;
+
+            case GS_OP_BS1:
+            case GS_OP_BC1:
+                cmd = op == GS_OP_BS1 ? PI_CMD_BS1 : PI_CMD_BC1;
+                ok = get_varint32(&p, end, &p1);
+                break;
+
+            case GS_OP_WRITE:
+                cmd = PI_CMD_WRITE;
+                ok = get_varint32(&p, end, &p1) && get_varint32(&p, end, &p2);
+                break;
+
+            case GS_OP_PATPLAY:
+                cmd = GS_CMD_PATPLAY;
+                ok = get_varint32(&p, end, &p1);
+                break;
+
+            case GS_OP_PATPLAY_AT:
+                cmd = GS_CMD_PATPLAY;
+                ok = get_varint32(&p, end, &p1) && get_varint64(&p, end, &target_us);
+                memcpy(ext, &target_us, 8);
+                ext_len = 8;
+                break;
+        }
+
+        if (!ok) {
+            // Unknown or truncated: nothing after it can be parsed
+            failed++;
+            break;
+        }
+
+        uint32_t res_p1 = p1, res_p2 = p2;
+        reply_ext_len = 0;
+        int32_t status = execute_command(owner, cmd, p1, p2, ext, ext_len, &res_p1, &res_p2);
+        ran++;
+
+        if (status < 0) {
+            failed++;
+        } else if ((cmd == GS_CMD_TRIGAT || cmd == GS_CMD_PATPLAY) && status > 0) {
+            late++;
+        }
+    }
+
+    if (!c->reply) {
+        return 0;
+    }
+    reply_ext_len = 0;
+    return send_client_reply(c, GS_CMD_FRAME, failed, late, (int32_t)ran);
+}
+
+// Feed bytes through the compact frame parser: a varint header (payload
+// length << 1 | reply bit), then the payload. Returns -1 to drop the client.
+static int compact_feed(client_t *c, int owner, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        if (c->need == 0) {
+            // Header bytes collect in buf until one without the continuation bit
+            c->buf[c->have++] = *data++;
+            len--;
+            if (c->buf[c->have - 1] & 0x80) {
+                if (c->have == 5) {
+                    return -1;
+                }
+                continue;
+            }
+
+            const uint8_t *p = c->buf;
+            uint32_t header;
+            if (!get_varint32(&p, c->buf + c->have, &header) || (header >> 1) > COMPACT_MAX_PAYLOAD) {
+                return -1;
+            }
+            c->reply = header & 1;
+            c->need = header >> 1;
+            c->have = 0;
+
+            if (c->need > 0) {
+                continue;
+            }
+        } else {
+            size_t n = c->need - c->have;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(c->buf + c->have, data, n);
+            c->have += n;
+            data += n;
+            len -= n;
+
+            if (c->have < c->need) {
+                continue;
+            }
+        }
+
+        if (run_compact_frame(c, owner) < 0) {
+            return -1;
+        }
+        c->have = 0;
+        c->need = 0;
+    }
+    return 0;
+}
+
+// Feed bytes received from client c through the command parser, running
+// each command as soon as it is complete. Returns -1 to drop the client.
+static int client_feed(client_t *c, int owner, const uint8_t *data, size_t len)
+{
+    if (c->compact) {
+        return compact_feed(c, owner, data, len);
+    }
+
+    while (len > 0) {
+        if (c->have < c->need) {
+            size_t n = c->need - c->have;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(c->buf + c->have, data, n);
+            c->have += n;
+            data += n;
+            len -= n;
+
+            if (c->have == 16) {
+                // Header complete: work out how much extension follows
+                uint32_t cmd, p3;
+                memcpy(&cmd, c->buf, 4);
+                memcpy(&p3, c->buf + 12, 4);
+                if (command_has_ext(cmd) && p3 > 0) {
+                    uint32_t keep = p3 < MAX_EXT ? p3 : MAX_EXT;
+                    c->need = 16 + keep;
+                    c->skip = p3 - keep;
+                }
+            }
+        } else {
+            size_t n = c->skip < len ? c->skip : len;
+            c->skip -= n;
+            data += n;
+            len -= n;
+        }
+
+        if (c->have == c->need && c->skip == 0) {
+            int32_t status;
+            if (run_client_command(c, owner, c->buf, c->need - 16, &status) < 0) {
+                return -1;
+            }
+            c->have = 0;
+            c->need = 16;
+
+            // Everything after a HELLO that chose compact frames is in them
+            uint32_t cmd;
+            memcpy(&cmd, c->buf, 4);
+            if (cmd == GS_CMD_HELLO && status == GS_PROTOCOL_COMPACT) {
+                c->compact = 1;
+                c->need = 0;
+                return compact_feed(c, owner, data, len);
+            }
+        }
+    }
+    return 0;
+}
+
+static void close_client(int slot)
+{
+    client_t *c = &clients[slot];
+
+    close(c->fd);   // also removes it from the epoll set
+    c->fd = -1;
+    release_pins(slot + 1);
+
+    int attached = slot + 1;
+    atomic_compare_exchange_strong(&shm_owner, &attached, 0);
+    printf("Client %d disconnected\n", slot + 1);
+}
+
+// Accept a pending connection into a free client slot
+static void accept_client(int server_fd, int epoll_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    int fd = accept4(server_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept failed");
+        }
+        return;
+    }
+
+    int slot = 0;
+    while (slot < MAX_CLIENTS && clients[slot].fd >= 0) {
+        slot++;
+    }
+    if (slot == MAX_CLIENTS) {
+        fprintf(stderr, "Too many clients, rejecting %s\n", inet_ntoa(addr.sin_addr));
+        close(fd);
+        return;
+    }
+
+    // Set TCP_NODELAY for minimal latency
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    // Reap half-open connections (e.g. a crashed GUI) within ~10 s
+    int idle = 5, interval = 1, count = 5;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = (uint32_t)slot };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(fd);
+        return;
+    }
+
+    client_t *c = &clients[slot];
+    c->fd = fd;
+    c->have = 0;
+    c->need = 16;
+    c->skip = 0;
+    c->compact = 0;
+    c->reply = 0;
+
+    printf("Client %d connected from %s:%d\n", slot + 1, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+}
+
+// Read whatever client slot has sent and run its complete commands
+static void service_client(int slot)
+{
+    client_t *c = &clients[slot];
+    uint8_t data[4096];
+
+    // One read per wakeup keeps a busy client from starving the rest
+    ssize_t n = recv(c->fd, data, sizeof(data), 0);
+    receipt_ns = now_ns();
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        close_client(slot);
+    } else if (n > 0 && client_feed(c, slot + 1, data, (size_t)n) < 0) {
+        fprintf(stderr, "Client %d is not reading replies, dropping it\n", slot + 1);
+        close_client(slot);
+    }
+}
+
+// Handle one UDP datagram: u32 seq, u32 flags, 16-byte command, extension.
+// Datagrams older than the newest one seen are dropped rather than run late.
+void handle_datagram(int udp_fd)
+{
+    uint8_t buf[UDP_HEADER_SIZE + 16 + MAX_EXT];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+
+    ssize_t n = recvfrom(udp_fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+    receipt_ns = now_ns();
+    if (n < UDP_HEADER_SIZE + 16) {
+        return;
+    }
+
+    uint32_t seq, flags, cmd, p1, p2, p3;
+    memcpy(&seq, buf, 4);
+    memcpy(&flags, buf + 4, 4);
+    memcpy(&cmd, buf + 8, 4);
+    memcpy(&p1, buf + 12, 4);
+    memcpy(&p2, buf + 16, 4);
+    memcpy(&p3, buf + 20, 4);
+
+    // A new sender, or the same one starting over, begins a new session
+    if (seq == 1 || from.sin_addr.s_addr != udp_peer.addr.sin_addr.s_addr
+        || from.sin_port != udp_peer.addr.sin_port) {
+        memset(&udp_peer, 0, sizeof(udp_peer));
+        udp_peer.addr = from;
+        release_pins(UDP_OWNER);
+        printf("UDP client %s:%d\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+    }
+
+    udp_peer.received++;
+
+    if ((int32_t)(seq - udp_peer.last_seq) <= 0) {
+        udp_peer.late++;
+        return;
+    }
+
+    udp_peer.dropped += seq - udp_peer.last_seq - 1;
+    udp_peer.last_seq = seq;
+
+    uint32_t ext_len = 0;
+    if (command_has_ext(cmd)) {
+        ext_len = (uint32_t)n - (UDP_HEADER_SIZE + 16);
+        if (ext_len > p3) {
+            ext_len = p3;
+        }
+    }
+
+    uint32_t res_p1 = p1, res_p2 = p2;
+    reply_ext_len = 0;
+    int32_t status = execute_command(UDP_OWNER, cmd, p1, p2, buf + UDP_HEADER_SIZE + 16, ext_len, &res_p1, &res_p2);
+
+    if (flags & GS_UDP_ACK) {
+        uint8_t res_buf[UDP_HEADER_SIZE + 16 + sizeof(reply_ext)];
+        memcpy(res_buf, &seq, 4);
+        memcpy(res_buf + 4, &flags, 4);
+        encode_reply(res_buf + UDP_HEADER_SIZE, cmd, res_p1, res_p2, status);
+        memcpy(res_buf + UDP_HEADER_SIZE + 16, reply_ext, reply_ext_len);
+        sendto(udp_fd, res_buf, UDP_HEADER_SIZE + 16 + reply_ext_len, 0, (struct sockaddr *)&from, from_len);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int server_fd;
+    struct sockaddr_in server_addr;
+    int port = 8888;
+    int opt;
+    const char *backend_name = NULL;
+    const char *shm_user = NULL;
+
+    // Pulse thread defaults to the last core (the one isolcpus=3 frees on a Pi).
+    // A spinning SCHED_FIFO thread would starve everything on a single core.
+    static int pulse_cpu;
+    int num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pulse_cpu = num_cpus - 1;
+    pulse_spin = num_cpus > 1;
+
+    while ((opt = getopt(argc, argv, "p:c:sb:u:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                pulse_cpu = atoi(optarg);
+                break;
+            case 's':
+                pulse_spin = 0;
+                break;
+            case 'b':
+                backend_name = optarg;
+                break;
+            case 'u':
+                shm_user = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-c pulse_cpu] [-s] [-b bcm2835|bcm2711|rp1] [-u shm_user]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // Set real-time scheduling priority for minimal latency
+    struct sched_param param;
+    param.sched_priority = 99;  // Highest priority
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+        fprintf(stderr, "Warning: Failed to set real-time priority (run with sudo): %s\n", strerror(errno));
+    } else {
+        printf("Real-time priority enabled (SCHED_FIFO, priority 99)\n");
+    }
+
+    // Lock memory to prevent paging delays
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Warning: Failed to lock memory: %s\n", strerror(errno));
+    } else {
+        printf("Memory locked to prevent paging\n");
+    }
+
+    // Initialize GPIO
+    if (init_gpio(backend_name) < 0) {
+        fprintf(stderr, "Failed to initialize GPIO\n");
+        return 1;
+    }
+
+    // Start the pulse engine (pulses fall back to inline timing without it)
+    if (start_pulse_engine(&pulse_cpu) < 0) {
+        fprintf(stderr, "Warning: Pulse engine unavailable, pulses will block the command loop\n");
+    }
+
+    // The shared-memory ring belongs to -u's user, or to whoever ran sudo
+    uid_t shm_uid = getuid();
+    gid_t shm_gid = getgid();
+    const char *sudo_uid = getenv("SUDO_UID"), *sudo_gid = getenv("SUDO_GID");
+    if (shm_user != NULL) {
+        struct passwd *pw = getpwnam(shm_user);
+        if (pw == NULL) {
+            fprintf(stderr, "Unknown user '%s'\n", shm_user);
+            return 1;
+        }
+        shm_uid = pw->pw_uid;
+        shm_gid = pw->pw_gid;
+    } else if (sudo_uid != NULL && sudo_gid != NULL) {
+        shm_uid = (uid_t)strtoul(sudo_uid, NULL, 10);
+        shm_gid = (gid_t)strtoul(sudo_gid, NULL, 10);
+    }
+
+    // Same-host clients can skip the network (not fatal if /dev/shm is unavailable)
+    if (shm_init(port, shm_uid, shm_gid) < 0) {
+        fprintf(stderr, "Warning: Shared-memory transport unavailable: %s\n", strerror(errno));
+    } else {
+        printf("Shared-memory transport at /dev/shm%s (uid %u only)\n", shm_name, (unsigned)shm_uid);
+    }
+
+    // Create socket
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket failed");
+        return 1;
+    }
+
+    // Set SO_REUSEADDR to allow quick restarts
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Bind to port
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind failed");
+        close(server_fd);
+        return 1;
+    }
+
+    // Listen
+    if (listen(server_fd, 5) < 0) {
+        perror("listen failed");
+        close(server_fd);
+        return 1;
+    }
+
+    // UDP socket on the same port
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_fd < 0 || bind(udp_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("UDP bind failed");
+        close(server_fd);
+        return 1;
+    }
+
+    printf("GPIO server listening on port %d (TCP and UDP)\n", port);
+
+    // One thread serves every client, so the RT priority and locked memory
+    // above cover all command handling
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return 1;
+    }
+
+    for (int slot = 0; slot < MAX_CLIENTS; slot++) {
+        clients[slot].fd = -1;
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    pwm_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pwm_stop_fd < 0) {
+        perror("eventfd failed");
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_LISTEN };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev.data.u32 = EV_UDP;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev);
+    ev.data.u32 = EV_PWM_STOP;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pwm_stop_fd, &ev);
+
+    struct epoll_event events[MAX_CLIENTS + 3];
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_CLIENTS + 3, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait failed");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint32_t tag = events[i].data.u32;
+
+            if (tag == EV_LISTEN) {
+                accept_client(server_fd, epoll_fd);
+            } else if (tag == EV_UDP) {
+                handle_datagram(udp_fd);
+            } else if (tag == EV_PWM_STOP) {
+                shm_pwm_drain();
+            } else if (clients[tag].fd >= 0) {
+                service_client((int)tag);
+            }
+        }
     }
 
+    close(epoll_fd);
+    close(pwm_stop_fd);
+    close(udp_fd);
     close(server_fd);
     return 0;
 }
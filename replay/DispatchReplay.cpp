@@ -0,0 +1,885 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Offline replay of the event dispatch path.
+
+    Replays a recorded TTL trace, or a synthetic Poisson or burst train, block
+    by block through the same PigpiodRouter, PigpiodDispatcher and
+    PigpiodClient the plugin uses, against an in-process mock of pigpiod or a
+    real gpio_server, and reports throughput, the producer's CPU cost per
+    event, queue depth and latency percentiles. Run with --help for the
+    options.
+*/
+
+#include "PigpiodRouter.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** One TTL transition, as handleTTLEvent sees it */
+struct TraceEvent
+{
+    double seconds;
+
+    /** TTL line, 0-based */
+    int line;
+
+    bool state;
+};
+
+/** Everything the command line sets */
+struct ReplayOptions
+{
+    std::string traceFile;
+    double poissonHz = 0.0;
+
+    int burstCount = 0;
+    double burstHz = 0.0;
+    double burstPeriodMs = 0.0;
+
+    double durationSeconds = 10.0;
+    int syntheticLines = 1;
+    double ttlWidthMs = 1.0;
+    unsigned int seed = 1;
+
+    /** Routes in the plugin's "routes" syntax; empty routes line n to GPIO 16 + n */
+    std::string routes;
+
+    int pulseUs = 50;
+    PigpiodRouter::Settings pulses;
+    double trainHz = 40.0;
+    double sampleRate = 30000.0;
+    int blockSize = 1024;
+    bool fast = false;
+
+    std::string host;
+    int port = 8888;
+    bool udp = false;
+    bool compact = false;
+
+    PigpiodDispatcher::ThreadSettings sender;
+};
+
+static void printUsage()
+{
+    std::printf (
+        "Usage: dispatch-replay [source] [routing] [pacing] [server]\n"
+        "\n"
+        "Source (one of):\n"
+        "  --trace FILE           CSV of 'seconds,state' rows, state = +line for a rising edge and\n"
+        "                         -line for a falling one (1-based, as Open Ephys records TTL states)\n"
+        "  --poisson HZ           Poisson train of rising edges at HZ per second (default 100)\n"
+        "  --burst N,HZ,MS        N edges at HZ, repeating every MS milliseconds\n"
+        "  --duration S           Length of a synthetic train in seconds (default 10)\n"
+        "  --lines N              Spread synthetic edges over lines 1..N (default 1)\n"
+        "  --ttl-ms MS            Width of synthetic TTL pulses (default 1)\n"
+        "  --seed N               Random seed for synthetic trains (default 1)\n"
+        "\n"
+        "Routing:\n"
+        "  --routes LIST          Routes as in the plugin: line:gpio[@host][:us[:high|low]], ...\n"
+        "                         (default line n -> GPIO 16+n); other hosts need --server\n"
+        "  --pulse-us US          Output pulse length (default 50)\n"
+        "  --delay US             Fixed delay after each event; TRIGAT on gpio_server (default 0)\n"
+        "  --coalesce POLICY      off, drop, merge or extend (default off)\n"
+        "  --refractory US        Coalescing window, if longer than the pulse (default 0)\n"
+        "  --train N,HZ           N pulses per event at HZ (default 1; sent as scheduled pulses)\n"
+        "\n"
+        "Pacing:\n"
+        "  --sample-rate HZ       Stream sample rate (default 30000)\n"
+        "  --block-size N         Samples per processing block (default 1024)\n"
+        "  --fast                 Don't wait for blocks in real time, only for room to send them\n"
+        "\n"
+        "Server:\n"
+        "  --server HOST[:PORT]   Replay against pigpiod or gpio_server (default: built-in mock)\n"
+        "  --udp                  Send over UDP (gpio_server only)\n"
+        "  --compact              Ask gpio_server for compact frames\n"
+        "  --cpu N                Pin the sender thread to CPU N\n"
+        "  --realtime             Give the sender thread real-time priority\n"
+        "  --busy-poll            Let the sender thread spin instead of sleeping\n");
+}
+
+//==============================================================================
+/**
+ * Stands in for pigpiod on a loopback port.
+ *
+ * Answers every command the way pigpiod does (gpio_server's own commands are
+ * rejected, so the client sends plain pigpiod writes) and timestamps each
+ * TRIG as it arrives. TCP keeps the client's order, so the n-th TRIG here is
+ * the n-th pulse the replay managed to queue.
+ */
+class MockServer
+{
+public:
+    ~MockServer() { stop(); }
+
+    /** Listens on an ephemeral loopback port, keeping room for maxTrigs arrival times */
+    bool start (size_t maxTrigs)
+    {
+        arrivalTicks.assign (maxTrigs, 0);
+        startTicks = juce::Time::getHighResolutionTicks();
+
+        listenFd = socket (AF_INET, SOCK_STREAM, 0);
+
+        if (listenFd < 0)
+            return false;
+
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t length = sizeof (address);
+
+        if (bind (listenFd, (sockaddr*) &address, sizeof (address)) < 0
+            || listen (listenFd, 1) < 0
+            || getsockname (listenFd, (sockaddr*) &address, &length) < 0)
+            return false;
+
+        port = ntohs (address.sin_port);
+        thread = std::thread ([this] { serve(); });
+        return true;
+    }
+
+    void stop()
+    {
+        stopping.store (true);
+
+        if (listenFd >= 0)
+            shutdown (listenFd, SHUT_RDWR);
+
+        if (clientFd >= 0)
+            shutdown (clientFd, SHUT_RDWR);
+
+        if (thread.joinable())
+            thread.join();
+
+        // serve() closes the connection it was reading
+        if (listenFd >= 0)
+            close (listenFd);
+
+        listenFd = -1;
+    }
+
+    int getPort() const { return port; }
+
+    /** Commands of any kind answered so far */
+    juce::uint64 getCommandCount() const { return commandCount.load (std::memory_order_acquire); }
+
+    /** TRIGs received so far */
+    size_t getTrigCount() const { return trigCount.load (std::memory_order_acquire); }
+
+    /** Arrival time of the n-th TRIG (only once the server has stopped, or n < getTrigCount()) */
+    juce::int64 getArrivalTicks (size_t n) const { return arrivalTicks[n]; }
+
+private:
+    static bool readFully (int fd, void* data, size_t size)
+    {
+        auto* bytes = (uint8_t*) data;
+
+        while (size > 0)
+        {
+            const ssize_t got = recv (fd, bytes, size, 0);
+
+            if (got <= 0)
+                return false;
+
+            bytes += got;
+            size -= (size_t) got;
+        }
+
+        return true;
+    }
+
+    void serve()
+    {
+        while (!stopping.load())
+        {
+            const int fd = accept (listenFd, nullptr, nullptr);
+
+            if (fd < 0)
+                return;
+
+            int flag = 1;
+            setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof (flag));
+            clientFd = fd;
+
+            std::vector<uint8_t> extension;
+            uint32_t command[4];
+
+            while (readFully (fd, command, sizeof (command)))
+            {
+                // pigpiod puts the extension length in p3
+                extension.resize (command[3]);
+
+                if (command[3] > 0 && !readFully (fd, extension.data(), extension.size()))
+                    break;
+
+                uint32_t reply[4] = { command[0], command[1], command[2], 0 };
+                int32_t result = 0;
+
+                switch (command[0])
+                {
+                    case PI_CMD_PIGPV:
+                        result = 79;
+                        break;
+
+                    case PI_CMD_TICK:
+                        result = (int32_t) (uint32_t) (juce::Time::highResolutionTicksToSeconds (
+                                                           juce::Time::getHighResolutionTicks() - startTicks) * 1.0e6);
+                        break;
+
+                    case PI_CMD_TRIG:
+                    {
+                        const size_t n = trigCount.load (std::memory_order_relaxed);
+
+                        if (n < arrivalTicks.size())
+                            arrivalTicks[n] = juce::Time::getHighResolutionTicks();
+
+                        trigCount.store (n + 1, std::memory_order_release);
+                        break;
+                    }
+
+                    default:
+                        // Unknown to pigpiod, as every gpio_server command is
+                        result = command[0] >= GS_CMD_TRIGAT ? -1 : 0;
+                        break;
+                }
+
+                memcpy (&reply[3], &result, sizeof (result));
+                commandCount.fetch_add (1, std::memory_order_release);
+
+                if (send (fd, reply, sizeof (reply), MSG_NOSIGNAL) != (ssize_t) sizeof (reply))
+                    break;
+            }
+
+            clientFd = -1;
+            close (fd);
+        }
+    }
+
+    std::thread thread;
+    std::atomic<bool> stopping { false };
+    int listenFd = -1;
+    std::atomic<int> clientFd { -1 };
+    int port = 0;
+
+    juce::int64 startTicks = 0;
+    std::atomic<juce::uint64> commandCount { 0 };
+    std::atomic<size_t> trigCount { 0 };
+    std::vector<juce::int64> arrivalTicks;
+};
+
+//==============================================================================
+/**
+ * Another Pi named by a route, standing in for the plugin's PigpiodTarget.
+ *
+ * Like it, a target has its own client and sender thread and times pulses
+ * with its own clock model; it just connects once up front instead of
+ * through a reconnector.
+ */
+class ReplayTarget : public PigpiodRouter::Target
+{
+public:
+    explicit ReplayTarget (const juce::String& host_) : host (host_), dispatcher (client) {}
+
+    ~ReplayTarget() override
+    {
+        dispatcher.stopThread (1000);
+        client.disconnect();
+    }
+
+    /** Connects, warms the clock model up and starts the sender thread */
+    bool start (const ReplayOptions& options, PigpiodClient::Transport transport)
+    {
+        client.setCompactProtocol (options.compact);
+
+        if (!client.connect (host, options.port, transport))
+            return false;
+
+        client.warmUp (10);
+        client.resetRoundTripLatency();
+        schedulePulses = options.pulses.scheduleDelayUs > 0 && client.supportsScheduledPulses();
+
+        dispatcher.setThreadSettings (options.sender);
+        dispatcher.resetStatistics();
+        dispatcher.startThread();
+        return true;
+    }
+
+    void trigger (int gpio, int pulseUs, int level, int numPulses, int periodUs,
+                  juce::int64 eventTicks, int delayUs) override
+    {
+        PigpiodRouter::queuePulses (client, dispatcher, schedulePulses, gpio, pulseUs, level, numPulses, periodUs,
+                                    eventTicks, delayUs);
+        framesPending = true;
+    }
+
+    void flush() override
+    {
+        if (framesPending)
+        {
+            dispatcher.flush();
+            framesPending = false;
+        }
+    }
+
+    const juce::String host;
+    PigpiodClient client;
+    PigpiodDispatcher dispatcher;
+
+private:
+    bool schedulePulses = false;
+    bool framesPending = false;
+};
+
+//==============================================================================
+static bool parseOptions (int argc, char** argv, ReplayOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+
+        auto value = [&]() -> std::string
+        {
+            if (i + 1 >= argc)
+            {
+                std::fprintf (stderr, "%s needs a value\n", arg.c_str());
+                std::exit (1);
+            }
+
+            return argv[++i];
+        };
+
+        if (arg == "--trace")
+            options.traceFile = value();
+        else if (arg == "--poisson")
+            options.poissonHz = std::atof (value().c_str());
+        else if (arg == "--burst")
+        {
+            if (std::sscanf (value().c_str(), "%d,%lf,%lf", &options.burstCount, &options.burstHz, &options.burstPeriodMs) != 3
+                || options.burstCount <= 0 || options.burstHz <= 0.0 || options.burstPeriodMs <= 0.0)
+            {
+                std::fprintf (stderr, "--burst takes N,HZ,MS\n");
+                return false;
+            }
+        }
+        else if (arg == "--duration")
+            options.durationSeconds = std::atof (value().c_str());
+        else if (arg == "--lines")
+            options.syntheticLines = std::max (1, std::atoi (value().c_str()));
+        else if (arg == "--ttl-ms")
+            options.ttlWidthMs = std::atof (value().c_str());
+        else if (arg == "--seed")
+            options.seed = (unsigned int) std::strtoul (value().c_str(), nullptr, 10);
+        else if (arg == "--routes")
+            options.routes = value();
+        else if (arg == "--pulse-us")
+            options.pulseUs = std::atoi (value().c_str());
+        else if (arg == "--delay")
+            options.pulses.scheduleDelayUs = std::max (0, std::atoi (value().c_str()));
+        else if (arg == "--coalesce")
+        {
+            const std::string policy = value();
+            const char* names[] = { "off", "drop", "merge", "extend" };
+            const auto found = std::find (std::begin (names), std::end (names), policy);
+
+            if (found == std::end (names))
+            {
+                std::fprintf (stderr, "--coalesce takes off, drop, merge or extend\n");
+                return false;
+            }
+
+            options.pulses.coalescePolicy = (PigpiodRouter::CoalescePolicy) (found - std::begin (names));
+        }
+        else if (arg == "--refractory")
+            options.pulses.refractoryUs = std::max (0, std::atoi (value().c_str()));
+        else if (arg == "--train")
+        {
+            if (std::sscanf (value().c_str(), "%d,%lf", &options.pulses.trainPulses, &options.trainHz) != 2
+                || options.pulses.trainPulses < 1 || options.trainHz <= 0.0)
+            {
+                std::fprintf (stderr, "--train takes N,HZ\n");
+                return false;
+            }
+        }
+        else if (arg == "--sample-rate")
+            options.sampleRate = std::atof (value().c_str());
+        else if (arg == "--block-size")
+            options.blockSize = std::max (1, std::atoi (value().c_str()));
+        else if (arg == "--fast")
+            options.fast = true;
+        else if (arg == "--server")
+        {
+            options.host = value();
+            const size_t colon = options.host.rfind (':');
+
+            if (colon != std::string::npos)
+            {
+                options.port = std::atoi (options.host.substr (colon + 1).c_str());
+                options.host.resize (colon);
+            }
+        }
+        else if (arg == "--udp")
+            options.udp = true;
+        else if (arg == "--compact")
+            options.compact = true;
+        else if (arg == "--cpu")
+            options.sender.cpu = std::atoi (value().c_str());
+        else if (arg == "--realtime")
+            options.sender.realtime = true;
+        else if (arg == "--busy-poll")
+            options.sender.busyPoll = true;
+        else
+        {
+            if (arg != "--help" && arg != "-h")
+                std::fprintf (stderr, "Unknown option %s\n\n", arg.c_str());
+
+            printUsage();
+            return false;
+        }
+    }
+
+    if (options.udp && options.host.empty())
+    {
+        std::fprintf (stderr, "--udp needs --server (the mock only speaks TCP)\n");
+        return false;
+    }
+
+    if (options.traceFile.empty() && options.poissonHz <= 0.0 && options.burstCount == 0)
+        options.poissonHz = 100.0;
+
+    return true;
+}
+
+/** Reads a trace of 'seconds,state' rows; anything that doesn't parse (headers, comments) is skipped */
+static bool loadTrace (const std::string& path, std::vector<TraceEvent>& events)
+{
+    std::ifstream file (path);
+
+    if (!file)
+    {
+        std::fprintf (stderr, "Can't open %s\n", path.c_str());
+        return false;
+    }
+
+    std::string row;
+
+    while (std::getline (file, row))
+    {
+        double seconds;
+        int state;
+
+        if (row.empty() || row[0] == '#' || std::sscanf (row.c_str(), "%lf , %d", &seconds, &state) != 2 || state == 0)
+            continue;
+
+        events.push_back ({ seconds, std::abs (state) - 1, state > 0 });
+    }
+
+    // A recording's clock rarely starts at zero
+    if (!events.empty())
+    {
+        std::stable_sort (events.begin(), events.end(),
+                          [] (const TraceEvent& a, const TraceEvent& b) { return a.seconds < b.seconds; });
+
+        const double first = events.front().seconds;
+
+        for (auto& event : events)
+            event.seconds -= first;
+    }
+
+    return true;
+}
+
+/** Builds a Poisson or burst train of TTL pulses on random lines */
+static void synthesize (const ReplayOptions& options, std::vector<TraceEvent>& events)
+{
+    std::mt19937_64 random (options.seed);
+    std::uniform_int_distribution<int> pickLine (0, options.syntheticLines - 1);
+    const double width = options.ttlWidthMs / 1000.0;
+
+    auto addPulse = [&] (double seconds)
+    {
+        const int line = pickLine (random);
+        events.push_back ({ seconds, line, true });
+        events.push_back ({ seconds + width, line, false });
+    };
+
+    if (options.burstCount > 0)
+    {
+        for (double start = 0.0; start < options.durationSeconds; start += options.burstPeriodMs / 1000.0)
+            for (int i = 0; i < options.burstCount; ++i)
+                addPulse (start + (double) i / options.burstHz);
+    }
+    else
+    {
+        std::exponential_distribution<double> interval (options.poissonHz);
+
+        for (double t = interval (random); t < options.durationSeconds; t += interval (random))
+            addPulse (t);
+    }
+
+    std::stable_sort (events.begin(), events.end(),
+                      [] (const TraceEvent& a, const TraceEvent& b) { return a.seconds < b.seconds; });
+}
+
+static juce::uint64 threadCpuNanoseconds()
+{
+    timespec now;
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &now);
+    return (juce::uint64) now.tv_sec * 1000000000ull + (juce::uint64) now.tv_nsec;
+}
+
+/** Sleeps, then yields for the last half millisecond, until the high resolution clock reaches ticks */
+static void waitUntilTicks (juce::int64 ticks)
+{
+    const juce::int64 ticksPerSecond = juce::Time::getHighResolutionTicksPerSecond();
+
+    for (;;)
+    {
+        const juce::int64 remaining = ticks - juce::Time::getHighResolutionTicks();
+
+        if (remaining <= 0)
+            return;
+
+        if (remaining > ticksPerSecond / 2000)
+            std::this_thread::sleep_for (std::chrono::microseconds ((remaining - ticksPerSecond / 2000) * 1000000 / ticksPerSecond));
+        else
+            std::this_thread::yield();
+    }
+}
+
+static void printPercentiles (const char* name, const LatencyHistogram& histogram)
+{
+    if (histogram.getCount() == 0)
+    {
+        std::printf ("  %-22s (none)\n", name);
+        return;
+    }
+
+    std::printf ("  %-22s p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f us  (n=%llu)\n", name,
+                 histogram.getPercentile (0.5) / 1000.0,
+                 histogram.getPercentile (0.9) / 1000.0,
+                 histogram.getPercentile (0.99) / 1000.0,
+                 histogram.getPercentile (0.999) / 1000.0,
+                 histogram.getMax() / 1000.0,
+                 (unsigned long long) histogram.getCount());
+}
+
+//==============================================================================
+int main (int argc, char** argv)
+{
+    ReplayOptions options;
+
+    if (!parseOptions (argc, argv, options))
+        return 1;
+
+    std::vector<TraceEvent> events;
+
+    if (options.traceFile.empty())
+        synthesize (options, events);
+    else if (!loadTrace (options.traceFile, events))
+        return 1;
+
+    if (events.empty())
+    {
+        std::fprintf (stderr, "Nothing to replay\n");
+        return 1;
+    }
+
+    int maxLine = 0;
+    for (const auto& event : events)
+        maxLine = std::max (maxLine, event.line);
+
+    // Unrouted lines are ignored, exactly as the plugin ignores them
+    if (options.routes.empty())
+        for (int line = 0; line <= std::min (maxLine, PigpiodRouter::maxRoutedLines - 1); ++line)
+            options.routes += (line > 0 ? "," : "") + std::to_string (line + 1) + ":" + std::to_string (17 + line);
+
+    PigpiodRouter::Route routes[PigpiodRouter::maxRoutedLines * PigpiodRouter::maxRoutesPerLine];
+    juce::StringArray mainHosts, targetHosts;
+
+    if (!options.host.empty())
+        mainHosts.add (options.host);
+
+    const juce::String routeError = PigpiodRouter::parseRoutes (options.routes, routes, options.pulseUs, mainHosts, targetHosts);
+
+    if (routeError.isNotEmpty())
+    {
+        std::fprintf (stderr, "Bad route %s\n", routeError.toRawUTF8());
+        return 1;
+    }
+
+    const bool useMock = options.host.empty();
+
+    if (useMock && targetHosts.size() > 0)
+    {
+        std::fprintf (stderr, "Routes to other Pis need --server (the mock is a single Pi)\n");
+        return 1;
+    }
+
+    // The mock pairs the n-th TRIG it receives with the n-th pulse queued for the main Pi,
+    // which only holds while every trigger is a pulse of its own
+    const bool pairable = useMock && options.pulses.coalescePolicy == PigpiodRouter::CoalescePolicy::off;
+
+    int mainRoutes[PigpiodRouter::maxRoutedLines] = {};
+    for (int line = 0; line < PigpiodRouter::maxRoutedLines; ++line)
+        for (int i = 0; i < PigpiodRouter::maxRoutesPerLine; ++i)
+            if (routes[line * PigpiodRouter::maxRoutesPerLine + i].gpio >= 0
+                && routes[line * PigpiodRouter::maxRoutesPerLine + i].target < 0)
+                ++mainRoutes[line];
+
+    size_t maxPulses = 0;
+    for (const auto& event : events)
+        if (event.state && event.line < PigpiodRouter::maxRoutedLines)
+            maxPulses += (size_t) mainRoutes[event.line];
+
+    MockServer mock;
+
+    if (useMock && !mock.start (maxPulses))
+    {
+        std::fprintf (stderr, "Couldn't start the mock server\n");
+        return 1;
+    }
+
+    PigpiodClient client;
+    client.setCompactProtocol (options.compact);
+
+    const auto transport = options.udp ? PigpiodClient::Transport::udpAcked : PigpiodClient::Transport::tcp;
+
+    if (!client.connect (useMock ? "127.0.0.1" : options.host.c_str(), useMock ? mock.getPort() : options.port, transport))
+    {
+        std::fprintf (stderr, "%s\n", client.getLastError().toRawUTF8());
+        return 1;
+    }
+
+    client.warmUp (10);
+    client.resetRoundTripLatency();
+
+    // What the sink decides at acquisition start. No train is stored on the server,
+    // so trains are scheduled pulses where TRIGAT is supported and single pulses elsewhere
+    options.pulses.schedulePulses = options.pulses.scheduleDelayUs > 0 && client.supportsScheduledPulses();
+    options.pulses.trainPeriodUs = (int) std::lround (1.0e6 / options.trainHz);
+    options.pulses.trainEngine = PigpiodRouter::TrainEngine::none;
+
+    PigpiodDispatcher dispatcher (client);
+    dispatcher.setThreadSettings (options.sender);
+    dispatcher.resetStatistics();
+
+    PigpiodRouter router (client, dispatcher, options.pulses);
+    std::vector<std::unique_ptr<ReplayTarget>> targets;
+
+    for (int i = 0; i < targetHosts.size(); ++i)
+    {
+        targets.push_back (std::make_unique<ReplayTarget> (targetHosts[i]));
+
+        if (!targets.back()->start (options, transport))
+        {
+            std::fprintf (stderr, "%s: %s\n", targetHosts[i].toRawUTF8(), targets.back()->client.getLastError().toRawUTF8());
+            return 1;
+        }
+
+        router.addTarget (targets.back().get());
+    }
+
+    dispatcher.startThread();
+
+    std::printf ("Replaying %zu events against %s%s%s%s", events.size(),
+                 useMock ? "the mock server" : options.host.c_str(),
+                 client.isUsingSharedMemory() ? ", shared memory" : (options.udp ? ", UDP" : ", TCP"),
+                 client.isUsingCompactFrames() ? ", compact frames" : "",
+                 options.fast ? ", unpaced" : "");
+
+    for (const auto& target : targets)
+        std::printf (" + %s", target->host.toRawUTF8());
+
+    std::printf ("\n");
+
+    const juce::int64 ticksPerSecond = juce::Time::getHighResolutionTicksPerSecond();
+    const double blockSeconds = options.blockSize / options.sampleRate;
+    const juce::int64 startTicks = juce::Time::getHighResolutionTicks() + ticksPerSecond / 100;
+
+    // When each queued pulse's event happened, matched to the mock's arrivals afterwards
+    std::vector<juce::int64> pulseEventTicks (pairable ? maxPulses : 0, 0);
+    size_t queuedPulses = 0;
+
+    LatencyHistogram queueDepth;
+    juce::uint64 handlerCpu = 0;
+    size_t next = 0;
+
+    waitUntilTicks (startTicks);
+
+    for (juce::int64 block = 0; next < events.size(); ++block)
+    {
+        const double blockEnd = (double) (block + 1) * blockSeconds;
+
+        // A block is processed once all of its samples have arrived. Unpaced, it
+        // only waits for room in the queue and among the commands awaiting replies
+        if (options.fast)
+        {
+            while (dispatcher.getQueueDepth() > (int) PigpiodDispatcher::queueSize / 2
+                   || client.getPendingCount() > 2 * PigpiodClient::maxFramesPerWrite)
+                std::this_thread::yield();
+        }
+        else
+        {
+            waitUntilTicks (startTicks + (juce::int64) (blockEnd * (double) ticksPerSecond));
+        }
+
+        const juce::int64 blockTicks = juce::Time::getHighResolutionTicks();
+        const juce::uint64 cpuBefore = threadCpuNanoseconds();
+
+        // handleTTLEvent's work past the gate: the router fans each rising edge out
+        for (; next < events.size() && events[next].seconds < blockEnd; ++next)
+        {
+            const TraceEvent& event = events[next];
+
+            if (!event.state || event.line >= PigpiodRouter::maxRoutedLines)
+                continue;
+
+            const juce::int64 eventTicks = options.fast ? blockTicks
+                                                        : startTicks + (juce::int64) (event.seconds * (double) ticksPerSecond);
+            const juce::uint64 droppedBefore = dispatcher.getDroppedCount();
+
+            router.routeEvent (routes + event.line * PigpiodRouter::maxRoutesPerLine,
+                               router.needsEventTimes() ? eventTicks : 0, true);
+
+            if (pairable)
+            {
+                const size_t queued = (size_t) mainRoutes[event.line] - (size_t) (dispatcher.getDroppedCount() - droppedBefore);
+
+                for (size_t i = 0; i < queued; ++i)
+                    pulseEventTicks[queuedPulses++] = eventTicks;
+            }
+        }
+
+        queueDepth.record ((juce::uint64) dispatcher.getQueueDepth());
+        router.flush (true);
+
+        handlerCpu += threadCpuNanoseconds() - cpuBefore;
+    }
+
+    // Drain: everything queued has been written, answered and (with the mock) received
+    const juce::int64 deadline = juce::Time::getHighResolutionTicks() + 5 * ticksPerSecond;
+
+    auto busy = [&]
+    {
+        for (const auto& target : targets)
+            if (target->dispatcher.getQueueDepth() > 0 || target->client.getPendingCount() > 0)
+                return true;
+
+        return dispatcher.getQueueDepth() > 0 || client.getPendingCount() > 0
+               || (pairable && mock.getTrigCount() < queuedPulses);
+    };
+
+    while (juce::Time::getHighResolutionTicks() < deadline && busy())
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+    dispatcher.stopThread (1000);
+
+    for (const auto& target : targets)
+        target->dispatcher.stopThread (1000);
+
+    const size_t arrived = pairable ? std::min (mock.getTrigCount(), queuedPulses) : 0;
+    const juce::int64 endTicks = pairable && arrived > 0 ? mock.getArrivalTicks (arrived - 1)
+                                                         : juce::Time::getHighResolutionTicks();
+
+    client.disconnect();
+    mock.stop();
+
+    // A failed write loses its pulses without a trace, and with them the pairing
+    const bool paired = dispatcher.getSendErrorCount() == 0;
+
+    LatencyHistogram eventToServer;
+    for (size_t i = 0; paired && i < arrived; ++i)
+        eventToServer.record ((juce::uint64) std::max ((juce::int64) 0, mock.getArrivalTicks (i) - pulseEventTicks[i])
+                              * 1000000000ull / (juce::uint64) ticksPerSecond);
+
+    const double wallSeconds = juce::Time::highResolutionTicksToSeconds (endTicks - startTicks);
+
+    juce::uint64 framesSent = dispatcher.getQueueDelay().getCount();
+    for (const auto& target : targets)
+        framesSent += target->dispatcher.getQueueDelay().getCount();
+
+    std::printf ("\nThroughput\n");
+    std::printf ("  events                 %zu in %.3f s (%.0f events/s, %.0f frames/s)\n", events.size(), wallSeconds,
+                 events.size() / wallSeconds, framesSent / wallSeconds);
+    std::printf ("  handler CPU            %.0f ns per event\n", (double) handlerCpu / (double) events.size());
+
+    if (router.getCoalescedCount() > 0)
+        std::printf ("  coalesced              %llu\n", (unsigned long long) router.getCoalescedCount());
+
+    std::printf ("\nQueue\n");
+    std::printf ("  depth at flush         p50 %llu  p99 %llu  max %llu (high-water %d of %zu)\n",
+                 (unsigned long long) queueDepth.getPercentile (0.5),
+                 (unsigned long long) queueDepth.getPercentile (0.99),
+                 (unsigned long long) queueDepth.getMax(),
+                 dispatcher.getHighWaterMark(), PigpiodDispatcher::queueSize);
+    std::printf ("  dropped                %llu\n", (unsigned long long) dispatcher.getDroppedCount());
+    std::printf ("  send errors            %llu\n", (unsigned long long) dispatcher.getSendErrorCount());
+
+    if (pairable)
+        std::printf ("  reached the server     %zu of %zu\n", arrived, queuedPulses);
+
+    std::printf ("\nLatency\n");
+    printPercentiles ("queue delay", dispatcher.getQueueDelay());
+    printPercentiles ("socket write", dispatcher.getSendLatency());
+    printPercentiles ("round trip", client.getRoundTripLatency());
+
+    if (pairable && !paired)
+        std::printf ("  %-22s (not measured: some writes failed)\n", options.fast ? "block to server" : "event to server");
+    else if (pairable)
+        printPercentiles (options.fast ? "block to server" : "event to server", eventToServer);
+    else if (useMock)
+        std::printf ("  %-22s (not measured: coalescing changes which trigger a pulse belongs to)\n",
+                     options.fast ? "block to server" : "event to server");
+
+    for (const auto& target : targets)
+    {
+        std::printf ("\n%s (%llu dropped, %llu send errors)\n", target->host.toRawUTF8(),
+                     (unsigned long long) target->dispatcher.getDroppedCount(),
+                     (unsigned long long) target->dispatcher.getSendErrorCount());
+        printPercentiles ("queue delay", target->dispatcher.getQueueDelay());
+        printPercentiles ("socket write", target->dispatcher.getSendLatency());
+        printPercentiles ("round trip", target->client.getRoundTripLatency());
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2024 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+/*
+    Stands in for the GUI's ProcessorHeaders.h when the dispatch path is built
+    outside the GUI. All the dispatcher takes from it is the console log.
+*/
+
+#include "CommonLibHeader.h"
+
+#include <iostream>
+
+/** Writes its arguments to stderr as one line, like the GUI's console log */
+template <typename... Args>
+void replayLog (Args&&... args)
+{
+    juce::String line;
+    (line << ... << args);
+    std::cerr << line.toRawUTF8() << std::endl;
+}
+
+#define LOGC(...) replayLog (__VA_ARGS__)
+#define LOGD(...) replayLog (__VA_ARGS__)
+#define LOGE(...) replayLog (__VA_ARGS__)